@@ -0,0 +1,484 @@
+// Compares read throughput of the in-process NBD server with nbdkit serving
+// the same file. Each server runs in a separate process and is driven over
+// its unix socket by a pipelined client, similarly to the kernel NBD client.
+//
+// Usage: nbd-throughput [-r request_KiB] [-q queue_depth] [-s size_MiB]
+//                       [-l latency_ms] [-n nbdkit_binary] <image file>
+//
+// Latency delays every read of the built-in server from the file, as a
+// network share would; nbdkit is not run then.
+// The image is created (filled with a non-zero pattern) when it does not
+// exist yet.
+
+#include "nbd/file_backend.hpp"
+#include "nbd/protocol.hpp"
+#include "nbd/server.hpp"
+
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <chrono>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace proto = nbd::proto;
+
+namespace
+{
+
+struct Options
+{
+    uint32_t requestSize = 128 * 1024;
+    uint32_t queueDepth = 16;
+    uint64_t imageSize = 256 * 1024 * 1024;
+    std::chrono::milliseconds latency{0};
+    std::string nbdkit = "nbdkit";
+    std::string image;
+};
+
+// File read with latency of a network share
+class DelayedBackend : public nbd::Backend
+{
+  public:
+    DelayedBackend(boost::asio::io_context& ioc,
+                   std::shared_ptr<nbd::Backend> lower,
+                   std::chrono::milliseconds latency) :
+        ioc(ioc), lower(std::move(lower)), latency(latency)
+    {
+    }
+
+    void open(Handler&& handler) override
+    {
+        lower->open(std::move(handler));
+    }
+
+    uint64_t size() const override
+    {
+        return lower->size();
+    }
+
+    std::string contentId() const override
+    {
+        return lower->contentId();
+    }
+
+    bool isWritable() const override
+    {
+        return false;
+    }
+
+    void read(uint64_t offset, boost::asio::mutable_buffer buffer,
+              Handler&& handler) override
+    {
+        delay([this, offset, buffer, handler = std::move(handler)]() mutable {
+            lower->read(offset, buffer, std::move(handler));
+        });
+    }
+
+    bool supportsSplice() const override
+    {
+        return lower->supportsSplice();
+    }
+
+    void splice(uint64_t offset, size_t length, int pipe,
+                Handler&& handler) override
+    {
+        delay([this, offset, length, pipe,
+               handler = std::move(handler)]() mutable {
+            lower->splice(offset, length, pipe, std::move(handler));
+        });
+    }
+
+  private:
+    template <typename Function>
+    void delay(Function&& function)
+    {
+        auto timer = std::make_shared<boost::asio::steady_timer>(ioc, latency);
+        timer->async_wait(
+            [timer, function = std::forward<Function>(function)](
+                const boost::system::error_code&) mutable { function(); });
+    }
+
+    boost::asio::io_context& ioc;
+    std::shared_ptr<nbd::Backend> lower;
+    std::chrono::milliseconds latency;
+};
+
+struct Result
+{
+    double startupMs;
+    double seconds;
+    uint64_t bytes;
+    uint64_t rssKiB;
+};
+
+bool readAll(int fd, void* data, size_t size)
+{
+    auto* ptr = static_cast<char*>(data);
+    while (size > 0)
+    {
+        ssize_t rc = ::read(fd, ptr, size);
+        if (rc < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (rc <= 0)
+        {
+            return false;
+        }
+        ptr += rc;
+        size -= static_cast<size_t>(rc);
+    }
+    return true;
+}
+
+bool writeAll(int fd, const void* data, size_t size)
+{
+    const auto* ptr = static_cast<const char*>(data);
+    while (size > 0)
+    {
+        ssize_t rc = ::write(fd, ptr, size);
+        if (rc < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (rc <= 0)
+        {
+            return false;
+        }
+        ptr += rc;
+        size -= static_cast<size_t>(rc);
+    }
+    return true;
+}
+
+bool prepareImage(const Options& options)
+{
+    if (std::filesystem::exists(options.image))
+    {
+        return true;
+    }
+    std::ofstream file(options.image, std::ios::binary);
+    std::vector<char> chunk(1024 * 1024);
+    for (size_t i = 0; i < chunk.size(); i++)
+    {
+        chunk[i] = static_cast<char>(i * 131 + 7);
+    }
+    for (uint64_t written = 0; written < options.imageSize;
+         written += chunk.size())
+    {
+        file.write(chunk.data(), static_cast<std::streamsize>(chunk.size()));
+    }
+    return file.good();
+}
+
+int connectTo(const std::string& socketPath)
+{
+    sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    std::strncpy(addr.sun_path, socketPath.c_str(), sizeof(addr.sun_path) - 1);
+
+    for (int attempt = 0; attempt < 500; attempt++)
+    {
+        int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0)
+        {
+            return -1;
+        }
+        if (::connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) ==
+            0)
+        {
+            return fd;
+        }
+        ::close(fd);
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    return -1;
+}
+
+// Fixed newstyle handshake with NBD_OPT_GO, returns export size
+std::optional<uint64_t> handshake(int fd)
+{
+    proto::ServerGreeting greeting;
+    if (!readAll(fd, &greeting, sizeof(greeting)) ||
+        greeting.magic.value() != proto::nbdMagic ||
+        greeting.optionMagic.value() != proto::optionMagic)
+    {
+        return std::nullopt;
+    }
+
+    proto::big_uint32_buf_t clientFlags{proto::clientFlagFixedNewstyle |
+                                        proto::clientFlagNoZeroes};
+    proto::OptionHeader option;
+    option.magic = proto::optionMagic;
+    option.option = proto::optGo;
+    // Empty export name, no information requests
+    const std::array<char, 6> payload = {};
+    option.length = static_cast<uint32_t>(payload.size());
+    if (!writeAll(fd, &clientFlags, sizeof(clientFlags)) ||
+        !writeAll(fd, &option, sizeof(option)) ||
+        !writeAll(fd, payload.data(), payload.size()))
+    {
+        return std::nullopt;
+    }
+
+    std::optional<uint64_t> size;
+    while (true)
+    {
+        proto::OptionReplyHeader reply;
+        if (!readAll(fd, &reply, sizeof(reply)))
+        {
+            return std::nullopt;
+        }
+        std::vector<char> data(reply.length.value());
+        if (!readAll(fd, data.data(), data.size()))
+        {
+            return std::nullopt;
+        }
+        if (reply.type.value() == proto::repAck)
+        {
+            return size;
+        }
+        if (reply.type.value() == proto::repInfo &&
+            data.size() == sizeof(proto::InfoExport))
+        {
+            proto::InfoExport info;
+            std::memcpy(&info, data.data(), sizeof(info));
+            size = info.size.value();
+        }
+        else if ((reply.type.value() & proto::replyErrorBit) != 0)
+        {
+            return std::nullopt;
+        }
+    }
+}
+
+// Reads the whole export keeping queueDepth requests in flight
+std::optional<uint64_t> readExport(int fd, uint64_t size,
+                                   const Options& options)
+{
+    std::vector<char> payload(options.requestSize);
+    uint64_t nextOffset = 0;
+    uint64_t received = 0;
+    uint32_t inFlight = 0;
+
+    auto sendRequest = [&]() {
+        const auto length = static_cast<uint32_t>(
+            std::min<uint64_t>(options.requestSize, size - nextOffset));
+        proto::Request request;
+        request.magic = proto::requestMagic;
+        request.flags = 0;
+        request.type = proto::cmdRead;
+        request.handle = nextOffset;
+        request.offset = nextOffset;
+        request.length = length;
+        nextOffset += length;
+        inFlight++;
+        return writeAll(fd, &request, sizeof(request));
+    };
+
+    while (inFlight < options.queueDepth && nextOffset < size)
+    {
+        if (!sendRequest())
+        {
+            return std::nullopt;
+        }
+    }
+    while (inFlight > 0)
+    {
+        proto::SimpleReply reply;
+        if (!readAll(fd, &reply, sizeof(reply)) ||
+            reply.magic.value() != proto::simpleReplyMagic ||
+            reply.error.value() != proto::errNone)
+        {
+            return std::nullopt;
+        }
+        const auto length = static_cast<uint32_t>(std::min<uint64_t>(
+            options.requestSize, size - reply.handle.value()));
+        if (!readAll(fd, payload.data(), length))
+        {
+            return std::nullopt;
+        }
+        received += length;
+        inFlight--;
+        if (nextOffset < size && !sendRequest())
+        {
+            return std::nullopt;
+        }
+    }
+
+    proto::Request disconnect = {};
+    disconnect.magic = proto::requestMagic;
+    disconnect.type = proto::cmdDisc;
+    writeAll(fd, &disconnect, sizeof(disconnect));
+    return received;
+}
+
+uint64_t rssOf(pid_t pid)
+{
+    std::ifstream status("/proc/" + std::to_string(pid) + "/status");
+    std::string line;
+    while (std::getline(status, line))
+    {
+        if (line.rfind("VmRSS:", 0) == 0)
+        {
+            return std::stoull(line.substr(6));
+        }
+    }
+    return 0;
+}
+
+template <typename ServerFn>
+std::optional<Result> run(const Options& options,
+                          const std::string& socketPath, ServerFn&& server)
+{
+    std::filesystem::remove(socketPath);
+    const auto start = std::chrono::steady_clock::now();
+    pid_t pid = ::fork();
+    if (pid < 0)
+    {
+        return std::nullopt;
+    }
+    if (pid == 0)
+    {
+        server();
+        ::_exit(1);
+    }
+
+    std::optional<Result> result;
+    int fd = connectTo(socketPath);
+    if (fd >= 0)
+    {
+        if (auto size = handshake(fd))
+        {
+            const auto ready = std::chrono::steady_clock::now();
+            if (auto bytes = readExport(fd, *size, options))
+            {
+                const auto done = std::chrono::steady_clock::now();
+                result = Result{
+                    std::chrono::duration<double, std::milli>(ready - start)
+                        .count(),
+                    std::chrono::duration<double>(done - ready).count(),
+                    *bytes, rssOf(pid)};
+            }
+        }
+        ::close(fd);
+    }
+
+    ::kill(pid, SIGTERM);
+    ::waitpid(pid, nullptr, 0);
+    std::filesystem::remove(socketPath);
+    return result;
+}
+
+void report(const std::string& name, const std::optional<Result>& result)
+{
+    if (!result)
+    {
+        std::cout << name << ": failed" << std::endl;
+        return;
+    }
+    const double mib = static_cast<double>(result->bytes) / (1024 * 1024);
+    std::cout << name << ": " << mib / result->seconds << " MiB/s, startup "
+              << result->startupMs << " ms, server RSS " << result->rssKiB
+              << " KiB" << std::endl;
+}
+
+} // namespace
+
+int main(int argc, char** argv)
+{
+    Options options;
+    int opt = 0;
+    while ((opt = ::getopt(argc, argv, "r:q:s:l:n:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'r':
+                options.requestSize =
+                    static_cast<uint32_t>(std::stoul(optarg)) * 1024;
+                break;
+            case 'q':
+                options.queueDepth = static_cast<uint32_t>(std::stoul(optarg));
+                break;
+            case 's':
+                options.imageSize = std::stoull(optarg) * 1024 * 1024;
+                break;
+            case 'l':
+                options.latency = std::chrono::milliseconds(std::stoul(optarg));
+                break;
+            case 'n':
+                options.nbdkit = optarg;
+                break;
+            default:
+                return 1;
+        }
+    }
+    if (optind >= argc || options.requestSize == 0 || options.queueDepth == 0)
+    {
+        std::cerr << "Usage: " << argv[0]
+                  << " [-r request_KiB] [-q queue_depth] [-s size_MiB]"
+                     " [-l latency_ms] [-n nbdkit_binary] <image file>"
+                  << std::endl;
+        return 1;
+    }
+    options.image = argv[optind];
+    if (!prepareImage(options))
+    {
+        std::cerr << "Unable to create " << options.image << std::endl;
+        return 1;
+    }
+
+    const std::string socketPath =
+        (std::filesystem::temp_directory_path() /
+         ("nbd-throughput-" + std::to_string(::getpid()) + ".sock"))
+            .string();
+
+    std::cout << "Request size " << options.requestSize / 1024
+              << " KiB, queue depth " << options.queueDepth << std::endl;
+
+    report("virtual-media", run(options, socketPath, [&]() {
+               boost::asio::io_context ioc;
+               std::shared_ptr<nbd::Backend> backend =
+                   std::make_shared<nbd::FileBackend>(ioc, options.image,
+                                                      false);
+               if (options.latency.count() > 0)
+               {
+                   backend = std::make_shared<DelayedBackend>(
+                       ioc, std::move(backend), options.latency);
+               }
+               auto server = std::make_shared<nbd::Server>(ioc, "benchmark",
+                                                           std::move(backend));
+               if (server->start(socketPath))
+               {
+                   ioc.run();
+               }
+           }));
+    if (options.latency.count() > 0)
+    {
+        return 0;
+    }
+
+    report("nbdkit", run(options, socketPath, [&]() {
+               const std::string file = "file=" + options.image;
+               ::execlp(options.nbdkit.c_str(), options.nbdkit.c_str(),
+                        "--foreground", "--readonly", "--exit-with-parent",
+                        "--unix", socketPath.c_str(), "file", file.c_str(),
+                        nullptr);
+           }));
+
+    return 0;
+}
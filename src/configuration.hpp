@@ -1,6 +1,8 @@
 #pragma once
 
 #include "logger.hpp"
+#include "nbd/statistics.hpp"
+#include "nbd/token_bucket.hpp"
 #include "system.hpp"
 
 #include <sys/types.h>
@@ -39,9 +41,51 @@ class Configuration
         std::string unixSocket;
         std::string endPointId;
         std::optional<int> timeout;
+        // Logical block size of the NBD device
         std::optional<int> blocksize;
+        // Largest request of the NBD device in bytes, kernel default when
+        // neither set nor autotuned
+        std::optional<uint32_t> maxRequestSize;
+        bool autotuneRequestSize = false;
+        // Parallel connections of the NBD device in legacy mode
+        unsigned connections = 1;
+        // Values the mounted NBD device runs with, 0 when not known
+        uint32_t activeBlockSize = 0;
+        uint32_t activeMaxRequestSize = 0;
+        uint32_t activeConnections = 0;
+        // Memory for caching chunks of HTTPS images in bytes, 0 disables
+        uint64_t cacheSize = 0;
+        // Largest read-ahead window in bytes, 0 disables read-ahead
+        uint64_t readAheadSize = 0;
+        // Local storage for writes to HTTPS images mounted read-write in
+        // bytes, 0 serves them read-only
+        uint64_t overlaySize = 0;
+        // Bytes of writes buffered for RW CIFS images, 0 disables write-back
+        uint64_t writeBackSize = 0;
+        // Reads of the first seconds of a mount are recorded and replayed
+        // on later mounts of the image, 0 disables boot traces
+        uint64_t bootTraceSeconds = 0;
+        // Bytes of ISO9660 images read into caches before the host sees the
+        // device, 0 disables warm-up
+        uint64_t warmUpSize = 0;
+        // Read-only images are downloaded to local storage in background
+        // and served from there once complete
+        bool streamThenPin = false;
+        // Bytes per second of the background download, 0 does not limit it
+        uint64_t pinRate = 0;
+        // Bytes per second of traffic to the image, 0 does not limit it;
+        // adjustable over D-Bus
+        nbd::TokenBucket bandwidth;
+        // Parallel connections to HTTPS servers
+        unsigned httpConnections = 1;
+        // CIFS images are exported by pointing the mass storage LUN directly
+        // at the file on the mounted share, bypassing NBD
+        bool cifsDirect = false;
+        // nbd-client of a legacy mode slot is started ahead of mounts
+        bool warmNbdClient = false;
         std::chrono::seconds remainingInactivityTimeout;
         Mode mode;
+        nbd::Statistics statistics;
 
         static std::vector<std::string> toArgs(const MountPoint& mp)
         {
@@ -50,6 +94,17 @@ class Configuration
             std::vector<std::string> args = {
                 "-t", timeout, "-u", mp.unixSocket, mp.nbdDevice.to_path(),
                 "-n"};
+            if (mp.blocksize)
+            {
+                args.emplace_back("-b");
+                args.emplace_back(std::to_string(*mp.blocksize));
+            }
+            // Proxy accepts single connection only
+            if (mp.mode == Mode::legacy && mp.connections > 1)
+            {
+                args.emplace_back("-C");
+                args.emplace_back(std::to_string(mp.connections));
+            }
             return args;
         }
     };
@@ -70,6 +125,22 @@ class Configuration
     bool valid = false;
     boost::container::flat_map<std::string, MountPoint> mountPoints;
     static std::chrono::seconds inactivityTimeout;
+    // Persistent cache of HTTPS images shared by all mount points, disabled
+    // when directory is empty or size is 0
+    static std::string imageCacheDirectory;
+    static uint64_t imageCacheSize;
+    // Images on BMC storage which can be mounted with file:// URLs, local
+    // images are disabled when empty
+    static std::string localImageDirectory;
+    // Directory of copy-on-write overlays of HTTPS images, eg. on tmpfs
+    static std::string overlayDirectory;
+    // Recorded reads of images, boot traces are disabled when empty
+    static std::string bootTraceDirectory;
+    // Local copies of images mounted in stream-then-pin mode
+    static std::string pinDirectory;
+    // Bytes per second of traffic to images of all mount points together,
+    // 0 does not limit it; adjustable over D-Bus
+    static nbd::TokenBucket bandwidth;
 
     Configuration(const std::string& file)
     {
@@ -112,6 +183,17 @@ class Configuration
             LogMsg(Logger::Error, "InactivityTimeout required, not set");
         }
 
+        imageCacheDirectory =
+            config.value("ImageCacheDirectory", std::string());
+        imageCacheSize = config.value("ImageCacheSize", uint64_t(0));
+        localImageDirectory =
+            config.value("LocalImageDirectory", std::string());
+        overlayDirectory = config.value("OverlayDirectory", std::string());
+        bootTraceDirectory =
+            config.value("BootTraceDirectory", std::string());
+        pinDirectory = config.value("PinDirectory", std::string());
+        bandwidth.setRate(config.value("Bandwidth", uint64_t(0)));
+
         for (const auto& item : config.items())
         {
             if (item.key() == "MountPoints")
@@ -197,9 +279,11 @@ class Configuration
                     {
                         const uint64_t* value =
                             blocksizeIter->get_ptr<const uint64_t*>();
-                        if (value)
+                        // Power of two supported by the kernel
+                        if (value && *value >= 512 && *value <= 4096 &&
+                            (*value & (*value - 1)) == 0)
                         {
-                            mp.blocksize = *value;
+                            mp.blocksize = static_cast<int>(*value);
                         }
                         else
                         {
@@ -207,6 +291,238 @@ class Configuration
                                    "BlockSize not set, use default");
                         }
                     }
+                    const auto maxRequestSizeIter =
+                        mountpoint.value().find("MaxRequestSize");
+                    if (maxRequestSizeIter != mountpoint.value().cend())
+                    {
+                        const uint64_t* value =
+                            maxRequestSizeIter->get_ptr<const uint64_t*>();
+                        const std::string* mode =
+                            maxRequestSizeIter->get_ptr<const std::string*>();
+                        if (value && *value >= 4096 &&
+                            *value <= 32 * 1024 * 1024)
+                        {
+                            mp.maxRequestSize = static_cast<uint32_t>(*value);
+                        }
+                        else if (mode && *mode == "auto")
+                        {
+                            mp.autotuneRequestSize = true;
+                        }
+                        else
+                        {
+                            LogMsg(Logger::Info,
+                                   "MaxRequestSize not set, use default");
+                        }
+                    }
+                    const auto cacheSizeIter =
+                        mountpoint.value().find("CacheSize");
+                    if (cacheSizeIter != mountpoint.value().cend())
+                    {
+                        const uint64_t* value =
+                            cacheSizeIter->get_ptr<const uint64_t*>();
+                        if (value)
+                        {
+                            mp.cacheSize = *value;
+                        }
+                        else
+                        {
+                            LogMsg(Logger::Info,
+                                   "CacheSize not set, cache disabled");
+                        }
+                    }
+                    const auto readAheadSizeIter =
+                        mountpoint.value().find("ReadAheadSize");
+                    if (readAheadSizeIter != mountpoint.value().cend())
+                    {
+                        const uint64_t* value =
+                            readAheadSizeIter->get_ptr<const uint64_t*>();
+                        if (value)
+                        {
+                            mp.readAheadSize = *value;
+                        }
+                        else
+                        {
+                            LogMsg(Logger::Info, "ReadAheadSize not set, "
+                                                 "read-ahead disabled");
+                        }
+                    }
+                    const auto overlaySizeIter =
+                        mountpoint.value().find("OverlaySize");
+                    if (overlaySizeIter != mountpoint.value().cend())
+                    {
+                        const uint64_t* value =
+                            overlaySizeIter->get_ptr<const uint64_t*>();
+                        if (value)
+                        {
+                            mp.overlaySize = *value;
+                        }
+                        else
+                        {
+                            LogMsg(Logger::Info, "OverlaySize not set, "
+                                                 "HTTPS images read-only");
+                        }
+                    }
+                    const auto writeBackSizeIter =
+                        mountpoint.value().find("WriteBackSize");
+                    if (writeBackSizeIter != mountpoint.value().cend())
+                    {
+                        const uint64_t* value =
+                            writeBackSizeIter->get_ptr<const uint64_t*>();
+                        if (value)
+                        {
+                            mp.writeBackSize = *value;
+                        }
+                        else
+                        {
+                            LogMsg(Logger::Info, "WriteBackSize not set, "
+                                                 "write-back disabled");
+                        }
+                    }
+                    const auto bootTraceSecondsIter =
+                        mountpoint.value().find("BootTraceSeconds");
+                    if (bootTraceSecondsIter != mountpoint.value().cend())
+                    {
+                        const uint64_t* value =
+                            bootTraceSecondsIter->get_ptr<const uint64_t*>();
+                        if (value)
+                        {
+                            mp.bootTraceSeconds = *value;
+                        }
+                        else
+                        {
+                            LogMsg(Logger::Info, "BootTraceSeconds not set, "
+                                                 "boot traces disabled");
+                        }
+                    }
+                    const auto warmUpSizeIter =
+                        mountpoint.value().find("WarmUpSize");
+                    if (warmUpSizeIter != mountpoint.value().cend())
+                    {
+                        const uint64_t* value =
+                            warmUpSizeIter->get_ptr<const uint64_t*>();
+                        if (value)
+                        {
+                            mp.warmUpSize = *value;
+                        }
+                        else
+                        {
+                            LogMsg(Logger::Info, "WarmUpSize not set, "
+                                                 "warm-up disabled");
+                        }
+                    }
+                    const auto streamThenPinIter =
+                        mountpoint.value().find("StreamThenPin");
+                    if (streamThenPinIter != mountpoint.value().cend())
+                    {
+                        const bool* value =
+                            streamThenPinIter->get_ptr<const bool*>();
+                        if (value)
+                        {
+                            mp.streamThenPin = *value;
+                        }
+                        else
+                        {
+                            LogMsg(Logger::Info, "StreamThenPin not set, "
+                                                 "images served remotely");
+                        }
+                    }
+                    const auto pinRateIter = mountpoint.value().find("PinRate");
+                    if (pinRateIter != mountpoint.value().cend())
+                    {
+                        const uint64_t* value =
+                            pinRateIter->get_ptr<const uint64_t*>();
+                        if (value)
+                        {
+                            mp.pinRate = *value;
+                        }
+                        else
+                        {
+                            LogMsg(Logger::Info,
+                                   "PinRate not set, download not limited");
+                        }
+                    }
+                    const auto bandwidthIter =
+                        mountpoint.value().find("Bandwidth");
+                    if (bandwidthIter != mountpoint.value().cend())
+                    {
+                        const uint64_t* value =
+                            bandwidthIter->get_ptr<const uint64_t*>();
+                        if (value)
+                        {
+                            mp.bandwidth.setRate(*value);
+                        }
+                        else
+                        {
+                            LogMsg(Logger::Info,
+                                   "Bandwidth not set, traffic not limited");
+                        }
+                    }
+                    const auto cifsDirectIter =
+                        mountpoint.value().find("CifsDirect");
+                    if (cifsDirectIter != mountpoint.value().cend())
+                    {
+                        const bool* value =
+                            cifsDirectIter->get_ptr<const bool*>();
+                        if (value)
+                        {
+                            mp.cifsDirect = *value;
+                        }
+                        else
+                        {
+                            LogMsg(Logger::Info,
+                                   "CifsDirect not set, serve CIFS over NBD");
+                        }
+                    }
+                    const auto connectionsIter =
+                        mountpoint.value().find("Connections");
+                    if (connectionsIter != mountpoint.value().cend())
+                    {
+                        const uint64_t* value =
+                            connectionsIter->get_ptr<const uint64_t*>();
+                        if (value && *value > 0 && *value <= 16)
+                        {
+                            mp.connections = static_cast<unsigned>(*value);
+                        }
+                        else
+                        {
+                            LogMsg(Logger::Info,
+                                   "Connections out of range, use single "
+                                   "connection");
+                        }
+                    }
+                    const auto warmNbdClientIter =
+                        mountpoint.value().find("WarmNbdClient");
+                    if (warmNbdClientIter != mountpoint.value().cend())
+                    {
+                        const bool* value =
+                            warmNbdClientIter->get_ptr<const bool*>();
+                        if (value)
+                        {
+                            mp.warmNbdClient = *value;
+                        }
+                        else
+                        {
+                            LogMsg(Logger::Info, "WarmNbdClient not set, "
+                                                 "spawn nbd-client on mount");
+                        }
+                    }
+                    const auto httpConnectionsIter =
+                        mountpoint.value().find("HttpConnections");
+                    if (httpConnectionsIter != mountpoint.value().cend())
+                    {
+                        const uint64_t* value =
+                            httpConnectionsIter->get_ptr<const uint64_t*>();
+                        if (value && *value > 0 && *value <= 16)
+                        {
+                            mp.httpConnections = static_cast<unsigned>(*value);
+                        }
+                        else
+                        {
+                            LogMsg(Logger::Info,
+                                   "HttpConnections out of range, use single "
+                                   "connection");
+                        }
+                    }
                     const auto modeIter = mountpoint.value().find("Mode");
                     if (modeIter != mountpoint.value().cend())
                     {
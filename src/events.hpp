@@ -81,5 +81,26 @@ struct UdevStateChangeEvent : public BasicEvent
     StateChange devState;
 };
 
+struct ImageFlushedEvent : public BasicEvent
+{
+    explicit ImageFlushedEvent(const std::error_code& ec) :
+        BasicEvent(__FUNCTION__), ec{ec}
+    {
+    }
+
+    std::error_code ec;
+};
+
+struct ImageUnavailableEvent : public BasicEvent
+{
+    explicit ImageUnavailableEvent(const std::error_code& ec) :
+        BasicEvent(__FUNCTION__), ec{ec}
+    {
+    }
+
+    std::error_code ec;
+};
+
 using Event = std::variant<RegisterDbusEvent, MountEvent, UnmountEvent,
-                           SubprocessStoppedEvent, UdevStateChangeEvent>;
+                           SubprocessStoppedEvent, UdevStateChangeEvent,
+                           ImageFlushedEvent, ImageUnavailableEvent>;
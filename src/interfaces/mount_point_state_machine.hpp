@@ -1,6 +1,8 @@
 #pragma once
 
 #include "configuration.hpp"
+#include "nbd/https_pool.hpp"
+#include "nbd/image_registry.hpp"
 #include "resources.hpp"
 
 #include <system_error>
@@ -18,6 +20,8 @@ struct MountPointStateMachine
         bool rw;
         std::unique_ptr<resource::Mount> mountPoint;
         std::unique_ptr<utils::CredentialsProvider> credentials;
+        // Declared after mountPoint, so image is closed before unmounting
+        std::unique_ptr<resource::Server> server;
     };
 
     virtual ~MountPointStateMachine() = default;
@@ -35,6 +39,9 @@ struct MountPointStateMachine
     virtual BasicState& getState() = 0;
     virtual int& getExitCode() = 0;
     virtual boost::asio::io_context& getIoc() = 0;
+    virtual resource::WarmClient& getWarmClient() = 0;
+    virtual nbd::ImageRegistry& getImageRegistry() = 0;
+    virtual nbd::HttpsPool& getHttpsPool() = 0;
 
     virtual void emitRegisterDBusEvent(
         std::shared_ptr<sdbusplus::asio::connection> bus,
@@ -44,6 +51,8 @@ struct MountPointStateMachine
     virtual void emitSubprocessStoppedEvent() = 0;
     virtual void emitUdevStateChangeEvent(const NBDDevice& dev,
                                           StateChange devState) = 0;
+    virtual void emitImageFlushedEvent(const std::error_code& ec) = 0;
+    virtual void emitImageUnavailableEvent(const std::error_code& ec) = 0;
 };
 
 } // namespace interfaces
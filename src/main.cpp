@@ -22,14 +22,21 @@
 #include <sdbusplus/asio/object_server.hpp>
 
 std::chrono::seconds Configuration::inactivityTimeout;
+std::string Configuration::imageCacheDirectory;
+uint64_t Configuration::imageCacheSize;
+std::string Configuration::localImageDirectory;
+std::string Configuration::overlayDirectory;
+std::string Configuration::bootTraceDirectory;
+std::string Configuration::pinDirectory;
+nbd::TokenBucket Configuration::bandwidth;
 
 class App
 {
   public:
     App(boost::asio::io_context& ioc, const Configuration& config,
         sd_bus* custom_bus = nullptr) :
-        ioc(ioc),
-        devMonitor(ioc), config(config)
+        httpsPool(ioc),
+        ioc(ioc), devMonitor(ioc), imageRegistry(ioc), config(config)
     {
         if (!custom_bus)
         {
@@ -45,10 +52,28 @@ class App
         objManager = std::make_shared<sdbusplus::server::manager::manager>(
             *bus, "/xyz/openbmc_project/VirtualMedia");
 
+        // Bandwidth shared by all mount points
+        serviceIface = objServer->add_interface(
+            "/xyz/openbmc_project/VirtualMedia",
+            "xyz.openbmc_project.VirtualMedia.Service");
+        serviceIface->register_property(
+            "Bandwidth", Configuration::bandwidth.getRate(),
+            [](const uint64_t& req, uint64_t& property) {
+                LogMsg(Logger::Info, "[App]: Shared bandwidth set to ", req,
+                       " bytes per second");
+                Configuration::bandwidth.setRate(req);
+                property = req;
+                return 1;
+            },
+            []([[maybe_unused]] const uint64_t& property) {
+                return Configuration::bandwidth.getRate();
+            });
+        serviceIface->initialize();
+
         for (const auto& [name, entry] : config.mountPoints)
         {
             mpsm[name] = std::make_shared<MountPointStateMachine>(
-                ioc, devMonitor, name, entry);
+                ioc, devMonitor, imageRegistry, httpsPool, name, entry);
             mpsm[name]->emitRegisterDBusEvent(bus, objServer);
         }
 
@@ -61,6 +86,9 @@ class App
     }
 
   private:
+    // Declared first, so images of mount points return their connections
+    // before it is destroyed
+    nbd::HttpsPool httpsPool;
     boost::container::flat_map<std::string,
                                std::shared_ptr<MountPointStateMachine>>
         mpsm;
@@ -68,7 +96,10 @@ class App
     std::shared_ptr<sdbusplus::asio::connection> bus;
     std::shared_ptr<sdbusplus::asio::object_server> objServer;
     std::shared_ptr<sdbusplus::server::manager::manager> objManager;
+    std::shared_ptr<sdbusplus::asio::dbus_interface> serviceIface;
     DeviceMonitor devMonitor;
+    // Images shared by mount points
+    nbd::ImageRegistry imageRegistry;
     const Configuration& config;
 };
 
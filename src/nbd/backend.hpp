@@ -0,0 +1,161 @@
+#pragma once
+
+#include <boost/asio/buffer.hpp>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <system_error>
+#include <vector>
+
+namespace nbd
+{
+
+// Consecutive part of the image, either holding data or reading as zeroes
+struct Extent
+{
+    uint64_t length;
+    bool zero;
+};
+
+// Appends extent to the list, merging it with the last one of the same kind
+inline void appendExtent(std::vector<Extent>& extents, uint64_t length,
+                         bool zero)
+{
+    if (!extents.empty() && extents.back().zero == zero)
+    {
+        extents.back().length += length;
+        return;
+    }
+    extents.push_back(Extent{length, zero});
+}
+
+// Whether all bytes of data are zero. Comparing data with itself shifted by
+// one byte leaves the scan to the vectorized memcmp of the C library.
+inline bool isZero(const char* data, size_t length)
+{
+    return length == 0 ||
+           (data[0] == 0 && std::memcmp(data, data + 1, length - 1) == 0);
+}
+
+// Marks requests issued while it exists as background work, eg. prefetches
+// and downloads, which backends may serve after requests of the host
+class BackgroundScope
+{
+  public:
+    explicit BackgroundScope(bool background = true) : previous(active)
+    {
+        active = active || background;
+    }
+
+    ~BackgroundScope()
+    {
+        active = previous;
+    }
+
+    BackgroundScope(const BackgroundScope&) = delete;
+    BackgroundScope& operator=(const BackgroundScope&) = delete;
+
+    static bool isActive()
+    {
+        return active;
+    }
+
+  private:
+    static inline bool active = false;
+    bool previous;
+};
+
+// Storage served to the NBD client. Implementations are driven from the
+// io_context thread only; completion handlers are invoked from it as well,
+// possibly before the initiating call returns.
+class Backend
+{
+  public:
+    using Handler = std::function<void(std::error_code)>;
+    using ExtentsHandler =
+        std::function<void(std::error_code, std::vector<Extent>)>;
+
+    Backend() = default;
+    Backend(const Backend&) = delete;
+    Backend(Backend&&) = delete;
+    Backend& operator=(const Backend&) = delete;
+    Backend& operator=(Backend&&) = delete;
+
+    virtual ~Backend() = default;
+
+    // Called once by the server before the export is announced to clients,
+    // eg. to reach a remote server. size() is valid only after it succeeds.
+    virtual void open(Handler&& handler)
+    {
+        handler({});
+    }
+
+    virtual uint64_t size() const = 0;
+
+    // Identifies content of the image, changes whenever the content does.
+    // Empty when not known, such images are never cached across mounts.
+    virtual std::string contentId() const
+    {
+        return {};
+    }
+
+    virtual bool isWritable() const
+    {
+        return false;
+    }
+
+    virtual void read(uint64_t offset, boost::asio::mutable_buffer buffer,
+                      Handler&& handler) = 0;
+
+    virtual void write([[maybe_unused]] uint64_t offset,
+                       [[maybe_unused]] boost::asio::const_buffer buffer,
+                       Handler&& handler)
+    {
+        handler(std::make_error_code(std::errc::read_only_file_system));
+    }
+
+    virtual void flush(Handler&& handler)
+    {
+        handler({});
+    }
+
+    // Backends keeping the image in a file can move its data into a pipe,
+    // so the server sends it without copying it through user space
+    virtual bool supportsSplice() const
+    {
+        return false;
+    }
+
+    // Moves length bytes of the image at offset into pipe, which has room for
+    // all of them
+    virtual void splice([[maybe_unused]] uint64_t offset,
+                        [[maybe_unused]] size_t length,
+                        [[maybe_unused]] int pipe, Handler&& handler)
+    {
+        handler(std::make_error_code(std::errc::operation_not_supported));
+    }
+
+    // Describes which parts of the range read as zeroes. Extents follow each
+    // other from offset on and cover at least the beginning of the range;
+    // data is reported wherever backend does not know better.
+    virtual void extents([[maybe_unused]] uint64_t offset, uint64_t length,
+                         ExtentsHandler&& handler)
+    {
+        handler({}, {Extent{length, false}});
+    }
+
+    // Hints the range is likely to be read soon. Backends able to keep the
+    // data fetch it in the background, others ignore the hint.
+    virtual void prefetch([[maybe_unused]] uint64_t offset,
+                          [[maybe_unused]] uint64_t length)
+    {
+    }
+
+    // Drops prefetches which were not started yet
+    virtual void cancelPrefetch()
+    {
+    }
+};
+
+} // namespace nbd
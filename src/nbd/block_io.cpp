@@ -0,0 +1,728 @@
+#include "nbd/block_io.hpp"
+
+#include "logger.hpp"
+
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <boost/asio/post.hpp>
+#include <boost/asio/posix/stream_descriptor.hpp>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace nbd
+{
+
+namespace
+{
+
+enum class OpType
+{
+    read,
+    write,
+    sync,
+    splice
+};
+
+struct Operation
+{
+    Operation(OpType type, int fd, uint64_t offset, char* data, size_t length,
+              BlockIo::Handler&& handler) :
+        type(type),
+        fd(fd), offset(offset), data(data), length(length),
+        handler(std::move(handler))
+    {
+    }
+
+    // Splice of length bytes of file at offset into pipe
+    Operation(int fd, uint64_t offset, int pipe, size_t length,
+              BlockIo::Handler&& handler) :
+        type(OpType::splice),
+        fd(fd), offset(offset), data(nullptr), length(length),
+        handler(std::move(handler)), pipe(pipe)
+    {
+    }
+
+    OpType type;
+    int fd;
+    uint64_t offset;
+    char* data;
+    size_t length;
+    size_t done = 0;
+    std::error_code result;
+    BlockIo::Handler handler;
+    // Destination of splice
+    int pipe = -1;
+    // Vectored variants are used, as they are supported since io_uring was
+    // introduced (plain IORING_OP_READ requires 5.6)
+    iovec iov = {};
+};
+
+std::error_code lastError()
+{
+    return {errno, std::generic_category()};
+}
+
+// Both engines signal completions to the io_context through an eventfd
+class EventFdEngine : public BlockIo
+{
+  public:
+    explicit EventFdEngine(boost::asio::io_context& ioc) :
+        ioc(ioc), eventSd(ioc)
+    {
+    }
+
+  protected:
+    bool openEventFd()
+    {
+        int efd = ::eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        if (efd < 0)
+        {
+            LogMsg(Logger::Error, "[BlockIo]: Unable to create eventfd: ",
+                   lastError());
+            return false;
+        }
+        eventSd.assign(efd);
+        return true;
+    }
+
+    void clearEventFd()
+    {
+        uint64_t counter = 0;
+        while (::read(eventSd.native_handle(), &counter, sizeof(counter)) > 0)
+        {
+        }
+    }
+
+    static void complete(std::unique_ptr<Operation> op)
+    {
+        auto handler = std::move(op->handler);
+        auto result = op->result;
+        op.reset();
+        handler(result);
+    }
+
+    boost::asio::io_context& ioc;
+    boost::asio::posix::stream_descriptor eventSd;
+};
+
+class UringBlockIo :
+    public EventFdEngine,
+    public std::enable_shared_from_this<UringBlockIo>
+{
+  public:
+    explicit UringBlockIo(boost::asio::io_context& ioc) : EventFdEngine(ioc)
+    {
+    }
+
+    ~UringBlockIo() override
+    {
+        if (sqes != nullptr)
+        {
+            ::munmap(sqes, sqesSize);
+        }
+        if (cqRing != nullptr && cqRing != sqRing)
+        {
+            ::munmap(cqRing, cqRingSize);
+        }
+        if (sqRing != nullptr)
+        {
+            ::munmap(sqRing, sqRingSize);
+        }
+        if (ringFd >= 0)
+        {
+            ::close(ringFd);
+        }
+    }
+
+    bool setup(unsigned queueDepth)
+    {
+        io_uring_params params = {};
+        ringFd = static_cast<int>(
+            ::syscall(__NR_io_uring_setup, queueDepth, &params));
+        if (ringFd < 0)
+        {
+            LogMsg(Logger::Info, "[BlockIo]: io_uring unavailable: ",
+                   lastError());
+            return false;
+        }
+
+        sqRingSize = params.sq_off.array + params.sq_entries * sizeof(__u32);
+        cqRingSize =
+            params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        const bool singleMmap = (params.features & IORING_FEAT_SINGLE_MMAP);
+        if (singleMmap)
+        {
+            sqRingSize = cqRingSize = std::max(sqRingSize, cqRingSize);
+        }
+
+        sqRing = map(sqRingSize, IORING_OFF_SQ_RING);
+        if (sqRing == nullptr)
+        {
+            return false;
+        }
+        cqRing = singleMmap ? sqRing : map(cqRingSize, IORING_OFF_CQ_RING);
+        if (cqRing == nullptr)
+        {
+            return false;
+        }
+        sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+        sqes = static_cast<io_uring_sqe*>(map(sqesSize, IORING_OFF_SQES));
+        if (sqes == nullptr)
+        {
+            return false;
+        }
+
+        auto* sq = static_cast<char*>(sqRing);
+        sqHead = reinterpret_cast<__u32*>(sq + params.sq_off.head);
+        sqTail = reinterpret_cast<__u32*>(sq + params.sq_off.tail);
+        sqMask = *reinterpret_cast<__u32*>(sq + params.sq_off.ring_mask);
+        sqArray = reinterpret_cast<__u32*>(sq + params.sq_off.array);
+        sqEntries = params.sq_entries;
+
+        auto* cq = static_cast<char*>(cqRing);
+        cqHead = reinterpret_cast<__u32*>(cq + params.cq_off.head);
+        cqTail = reinterpret_cast<__u32*>(cq + params.cq_off.tail);
+        cqMask = *reinterpret_cast<__u32*>(cq + params.cq_off.ring_mask);
+        cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+
+        if (!openEventFd())
+        {
+            return false;
+        }
+        int efd = eventSd.native_handle();
+        if (::syscall(__NR_io_uring_register, ringFd, IORING_REGISTER_EVENTFD,
+                      &efd, 1) != 0)
+        {
+            LogMsg(Logger::Error, "[BlockIo]: Unable to register eventfd: ",
+                   lastError());
+            return false;
+        }
+
+        slots.resize(sqEntries);
+        for (unsigned slot = sqEntries; slot > 0; slot--)
+        {
+            freeSlots.push_back(slot - 1);
+        }
+        return true;
+    }
+
+    void read(int fd, uint64_t offset, boost::asio::mutable_buffer buffer,
+              Handler&& handler) override
+    {
+        queue(std::make_unique<Operation>(OpType::read, fd, offset,
+                                          static_cast<char*>(buffer.data()),
+                                          buffer.size(), std::move(handler)));
+    }
+
+    void write(int fd, uint64_t offset, boost::asio::const_buffer buffer,
+               Handler&& handler) override
+    {
+        queue(std::make_unique<Operation>(
+            OpType::write, fd, offset,
+            const_cast<char*>(static_cast<const char*>(buffer.data())),
+            buffer.size(), std::move(handler)));
+    }
+
+    void sync(int fd, Handler&& handler) override
+    {
+        queue(std::make_unique<Operation>(OpType::sync, fd, 0, nullptr, 0,
+                                          std::move(handler)));
+    }
+
+    void splice(int fd, uint64_t offset, int pipe, size_t length,
+                Handler&& handler) override
+    {
+        queue(std::make_unique<Operation>(fd, offset, pipe, length,
+                                          std::move(handler)));
+    }
+
+    std::string_view engineName() const override
+    {
+        return "io_uring";
+    }
+
+  private:
+    void* map(size_t size, off_t offset)
+    {
+        void* ptr = ::mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                           MAP_SHARED | MAP_POPULATE, ringFd, offset);
+        if (ptr == MAP_FAILED)
+        {
+            LogMsg(Logger::Error, "[BlockIo]: Unable to map io_uring: ",
+                   lastError());
+            return nullptr;
+        }
+        return ptr;
+    }
+
+    void queue(std::unique_ptr<Operation> op)
+    {
+        pending.push_back(std::move(op));
+        scheduleSubmit();
+    }
+
+    // Requests queued during single io_context handler are submitted to the
+    // kernel with one io_uring_enter call
+    void scheduleSubmit()
+    {
+        if (submitScheduled)
+        {
+            return;
+        }
+        submitScheduled = true;
+        boost::asio::post(ioc, [self = shared_from_this()]() {
+            self->submitScheduled = false;
+            self->submit();
+        });
+    }
+
+    void prepare(unsigned slot)
+    {
+        Operation& op = *slots[slot];
+        const __u32 tail = *sqTail;
+        const __u32 index = tail & sqMask;
+        io_uring_sqe& sqe = sqes[index];
+        std::memset(&sqe, 0, sizeof(sqe));
+        sqe.fd = op.fd;
+        sqe.user_data = slot;
+        switch (op.type)
+        {
+            case OpType::read:
+            case OpType::write:
+                op.iov.iov_base = op.data + op.done;
+                op.iov.iov_len = op.length - op.done;
+                sqe.opcode = (op.type == OpType::read) ? IORING_OP_READV
+                                                       : IORING_OP_WRITEV;
+                sqe.off = op.offset + op.done;
+                sqe.addr = reinterpret_cast<uintptr_t>(&op.iov);
+                sqe.len = 1;
+                break;
+            case OpType::sync:
+                sqe.opcode = IORING_OP_FSYNC;
+                sqe.fsync_flags = IORING_FSYNC_DATASYNC;
+                break;
+            case OpType::splice:
+                // Kernels before 5.7 fail it with EINVAL
+                sqe.opcode = IORING_OP_SPLICE;
+                sqe.splice_fd_in = op.fd;
+                sqe.splice_off_in = op.offset + op.done;
+                sqe.fd = op.pipe;
+                sqe.off = static_cast<__u64>(-1);
+                sqe.len = static_cast<__u32>(op.length - op.done);
+                break;
+        }
+        sqArray[index] = index;
+        __atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+        unsubmitted++;
+    }
+
+    void submit()
+    {
+        while (!pending.empty() && !freeSlots.empty())
+        {
+            const unsigned slot = freeSlots.back();
+            freeSlots.pop_back();
+            slots[slot] = std::move(pending.front());
+            pending.pop_front();
+            prepare(slot);
+            inflight++;
+        }
+
+        while (unsubmitted > 0)
+        {
+            int rc = static_cast<int>(::syscall(__NR_io_uring_enter, ringFd,
+                                                unsubmitted, 0, 0, nullptr, 0));
+            if (rc < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                // EAGAIN / EBUSY - retried when completions are reaped, as
+                // long as there are any to come
+                if ((errno == EAGAIN || errno == EBUSY) &&
+                    inflight > unsubmitted)
+                {
+                    break;
+                }
+                const std::error_code ec = lastError();
+                LogMsg(Logger::Error,
+                       "[BlockIo]: io_uring_enter failed: ", ec);
+                failUnsubmitted(ec);
+                return;
+            }
+            unsubmitted -= static_cast<unsigned>(rc);
+        }
+
+        if (inflight > 0)
+        {
+            waitForCompletions();
+        }
+    }
+
+    // Entries refused by the kernel are taken back from the submission
+    // queue and their requests fail, nothing would ever complete them
+    void failUnsubmitted(std::error_code ec)
+    {
+        std::vector<std::unique_ptr<Operation>> failed;
+        __u32 tail = *sqTail;
+        for (; unsubmitted > 0; unsubmitted--)
+        {
+            tail--;
+            const auto slot =
+                static_cast<unsigned>(sqes[tail & sqMask].user_data);
+            slots[slot]->result = ec;
+            failed.push_back(std::move(slots[slot]));
+            freeSlots.push_back(slot);
+            inflight--;
+        }
+        __atomic_store_n(sqTail, tail, __ATOMIC_RELEASE);
+
+        if (inflight > 0)
+        {
+            waitForCompletions();
+        }
+        if (!pending.empty())
+        {
+            scheduleSubmit();
+        }
+        for (auto& op : failed)
+        {
+            complete(std::move(op));
+        }
+    }
+
+    // The pending wait keeps engine alive until all requests complete
+    void waitForCompletions()
+    {
+        if (waiting)
+        {
+            return;
+        }
+        waiting = true;
+        eventSd.async_wait(
+            boost::asio::posix::stream_descriptor::wait_read,
+            [self = shared_from_this()](const boost::system::error_code& ec) {
+                self->waiting = false;
+                if (ec)
+                {
+                    return;
+                }
+                self->clearEventFd();
+                self->reap();
+            });
+    }
+
+    void reap()
+    {
+        std::vector<std::unique_ptr<Operation>> completed;
+
+        __u32 head = *cqHead;
+        const __u32 tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++)
+        {
+            const io_uring_cqe& cqe = cqes[head & cqMask];
+            const auto slot = static_cast<unsigned>(cqe.user_data);
+            Operation& op = *slots[slot];
+
+            if (cqe.res < 0)
+            {
+                op.result = std::error_code(-cqe.res, std::generic_category());
+            }
+            else if (op.type != OpType::sync)
+            {
+                op.done += static_cast<size_t>(cqe.res);
+                if (cqe.res == 0)
+                {
+                    op.result = std::make_error_code(std::errc::io_error);
+                }
+                else if (op.done < op.length)
+                {
+                    // Short transfer, continue where it ended
+                    prepare(slot);
+                    continue;
+                }
+            }
+
+            completed.push_back(std::move(slots[slot]));
+            freeSlots.push_back(slot);
+            inflight--;
+        }
+        __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+
+        submit();
+
+        for (auto& op : completed)
+        {
+            complete(std::move(op));
+        }
+    }
+
+    int ringFd = -1;
+    void* sqRing = nullptr;
+    void* cqRing = nullptr;
+    io_uring_sqe* sqes = nullptr;
+    size_t sqRingSize = 0;
+    size_t cqRingSize = 0;
+    size_t sqesSize = 0;
+
+    __u32* sqHead = nullptr;
+    __u32* sqTail = nullptr;
+    __u32* sqArray = nullptr;
+    __u32 sqMask = 0;
+    unsigned sqEntries = 0;
+    __u32* cqHead = nullptr;
+    __u32* cqTail = nullptr;
+    __u32 cqMask = 0;
+    io_uring_cqe* cqes = nullptr;
+
+    std::vector<std::unique_ptr<Operation>> slots;
+    std::vector<unsigned> freeSlots;
+    std::deque<std::unique_ptr<Operation>> pending;
+    unsigned inflight = 0;
+    unsigned unsubmitted = 0;
+    bool submitScheduled = false;
+    bool waiting = false;
+};
+
+// Fallback for kernels without io_uring - blocking pread/pwrite executed by
+// worker threads. Workers only ever touch the I/O parameters of operation,
+// handlers are run on the io_context thread.
+class ThreadPoolBlockIo :
+    public EventFdEngine,
+    public std::enable_shared_from_this<ThreadPoolBlockIo>
+{
+  public:
+    explicit ThreadPoolBlockIo(boost::asio::io_context& ioc) :
+        EventFdEngine(ioc)
+    {
+    }
+
+    ~ThreadPoolBlockIo() override
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        jobAvailable.notify_all();
+        for (auto& worker : workers)
+        {
+            worker.join();
+        }
+    }
+
+    bool setup(unsigned threads)
+    {
+        if (!openEventFd())
+        {
+            return false;
+        }
+        for (unsigned i = 0; i < threads; i++)
+        {
+            workers.emplace_back([this]() { work(); });
+        }
+        return true;
+    }
+
+    void read(int fd, uint64_t offset, boost::asio::mutable_buffer buffer,
+              Handler&& handler) override
+    {
+        queue(std::make_unique<Operation>(OpType::read, fd, offset,
+                                          static_cast<char*>(buffer.data()),
+                                          buffer.size(), std::move(handler)));
+    }
+
+    void write(int fd, uint64_t offset, boost::asio::const_buffer buffer,
+               Handler&& handler) override
+    {
+        queue(std::make_unique<Operation>(
+            OpType::write, fd, offset,
+            const_cast<char*>(static_cast<const char*>(buffer.data())),
+            buffer.size(), std::move(handler)));
+    }
+
+    void sync(int fd, Handler&& handler) override
+    {
+        queue(std::make_unique<Operation>(OpType::sync, fd, 0, nullptr, 0,
+                                          std::move(handler)));
+    }
+
+    void splice(int fd, uint64_t offset, int pipe, size_t length,
+                Handler&& handler) override
+    {
+        queue(std::make_unique<Operation>(fd, offset, pipe, length,
+                                          std::move(handler)));
+    }
+
+    std::string_view engineName() const override
+    {
+        return "thread pool";
+    }
+
+  private:
+    void queue(std::unique_ptr<Operation> op)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            jobs.push_back(op.release());
+        }
+        jobAvailable.notify_one();
+        inflight++;
+        waitForCompletions();
+    }
+
+    void waitForCompletions()
+    {
+        if (waiting)
+        {
+            return;
+        }
+        waiting = true;
+        eventSd.async_wait(
+            boost::asio::posix::stream_descriptor::wait_read,
+            [self = shared_from_this()](const boost::system::error_code& ec) {
+                self->waiting = false;
+                if (ec)
+                {
+                    return;
+                }
+                self->clearEventFd();
+                self->reap();
+            });
+    }
+
+    void reap()
+    {
+        std::vector<Operation*> completed;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            std::swap(completed, completions);
+        }
+        inflight -= static_cast<unsigned>(completed.size());
+        if (inflight > 0)
+        {
+            waitForCompletions();
+        }
+        for (Operation* op : completed)
+        {
+            complete(std::unique_ptr<Operation>(op));
+        }
+    }
+
+    static void execute(Operation& op)
+    {
+        if (op.type == OpType::sync)
+        {
+            if (::fdatasync(op.fd) != 0)
+            {
+                op.result = lastError();
+            }
+            return;
+        }
+        while (op.done < op.length)
+        {
+            auto offset = static_cast<off_t>(op.offset + op.done);
+            ssize_t rc = 0;
+            switch (op.type)
+            {
+                case OpType::read:
+                    rc = ::pread(op.fd, op.data + op.done,
+                                 op.length - op.done, offset);
+                    break;
+                case OpType::write:
+                    rc = ::pwrite(op.fd, op.data + op.done,
+                                  op.length - op.done, offset);
+                    break;
+                default:
+                    rc = ::splice(op.fd, &offset, op.pipe, nullptr,
+                                  op.length - op.done, SPLICE_F_MOVE);
+                    break;
+            }
+            if (rc < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (rc < 0)
+            {
+                op.result = lastError();
+                return;
+            }
+            if (rc == 0)
+            {
+                op.result = std::make_error_code(std::errc::io_error);
+                return;
+            }
+            op.done += static_cast<size_t>(rc);
+        }
+    }
+
+    void work()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true)
+        {
+            jobAvailable.wait(lock,
+                              [this]() { return stopping || !jobs.empty(); });
+            if (stopping)
+            {
+                return;
+            }
+            Operation* op = jobs.front();
+            jobs.pop_front();
+            lock.unlock();
+
+            execute(*op);
+
+            lock.lock();
+            completions.push_back(op);
+            const uint64_t one = 1;
+            if (::write(eventSd.native_handle(), &one, sizeof(one)) < 0)
+            {
+                LogMsg(Logger::Error, "[BlockIo]: Unable to signal eventfd");
+            }
+        }
+    }
+
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable jobAvailable;
+    std::deque<Operation*> jobs;
+    std::vector<Operation*> completions;
+    bool stopping = false;
+    unsigned inflight = 0;
+    bool waiting = false;
+};
+
+constexpr unsigned poolThreads = 8;
+
+} // namespace
+
+std::shared_ptr<BlockIo> BlockIo::create(boost::asio::io_context& ioc,
+                                         unsigned queueDepth)
+{
+    auto uring = std::make_shared<UringBlockIo>(ioc);
+    if (uring->setup(queueDepth))
+    {
+        return uring;
+    }
+
+    auto pool = std::make_shared<ThreadPoolBlockIo>(ioc);
+    if (pool->setup(std::min(queueDepth, poolThreads)))
+    {
+        return pool;
+    }
+    return nullptr;
+}
+
+} // namespace nbd
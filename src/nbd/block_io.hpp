@@ -0,0 +1,60 @@
+#pragma once
+
+#include <boost/asio/buffer.hpp>
+#include <boost/asio/io_context.hpp>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string_view>
+#include <system_error>
+
+namespace nbd
+{
+
+// Asynchronous positional I/O engine. Requests are queued from the
+// io_context thread and completed on it, transfers are always complete -
+// short reads and writes are continued internally, and reaching end of file
+// is reported as an I/O error.
+//
+// Engines are owned by shared_ptr and stay alive until all of the queued
+// requests complete, so buffers and handlers passed in have to stay valid
+// until then as well.
+class BlockIo
+{
+  public:
+    using Handler = std::function<void(std::error_code)>;
+
+    // Maximum number of requests handed over to the kernel at once, the rest
+    // waits in submission order
+    static constexpr unsigned defaultQueueDepth = 128;
+
+    BlockIo() = default;
+    BlockIo(const BlockIo&) = delete;
+    BlockIo(BlockIo&&) = delete;
+    BlockIo& operator=(const BlockIo&) = delete;
+    BlockIo& operator=(BlockIo&&) = delete;
+
+    virtual ~BlockIo() = default;
+
+    virtual void read(int fd, uint64_t offset,
+                      boost::asio::mutable_buffer buffer,
+                      Handler&& handler) = 0;
+    virtual void write(int fd, uint64_t offset,
+                       boost::asio::const_buffer buffer,
+                       Handler&& handler) = 0;
+    virtual void sync(int fd, Handler&& handler) = 0;
+    // Moves file data into pipe without copying it through user space. The
+    // pipe has to have room for all of it, otherwise the request blocks.
+    virtual void splice(int fd, uint64_t offset, int pipe, size_t length,
+                        Handler&& handler) = 0;
+
+    virtual std::string_view engineName() const = 0;
+
+    // Creates io_uring based engine and falls back to a pool of pread/pwrite
+    // worker threads when io_uring is not supported by the kernel
+    static std::shared_ptr<BlockIo>
+        create(boost::asio::io_context& ioc,
+               unsigned queueDepth = defaultQueueDepth);
+};
+
+} // namespace nbd
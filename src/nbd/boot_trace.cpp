@@ -0,0 +1,235 @@
+#include "nbd/boot_trace.hpp"
+
+#include "logger.hpp"
+#include "nbd/disk_cache.hpp"
+
+#include <algorithm>
+#include <fstream>
+
+namespace nbd
+{
+
+namespace fs = std::filesystem;
+
+BootTrace::BootTrace(std::string_view name, std::shared_ptr<Backend> lower,
+                     fs::path directory, std::chrono::seconds duration,
+                     uint64_t window) :
+    name(name),
+    lower(std::move(lower)), directory(std::move(directory)),
+    duration(duration), window(std::min(window, maxWindow))
+{
+}
+
+BootTrace::~BootTrace()
+{
+    // Mount ended before the trace was complete, what was read is still
+    // worth replaying
+    if (recording)
+    {
+        save();
+    }
+    if (!trace.empty())
+    {
+        LogMsg(Logger::Info, "[BootTrace]: (", name, ") Replayed ", next,
+               " of ", trace.size(), " records");
+    }
+}
+
+void BootTrace::open(Handler&& handler)
+{
+    lower->open([self = shared_from_this(),
+                 handler = std::move(handler)](std::error_code ec) {
+        if (!ec)
+        {
+            self->load();
+        }
+        handler(ec);
+    });
+}
+
+void BootTrace::load()
+{
+    const std::string id = lower->contentId();
+    if (id.empty() || lower->isWritable())
+    {
+        LogMsg(Logger::Info, "[BootTrace]: (", name,
+               ") Image can not be validated, not traced");
+        return;
+    }
+    path = directory / hashOf(id);
+
+    std::ifstream file(path, std::ios::binary | std::ios::ate);
+    if (!file)
+    {
+        LogMsg(Logger::Info, "[BootTrace]: (", name, ") Recording reads of ",
+               duration.count(), "s");
+        recording = true;
+        return;
+    }
+
+    const auto length = static_cast<size_t>(file.tellg());
+    if (length % sizeof(Record) == 0 && length <= maxRecords * sizeof(Record))
+    {
+        trace.resize(length / sizeof(Record));
+        file.seekg(0);
+        file.read(reinterpret_cast<char*>(trace.data()),
+                  static_cast<std::streamsize>(length));
+    }
+    const bool valid =
+        file && !trace.empty() &&
+        std::all_of(trace.begin(), trace.end(), [this](const Record& r) {
+            return r.length > 0 && r.length <= maxRecordLength &&
+                   r.offset <= size() && r.length <= size() - r.offset;
+        });
+    if (!valid)
+    {
+        LogMsg(Logger::Error, "[BootTrace]: (", name, ") Discarding invalid ",
+               path);
+        trace.clear();
+        std::error_code ec;
+        fs::remove(path, ec);
+        return;
+    }
+
+    // Traces of images mounted recently are kept longest
+    std::error_code ec;
+    fs::last_write_time(path, fs::file_time_type::clock::now(), ec);
+    LogMsg(Logger::Info, "[BootTrace]: (", name, ") Replaying ", trace.size(),
+           " records");
+    replay();
+}
+
+void BootTrace::save()
+{
+    recording = false;
+    if (records.empty())
+    {
+        return;
+    }
+
+    std::error_code ec;
+    fs::create_directories(directory, ec);
+    // Trace appears complete or not at all
+    fs::path temporary = path;
+    temporary += ".tmp";
+    {
+        std::ofstream file(temporary, std::ios::binary | std::ios::trunc);
+        file.write(reinterpret_cast<const char*>(records.data()),
+                   static_cast<std::streamsize>(records.size() *
+                                                sizeof(Record)));
+        if (!file)
+        {
+            LogMsg(Logger::Error, "[BootTrace]: (", name, ") Unable to write ",
+                   temporary);
+            fs::remove(temporary, ec);
+            return;
+        }
+    }
+    fs::rename(temporary, path, ec);
+    if (ec)
+    {
+        LogMsg(Logger::Error, "[BootTrace]: (", name, ") Unable to save ",
+               path, ": ", ec.message());
+        fs::remove(temporary, ec);
+        return;
+    }
+
+    LogMsg(Logger::Info, "[BootTrace]: (", name, ") Recorded ",
+           records.size(), " records");
+    records.clear();
+    removeOldest();
+}
+
+void BootTrace::removeOldest()
+{
+    std::vector<std::pair<fs::file_time_type, fs::path>> traces;
+    std::error_code ec;
+    for (const auto& entry : fs::directory_iterator(directory, ec))
+    {
+        traces.emplace_back(entry.last_write_time(ec), entry.path());
+    }
+    if (traces.size() <= maxTraces)
+    {
+        return;
+    }
+
+    std::sort(traces.begin(), traces.end());
+    for (size_t i = 0; i < traces.size() - maxTraces; i++)
+    {
+        fs::remove(traces[i].second, ec);
+    }
+}
+
+void BootTrace::observe(uint64_t offset, uint64_t length)
+{
+    if (!trace.empty())
+    {
+        hostRead += length;
+        replay();
+        return;
+    }
+    if (!recording)
+    {
+        return;
+    }
+
+    const auto now = std::chrono::steady_clock::now();
+    if (!started)
+    {
+        started = now;
+    }
+    else if (now - *started >= duration)
+    {
+        save();
+        return;
+    }
+
+    if (!records.empty())
+    {
+        Record& last = records.back();
+        if (last.offset + last.length == offset &&
+            last.length + length <= maxRecordLength)
+        {
+            last.length += length;
+            return;
+        }
+    }
+    if (records.size() == maxRecords)
+    {
+        save();
+        return;
+    }
+    records.push_back(Record{offset, std::min(length, maxRecordLength)});
+}
+
+void BootTrace::replay()
+{
+    while (next < trace.size() && replayed < hostRead + window)
+    {
+        lower->prefetch(trace[next].offset, trace[next].length);
+        replayed += trace[next].length;
+        next++;
+    }
+}
+
+void BootTrace::cancelPrefetch()
+{
+    lower->cancelPrefetch();
+    if (trace.empty())
+    {
+        return;
+    }
+
+    // Records the host has not caught up with yet may have been dropped,
+    // they are hinted again
+    next = 0;
+    replayed = 0;
+    while (next < trace.size() && replayed + trace[next].length <= hostRead)
+    {
+        replayed += trace[next].length;
+        next++;
+    }
+    replay();
+}
+
+} // namespace nbd
@@ -0,0 +1,134 @@
+#pragma once
+
+#include "nbd/backend.hpp"
+
+#include <chrono>
+#include <filesystem>
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+
+namespace nbd
+{
+
+// Records which parts of the image the host reads during the first seconds of
+// a mount, eg. while it boots an installer, and replays them as prefetch hints
+// when the same image is mounted again. Traces are files in a directory named
+// after hash of the content id of the image; images without content id are
+// neither recorded nor replayed. Recording starts with the first read and
+// a trace, once saved, is not recorded again.
+//
+// Replay keeps at most window bytes of the trace ahead of what the host has
+// read so far, so prefetched data is not evicted before the host reads it.
+// Host reads are served before prefetches by the backends below.
+class BootTrace : public Backend, public std::enable_shared_from_this<BootTrace>
+{
+  public:
+    static constexpr size_t maxRecords = 16384;
+    // Sequential reads are merged into records up to this length, which is
+    // also the granularity of the replay
+    static constexpr uint64_t maxRecordLength = 1024 * 1024;
+    static constexpr uint64_t maxWindow = 64 * 1024 * 1024;
+    // Traces of images not mounted recently are removed beyond this count
+    static constexpr size_t maxTraces = 64;
+
+    BootTrace(std::string_view name, std::shared_ptr<Backend> lower,
+              std::filesystem::path directory, std::chrono::seconds duration,
+              uint64_t window);
+    ~BootTrace() override;
+
+    void open(Handler&& handler) override;
+
+    uint64_t size() const override
+    {
+        return lower->size();
+    }
+
+    std::string contentId() const override
+    {
+        return lower->contentId();
+    }
+
+    bool isWritable() const override
+    {
+        return lower->isWritable();
+    }
+
+    void read(uint64_t offset, boost::asio::mutable_buffer buffer,
+              Handler&& handler) override
+    {
+        lower->read(offset, buffer, std::move(handler));
+        observe(offset, buffer.size());
+    }
+
+    void write(uint64_t offset, boost::asio::const_buffer buffer,
+               Handler&& handler) override
+    {
+        lower->write(offset, buffer, std::move(handler));
+    }
+
+    void flush(Handler&& handler) override
+    {
+        lower->flush(std::move(handler));
+    }
+
+    bool supportsSplice() const override
+    {
+        return lower->supportsSplice();
+    }
+
+    void splice(uint64_t offset, size_t length, int pipe,
+                Handler&& handler) override
+    {
+        lower->splice(offset, length, pipe, std::move(handler));
+        observe(offset, length);
+    }
+
+    void extents(uint64_t offset, uint64_t length,
+                 ExtentsHandler&& handler) override
+    {
+        lower->extents(offset, length, std::move(handler));
+    }
+
+    void prefetch(uint64_t offset, uint64_t length) override
+    {
+        lower->prefetch(offset, length);
+    }
+
+    void cancelPrefetch() override;
+
+  private:
+    struct Record
+    {
+        uint64_t offset;
+        uint64_t length;
+    };
+
+    void load();
+    void save();
+    void removeOldest();
+    void observe(uint64_t offset, uint64_t length);
+    void replay();
+
+    std::string name;
+    std::shared_ptr<Backend> lower;
+    std::filesystem::path directory;
+    std::chrono::seconds duration;
+    uint64_t window;
+
+    // Empty when the image is not traced
+    std::filesystem::path path;
+
+    bool recording = false;
+    std::optional<std::chrono::steady_clock::time_point> started;
+    std::vector<Record> records;
+
+    std::vector<Record> trace;
+    // Next record to replay
+    size_t next = 0;
+    uint64_t replayed = 0;
+    uint64_t hostRead = 0;
+};
+
+} // namespace nbd
@@ -0,0 +1,380 @@
+#pragma once
+
+#include "logger.hpp"
+#include "nbd/backend.hpp"
+#include "nbd/statistics.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <deque>
+#include <list>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+namespace nbd
+{
+
+// Keeps recently read, fixed size chunks of the image in memory, so regions
+// re-read by the host (eg. an installer scanning the same ISO structures over
+// and over) are not fetched from the underlying backend again. Chunks are
+// evicted in least recently used order once the capacity is exceeded. Writes
+// are passed through and invalidate the chunks they overlap.
+//
+// Prefetched chunks are fetched in the background, only a few at a time, so
+// reads of the host are not stuck behind a long queue of prefetches. Reads of
+// a chunk already being fetched wait for that fetch instead of issuing another
+// one.
+//
+// Chunks found to hold only zeroes share a single zero filled buffer, so
+// empty regions of sparse images take almost no memory and are reported as
+// such by extents().
+class ChunkCache :
+    public Backend,
+    public std::enable_shared_from_this<ChunkCache>
+{
+  public:
+    static constexpr uint32_t defaultChunkSize = 128 * 1024;
+    static constexpr unsigned maxPrefetching = 8;
+    // Charged to capacity for a chunk of zeroes, roughly its bookkeeping
+    static constexpr uint32_t zeroChunkFootprint = 128;
+
+    ChunkCache(std::shared_ptr<Backend> lower, uint64_t capacity,
+               Statistics::Cache& stats,
+               Statistics::ReadAhead& readAheadStats,
+               uint32_t chunkSize = defaultChunkSize) :
+        lower(std::move(lower)),
+        capacity(capacity), chunkSize(chunkSize), stats(stats),
+        readAheadStats(readAheadStats)
+    {
+        LogMsg(Logger::Info, "[ChunkCache]: Capacity ", capacity,
+               " bytes, chunk size ", chunkSize, " bytes");
+    }
+
+    ~ChunkCache() override
+    {
+        stats.size -= used;
+    }
+
+    void open(Handler&& handler) override
+    {
+        lower->open(std::move(handler));
+    }
+
+    uint64_t size() const override
+    {
+        return lower->size();
+    }
+
+    std::string contentId() const override
+    {
+        return lower->contentId();
+    }
+
+    bool isWritable() const override
+    {
+        return lower->isWritable();
+    }
+
+    void read(uint64_t offset, boost::asio::mutable_buffer buffer,
+              Handler&& handler) override
+    {
+        auto pending = std::make_shared<PendingRead>(std::move(handler));
+        auto* dst = static_cast<char*>(buffer.data());
+        const uint64_t end = offset + buffer.size();
+
+        for (uint64_t index = offset / chunkSize; index * chunkSize < end;
+             index++)
+        {
+            const uint64_t chunkStart = index * chunkSize;
+            const uint64_t from = std::max(offset, chunkStart);
+            const uint64_t to = std::min(end, chunkStart + chunkSize);
+            char* target = dst + (from - offset);
+            const auto skip = static_cast<size_t>(from - chunkStart);
+            const auto length = static_cast<size_t>(to - from);
+
+            if (const char* data = lookup(index))
+            {
+                stats.hits++;
+                std::memcpy(target, data + skip, length);
+                continue;
+            }
+
+            stats.misses++;
+            pending->remaining++;
+            fetch(index, false,
+                  [pending, target, skip,
+                   length](std::error_code ec, const char* data) {
+                      if (ec)
+                      {
+                          pending->ec = ec;
+                      }
+                      else
+                      {
+                          std::memcpy(target, data + skip, length);
+                      }
+                      pending->complete();
+                  });
+        }
+        pending->complete();
+    }
+
+    void write(uint64_t offset, boost::asio::const_buffer buffer,
+               Handler&& handler) override
+    {
+        generation++;
+        const uint64_t last = offset + buffer.size() - 1;
+        for (uint64_t index = offset / chunkSize;
+             buffer.size() > 0 && index <= last / chunkSize; index++)
+        {
+            if (auto it = chunks.find(index); it != chunks.end())
+            {
+                remove(it->second);
+            }
+        }
+        lower->write(offset, buffer, std::move(handler));
+    }
+
+    void flush(Handler&& handler) override
+    {
+        lower->flush(std::move(handler));
+    }
+
+    void prefetch(uint64_t offset, uint64_t length) override
+    {
+        const uint64_t end = std::min(offset + length, size());
+        for (uint64_t index = offset / chunkSize; index * chunkSize < end;
+             index++)
+        {
+            if (chunks.count(index) == 0 && fetches.count(index) == 0)
+            {
+                prefetchQueue.push_back(index);
+            }
+        }
+        startPrefetches();
+    }
+
+    void cancelPrefetch() override
+    {
+        prefetchQueue.clear();
+    }
+
+    // Cached chunks are described from memory, the rest by lower backend
+    void extents(uint64_t offset, uint64_t length,
+                 ExtentsHandler&& handler) override
+    {
+        std::vector<Extent> known;
+        const uint64_t end = std::min(offset + length, size());
+        for (uint64_t from = offset; from < end;)
+        {
+            auto it = chunks.find(from / chunkSize);
+            if (it == chunks.end())
+            {
+                break;
+            }
+            const uint64_t to =
+                std::min(end, (from / chunkSize + 1) * chunkSize);
+            appendExtent(known, to - from, it->second->data == zeroes);
+            from = to;
+        }
+        if (known.empty())
+        {
+            lower->extents(offset, length, std::move(handler));
+            return;
+        }
+        handler({}, std::move(known));
+    }
+
+  private:
+    struct Chunk
+    {
+        uint64_t index;
+        std::shared_ptr<char[]> data;
+        uint32_t length;
+        // Fetched ahead and not read by the host yet
+        bool prefetched;
+    };
+
+    using Lru = std::list<Chunk>;
+    using FetchHandler = std::function<void(std::error_code, const char*)>;
+
+    struct Fetch
+    {
+        bool prefetched;
+        // Host read the chunk while it was being prefetched
+        bool used;
+        std::vector<FetchHandler> handlers;
+    };
+
+    // Completes the host request once all of its missing chunks arrived
+    struct PendingRead
+    {
+        explicit PendingRead(Handler&& handler) : handler(std::move(handler))
+        {
+        }
+
+        void complete()
+        {
+            if (--remaining == 0)
+            {
+                handler(ec);
+            }
+        }
+
+        Handler handler;
+        unsigned remaining = 1;
+        std::error_code ec;
+    };
+
+    const char* lookup(uint64_t index)
+    {
+        auto it = chunks.find(index);
+        if (it == chunks.end())
+        {
+            return nullptr;
+        }
+        auto& chunk = *it->second;
+        if (chunk.prefetched)
+        {
+            chunk.prefetched = false;
+            readAheadStats.used += chunk.length;
+        }
+        lru.splice(lru.begin(), lru, it->second);
+        return chunk.data.get();
+    }
+
+    void fetch(uint64_t index, bool prefetched, FetchHandler&& handler)
+    {
+        if (auto it = fetches.find(index); it != fetches.end())
+        {
+            it->second.used = it->second.used || !prefetched;
+            it->second.handlers.push_back(std::move(handler));
+            return;
+        }
+
+        const uint64_t chunkStart = index * chunkSize;
+        const auto length = static_cast<uint32_t>(
+            std::min<uint64_t>(chunkSize, lower->size() - chunkStart));
+        std::shared_ptr<char[]> data(new char[length]);
+        auto& pending = fetches[index];
+        pending.prefetched = prefetched;
+        pending.used = !prefetched;
+        pending.handlers.push_back(std::move(handler));
+
+        BackgroundScope scope(prefetched);
+        lower->read(
+            chunkStart, boost::asio::buffer(data.get(), length),
+            [self = shared_from_this(), index, data, length,
+             generation = generation](std::error_code ec) {
+                auto node = self->fetches.extract(index);
+                const Fetch& fetch = node.mapped();
+                if (!ec && fetch.prefetched)
+                {
+                    self->readAheadStats.fetched += length;
+                    if (fetch.used)
+                    {
+                        self->readAheadStats.used += length;
+                    }
+                }
+                // Chunk fetched before a write landed is stale
+                if (!ec && generation == self->generation)
+                {
+                    self->insert(index, data, length,
+                                 fetch.prefetched && !fetch.used);
+                }
+                for (const auto& handler : fetch.handlers)
+                {
+                    handler(ec, data.get());
+                }
+            });
+    }
+
+    void startPrefetches()
+    {
+        while (prefetching < maxPrefetching && !prefetchQueue.empty())
+        {
+            const uint64_t index = prefetchQueue.front();
+            prefetchQueue.pop_front();
+            if (chunks.count(index) != 0 || fetches.count(index) != 0)
+            {
+                continue;
+            }
+
+            prefetching++;
+            fetch(index, true,
+                  [this](std::error_code ec, [[maybe_unused]] const char*) {
+                      if (ec)
+                      {
+                          LogMsg(Logger::Debug,
+                                 "[ChunkCache]: Prefetch failed: ",
+                                 ec.message());
+                      }
+                      prefetching--;
+                      startPrefetches();
+                  });
+        }
+    }
+
+    uint32_t footprint(const Chunk& chunk) const
+    {
+        return chunk.data == zeroes ? zeroChunkFootprint : chunk.length;
+    }
+
+    void insert(uint64_t index, std::shared_ptr<char[]> data,
+                uint32_t length, bool prefetched)
+    {
+        if (chunks.count(index) != 0)
+        {
+            return;
+        }
+        if (isZero(data.get(), length))
+        {
+            if (!zeroes)
+            {
+                zeroes.reset(new char[chunkSize]());
+            }
+            data = zeroes;
+        }
+        lru.push_front(Chunk{index, std::move(data), length, prefetched});
+        chunks.emplace(index, lru.begin());
+        used += footprint(lru.front());
+        stats.size += footprint(lru.front());
+
+        while (used > capacity && !lru.empty())
+        {
+            remove(std::prev(lru.end()));
+            stats.evictions++;
+        }
+    }
+
+    void remove(Lru::iterator it)
+    {
+        if (it->prefetched)
+        {
+            readAheadStats.wasted += it->length;
+        }
+        used -= footprint(*it);
+        stats.size -= footprint(*it);
+        chunks.erase(it->index);
+        lru.erase(it);
+    }
+
+    std::shared_ptr<Backend> lower;
+    uint64_t capacity;
+    uint32_t chunkSize;
+    Statistics::Cache& stats;
+    Statistics::ReadAhead& readAheadStats;
+
+    Lru lru;
+    std::unordered_map<uint64_t, Lru::iterator> chunks;
+    uint64_t used = 0;
+    uint64_t generation = 0;
+    // Shared by all chunks of zeroes
+    std::shared_ptr<char[]> zeroes;
+
+    std::unordered_map<uint64_t, Fetch> fetches;
+    std::deque<uint64_t> prefetchQueue;
+    unsigned prefetching = 0;
+};
+
+} // namespace nbd
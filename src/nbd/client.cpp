@@ -0,0 +1,199 @@
+#include "nbd/client.hpp"
+
+#include "logger.hpp"
+#include "nbd/protocol.hpp"
+
+#include <array>
+#include <boost/asio/local/stream_protocol.hpp>
+#include <boost/asio/read.hpp>
+#include <boost/asio/spawn.hpp>
+#include <boost/asio/write.hpp>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+namespace nbd
+{
+
+namespace
+{
+
+// Upper bound for option reply payload, anything bigger is malformed
+constexpr uint32_t maxReplyLength = 64 * 1024;
+
+using Socket = boost::asio::local::stream_protocol::socket;
+
+bool sendOption(Socket& socket, uint32_t option,
+                const std::vector<char>& data,
+                boost::asio::yield_context yield)
+{
+    proto::OptionHeader header;
+    header.magic = proto::optionMagic;
+    header.option = option;
+    header.length = static_cast<uint32_t>(data.size());
+    const std::array<boost::asio::const_buffer, 2> buffers = {
+        boost::asio::buffer(&header, sizeof(header)),
+        boost::asio::buffer(data)};
+    boost::system::error_code ec;
+    boost::asio::async_write(socket, buffers, yield[ec]);
+    return !ec;
+}
+
+// Export name of old style negotiation, the reply carries no error
+std::error_code exportName(Socket& socket, bool noZeroes,
+                           netlink::Export& exp,
+                           boost::asio::yield_context yield)
+{
+    boost::system::error_code ec;
+    if (!sendOption(socket, proto::optExportName, {}, yield))
+    {
+        return std::make_error_code(std::errc::connection_reset);
+    }
+    proto::ExportNameReply reply;
+    boost::asio::async_read(socket, boost::asio::buffer(&reply, sizeof(reply)),
+                            yield[ec]);
+    std::array<char, 124> zeroes;
+    if (!ec && !noZeroes)
+    {
+        boost::asio::async_read(socket, boost::asio::buffer(zeroes),
+                                yield[ec]);
+    }
+    if (ec)
+    {
+        return std::make_error_code(std::errc::connection_reset);
+    }
+    exp.size = reply.size.value();
+    exp.flags = reply.flags.value();
+    return {};
+}
+
+std::error_code handshake(Socket& socket, std::string_view name,
+                          netlink::Export& exp,
+                          boost::asio::yield_context yield)
+{
+    boost::system::error_code ec;
+    proto::ServerGreeting greeting;
+    boost::asio::async_read(
+        socket, boost::asio::buffer(&greeting, sizeof(greeting)), yield[ec]);
+    if (ec)
+    {
+        return std::make_error_code(std::errc::connection_reset);
+    }
+    if (greeting.magic.value() != proto::nbdMagic ||
+        greeting.optionMagic.value() != proto::optionMagic ||
+        (greeting.handshakeFlags.value() & proto::flagFixedNewstyle) == 0)
+    {
+        LogMsg(Logger::Error, "[NbdClient]: (", name,
+               ") Server does not support fixed newstyle negotiation");
+        return std::make_error_code(std::errc::protocol_not_supported);
+    }
+
+    const bool noZeroes =
+        (greeting.handshakeFlags.value() & proto::flagNoZeroes) != 0;
+    proto::big_uint32_buf_t clientFlags{
+        proto::clientFlagFixedNewstyle |
+        (noZeroes ? proto::clientFlagNoZeroes : 0U)};
+    boost::asio::async_write(
+        socket, boost::asio::buffer(&clientFlags, sizeof(clientFlags)),
+        yield[ec]);
+    if (ec)
+    {
+        return std::make_error_code(std::errc::connection_reset);
+    }
+
+    // Default export name and no information requests
+    const std::vector<char> go(sizeof(uint32_t) + sizeof(uint16_t), 0);
+    if (!sendOption(socket, proto::optGo, go, yield))
+    {
+        return std::make_error_code(std::errc::connection_reset);
+    }
+    bool haveExport = false;
+    while (true)
+    {
+        proto::OptionReplyHeader header;
+        boost::asio::async_read(
+            socket, boost::asio::buffer(&header, sizeof(header)), yield[ec]);
+        if (ec || header.magic.value() != proto::optionReplyMagic ||
+            header.length.value() > maxReplyLength)
+        {
+            return std::make_error_code(std::errc::connection_reset);
+        }
+        std::vector<char> data(header.length.value());
+        boost::asio::async_read(socket, boost::asio::buffer(data), yield[ec]);
+        if (ec)
+        {
+            return std::make_error_code(std::errc::connection_reset);
+        }
+
+        const uint32_t type = header.type.value();
+        if (type == proto::repErrUnsup)
+        {
+            // Server predates NBD_OPT_GO
+            return exportName(socket, noZeroes, exp, yield);
+        }
+        if ((type & proto::replyErrorBit) != 0)
+        {
+            LogMsg(Logger::Error, "[NbdClient]: (", name,
+                   ") Export refused, reply ", type);
+            return std::make_error_code(std::errc::connection_refused);
+        }
+        if (type == proto::repInfo && data.size() >= sizeof(proto::InfoExport))
+        {
+            proto::InfoExport info;
+            std::memcpy(&info, data.data(), sizeof(info));
+            if (info.type.value() == proto::infoExport)
+            {
+                exp.size = info.size.value();
+                exp.flags = info.flags.value();
+                haveExport = true;
+            }
+        }
+        else if (type == proto::repAck)
+        {
+            if (!haveExport)
+            {
+                return std::make_error_code(std::errc::protocol_error);
+            }
+            return {};
+        }
+    }
+}
+
+} // namespace
+
+void negotiate(boost::asio::io_context& ioc, std::string_view name,
+               const std::filesystem::path& socketPath,
+               NegotiateHandler&& handler)
+{
+    boost::asio::spawn(ioc, [&ioc, name = std::string(name), socketPath,
+                             handler = std::move(handler)](
+                                boost::asio::yield_context yield) {
+        Socket socket(ioc);
+        boost::system::error_code ec;
+        socket.async_connect(
+            boost::asio::local::stream_protocol::endpoint(socketPath.string()),
+            yield[ec]);
+        if (ec)
+        {
+            LogMsg(Logger::Error, "[NbdClient]: (", name,
+                   ") Unable to connect to ", socketPath, ": ", ec);
+            handler(std::make_error_code(std::errc::connection_refused), -1,
+                    {});
+            return;
+        }
+
+        netlink::Export exp;
+        if (const auto error = handshake(socket, name, exp, yield))
+        {
+            LogMsg(Logger::Error, "[NbdClient]: (", name,
+                   ") Handshake failed: ", error.message());
+            handler(error, -1, {});
+            return;
+        }
+        LogMsg(Logger::Info, "[NbdClient]: (", name, ") Export of ",
+               exp.size, " bytes negotiated");
+        handler({}, socket.release(), exp);
+    });
+}
+
+} // namespace nbd
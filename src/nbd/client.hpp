@@ -0,0 +1,26 @@
+#pragma once
+
+#include "nbd/netlink.hpp"
+
+#include <boost/asio/io_context.hpp>
+#include <filesystem>
+#include <functional>
+#include <string_view>
+#include <system_error>
+
+namespace nbd
+{
+
+// Socket of the negotiated connection, owned by the handler, and the export
+// it provides
+using NegotiateHandler =
+    std::function<void(std::error_code, int socket, netlink::Export)>;
+
+// Client side of the fixed newstyle handshake. Connects to the server
+// listening on socketPath and negotiates its default export, after which the
+// socket can be attached to an NBD device.
+void negotiate(boost::asio::io_context& ioc, std::string_view name,
+               const std::filesystem::path& socketPath,
+               NegotiateHandler&& handler);
+
+} // namespace nbd
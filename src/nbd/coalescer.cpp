@@ -0,0 +1,346 @@
+#include "nbd/coalescer.hpp"
+
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#include <boost/asio/post.hpp>
+
+#include <algorithm>
+#include <cstring>
+#include <iterator>
+#include <utility>
+
+namespace nbd
+{
+
+namespace
+{
+
+// Writes data to the pipe only when the pipe has room for all of it, a pipe
+// of the caller must not block the io_context. Returns bytes written.
+size_t fillPipe(int pipe, const char* data, size_t length)
+{
+    const int size = ::fcntl(pipe, F_GETPIPE_SZ);
+    int used = 0;
+    if (size < 0 || ::ioctl(pipe, FIONREAD, &used) != 0 ||
+        static_cast<size_t>(size - used) < length)
+    {
+        return 0;
+    }
+    size_t written = 0;
+    while (written < length)
+    {
+        const ssize_t rc = ::write(pipe, data + written, length - written);
+        if (rc <= 0)
+        {
+            break;
+        }
+        written += static_cast<size_t>(rc);
+    }
+    return written;
+}
+
+} // namespace
+
+Coalescer::Coalescer(boost::asio::io_context& ioc,
+                     std::shared_ptr<Backend> lower,
+                     Statistics::Coalescing& stats) :
+    ioc(ioc),
+    lower(std::move(lower)), stats(stats)
+{
+}
+
+void Coalescer::read(uint64_t offset, boost::asio::mutable_buffer buffer,
+                     Handler&& handler)
+{
+    if (buffer.size() == 0)
+    {
+        handler({});
+        return;
+    }
+
+    Reader reader{offset, buffer, std::move(handler),
+                  BackgroundScope::isActive()};
+    if (join(reader))
+    {
+        stats.joined++;
+        return;
+    }
+    if (pending.empty())
+    {
+        boost::asio::post(ioc, [self = shared_from_this()]() {
+            self->issue();
+        });
+    }
+    pending.push_back(std::move(reader));
+}
+
+bool Coalescer::join(Reader& reader)
+{
+    // Only reads of a single reader are longer than maxLength, those are
+    // not joined
+    const uint64_t end = reader.offset + reader.buffer.size();
+    auto it = inFlight.lower_bound(
+        reader.offset > maxLength ? reader.offset - maxLength : 0);
+    for (; it != inFlight.end() && it->first <= reader.offset; it++)
+    {
+        Fetch& fetch = *it->second;
+        if (fetch.joinable && fetch.offset + fetch.length >= end)
+        {
+            fetch.readers.push_back(std::move(reader));
+            return true;
+        }
+    }
+    return false;
+}
+
+void Coalescer::splice(uint64_t offset, size_t length, int pipe,
+                       Handler&& handler)
+{
+    if (length == 0)
+    {
+        handler({});
+        return;
+    }
+
+    Splicer splicer{offset, length, pipe, std::move(handler)};
+    if (join(splicer))
+    {
+        stats.joined++;
+        return;
+    }
+
+    auto splice = std::make_shared<Splice>();
+    splice->offset = offset;
+    splice->length = length;
+    splice->pipe = pipe;
+    splicing.emplace(offset, splice);
+    lower->splice(offset, length, pipe,
+                  [self = shared_from_this(), splice,
+                   handler = std::move(splicer.handler)](std::error_code ec) {
+                      self->complete(splice, ec);
+                      handler(ec);
+                  });
+}
+
+bool Coalescer::join(Splicer& splicer)
+{
+    auto [first, last] = splicing.equal_range(splicer.offset);
+    for (auto it = first; it != last; it++)
+    {
+        Splice& splice = *it->second;
+        // Pipe of the splice cannot take a copy of its own data
+        if (splice.joinable && splice.length >= splicer.length &&
+            splice.pipe != splicer.pipe)
+        {
+            splice.joiners.push_back(std::move(splicer));
+            return true;
+        }
+    }
+
+    // Data of a fetch is written to the pipe, which the pipe holds unless
+    // the caller left data of its own there
+    const uint64_t end = splicer.offset + splicer.length;
+    auto it = inFlight.lower_bound(
+        splicer.offset > maxLength ? splicer.offset - maxLength : 0);
+    for (; it != inFlight.end() && it->first <= splicer.offset; it++)
+    {
+        Fetch& fetch = *it->second;
+        if (!fetch.joinable || fetch.offset + fetch.length < end)
+        {
+            continue;
+        }
+        std::shared_ptr<char[]> data(new char[splicer.length]);
+        auto joiner = std::make_shared<Splicer>(std::move(splicer));
+        fetch.readers.push_back(
+            {joiner->offset, boost::asio::buffer(data.get(), joiner->length),
+             [self = shared_from_this(), joiner, data](std::error_code ec) {
+                 if (ec)
+                 {
+                     joiner->handler(ec);
+                     return;
+                 }
+                 self->spliceRest(*joiner, fillPipe(joiner->pipe, data.get(),
+                                                    joiner->length));
+             },
+             BackgroundScope::isActive()});
+        return true;
+    }
+    return false;
+}
+
+void Coalescer::spliceRest(Splicer& splicer, size_t copied)
+{
+    if (copied == splicer.length)
+    {
+        splicer.handler({});
+        return;
+    }
+    lower->splice(splicer.offset + copied, splicer.length - copied,
+                  splicer.pipe, std::move(splicer.handler));
+}
+
+void Coalescer::complete(const std::shared_ptr<Splice>& splice,
+                         const std::error_code& ec)
+{
+    auto [first, last] = splicing.equal_range(splice->offset);
+    auto it = std::find_if(first, last, [&splice](const auto& entry) {
+        return entry.second == splice;
+    });
+    if (it != last)
+    {
+        splicing.erase(it);
+    }
+
+    if (splice->joiners.empty())
+    {
+        return;
+    }
+    // Copies are taken before the handler of the splice consumes the pipe,
+    // through a read end of the pipe of its own, splices get the write end
+    int source = -1;
+    if (!ec)
+    {
+        const std::string path =
+            "/proc/self/fd/" + std::to_string(splice->pipe);
+        source = ::open(path.c_str(), O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    }
+    for (auto& joiner : splice->joiners)
+    {
+        if (ec)
+        {
+            joiner.handler(ec);
+            continue;
+        }
+        const ssize_t copied =
+            source < 0 ? 0
+                       : ::tee(source, joiner.pipe, joiner.length,
+                               SPLICE_F_NONBLOCK);
+        spliceRest(joiner, copied > 0 ? static_cast<size_t>(copied) : 0);
+    }
+    if (source >= 0)
+    {
+        ::close(source);
+    }
+}
+
+void Coalescer::write(uint64_t offset, boost::asio::const_buffer buffer,
+                      Handler&& handler)
+{
+    // Reads requested before the write are issued before it
+    issue();
+
+    const uint64_t end = offset + buffer.size();
+    for (auto& [start, fetch] : inFlight)
+    {
+        if (start < end && start + fetch->length > offset)
+        {
+            fetch->joinable = false;
+        }
+    }
+    for (auto& [start, splice] : splicing)
+    {
+        if (start < end && start + splice->length > offset)
+        {
+            splice->joinable = false;
+        }
+    }
+    lower->write(offset, buffer, std::move(handler));
+}
+
+void Coalescer::issue()
+{
+    if (pending.empty())
+    {
+        return;
+    }
+
+    auto readers = std::exchange(pending, {});
+    std::stable_sort(readers.begin(), readers.end(),
+                     [](const Reader& a, const Reader& b) {
+                         return a.offset < b.offset;
+                     });
+
+    auto first = readers.begin();
+    uint64_t end = first->offset + first->buffer.size();
+    for (auto it = std::next(first); it != readers.end(); it++)
+    {
+        const uint64_t readerEnd = it->offset + it->buffer.size();
+        if (it->offset <= end &&
+            std::max(end, readerEnd) - first->offset <= maxLength)
+        {
+            end = std::max(end, readerEnd);
+            continue;
+        }
+        start(first, it, end);
+        first = it;
+        end = readerEnd;
+    }
+    start(first, readers.end(), end);
+}
+
+void Coalescer::start(std::vector<Reader>::iterator first,
+                      std::vector<Reader>::iterator last, uint64_t end)
+{
+    auto fetch = std::make_shared<Fetch>();
+    fetch->offset = first->offset;
+    fetch->length = end - first->offset;
+    if (std::next(first) == last)
+    {
+        // Single reader receives the data directly
+        fetch->data = static_cast<char*>(first->buffer.data());
+    }
+    else
+    {
+        fetch->merged.reset(new char[fetch->length]);
+        fetch->data = fetch->merged.get();
+        stats.merged += static_cast<uint64_t>(std::distance(first, last) - 1);
+    }
+    fetch->readers.assign(std::make_move_iterator(first),
+                          std::make_move_iterator(last));
+    inFlight.emplace(fetch->offset, fetch);
+
+    BackgroundScope scope(
+        std::all_of(fetch->readers.begin(), fetch->readers.end(),
+                    [](const Reader& reader) { return reader.background; }));
+    lower->read(fetch->offset,
+                boost::asio::buffer(fetch->data,
+                                    static_cast<size_t>(fetch->length)),
+                [self = shared_from_this(), fetch](std::error_code ec) {
+                    self->complete(fetch, ec);
+                });
+}
+
+void Coalescer::complete(const std::shared_ptr<Fetch>& fetch,
+                         const std::error_code& ec)
+{
+    auto [first, last] = inFlight.equal_range(fetch->offset);
+    auto it = std::find_if(first, last, [&fetch](const auto& entry) {
+        return entry.second == fetch;
+    });
+    if (it != last)
+    {
+        inFlight.erase(it);
+    }
+
+    // Data is copied before any handler runs, the first reader may own the
+    // buffer of the fetch
+    if (!ec)
+    {
+        for (const auto& reader : fetch->readers)
+        {
+            const char* src = fetch->data + (reader.offset - fetch->offset);
+            if (reader.buffer.data() != src)
+            {
+                std::memcpy(reader.buffer.data(), src, reader.buffer.size());
+            }
+        }
+    }
+    for (const auto& reader : fetch->readers)
+    {
+        reader.handler(ec);
+    }
+}
+
+} // namespace nbd
@@ -0,0 +1,153 @@
+#pragma once
+
+#include "nbd/backend.hpp"
+#include "nbd/statistics.hpp"
+
+#include <boost/asio/io_context.hpp>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace nbd
+{
+
+// Keeps the reads in flight to the image below, eg. a remote server, so
+// a read of data already being fetched waits for that fetch instead of
+// fetching the data again. Reads issued together, within one turn of the
+// io_context, are sorted and adjacent or overlapping ones are merged into
+// a single read of at most maxLength bytes.
+//
+// Splices are not merged, their data would have to pass through memory, but
+// a splice of data being fetched waits for that fetch, and a splice starting
+// where a splice in flight starts gets a copy of the data of that splice by
+// tee(2). Reads do not wait for splices.
+//
+// A write makes fetches of data it overlaps unusable for later reads, so they
+// never return data older than a completed write. Fetches of background reads
+// only are issued in a BackgroundScope.
+class Coalescer : public Backend, public std::enable_shared_from_this<Coalescer>
+{
+  public:
+    static constexpr uint64_t maxLength = 4 * 1024 * 1024;
+
+    Coalescer(boost::asio::io_context& ioc, std::shared_ptr<Backend> lower,
+              Statistics::Coalescing& stats);
+
+    void open(Handler&& handler) override
+    {
+        lower->open(std::move(handler));
+    }
+
+    uint64_t size() const override
+    {
+        return lower->size();
+    }
+
+    std::string contentId() const override
+    {
+        return lower->contentId();
+    }
+
+    bool isWritable() const override
+    {
+        return lower->isWritable();
+    }
+
+    void read(uint64_t offset, boost::asio::mutable_buffer buffer,
+              Handler&& handler) override;
+    void write(uint64_t offset, boost::asio::const_buffer buffer,
+               Handler&& handler) override;
+
+    void flush(Handler&& handler) override
+    {
+        lower->flush(std::move(handler));
+    }
+
+    bool supportsSplice() const override
+    {
+        return lower->supportsSplice();
+    }
+
+    void splice(uint64_t offset, size_t length, int pipe,
+                Handler&& handler) override;
+
+    void extents(uint64_t offset, uint64_t length,
+                 ExtentsHandler&& handler) override
+    {
+        lower->extents(offset, length, std::move(handler));
+    }
+
+    void prefetch(uint64_t offset, uint64_t length) override
+    {
+        lower->prefetch(offset, length);
+    }
+
+    void cancelPrefetch() override
+    {
+        lower->cancelPrefetch();
+    }
+
+  private:
+    struct Reader
+    {
+        uint64_t offset;
+        boost::asio::mutable_buffer buffer;
+        Handler handler;
+        // Issued in a BackgroundScope
+        bool background;
+    };
+
+    struct Fetch
+    {
+        uint64_t offset;
+        uint64_t length;
+        // Buffer of the only reader or of the merged read
+        char* data;
+        std::unique_ptr<char[]> merged;
+        std::vector<Reader> readers;
+        bool joinable = true;
+    };
+
+    struct Splicer
+    {
+        uint64_t offset;
+        size_t length;
+        int pipe;
+        Handler handler;
+    };
+
+    struct Splice
+    {
+        uint64_t offset;
+        size_t length;
+        int pipe;
+        // Splicers waiting for a copy of the data in the pipe
+        std::vector<Splicer> joiners;
+        bool joinable = true;
+    };
+
+    bool join(Reader& reader);
+    bool join(Splicer& splicer);
+    // Splices into the pipe of splicer what was not copied there already
+    void spliceRest(Splicer& splicer, size_t copied);
+    void complete(const std::shared_ptr<Splice>& splice,
+                  const std::error_code& ec);
+    void issue();
+    void start(std::vector<Reader>::iterator first,
+               std::vector<Reader>::iterator last, uint64_t end);
+    void complete(const std::shared_ptr<Fetch>& fetch,
+                  const std::error_code& ec);
+
+    boost::asio::io_context& ioc;
+    std::shared_ptr<Backend> lower;
+    Statistics::Coalescing& stats;
+
+    // Reads waiting for the end of the current turn
+    std::vector<Reader> pending;
+    // Fetches and splices in flight by offset
+    std::multimap<uint64_t, std::shared_ptr<Fetch>> inFlight;
+    std::multimap<uint64_t, std::shared_ptr<Splice>> splicing;
+};
+
+} // namespace nbd
@@ -0,0 +1,442 @@
+#include "nbd/disk_cache.hpp"
+
+#include "logger.hpp"
+
+#include <fcntl.h>
+#include <openssl/evp.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <fstream>
+
+namespace nbd
+{
+
+namespace fs = std::filesystem;
+
+namespace
+{
+
+constexpr const char* dataFile = "data";
+constexpr const char* indexFile = "index";
+constexpr unsigned queueDepth = 32;
+
+struct IndexHeader
+{
+    std::array<char, 8> magic;
+    uint32_t version;
+    uint32_t chunkSize;
+    uint64_t imageSize;
+};
+
+constexpr std::array<char, 8> indexMagic = {'V', 'M', 'C', 'A',
+                                            'C', 'H', 'E', '\0'};
+constexpr uint32_t indexVersion = 1;
+
+uint64_t allocatedSize(const fs::path& path)
+{
+    struct stat st = {};
+    if (::stat(path.c_str(), &st) != 0)
+    {
+        return 0;
+    }
+    return static_cast<uint64_t>(st.st_blocks) * 512;
+}
+
+// Entries of images being served by other mount points are locked
+bool isLocked(const fs::path& path)
+{
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        return false;
+    }
+    const bool locked = ::flock(fd, LOCK_EX | LOCK_NB) != 0;
+    ::close(fd);
+    return locked;
+}
+
+} // namespace
+
+std::string hashOf(const std::string& id)
+{
+    std::array<unsigned char, EVP_MAX_MD_SIZE> digest = {};
+    unsigned int length = 0;
+    if (EVP_Digest(id.data(), id.size(), digest.data(), &length, EVP_sha256(),
+                   nullptr) != 1)
+    {
+        return {};
+    }
+
+    constexpr std::string_view hex = "0123456789abcdef";
+    std::string result;
+    for (unsigned int i = 0; i < length; i++)
+    {
+        result.push_back(hex[digest[i] >> 4]);
+        result.push_back(hex[digest[i] & 0xf]);
+    }
+    return result;
+}
+
+struct DiskCache::PendingRead
+{
+    explicit PendingRead(Handler&& handler) : handler(std::move(handler))
+    {
+    }
+
+    void complete(const std::error_code& result = {})
+    {
+        if (result)
+        {
+            ec = result;
+        }
+        if (--remaining == 0)
+        {
+            handler(ec);
+        }
+    }
+
+    Handler handler;
+    unsigned remaining = 1;
+    std::error_code ec;
+};
+
+DiskCache::DiskCache(boost::asio::io_context& ioc,
+                     std::shared_ptr<Backend> lower, fs::path directory,
+                     uint64_t capacity, Statistics::Cache& stats) :
+    ioc(ioc),
+    lower(std::move(lower)), directory(std::move(directory)),
+    capacity(capacity), stats(stats)
+{
+}
+
+DiskCache::~DiskCache()
+{
+    if (fd < 0)
+    {
+        return;
+    }
+    if (dirty)
+    {
+        if (::fdatasync(fd) == 0)
+        {
+            saveIndex();
+        }
+        else
+        {
+            LogMsg(Logger::Error, "[DiskCache]: Unable to sync ", entry,
+                   ", index not updated");
+        }
+    }
+    stats.size -= stored;
+    ::close(fd);
+}
+
+void DiskCache::open(Handler&& handler)
+{
+    lower->open([self = shared_from_this(),
+                 handler = std::move(handler)](std::error_code ec) {
+        // Problems with the cache only make the image uncached
+        if (!ec && !self->attach() && self->fd >= 0)
+        {
+            ::close(self->fd);
+            self->fd = -1;
+        }
+        handler(ec);
+    });
+}
+
+bool DiskCache::attach()
+{
+    const std::string id = lower->contentId();
+    if (id.empty() || lower->isWritable())
+    {
+        LogMsg(Logger::Info,
+               "[DiskCache]: Image can not be validated, not cached on disk");
+        return false;
+    }
+
+    std::error_code ec;
+    fs::create_directories(directory, ec);
+    entry = directory / hashOf(id);
+    if (!ec)
+    {
+        fs::create_directory(entry, ec);
+    }
+    if (ec)
+    {
+        LogMsg(Logger::Error, "[DiskCache]: Unable to create ", entry, ": ",
+               ec.message());
+        return false;
+    }
+
+    fd = ::open((entry / dataFile).c_str(), O_RDWR | O_CREAT | O_CLOEXEC,
+                0600);
+    if (fd < 0)
+    {
+        LogMsg(Logger::Error, "[DiskCache]: Unable to open ", entry, ": ",
+               std::strerror(errno));
+        return false;
+    }
+    if (::flock(fd, LOCK_EX | LOCK_NB) != 0)
+    {
+        LogMsg(Logger::Info, "[DiskCache]: ", entry,
+               " is used by another mount point");
+        return false;
+    }
+    if (::ftruncate(fd, static_cast<off_t>(size())) != 0)
+    {
+        LogMsg(Logger::Error, "[DiskCache]: Unable to resize ", entry, ": ",
+               std::strerror(errno));
+        return false;
+    }
+
+    blockIo = BlockIo::create(ioc, queueDepth);
+    if (!blockIo)
+    {
+        return false;
+    }
+
+    loadIndex();
+    // Modification time of the entry tells when it was used last
+    fs::last_write_time(entry, fs::file_time_type::clock::now(), ec);
+    evict(size() - stored);
+    stats.size += stored;
+
+    LogMsg(Logger::Info, "[DiskCache]: Using ", entry, ", ", stored, " of ",
+           size(), " bytes cached");
+    return true;
+}
+
+void DiskCache::evict(uint64_t needed)
+{
+    struct Entry
+    {
+        fs::path path;
+        fs::file_time_type used;
+        uint64_t size;
+    };
+
+    std::vector<Entry> entries;
+    uint64_t total = 0;
+    std::error_code ec;
+    for (const auto& item : fs::directory_iterator(directory, ec))
+    {
+        if (item.path() == entry || !item.is_directory(ec))
+        {
+            continue;
+        }
+        Entry other{item.path(), fs::last_write_time(item.path(), ec),
+                    allocatedSize(item.path() / dataFile)};
+        total += other.size;
+        entries.push_back(std::move(other));
+    }
+
+    std::sort(entries.begin(), entries.end(),
+              [](const Entry& a, const Entry& b) { return a.used < b.used; });
+    for (const auto& other : entries)
+    {
+        if (total + stored + needed <= capacity)
+        {
+            break;
+        }
+        if (isLocked(other.path / dataFile))
+        {
+            continue;
+        }
+        LogMsg(Logger::Info, "[DiskCache]: Evicting ", other.path);
+        fs::remove_all(other.path, ec);
+        total -= other.size;
+        stats.evictions++;
+    }
+
+    limit = capacity > total ? capacity - total : 0;
+}
+
+void DiskCache::loadIndex()
+{
+    const uint64_t chunks = (size() + chunkSize - 1) / chunkSize;
+    present.assign(static_cast<size_t>((chunks + 7) / 8), 0);
+    stored = 0;
+
+    std::ifstream file(entry / indexFile, std::ios::binary);
+    IndexHeader header = {};
+    if (!file.read(reinterpret_cast<char*>(&header), sizeof(header)) ||
+        header.magic != indexMagic || header.version != indexVersion ||
+        header.chunkSize != chunkSize || header.imageSize != size())
+    {
+        return;
+    }
+    if (!file.read(reinterpret_cast<char*>(present.data()),
+                   static_cast<std::streamsize>(present.size())))
+    {
+        std::fill(present.begin(), present.end(), 0);
+        return;
+    }
+
+    for (uint64_t index = 0; index < chunks; index++)
+    {
+        if (isPresent(index))
+        {
+            stored += chunkLength(index);
+        }
+    }
+}
+
+void DiskCache::saveIndex()
+{
+    const IndexHeader header = {indexMagic, indexVersion, chunkSize, size()};
+    const fs::path temporary = entry / (std::string(indexFile) + ".tmp");
+
+    int indexFd = ::open(temporary.c_str(),
+                         O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (indexFd < 0)
+    {
+        LogMsg(Logger::Error, "[DiskCache]: Unable to save index of ", entry);
+        return;
+    }
+    const bool written =
+        ::write(indexFd, &header, sizeof(header)) ==
+            static_cast<ssize_t>(sizeof(header)) &&
+        ::write(indexFd, present.data(), present.size()) ==
+            static_cast<ssize_t>(present.size()) &&
+        ::fdatasync(indexFd) == 0;
+    ::close(indexFd);
+
+    std::error_code ec;
+    if (written)
+    {
+        fs::rename(temporary, entry / indexFile, ec);
+    }
+    if (!written || ec)
+    {
+        LogMsg(Logger::Error, "[DiskCache]: Unable to save index of ", entry);
+        fs::remove(temporary, ec);
+    }
+}
+
+uint32_t DiskCache::chunkLength(uint64_t index) const
+{
+    return static_cast<uint32_t>(
+        std::min<uint64_t>(chunkSize, size() - index * chunkSize));
+}
+
+bool DiskCache::isPresent(uint64_t index) const
+{
+    return (present[static_cast<size_t>(index / 8)] & (1u << (index % 8))) !=
+           0;
+}
+
+void DiskCache::read(uint64_t offset, boost::asio::mutable_buffer buffer,
+                     Handler&& handler)
+{
+    if (fd < 0)
+    {
+        lower->read(offset, buffer, std::move(handler));
+        return;
+    }
+
+    auto pending = std::make_shared<PendingRead>(std::move(handler));
+    auto* dst = static_cast<char*>(buffer.data());
+    const uint64_t end = offset + buffer.size();
+
+    for (uint64_t index = offset / chunkSize; index * chunkSize < end;
+         index++)
+    {
+        const uint64_t chunkStart = index * chunkSize;
+        const uint64_t from = std::max(offset, chunkStart);
+        const uint64_t to = std::min(end, chunkStart + chunkSize);
+        const boost::asio::mutable_buffer piece(
+            dst + (from - offset), static_cast<size_t>(to - from));
+
+        pending->remaining++;
+        if (isPresent(index))
+        {
+            stats.hits++;
+            readCached(from, piece, pending);
+        }
+        else
+        {
+            stats.misses++;
+            fetch(index, from, piece, pending);
+        }
+    }
+    pending->complete();
+}
+
+void DiskCache::readCached(uint64_t offset, boost::asio::mutable_buffer buffer,
+                           const std::shared_ptr<PendingRead>& pending)
+{
+    blockIo->read(fd, offset, buffer,
+                  [self = shared_from_this(), offset, buffer,
+                   pending](std::error_code ec) {
+                      if (!ec)
+                      {
+                          pending->complete();
+                          return;
+                      }
+                      LogMsg(Logger::Error,
+                             "[DiskCache]: Unable to read cached data: ",
+                             ec.message());
+                      self->lower->read(offset, buffer,
+                                        [pending](std::error_code ec) {
+                                            pending->complete(ec);
+                                        });
+                  });
+}
+
+void DiskCache::fetch(uint64_t index, uint64_t offset,
+                      boost::asio::mutable_buffer buffer,
+                      const std::shared_ptr<PendingRead>& pending)
+{
+    const uint64_t chunkStart = index * chunkSize;
+    const uint32_t length = chunkLength(index);
+    std::shared_ptr<char[]> data(new char[length]);
+
+    lower->read(chunkStart, boost::asio::buffer(data.get(), length),
+                [self = shared_from_this(), index, data, buffer, pending,
+                 skip = offset - chunkStart](std::error_code ec) {
+                    if (!ec)
+                    {
+                        std::memcpy(buffer.data(), data.get() + skip,
+                                    buffer.size());
+                        self->store(index, data);
+                    }
+                    pending->complete(ec);
+                });
+}
+
+void DiskCache::store(uint64_t index, const std::shared_ptr<char[]>& data)
+{
+    const uint32_t length = chunkLength(index);
+    if (isPresent(index) || storing.count(index) != 0 ||
+        stored + length > limit)
+    {
+        return;
+    }
+
+    storing.insert(index);
+    blockIo->write(
+        fd, index * chunkSize, boost::asio::buffer(data.get(), length),
+        [self = shared_from_this(), index, data,
+         length](std::error_code ec) {
+            self->storing.erase(index);
+            if (ec)
+            {
+                LogMsg(Logger::Debug, "[DiskCache]: Unable to store chunk ",
+                       index, ": ", ec.message());
+                return;
+            }
+            self->present[static_cast<size_t>(index / 8)] |=
+                static_cast<uint8_t>(1u << (index % 8));
+            self->stored += length;
+            self->stats.size += length;
+            self->dirty = true;
+        });
+}
+
+} // namespace nbd
@@ -0,0 +1,111 @@
+#pragma once
+
+#include "nbd/backend.hpp"
+#include "nbd/block_io.hpp"
+#include "nbd/statistics.hpp"
+
+#include <boost/asio/io_context.hpp>
+#include <filesystem>
+#include <memory>
+#include <unordered_set>
+#include <vector>
+
+namespace nbd
+{
+
+// Names files kept for an image across mounts, hex of SHA-256 of its content
+// id
+std::string hashOf(const std::string& id);
+
+// Keeps chunks of read-only images on disk across mounts and restarts of the
+// service. Each image gets an entry in the cache directory named after hash
+// of its content id (URL and validator), so a changed image never hits stale
+// data. Entries of images not mounted recently are evicted, oldest first,
+// when the directory would not fit into its capacity.
+//
+// Index of the cached chunks is written when the image is closed, after the
+// data are synced, so an interrupted session loses only chunks cached during
+// it. Images without content id, writable ones and images already cached by
+// another mount point are passed through.
+class DiskCache : public Backend, public std::enable_shared_from_this<DiskCache>
+{
+  public:
+    static constexpr uint32_t chunkSize = 128 * 1024;
+
+    DiskCache(boost::asio::io_context& ioc, std::shared_ptr<Backend> lower,
+              std::filesystem::path directory, uint64_t capacity,
+              Statistics::Cache& stats);
+    ~DiskCache() override;
+
+    void open(Handler&& handler) override;
+
+    uint64_t size() const override
+    {
+        return lower->size();
+    }
+
+    std::string contentId() const override
+    {
+        return lower->contentId();
+    }
+
+    bool isWritable() const override
+    {
+        return lower->isWritable();
+    }
+
+    void read(uint64_t offset, boost::asio::mutable_buffer buffer,
+              Handler&& handler) override;
+
+    void write(uint64_t offset, boost::asio::const_buffer buffer,
+               Handler&& handler) override
+    {
+        lower->write(offset, buffer, std::move(handler));
+    }
+
+    void flush(Handler&& handler) override
+    {
+        lower->flush(std::move(handler));
+    }
+
+    void extents(uint64_t offset, uint64_t length,
+                 ExtentsHandler&& handler) override
+    {
+        lower->extents(offset, length, std::move(handler));
+    }
+
+  private:
+    struct PendingRead;
+
+    bool attach();
+    void evict(uint64_t needed);
+    void loadIndex();
+    void saveIndex();
+
+    uint32_t chunkLength(uint64_t index) const;
+    bool isPresent(uint64_t index) const;
+    void readCached(uint64_t offset, boost::asio::mutable_buffer buffer,
+                    const std::shared_ptr<PendingRead>& pending);
+    void fetch(uint64_t index, uint64_t offset,
+               boost::asio::mutable_buffer buffer,
+               const std::shared_ptr<PendingRead>& pending);
+    void store(uint64_t index, const std::shared_ptr<char[]>& data);
+
+    boost::asio::io_context& ioc;
+    std::shared_ptr<Backend> lower;
+    std::filesystem::path directory;
+    uint64_t capacity;
+    Statistics::Cache& stats;
+
+    std::filesystem::path entry;
+    int fd = -1;
+    std::shared_ptr<BlockIo> blockIo;
+    std::vector<uint8_t> present;
+    std::unordered_set<uint64_t> storing;
+    // Bytes cached for this image and maximum it may grow to
+    uint64_t stored = 0;
+    uint64_t limit = 0;
+    bool dirty = false;
+};
+
+} // namespace nbd
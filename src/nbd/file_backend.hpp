@@ -0,0 +1,286 @@
+#pragma once
+
+#include "logger.hpp"
+#include "nbd/backend.hpp"
+#include "nbd/block_io.hpp"
+
+#include <fcntl.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/posix/stream_descriptor.hpp>
+#include <cstring>
+#include <filesystem>
+#include <map>
+#include <system_error>
+#include <thread>
+
+namespace nbd
+{
+
+// Serves a regular file, eg. an image placed on a mounted CIFS share. I/O is
+// performed asynchronously by nbd::BlockIo, so many requests of the NBD
+// client can be in flight at once.
+//
+// Holes of read-only sparse files are looked up once when the image is
+// opened, so extents() reports them without asking the file system, which
+// for a CIFS share means a round trip to the server. Holes are looked up on
+// a thread of its own, as the round trips would stall the io_context, and
+// the whole file is reported as data until they are known.
+class FileBackend :
+    public Backend,
+    public std::enable_shared_from_this<FileBackend>
+{
+  public:
+    // Bounds time spent mapping heavily fragmented files, holes past the
+    // limit are reported as data
+    static constexpr size_t maxHoles = 1024;
+
+    FileBackend(boost::asio::io_context& ioc,
+                const std::filesystem::path& path, bool rw) :
+        rw(rw),
+        mappedSd(ioc)
+    {
+        fd = ::open(path.c_str(), (rw ? O_RDWR : O_RDONLY) | O_CLOEXEC);
+        if (fd < 0)
+        {
+            throw std::system_error(errno, std::generic_category(),
+                                    "Unable to open " + path.string());
+        }
+
+        struct stat st = {};
+        if (::fstat(fd, &st) != 0)
+        {
+            int err = errno;
+            ::close(fd);
+            throw std::system_error(err, std::generic_category(),
+                                    "Unable to stat " + path.string());
+        }
+        fileSize = static_cast<uint64_t>(st.st_size);
+        if (!rw)
+        {
+            id = path.string() + "\n" + std::to_string(st.st_mtim.tv_sec) +
+                 "." + std::to_string(st.st_mtim.tv_nsec) + "\n" +
+                 std::to_string(fileSize);
+        }
+
+        blockIo = BlockIo::create(ioc);
+        if (!blockIo)
+        {
+            ::close(fd);
+            throw std::system_error(EIO, std::generic_category(),
+                                    "Unable to setup block I/O");
+        }
+
+        LogMsg(Logger::Info, "[FileBackend]: Serving ", path, " (",
+               fileSize, " bytes, rw=", rw, ", ", blockIo->engineName(), ")");
+    }
+
+    ~FileBackend() override
+    {
+        if (mapper.joinable())
+        {
+            mapper.join();
+        }
+        ::close(fd);
+    }
+
+    void open(Handler&& handler) override
+    {
+        if (rw)
+        {
+            handler({});
+            return;
+        }
+
+        int efd = ::eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        if (efd < 0)
+        {
+            LogMsg(Logger::Error, "[FileBackend]: Unable to create eventfd: ",
+                   std::error_code(errno, std::generic_category()));
+            handler({});
+            return;
+        }
+        mappedSd.assign(efd);
+        mapper = std::thread([this]() {
+            mapHoles();
+            const uint64_t one = 1;
+            if (::write(mappedSd.native_handle(), &one, sizeof(one)) < 0)
+            {
+                LogMsg(Logger::Error,
+                       "[FileBackend]: Unable to signal eventfd");
+            }
+        });
+        // The pending wait keeps backend alive until holes are mapped
+        mappedSd.async_wait(
+            boost::asio::posix::stream_descriptor::wait_read,
+            [self = shared_from_this(), handler = std::move(handler)](
+                const boost::system::error_code&) {
+                self->mapper.join();
+                self->holes = std::move(self->found);
+                self->mappedSd.close();
+                handler({});
+            });
+    }
+
+    uint64_t size() const override
+    {
+        return fileSize;
+    }
+
+    // Path and modification time, files written through the backend are
+    // not identified
+    std::string contentId() const override
+    {
+        return id;
+    }
+
+    bool isWritable() const override
+    {
+        return rw;
+    }
+
+    // Handlers keep the backend, thus file descriptor, alive until the
+    // request completes
+    void read(uint64_t offset, boost::asio::mutable_buffer buffer,
+              Handler&& handler) override
+    {
+        blockIo->read(fd, offset, buffer,
+                      [self = shared_from_this(),
+                       handler = std::move(handler)](std::error_code ec) {
+                          handler(ec);
+                      });
+    }
+
+    void write(uint64_t offset, boost::asio::const_buffer buffer,
+               Handler&& handler) override
+    {
+        blockIo->write(fd, offset, buffer,
+                       [self = shared_from_this(),
+                        handler = std::move(handler)](std::error_code ec) {
+                           handler(ec);
+                       });
+    }
+
+    void flush(Handler&& handler) override
+    {
+        blockIo->sync(fd, [self = shared_from_this(),
+                           handler = std::move(handler)](std::error_code ec) {
+            handler(ec);
+        });
+    }
+
+    bool supportsSplice() const override
+    {
+        return true;
+    }
+
+    void splice(uint64_t offset, size_t length, int pipe,
+                Handler&& handler) override
+    {
+        blockIo->splice(fd, offset, pipe, length,
+                        [self = shared_from_this(),
+                         handler = std::move(handler)](std::error_code ec) {
+                            handler(ec);
+                        });
+    }
+
+    // Lets the kernel read ahead into the page cache, eg. from the CIFS
+    // share, so following reads of the host do not wait for the network
+    void prefetch(uint64_t offset, uint64_t length) override
+    {
+        if (int err = ::posix_fadvise(fd, static_cast<off_t>(offset),
+                                      static_cast<off_t>(length),
+                                      POSIX_FADV_WILLNEED);
+            err != 0)
+        {
+            LogMsg(Logger::Debug, "[FileBackend]: Prefetch hint failed: ",
+                   std::strerror(err));
+        }
+    }
+
+    void extents(uint64_t offset, uint64_t length,
+                 ExtentsHandler&& handler) override
+    {
+        std::vector<Extent> result;
+        const uint64_t end = std::min(offset + length, fileSize);
+        // First hole ending past offset
+        auto hole = holes.upper_bound(offset);
+        if (hole != holes.begin() && std::prev(hole)->second > offset)
+        {
+            hole--;
+        }
+        for (uint64_t from = offset; from < end;)
+        {
+            if (hole != holes.end() && hole->first <= from)
+            {
+                const uint64_t to = std::min(end, hole->second);
+                appendExtent(result, to - from, true);
+                from = to;
+                hole++;
+                continue;
+            }
+            const uint64_t to =
+                hole == holes.end() ? end : std::min(end, hole->first);
+            appendExtent(result, to - from, false);
+            from = to;
+        }
+        if (result.empty())
+        {
+            result.push_back(Extent{length, false});
+        }
+        handler({}, std::move(result));
+    }
+
+  private:
+    // Runs on the mapper thread, which touches found and fd only
+    void mapHoles()
+    {
+        const auto size = static_cast<off_t>(fileSize);
+        uint64_t holeBytes = 0;
+        for (off_t offset = 0; offset < size && found.size() < maxHoles;)
+        {
+            const off_t hole = ::lseek(fd, offset, SEEK_HOLE);
+            // File systems without support report the whole file as data
+            if (hole < 0 || hole >= size)
+            {
+                break;
+            }
+            off_t data = ::lseek(fd, hole, SEEK_DATA);
+            if (data < 0)
+            {
+                if (errno != ENXIO)
+                {
+                    break;
+                }
+                // Hole reaches end of the file
+                data = size;
+            }
+            found.emplace(hole, data);
+            holeBytes += static_cast<uint64_t>(data - hole);
+            offset = data;
+        }
+        if (!found.empty())
+        {
+            LogMsg(Logger::Info, "[FileBackend]: Found ", found.size(),
+                   " holes, ", holeBytes, " bytes in total");
+        }
+    }
+
+    int fd;
+    bool rw;
+    uint64_t fileSize = 0;
+    std::string id;
+    std::shared_ptr<BlockIo> blockIo;
+    // Start and end of holes of the file
+    std::map<uint64_t, uint64_t> holes;
+    // Signalled by the mapper thread once holes were found
+    boost::asio::posix::stream_descriptor mappedSd;
+    std::thread mapper;
+    std::map<uint64_t, uint64_t> found;
+};
+
+} // namespace nbd
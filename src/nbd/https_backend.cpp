@@ -0,0 +1,572 @@
+#include "nbd/https_backend.hpp"
+
+#include "logger.hpp"
+
+#include <openssl/evp.h>
+#include <openssl/ssl.h>
+#include <string.h>
+
+#include <algorithm>
+#include <boost/asio/ip/address.hpp>
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/ssl/host_name_verification.hpp>
+#include <boost/beast/http/buffer_body.hpp>
+#include <boost/beast/http/empty_body.hpp>
+#include <boost/beast/http/parser.hpp>
+#include <boost/beast/http/read.hpp>
+#include <boost/beast/http/write.hpp>
+
+namespace nbd
+{
+
+namespace http = boost::beast::http;
+
+namespace
+{
+
+using Parser = http::response_parser<http::buffer_body>;
+
+std::error_code statusError(http::status status)
+{
+    switch (status)
+    {
+        case http::status::unauthorized:
+        case http::status::forbidden:
+            return std::make_error_code(std::errc::permission_denied);
+        case http::status::not_found:
+        case http::status::gone:
+            return std::make_error_code(std::errc::no_such_file_or_directory);
+        case http::status::ok:
+            // Whole image would be sent instead of the requested range
+            return std::make_error_code(std::errc::not_supported);
+        default:
+            return std::make_error_code(std::errc::io_error);
+    }
+}
+
+std::string rangeOf(uint64_t first, uint64_t last)
+{
+    return std::to_string(first) + "-" + std::to_string(last);
+}
+
+// Sends a range request and reads header of the response, body is left for
+// the caller to be read directly into the destination buffer
+std::error_code requestRange(HttpsBackend::Stream& stream,
+                             boost::beast::flat_buffer& readBuffer,
+                             http::request<http::empty_body>& request,
+                             Parser& parser, std::chrono::seconds timeout,
+                             boost::asio::yield_context yield)
+{
+    boost::beast::error_code ec;
+    boost::beast::get_lowest_layer(stream).expires_after(timeout);
+    http::async_write(stream, request, yield[ec]);
+    if (!ec)
+    {
+        http::async_read_header(stream, readBuffer, parser, yield[ec]);
+    }
+    return ec;
+}
+
+std::error_code readBody(HttpsBackend::Stream& stream,
+                         boost::beast::flat_buffer& readBuffer,
+                         Parser& parser, boost::asio::mutable_buffer buffer,
+                         std::chrono::seconds timeout,
+                         boost::asio::yield_context yield)
+{
+    auto& body = parser.get().body();
+    body.data = buffer.data();
+    body.size = buffer.size();
+
+    boost::beast::error_code ec;
+    while (!parser.is_done())
+    {
+        boost::beast::get_lowest_layer(stream).expires_after(timeout);
+        http::async_read(stream, readBuffer, parser, yield[ec]);
+        if (ec == http::error::need_buffer)
+        {
+            ec = {};
+        }
+        if (ec)
+        {
+            return ec;
+        }
+        if (body.size == 0 && !parser.is_done())
+        {
+            return std::make_error_code(std::errc::protocol_error);
+        }
+    }
+    return {};
+}
+
+} // namespace
+
+std::optional<Url> Url::parse(std::string_view url)
+{
+    constexpr std::string_view scheme = "https://";
+    if (url.substr(0, scheme.size()) != scheme)
+    {
+        return std::nullopt;
+    }
+    url.remove_prefix(scheme.size());
+    url = url.substr(0, url.find('#'));
+
+    const auto slash = url.find('/');
+    std::string_view authority = url.substr(0, slash);
+    Url result;
+    result.authority = authority;
+    result.target = slash == std::string_view::npos
+                        ? std::string("/")
+                        : std::string(url.substr(slash));
+    result.port = "443";
+
+    // Credentials are passed separately, never as a part of URL
+    if (authority.find('@') != std::string_view::npos)
+    {
+        return std::nullopt;
+    }
+
+    if (!authority.empty() && authority.front() == '[')
+    {
+        const auto close = authority.find(']');
+        if (close == std::string_view::npos)
+        {
+            return std::nullopt;
+        }
+        result.host = authority.substr(1, close - 1);
+        authority.remove_prefix(close + 1);
+    }
+    else
+    {
+        const auto colon = authority.find(':');
+        result.host = authority.substr(0, colon);
+        authority.remove_prefix(
+            colon == std::string_view::npos ? authority.size() : colon);
+    }
+
+    if (!authority.empty())
+    {
+        authority.remove_prefix(1);
+        if (authority.empty() || authority.front() == '0' ||
+            !std::all_of(authority.begin(), authority.end(),
+                         [](char c) { return c >= '0' && c <= '9'; }))
+        {
+            return std::nullopt;
+        }
+        result.port = authority;
+    }
+
+    if (result.host.empty())
+    {
+        return std::nullopt;
+    }
+    return result;
+}
+
+HttpsBackend::HttpsBackend(boost::asio::io_context& ioc, HttpsPool& pool,
+                           std::string_view name, std::string_view imageUrl,
+                           std::chrono::seconds timeout,
+                           Statistics::Https& stats, unsigned connections) :
+    ioc(ioc),
+    pool(pool), name(name), timeout(timeout), stats(stats),
+    connections(std::max(connections, 1U))
+{
+    auto parsed = Url::parse(imageUrl);
+    if (!parsed)
+    {
+        throw std::system_error(
+            std::make_error_code(std::errc::invalid_argument),
+            "Malformed HTTPS URL");
+    }
+    url = std::move(*parsed);
+    origin = url.host + ":" + url.port;
+
+    if (!pool.usable())
+    {
+        throw std::system_error(
+            std::make_error_code(std::errc::not_supported),
+            "Unable to setup HTTPS client");
+    }
+}
+
+HttpsBackend::~HttpsBackend()
+{
+    explicit_bzero(authorization.data(), authorization.size());
+
+    // Connections outlive the image unless the service is exiting
+    if (ioc.stopped())
+    {
+        return;
+    }
+    for (auto& connection : idle)
+    {
+        if (connection->stream && connection->readBuffer.size() == 0)
+        {
+            pool.give(origin, std::move(connection->stream));
+        }
+    }
+}
+
+void HttpsBackend::setCredentials(const std::string& user,
+                                  const std::string& password)
+{
+    // Built in place, so no copies of the secret are left behind
+    std::string plain;
+    plain.reserve(user.size() + password.size() + 1);
+    plain.append(user).append(":").append(password);
+
+    std::string encoded(4 * ((plain.size() + 2) / 3) + 1, '\0');
+    const int length = EVP_EncodeBlock(
+        reinterpret_cast<unsigned char*>(encoded.data()),
+        reinterpret_cast<const unsigned char*>(plain.data()),
+        static_cast<int>(plain.size()));
+
+    explicit_bzero(authorization.data(), authorization.size());
+    authorization.clear();
+    authorization.reserve(encoded.size() + 6);
+    authorization.append("Basic ").append(
+        encoded.data(), static_cast<size_t>(std::max(length, 0)));
+
+    explicit_bzero(plain.data(), plain.size());
+    explicit_bzero(encoded.data(), encoded.size());
+}
+
+void HttpsBackend::open(Handler&& handler)
+{
+    boost::asio::spawn(
+        ioc, [this, self = shared_from_this(), handler = std::move(handler)](
+                 boost::asio::yield_context yield) {
+            const auto started = std::chrono::steady_clock::now();
+            auto connection = takeConnection();
+            // Connection left by an earlier mount may have been closed by
+            // the server, it is retried once over a new one
+            const bool reused = connection->stream != nullptr;
+            std::error_code ec = probe(*connection, yield);
+            if (ec && reused)
+            {
+                ec = probe(*connection, yield);
+            }
+            if (!ec)
+            {
+                stats.firstByte = static_cast<uint64_t>(
+                    std::chrono::duration_cast<std::chrono::milliseconds>(
+                        std::chrono::steady_clock::now() - started)
+                        .count());
+                LogMsg(Logger::Info, "[HttpsBackend]: (", name, ") Serving ",
+                       url.authority, url.target, " (", imageSize,
+                       " bytes, ", connections, " connections, first byte in ",
+                       stats.firstByte, " ms)");
+            }
+            idle.push_back(std::move(connection));
+            handler(ec);
+        });
+}
+
+void HttpsBackend::read(uint64_t offset, boost::asio::mutable_buffer buffer,
+                        Handler&& handler)
+{
+    if (buffer.size() == 0)
+    {
+        handler({});
+        return;
+    }
+
+    // Large reads are spread evenly over connections, parts are fetched
+    // straight to their place in the buffer, so no reassembly is needed
+    const uint64_t partSize =
+        std::max(minPartSize, (buffer.size() + connections - 1) / connections);
+    auto read = std::make_shared<PendingRead>(std::move(handler));
+    auto* data = static_cast<char*>(buffer.data());
+    for (uint64_t done = 0; done < buffer.size(); done += partSize)
+    {
+        const auto length =
+            static_cast<size_t>(std::min(partSize, buffer.size() - done));
+        parts.push_back(Part{offset + done,
+                             boost::asio::buffer(data + done, length), read});
+        read->remaining++;
+    }
+    run();
+}
+
+void HttpsBackend::run()
+{
+    while (workers < connections && workers < parts.size())
+    {
+        workers++;
+        boost::asio::spawn(ioc, [this, self = shared_from_this()](
+                                    boost::asio::yield_context yield) {
+            auto connection = takeConnection();
+            while (!parts.empty())
+            {
+                Part part = std::move(parts.front());
+                parts.pop_front();
+
+                // Server may have closed an idle keep-alive connection in the
+                // meantime, such request is retried once over a new one
+                const bool reused = connection->stream != nullptr;
+                std::error_code ec =
+                    fetch(*connection, part.offset, part.buffer, yield);
+                if (ec && reused)
+                {
+                    ec = fetch(*connection, part.offset, part.buffer, yield);
+                }
+                part.read->complete(ec);
+            }
+            idle.push_back(std::move(connection));
+            workers--;
+        });
+    }
+}
+
+std::unique_ptr<HttpsBackend::Connection> HttpsBackend::takeConnection()
+{
+    if (idle.empty())
+    {
+        auto connection = std::make_unique<Connection>();
+        connection->stream = pool.take(origin);
+        if (connection->stream)
+        {
+            stats.reused++;
+        }
+        return connection;
+    }
+    auto connection = std::move(idle.back());
+    idle.pop_back();
+    return connection;
+}
+
+std::error_code HttpsBackend::connect(Connection& connection,
+                                      boost::asio::yield_context yield)
+{
+    if (connection.stream)
+    {
+        return {};
+    }
+
+    // Name server may take long to answer, so the name is resolved by the
+    // resolver thread of the pool
+    Resolver::Endpoints endpoints;
+    if (auto resolved = pool.resolver().resolve(url.host, url.port, timeout,
+                                                endpoints, yield))
+    {
+        LogMsg(Logger::Error, "[HttpsBackend]: (", name,
+               ") Unable to resolve ", url.host, ": ", resolved.message());
+        return resolved;
+    }
+
+    boost::beast::error_code ec;
+    auto candidate = std::make_unique<Stream>(ioc, pool.context());
+    boost::asio::ip::make_address(url.host, ec);
+    // Server name indication is not used for IP addresses. Expanded
+    // SSL_set_tlsext_host_name(), the macro casts away constness.
+    if (ec && SSL_ctrl(candidate->native_handle(),
+                       SSL_CTRL_SET_TLSEXT_HOSTNAME, TLSEXT_NAMETYPE_host_name,
+                       const_cast<char*>(url.host.c_str())) != 1)
+    {
+        return std::make_error_code(std::errc::invalid_argument);
+    }
+    candidate->set_verify_callback(
+        boost::asio::ssl::host_name_verification(url.host));
+    pool.resume(origin, *candidate);
+
+    auto& socket = boost::beast::get_lowest_layer(*candidate);
+    socket.expires_after(timeout);
+    socket.async_connect(endpoints, yield[ec]);
+    if (!ec)
+    {
+        candidate->async_handshake(boost::asio::ssl::stream_base::client,
+                                   yield[ec]);
+    }
+    if (ec)
+    {
+        LogMsg(Logger::Error, "[HttpsBackend]: (", name,
+               ") Unable to connect to ", url.authority, ": ", ec.message());
+        return ec;
+    }
+
+    if (SSL_session_reused(candidate->native_handle()) == 1)
+    {
+        stats.resumed++;
+    }
+    else
+    {
+        stats.handshakes++;
+    }
+    connection.stream = std::move(candidate);
+    return {};
+}
+
+void HttpsBackend::disconnect(Connection& connection)
+{
+    connection.stream.reset();
+    connection.readBuffer.clear();
+}
+
+http::request<http::empty_body>
+    HttpsBackend::makeRequest(uint64_t first, uint64_t last) const
+{
+    http::request<http::empty_body> request{http::verb::get, url.target, 11};
+    request.set(http::field::host, url.authority);
+    request.set(http::field::user_agent, "virtual-media");
+    request.set(http::field::range, "bytes=" + rangeOf(first, last));
+    if (!authorization.empty())
+    {
+        request.set(http::field::authorization, authorization);
+    }
+    if (!validator.empty())
+    {
+        request.set(http::field::if_range, validator);
+    }
+    return request;
+}
+
+std::string HttpsBackend::contentId() const
+{
+    if (validator.empty())
+    {
+        return {};
+    }
+    return url.authority + url.target + "\n" + validator + "\n" +
+           std::to_string(imageSize);
+}
+
+std::error_code HttpsBackend::probe(Connection& connection,
+                                    boost::asio::yield_context yield)
+{
+    if (auto ec = connect(connection, yield))
+    {
+        return ec;
+    }
+    auto& stream = *connection.stream;
+    auto& readBuffer = connection.readBuffer;
+
+    // Single byte range both checks range requests are supported and
+    // reveals size of the image in Content-Range
+    auto request = makeRequest(0, 0);
+    Parser parser;
+    std::error_code ec =
+        requestRange(stream, readBuffer, request, parser, timeout, yield);
+    if (ec)
+    {
+        LogMsg(Logger::Error, "[HttpsBackend]: (", name,
+               ") Request failed: ", ec.message());
+        disconnect(connection);
+        return ec;
+    }
+
+    const auto& response = parser.get();
+    if (response.result() != http::status::partial_content)
+    {
+        LogMsg(Logger::Error, "[HttpsBackend]: (", name,
+               ") Unexpected HTTP status ", response.result_int(),
+               response.result() == http::status::ok
+                   ? ", server does not support range requests"
+                   : "");
+        disconnect(connection);
+        return statusError(response.result());
+    }
+
+    const auto contentRange = response[http::field::content_range];
+    const std::string_view range(contentRange.data(), contentRange.size());
+    const auto slash = range.find('/');
+    if (range.substr(0, slash) != "bytes 0-0" ||
+        slash == std::string_view::npos)
+    {
+        LogMsg(Logger::Error, "[HttpsBackend]: (", name,
+               ") Malformed Content-Range: ", range);
+        disconnect(connection);
+        return std::make_error_code(std::errc::protocol_error);
+    }
+    try
+    {
+        imageSize = std::stoull(std::string(range.substr(slash + 1)));
+    }
+    catch (const std::exception&)
+    {
+        LogMsg(Logger::Error, "[HttpsBackend]: (", name,
+               ") Image size unknown: ", range);
+        disconnect(connection);
+        return std::make_error_code(std::errc::protocol_error);
+    }
+
+    // Weak ETag does not guarantee byte equality, thus is not usable
+    const auto etag = response[http::field::etag];
+    if (!etag.empty() && !etag.starts_with("W/"))
+    {
+        validator.assign(etag.data(), etag.size());
+    }
+    else
+    {
+        const auto lastModified = response[http::field::last_modified];
+        validator.assign(lastModified.data(), lastModified.size());
+    }
+
+    char firstByte = 0;
+    ec = readBody(stream, readBuffer, parser,
+                  boost::asio::buffer(&firstByte, 1), timeout, yield);
+    if (ec || !parser.keep_alive())
+    {
+        disconnect(connection);
+    }
+    return ec;
+}
+
+std::error_code HttpsBackend::fetch(Connection& connection, uint64_t offset,
+                                    boost::asio::mutable_buffer buffer,
+                                    boost::asio::yield_context yield)
+{
+    if (auto ec = connect(connection, yield))
+    {
+        return ec;
+    }
+    auto& stream = *connection.stream;
+    auto& readBuffer = connection.readBuffer;
+
+    const uint64_t last = offset + buffer.size() - 1;
+    auto request = makeRequest(offset, last);
+    Parser parser;
+    parser.body_limit(buffer.size());
+    std::error_code ec =
+        requestRange(stream, readBuffer, request, parser, timeout, yield);
+    if (ec)
+    {
+        LogMsg(Logger::Debug, "[HttpsBackend]: (", name,
+               ") Request failed: ", ec.message());
+        disconnect(connection);
+        return ec;
+    }
+
+    const auto& response = parser.get();
+    if (response.result() != http::status::partial_content)
+    {
+        LogMsg(Logger::Error, "[HttpsBackend]: (", name,
+               ") Unexpected HTTP status ", response.result_int(),
+               response.result() == http::status::ok
+                   ? ", image changed on the server"
+                   : "");
+        disconnect(connection);
+        return statusError(response.result());
+    }
+
+    // Server has to return exactly the requested range
+    const std::string expected = "bytes " + rangeOf(offset, last) + "/";
+    const auto length = parser.content_length();
+    if (!length || *length != buffer.size() ||
+        response[http::field::content_range].substr(0, expected.size()) !=
+            expected)
+    {
+        LogMsg(Logger::Error, "[HttpsBackend]: (", name,
+               ") Unexpected range returned: ",
+               response[http::field::content_range]);
+        disconnect(connection);
+        return std::make_error_code(std::errc::protocol_error);
+    }
+
+    ec = readBody(stream, readBuffer, parser, buffer, timeout, yield);
+    if (ec || !parser.keep_alive())
+    {
+        disconnect(connection);
+    }
+    return ec;
+}
+
+} // namespace nbd
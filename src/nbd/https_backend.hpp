@@ -0,0 +1,148 @@
+#pragma once
+
+#include "nbd/backend.hpp"
+#include "nbd/https_pool.hpp"
+#include "nbd/statistics.hpp"
+
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/spawn.hpp>
+#include <boost/beast/core/flat_buffer.hpp>
+#include <boost/beast/http/empty_body.hpp>
+#include <boost/beast/http/message.hpp>
+#include <chrono>
+#include <deque>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace nbd
+{
+
+// Location of an image on a HTTPS server
+struct Url
+{
+    // host[:port] as written in the URL, sent in Host header
+    std::string authority;
+    std::string host;
+    std::string port;
+    std::string target;
+
+    // Accepts https://host[:port][/path], IPv6 hosts in brackets
+    static std::optional<Url> parse(std::string_view url);
+};
+
+// Serves an image from a HTTPS server with HTTP range requests sent over up
+// to `connections` keep-alive connections in parallel, one request at a time
+// on each connection. Large reads are split into parts fetched in parallel
+// directly into their place in the destination buffer. Redirects are not
+// followed, server certificate is verified against the BMC certificate
+// authority store. TLS sessions and connections left idle are shared with
+// other images of the same server through the pool.
+class HttpsBackend :
+    public Backend,
+    public std::enable_shared_from_this<HttpsBackend>
+{
+  public:
+    using Stream = HttpsPool::Stream;
+
+    // Reads are not split into parts smaller than this
+    static constexpr uint64_t minPartSize = 256 * 1024;
+
+    HttpsBackend(boost::asio::io_context& ioc, HttpsPool& pool,
+                 std::string_view name, std::string_view url,
+                 std::chrono::seconds timeout, Statistics::Https& stats,
+                 unsigned connections = 1);
+    ~HttpsBackend() override;
+
+    // Credentials are sent using HTTP basic authentication
+    void setCredentials(const std::string& user, const std::string& password);
+
+    // Checks the image is reachable, supports range requests and learns its
+    // size
+    void open(Handler&& handler) override;
+
+    uint64_t size() const override
+    {
+        return imageSize;
+    }
+
+    // URL with the validator (strong ETag or Last-Modified) of the image
+    std::string contentId() const override;
+
+    void read(uint64_t offset, boost::asio::mutable_buffer buffer,
+              Handler&& handler) override;
+
+  private:
+    struct Connection
+    {
+        std::unique_ptr<Stream> stream;
+        boost::beast::flat_buffer readBuffer;
+    };
+
+    // Completes the read once all of its parts were fetched
+    struct PendingRead
+    {
+        explicit PendingRead(Handler&& handler) : handler(std::move(handler))
+        {
+        }
+
+        void complete(std::error_code partError)
+        {
+            if (partError && !ec)
+            {
+                ec = partError;
+            }
+            if (--remaining == 0)
+            {
+                handler(ec);
+            }
+        }
+
+        Handler handler;
+        unsigned remaining = 0;
+        std::error_code ec;
+    };
+
+    struct Part
+    {
+        uint64_t offset;
+        boost::asio::mutable_buffer buffer;
+        std::shared_ptr<PendingRead> read;
+    };
+
+    void run();
+    std::unique_ptr<Connection> takeConnection();
+    std::error_code connect(Connection& connection,
+                            boost::asio::yield_context yield);
+    void disconnect(Connection& connection);
+    boost::beast::http::request<boost::beast::http::empty_body>
+        makeRequest(uint64_t first, uint64_t last) const;
+    std::error_code probe(Connection& connection,
+                          boost::asio::yield_context yield);
+    std::error_code fetch(Connection& connection, uint64_t offset,
+                          boost::asio::mutable_buffer buffer,
+                          boost::asio::yield_context yield);
+
+    boost::asio::io_context& ioc;
+    HttpsPool& pool;
+    std::string name;
+    Url url;
+    // Key of the server in the pool
+    std::string origin;
+    std::string authorization;
+    // Sent in If-Range, so image changed on the server is never mixed with
+    // data read before
+    std::string validator;
+    std::chrono::seconds timeout;
+    Statistics::Https& stats;
+    unsigned connections;
+    // Connections not used by any worker, kept open for following requests
+    std::vector<std::unique_ptr<Connection>> idle;
+    std::deque<Part> parts;
+    unsigned workers = 0;
+    uint64_t imageSize = 0;
+};
+
+} // namespace nbd
@@ -0,0 +1,123 @@
+#include "nbd/https_pool.hpp"
+
+#include "logger.hpp"
+
+#include <algorithm>
+
+namespace nbd
+{
+
+namespace
+{
+
+// Same restrictions as were passed to nbdkit curl plugin
+constexpr const char* caPath = "/etc/ssl/certs/authority";
+constexpr const char* cipherList = "ECDHE-RSA-AES256-GCM-SHA384:"
+                                   "ECDHE-ECDSA-AES256-GCM-SHA384";
+constexpr const char* tls13Ciphers = "TLS_AES_256_GCM_SHA384";
+
+// Application data of connections is taken by asio, origin goes to extra data
+int originIndex()
+{
+    static const int index =
+        SSL_get_ex_new_index(0, nullptr, nullptr, nullptr, nullptr);
+    return index;
+}
+
+} // namespace
+
+HttpsPool::HttpsPool(boost::asio::io_context& ioc) :
+    tls(boost::asio::ssl::context::tls_client), names(Resolver::create(ioc))
+{
+    tls.set_options(boost::asio::ssl::context::default_workarounds |
+                    boost::asio::ssl::context::no_sslv2 |
+                    boost::asio::ssl::context::no_sslv3 |
+                    boost::asio::ssl::context::no_tlsv1 |
+                    boost::asio::ssl::context::no_tlsv1_1 |
+                    boost::asio::ssl::context::no_compression);
+    tls.set_verify_mode(boost::asio::ssl::verify_peer);
+
+    boost::system::error_code ec;
+    tls.add_verify_path(caPath, ec);
+    if (ec)
+    {
+        LogMsg(Logger::Error,
+               "[HttpsPool]: Unable to use certificate authority path ",
+               caPath, ": ", ec.message());
+    }
+    if (SSL_CTX_set_cipher_list(tls.native_handle(), cipherList) != 1 ||
+        SSL_CTX_set_ciphersuites(tls.native_handle(), tls13Ciphers) != 1)
+    {
+        LogMsg(Logger::Critical, "[HttpsPool]: Unable to setup TLS ciphers");
+        ciphers = false;
+    }
+
+    // Sessions are kept per origin by the pool, not by OpenSSL
+    SSL_CTX_set_session_cache_mode(tls.native_handle(),
+                                   SSL_SESS_CACHE_CLIENT |
+                                       SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb(tls.native_handle(), &HttpsPool::onNewSession);
+}
+
+std::unique_ptr<HttpsPool::Stream> HttpsPool::take(const std::string& origin)
+{
+    closeExpired();
+    auto it = origins.find(origin);
+    if (it == origins.end() || it->second.idle.empty())
+    {
+        return nullptr;
+    }
+    // Most recently used connection is least likely closed by the server
+    auto stream = std::move(it->second.idle.back().stream);
+    it->second.idle.pop_back();
+    return stream;
+}
+
+void HttpsPool::give(const std::string& origin, std::unique_ptr<Stream> stream)
+{
+    closeExpired();
+    auto& idle = origins[origin].idle;
+    if (idle.size() >= maxIdle)
+    {
+        idle.erase(idle.begin());
+    }
+    idle.push_back(Idle{std::move(stream), std::chrono::steady_clock::now()});
+}
+
+void HttpsPool::resume(const std::string& origin, Stream& stream)
+{
+    auto& entry = origins[origin];
+    SSL_set_ex_data(stream.native_handle(), originIndex(), &entry);
+    if (entry.session)
+    {
+        SSL_set_session(stream.native_handle(), entry.session.get());
+    }
+}
+
+int HttpsPool::onNewSession(SSL* ssl, SSL_SESSION* session)
+{
+    auto* origin = static_cast<Origin*>(SSL_get_ex_data(ssl, originIndex()));
+    if (origin == nullptr)
+    {
+        return 0;
+    }
+    // Pool takes the reference passed by OpenSSL
+    origin->session.reset(session);
+    return 1;
+}
+
+void HttpsPool::closeExpired()
+{
+    const auto expired = std::chrono::steady_clock::now() - idleTimeout;
+    for (auto& [name, origin] : origins)
+    {
+        auto& idle = origin.idle;
+        idle.erase(std::remove_if(idle.begin(), idle.end(),
+                                  [expired](const Idle& entry) {
+                                      return entry.since < expired;
+                                  }),
+                   idle.end());
+    }
+}
+
+} // namespace nbd
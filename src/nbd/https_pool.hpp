@@ -0,0 +1,97 @@
+#pragma once
+
+#include "nbd/resolver.hpp"
+
+#include <openssl/ssl.h>
+
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/ssl/context.hpp>
+#include <boost/beast/core/tcp_stream.hpp>
+#include <boost/beast/ssl/ssl_stream.hpp>
+#include <chrono>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace nbd
+{
+
+// TLS state of HTTPS servers shared by all HTTPS images for the lifetime of
+// the service, so mounts do not pay for a full handshake with a server the
+// service talked to before. Keeps per origin (host and port) the last TLS
+// session, which new connections resume, and keep-alive connections left
+// idle by unmounted images, which following mounts reuse. Idle connections
+// older than idleTimeout are closed whenever the pool is used. Names of
+// servers are resolved by the resolver thread of the pool.
+class HttpsPool
+{
+  public:
+    using Stream = boost::beast::ssl_stream<boost::beast::tcp_stream>;
+
+    static constexpr size_t maxIdle = 8;
+    static constexpr std::chrono::seconds idleTimeout{30};
+
+    explicit HttpsPool(boost::asio::io_context& ioc);
+
+    HttpsPool(const HttpsPool&) = delete;
+    HttpsPool& operator=(const HttpsPool&) = delete;
+
+    // Context all connections are created with, sessions are valid within
+    // it only
+    boost::asio::ssl::context& context()
+    {
+        return tls;
+    }
+
+    Resolver& resolver()
+    {
+        return *names;
+    }
+
+    // Whether the required ciphers and the resolver are available
+    bool usable() const
+    {
+        return ciphers && names;
+    }
+
+    // Idle connection to the origin, nullptr when there is none
+    std::unique_ptr<Stream> take(const std::string& origin);
+    void give(const std::string& origin, std::unique_ptr<Stream> stream);
+
+    // Sets up a new connection to resume the last session with the origin,
+    // sessions it receives replace that one
+    void resume(const std::string& origin, Stream& stream);
+
+  private:
+    struct SessionFree
+    {
+        void operator()(SSL_SESSION* session) const
+        {
+            SSL_SESSION_free(session);
+        }
+    };
+
+    struct Idle
+    {
+        std::unique_ptr<Stream> stream;
+        std::chrono::steady_clock::time_point since;
+    };
+
+    struct Origin
+    {
+        std::unique_ptr<SSL_SESSION, SessionFree> session;
+        std::vector<Idle> idle;
+    };
+
+    static int onNewSession(SSL* ssl, SSL_SESSION* session);
+    void closeExpired();
+
+    boost::asio::ssl::context tls;
+    bool ciphers = true;
+    std::shared_ptr<Resolver> names;
+    // Addresses of origins are passed to OpenSSL, so they are never removed
+    std::map<std::string, Origin> origins;
+};
+
+} // namespace nbd
@@ -0,0 +1,124 @@
+#include "nbd/image_registry.hpp"
+
+#include "logger.hpp"
+
+#include <boost/asio/steady_timer.hpp>
+#include <iterator>
+#include <utility>
+
+namespace nbd
+{
+
+std::shared_ptr<SharedImage> ImageRegistry::acquire(std::string_view name,
+                                                    const std::string& key,
+                                                    Statistics& statistics,
+                                                    const Factory& factory)
+{
+    // Entries of images no longer used are dropped on the way
+    for (auto it = images.begin(); it != images.end();)
+    {
+        it = it->second.expired() ? images.erase(it) : std::next(it);
+    }
+
+    auto& entry = images[key];
+    auto image = entry.lock();
+    if (image && !image->failed)
+    {
+        if (image->users > 0)
+        {
+            LogMsg(Logger::Info, "[ImageRegistry]: (", name,
+                   ") Sharing image with ", image->users,
+                   " other mount points");
+        }
+        else
+        {
+            LogMsg(Logger::Info, "[ImageRegistry]: (", name,
+                   ") Reusing image unmounted recently");
+        }
+        return std::make_shared<SharedImage>(ioc, std::move(image),
+                                             statistics);
+    }
+
+    image = std::make_shared<Image>();
+    image->layers = factory(image->statistics);
+    entry = image;
+    return std::make_shared<SharedImage>(ioc, std::move(image), statistics);
+}
+
+SharedImage::SharedImage(boost::asio::io_context& ioc,
+                         std::shared_ptr<ImageRegistry::Image> image,
+                         Statistics& statistics) :
+    ioc(ioc), image(std::move(image)), statistics(statistics),
+    syncTimer(ioc)
+{
+    this->image->users++;
+    // Counters grown before the mount belong to earlier mount points
+    synced = this->image->statistics;
+}
+
+SharedImage::~SharedImage()
+{
+    sync();
+    image->users--;
+    // Image is kept by the timer for a while, unless the service is exiting
+    if (image->users == 0 && image->opened && !ioc.stopped())
+    {
+        auto timer = std::make_shared<boost::asio::steady_timer>(
+            ioc, ImageRegistry::linger);
+        timer->async_wait(
+            [timer, image = image](const boost::system::error_code&) {});
+    }
+}
+
+void SharedImage::open(Handler&& handler)
+{
+    scheduleSync();
+    if (image->opened)
+    {
+        handler({});
+        return;
+    }
+
+    image->opening.push_back(std::move(handler));
+    if (image->opening.size() > 1)
+    {
+        return;
+    }
+    top().open([image = image](std::error_code ec) {
+        image->opened = !ec;
+        image->failed = static_cast<bool>(ec);
+        for (const auto& handler : std::exchange(image->opening, {}))
+        {
+            handler(ec);
+        }
+    });
+}
+
+void SharedImage::sync()
+{
+    statistics.addShared(image->statistics, synced);
+    synced = image->statistics;
+}
+
+void SharedImage::scheduleSync()
+{
+    if (syncing)
+    {
+        return;
+    }
+    syncing = true;
+    syncTimer.expires_after(syncInterval);
+    syncTimer.async_wait([weak = weak_from_this()](
+                             const boost::system::error_code& ec) {
+        auto self = weak.lock();
+        if (ec || !self)
+        {
+            return;
+        }
+        self->syncing = false;
+        self->sync();
+        self->scheduleSync();
+    });
+}
+
+} // namespace nbd
@@ -0,0 +1,182 @@
+#pragma once
+
+#include "nbd/backend.hpp"
+#include "nbd/statistics.hpp"
+
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <chrono>
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace nbd
+{
+
+class SharedImage;
+
+// Lets mount points serving the same read-only image share one stack of
+// backends, ie. one set of server connections and one cache, so memory and
+// traffic grow with the number of distinct images, not with the number of
+// mount points. Images are keyed by whatever identifies their content and
+// access to it, eg. URL and credentials, and by the configuration of the
+// shared layers. Shared layers count into statistics of the image, which
+// mount points add to their own.
+//
+// An image lives while a mount point uses it and for linger afterwards, so
+// an image remounted right after an unmount keeps its cache. Images which
+// failed to open are not shared, the next mount builds them anew.
+class ImageRegistry
+{
+  public:
+    static constexpr std::chrono::seconds linger{60};
+
+    // Backends of an image: the top of the stack served to mount points and
+    // the bottom reaching the image itself, read directly by measurements
+    struct Layers
+    {
+        std::shared_ptr<Backend> top;
+        std::shared_ptr<Backend> origin;
+    };
+    // Builds layers counting into statistics of the image
+    using Factory = std::function<Layers(Statistics&)>;
+
+    explicit ImageRegistry(boost::asio::io_context& ioc) : ioc(ioc)
+    {
+    }
+
+    ImageRegistry(const ImageRegistry&) = delete;
+    ImageRegistry& operator=(const ImageRegistry&) = delete;
+
+    // Image shared under key, built by factory when no mount point uses it,
+    // counting into statistics of the mount point
+    std::shared_ptr<SharedImage> acquire(std::string_view name,
+                                         const std::string& key,
+                                         Statistics& statistics,
+                                         const Factory& factory);
+
+  private:
+    friend class SharedImage;
+
+    struct Image
+    {
+        // Outlives the layers counting into it
+        Statistics statistics;
+        Layers layers;
+        bool opened = false;
+        bool failed = false;
+        // Open handlers of mount points waiting for the first open
+        std::vector<Backend::Handler> opening;
+        unsigned users = 0;
+    };
+
+    boost::asio::io_context& ioc;
+    std::map<std::string, std::weak_ptr<Image>> images;
+};
+
+// Mount point's use of an image of the registry. Opening it opens the image
+// only once; prefetches of the image are cancelled only when no other mount
+// point uses it. Statistics of the image grow the statistics of the mount
+// point from its open on, every syncInterval and once unmounted.
+class SharedImage :
+    public Backend,
+    public std::enable_shared_from_this<SharedImage>
+{
+  public:
+    static constexpr std::chrono::seconds syncInterval{1};
+
+    SharedImage(boost::asio::io_context& ioc,
+                std::shared_ptr<ImageRegistry::Image> image,
+                Statistics& statistics);
+    ~SharedImage() override;
+
+    const std::shared_ptr<Backend>& origin() const
+    {
+        return image->layers.origin;
+    }
+
+    void open(Handler&& handler) override;
+
+    uint64_t size() const override
+    {
+        return top().size();
+    }
+
+    std::string contentId() const override
+    {
+        return top().contentId();
+    }
+
+    bool isWritable() const override
+    {
+        return top().isWritable();
+    }
+
+    void read(uint64_t offset, boost::asio::mutable_buffer buffer,
+              Handler&& handler) override
+    {
+        top().read(offset, buffer, std::move(handler));
+    }
+
+    void write(uint64_t offset, boost::asio::const_buffer buffer,
+               Handler&& handler) override
+    {
+        top().write(offset, buffer, std::move(handler));
+    }
+
+    void flush(Handler&& handler) override
+    {
+        top().flush(std::move(handler));
+    }
+
+    bool supportsSplice() const override
+    {
+        return top().supportsSplice();
+    }
+
+    void splice(uint64_t offset, size_t length, int pipe,
+                Handler&& handler) override
+    {
+        top().splice(offset, length, pipe, std::move(handler));
+    }
+
+    void extents(uint64_t offset, uint64_t length,
+                 ExtentsHandler&& handler) override
+    {
+        top().extents(offset, length, std::move(handler));
+    }
+
+    void prefetch(uint64_t offset, uint64_t length) override
+    {
+        top().prefetch(offset, length);
+    }
+
+    void cancelPrefetch() override
+    {
+        if (image->users == 1)
+        {
+            top().cancelPrefetch();
+        }
+    }
+
+  private:
+    Backend& top() const
+    {
+        return *image->layers.top;
+    }
+
+    void sync();
+    void scheduleSync();
+
+    boost::asio::io_context& ioc;
+    std::shared_ptr<ImageRegistry::Image> image;
+    Statistics& statistics;
+    // Statistics of the image added to the mount point so far
+    Statistics synced;
+    bool syncing = false;
+    boost::asio::steady_timer syncTimer;
+};
+
+} // namespace nbd
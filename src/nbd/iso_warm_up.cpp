@@ -0,0 +1,324 @@
+#include "nbd/iso_warm_up.hpp"
+
+#include "logger.hpp"
+
+#include <boost/endian/conversion.hpp>
+
+#include <algorithm>
+#include <cstring>
+#include <optional>
+
+namespace nbd
+{
+
+namespace
+{
+
+// Volume descriptors start at sector 16, sectors before belong to the system
+// area, eg. partition table of hybrid images the host reads as well
+constexpr uint64_t descriptorsLength = 32 * IsoWarmUp::sectorSize;
+constexpr size_t firstDescriptor = 16;
+constexpr uint8_t typeBootRecord = 0;
+constexpr uint8_t typePrimary = 1;
+constexpr uint8_t typeTerminator = 255;
+constexpr std::string_view standardId = "CD001";
+constexpr std::string_view elToritoId = "EL TORITO SPECIFICATION";
+
+constexpr size_t catalogEntryLength = 32;
+constexpr uint8_t entryBootable = 0x88;
+constexpr uint8_t entrySectionHeader = 0x90;
+constexpr uint8_t entryLastSectionHeader = 0x91;
+constexpr uint8_t entryExtension = 0x44;
+// Catalog counts boot images in virtual sectors
+constexpr uint64_t virtualSectorSize = 512;
+// Boot images described as shorter are sized by their FAT boot sector, the
+// catalog often gives just the part the firmware loads first
+constexpr uint64_t minCatalogLength = 64 * 1024;
+
+uint16_t le16(const uint8_t* data)
+{
+    return boost::endian::load_little_u16(data);
+}
+
+uint32_t le32(const uint8_t* data)
+{
+    return boost::endian::load_little_u32(data);
+}
+
+bool hasId(const uint8_t* data, std::string_view id)
+{
+    return std::memcmp(data, id.data(), id.size()) == 0;
+}
+
+} // namespace
+
+IsoWarmUp::IsoWarmUp(boost::asio::io_context& ioc, std::string_view name,
+                     std::shared_ptr<Backend> lower, uint64_t limit,
+                     Statistics::WarmUp& stats) :
+    name(name), lower(std::move(lower)), limit(limit), stats(stats),
+    timer(ioc)
+{
+}
+
+void IsoWarmUp::open(Handler&& handler)
+{
+    opened = std::move(handler);
+    lower->open([self = shared_from_this()](std::error_code ec) {
+        if (ec)
+        {
+            std::exchange(self->opened, nullptr)(ec);
+            return;
+        }
+
+        self->stats = Statistics::WarmUp{};
+        self->started = std::chrono::steady_clock::now();
+        self->timer.expires_after(timeLimit);
+        self->timer.async_wait(
+            [weak = self->weak_from_this()](
+                const boost::system::error_code& ec) {
+                if (auto self = weak.lock(); self && !ec)
+                {
+                    self->finish("timed out");
+                }
+            });
+
+        if (self->size() < descriptorsLength)
+        {
+            self->finish("not ISO9660");
+            return;
+        }
+        self->readAt(0, descriptorsLength, [self](const Data& data) {
+            self->descriptorsRead(data);
+        });
+    });
+}
+
+void IsoWarmUp::readAt(uint64_t offset, uint64_t length,
+                       DataHandler&& handler)
+{
+    auto data = std::make_shared<std::vector<uint8_t>>(length);
+    lower->read(offset, boost::asio::buffer(*data),
+                [self = shared_from_this(), data,
+                 handler = std::move(handler)](std::error_code ec) {
+                    if (ec)
+                    {
+                        LogMsg(Logger::Error, "[IsoWarmUp]: (", self->name,
+                               ") Read failed: ", ec.message());
+                    }
+                    handler(ec ? nullptr : data);
+                });
+}
+
+void IsoWarmUp::descriptorsRead(const Data& data)
+{
+    if (!data)
+    {
+        finish("read failed");
+        return;
+    }
+
+    std::optional<uint64_t> catalog;
+    for (size_t i = firstDescriptor; i < descriptorsLength / sectorSize; i++)
+    {
+        const uint8_t* descriptor = data->data() + i * sectorSize;
+        if (!hasId(descriptor + 1, standardId))
+        {
+            if (i == firstDescriptor)
+            {
+                finish("not ISO9660");
+                return;
+            }
+            break;
+        }
+
+        const uint8_t type = descriptor[0];
+        if (type == typeTerminator)
+        {
+            break;
+        }
+        if (type == typePrimary)
+        {
+            // Path table and root directory record
+            plan(le32(descriptor + 140) * sectorSize, le32(descriptor + 132));
+            plan(le32(descriptor + 158) * sectorSize, le32(descriptor + 166));
+        }
+        else if (type == typeBootRecord && hasId(descriptor + 7, elToritoId))
+        {
+            catalog = le32(descriptor + 71) * sectorSize;
+        }
+    }
+
+    if (!catalog)
+    {
+        fetch();
+        return;
+    }
+    readAt(*catalog, sectorSize,
+           [self = shared_from_this()](const Data& data) {
+               self->catalogRead(data);
+           });
+}
+
+void IsoWarmUp::catalogRead(const Data& data)
+{
+    // Validation entry is followed by the default entry and sections
+    if (!data || (*data)[0] != 1 || (*data)[30] != 0x55 || (*data)[31] != 0xaa)
+    {
+        LogMsg(Logger::Info, "[IsoWarmUp]: (", name,
+               ") No valid boot catalog");
+        fetch();
+        return;
+    }
+
+    auto addImage = [this](const uint8_t* entry) {
+        if (entry[0] == entryBootable)
+        {
+            bootImages.push_back(
+                BootImage{le32(entry + 8) * sectorSize,
+                          le16(entry + 6) * virtualSectorSize});
+        }
+    };
+    addImage(data->data() + catalogEntryLength);
+
+    size_t position = 2 * catalogEntryLength;
+    bool last = false;
+    while (!last && position + catalogEntryLength <= data->size())
+    {
+        const uint8_t* header = data->data() + position;
+        if (header[0] != entrySectionHeader &&
+            header[0] != entryLastSectionHeader)
+        {
+            break;
+        }
+        last = header[0] == entryLastSectionHeader;
+        position += catalogEntryLength;
+
+        for (unsigned entries = le16(header + 2);
+             entries > 0 && position + catalogEntryLength <= data->size();
+             position += catalogEntryLength)
+        {
+            const uint8_t* entry = data->data() + position;
+            if (entry[0] != entryExtension)
+            {
+                addImage(entry);
+                entries--;
+            }
+        }
+    }
+
+    sizeBootImages();
+}
+
+void IsoWarmUp::sizeBootImages()
+{
+    auto image = std::find_if(bootImages.begin(), bootImages.end(),
+                              [](const BootImage& image) {
+                                  return image.length < minCatalogLength;
+                              });
+    if (image == bootImages.end())
+    {
+        for (const auto& image : bootImages)
+        {
+            plan(image.offset, image.length);
+        }
+        fetch();
+        return;
+    }
+
+    const size_t index = static_cast<size_t>(image - bootImages.begin());
+    readAt(image->offset, virtualSectorSize,
+           [self = shared_from_this(), index](const Data& data) {
+               BootImage& image = self->bootImages[index];
+               uint64_t length = std::max(image.length, sectorSize);
+               // FAT boot sector of EFI system partition image
+               if (data && (*data)[510] == 0x55 && (*data)[511] == 0xaa)
+               {
+                   const uint16_t bytesPerSector = le16(data->data() + 11);
+                   const uint16_t sectors16 = le16(data->data() + 19);
+                   const uint32_t sectors = sectors16 != 0
+                                                ? sectors16
+                                                : le32(data->data() + 32);
+                   if (bytesPerSector >= 512 && bytesPerSector <= 4096 &&
+                       (bytesPerSector & (bytesPerSector - 1)) == 0)
+                   {
+                       length = std::max<uint64_t>(
+                           length, uint64_t{bytesPerSector} * sectors);
+                   }
+               }
+               image.length = std::max(length, minCatalogLength);
+               self->sizeBootImages();
+           });
+}
+
+void IsoWarmUp::plan(uint64_t offset, uint64_t length)
+{
+    if (offset >= size())
+    {
+        return;
+    }
+    length = std::min({length, size() - offset, limit - planned});
+    if (length == 0)
+    {
+        return;
+    }
+    ranges.emplace_back(offset, length);
+    planned += length;
+}
+
+void IsoWarmUp::fetch()
+{
+    // Warm-up already ended, reads still in flight only fill caches
+    if (!opened)
+    {
+        return;
+    }
+
+    while (reading < parallelReads && next < ranges.size())
+    {
+        const auto [offset, length] = ranges[next];
+        const uint64_t from = std::max(offset, nextOffset);
+        const uint64_t part =
+            std::min<uint64_t>(readLength, offset + length - from);
+        nextOffset = from + part;
+        if (nextOffset == offset + length)
+        {
+            next++;
+            if (next < ranges.size())
+            {
+                nextOffset = ranges[next].first;
+            }
+        }
+
+        reading++;
+        readAt(from, part, [self = shared_from_this(), part](const Data&) {
+            self->reading--;
+            self->done += part;
+            self->stats.progress = self->done * 100 / self->planned;
+            self->fetch();
+        });
+    }
+
+    if (reading == 0 && next == ranges.size())
+    {
+        finish("done");
+    }
+}
+
+void IsoWarmUp::finish(std::string_view reason)
+{
+    if (!opened)
+    {
+        return;
+    }
+    timer.cancel();
+
+    const auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now() - started);
+    stats.duration = static_cast<uint64_t>(duration.count());
+    stats.progress = planned == 0 ? 100 : done * 100 / planned;
+    LogMsg(Logger::Info, "[IsoWarmUp]: (", name, ") Read ", done, " of ",
+           planned, " bytes in ", stats.duration, " ms, ", reason);
+    std::exchange(opened, nullptr)({});
+}
+
+} // namespace nbd
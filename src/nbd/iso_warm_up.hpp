@@ -0,0 +1,139 @@
+#pragma once
+
+#include "nbd/backend.hpp"
+#include "nbd/statistics.hpp"
+
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace nbd
+{
+
+// Reads the parts of an ISO9660 image the host reads first when the device
+// appears, before it appears: volume descriptors, path table and root
+// directory, El Torito boot catalog and boot images. Warm-up is part of
+// open(), so the server attaches the NBD device, and thus the gadget is
+// bound, only once they are in the caches below.
+//
+// Warm-up reads at most limit bytes and gives up after timeLimit. Images
+// which are not ISO9660 and read failures only end it early, open fails
+// only when the image below does.
+class IsoWarmUp : public Backend, public std::enable_shared_from_this<IsoWarmUp>
+{
+  public:
+    static constexpr uint64_t sectorSize = 2048;
+    static constexpr std::chrono::seconds timeLimit{30};
+    static constexpr uint32_t readLength = 1024 * 1024;
+    static constexpr unsigned parallelReads = 4;
+
+    IsoWarmUp(boost::asio::io_context& ioc, std::string_view name,
+              std::shared_ptr<Backend> lower, uint64_t limit,
+              Statistics::WarmUp& stats);
+
+    void open(Handler&& handler) override;
+
+    uint64_t size() const override
+    {
+        return lower->size();
+    }
+
+    std::string contentId() const override
+    {
+        return lower->contentId();
+    }
+
+    bool isWritable() const override
+    {
+        return lower->isWritable();
+    }
+
+    void read(uint64_t offset, boost::asio::mutable_buffer buffer,
+              Handler&& handler) override
+    {
+        lower->read(offset, buffer, std::move(handler));
+    }
+
+    void write(uint64_t offset, boost::asio::const_buffer buffer,
+               Handler&& handler) override
+    {
+        lower->write(offset, buffer, std::move(handler));
+    }
+
+    void flush(Handler&& handler) override
+    {
+        lower->flush(std::move(handler));
+    }
+
+    bool supportsSplice() const override
+    {
+        return lower->supportsSplice();
+    }
+
+    void splice(uint64_t offset, size_t length, int pipe,
+                Handler&& handler) override
+    {
+        lower->splice(offset, length, pipe, std::move(handler));
+    }
+
+    void extents(uint64_t offset, uint64_t length,
+                 ExtentsHandler&& handler) override
+    {
+        lower->extents(offset, length, std::move(handler));
+    }
+
+    void prefetch(uint64_t offset, uint64_t length) override
+    {
+        lower->prefetch(offset, length);
+    }
+
+    void cancelPrefetch() override
+    {
+        lower->cancelPrefetch();
+    }
+
+  private:
+    using Data = std::shared_ptr<std::vector<uint8_t>>;
+    using DataHandler = std::function<void(Data)>;
+
+    struct BootImage
+    {
+        uint64_t offset;
+        // Length given by the catalog until sized from the image
+        uint64_t length;
+    };
+
+    // Reads length bytes at offset, handler receives nullptr on failure
+    void readAt(uint64_t offset, uint64_t length, DataHandler&& handler);
+    void descriptorsRead(const Data& data);
+    void catalogRead(const Data& data);
+    void sizeBootImages();
+    void plan(uint64_t offset, uint64_t length);
+    void fetch();
+    void finish(std::string_view reason);
+
+    std::string name;
+    std::shared_ptr<Backend> lower;
+    uint64_t limit;
+    Statistics::WarmUp& stats;
+
+    Handler opened;
+    boost::asio::steady_timer timer;
+    std::chrono::steady_clock::time_point started;
+
+    std::vector<BootImage> bootImages;
+    // Ranges to read, in order, and the next one
+    std::vector<std::pair<uint64_t, uint64_t>> ranges;
+    size_t next = 0;
+    // Part of the next range already issued
+    uint64_t nextOffset = 0;
+    uint64_t planned = 0;
+    uint64_t done = 0;
+    unsigned reading = 0;
+};
+
+} // namespace nbd
@@ -0,0 +1,786 @@
+#include "nbd/netlink.hpp"
+
+#include "logger.hpp"
+
+#include <linux/genetlink.h>
+#include <linux/nbd-netlink.h>
+#include <linux/netlink.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <array>
+#include <boost/asio/post.hpp>
+#include <cstring>
+
+namespace nbd::netlink
+{
+
+namespace
+{
+
+// Replies of the kernel are awaited at most this long
+constexpr time_t replyTimeoutSec = 5;
+
+// Netlink messages and attributes are aligned to 4 bytes
+constexpr size_t align(size_t length)
+{
+    return (length + 3) & ~size_t{3};
+}
+
+constexpr size_t messageHeaderLength = align(sizeof(nlmsghdr));
+constexpr size_t attributeHeaderLength = align(sizeof(nlattr));
+// Attributes of generic netlink messages follow both headers
+constexpr size_t attributesOffset =
+    messageHeaderLength + align(sizeof(genlmsghdr));
+constexpr uint16_t attributeTypeMask =
+    static_cast<uint16_t>(~(NLA_F_NESTED | NLA_F_NET_BYTEORDER));
+
+class Message
+{
+  public:
+    Message(uint16_t family, uint8_t command) : data(attributesOffset)
+    {
+        auto* nh = header();
+        nh->nlmsg_type = family;
+        nh->nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
+        auto* gh =
+            reinterpret_cast<genlmsghdr*>(data.data() + messageHeaderLength);
+        gh->cmd = command;
+        gh->version = 1;
+    }
+
+    template <class T>
+    void put(uint16_t type, T value)
+    {
+        put(type, &value, sizeof(value));
+    }
+
+    void put(uint16_t type, const void* payload, size_t length)
+    {
+        const size_t start = begin(type);
+        const size_t offset = data.size();
+        data.resize(offset + align(length));
+        std::memcpy(data.data() + offset, payload, length);
+        end(start);
+    }
+
+    void put(uint16_t type, const std::string& value)
+    {
+        put(type, value.c_str(), value.size() + 1);
+    }
+
+    // Starts nested attribute, returns its offset for end()
+    size_t begin(uint16_t type)
+    {
+        const size_t start = data.size();
+        data.resize(start + attributeHeaderLength);
+        reinterpret_cast<nlattr*>(data.data() + start)->nla_type = type;
+        return start;
+    }
+
+    void end(size_t start)
+    {
+        reinterpret_cast<nlattr*>(data.data() + start)->nla_len =
+            static_cast<uint16_t>(data.size() - start);
+    }
+
+    nlmsghdr* header()
+    {
+        return reinterpret_cast<nlmsghdr*>(data.data());
+    }
+
+    nlmsghdr* finish(uint32_t sequence)
+    {
+        header()->nlmsg_len = static_cast<uint32_t>(data.size());
+        header()->nlmsg_seq = sequence;
+        return header();
+    }
+
+  private:
+    std::vector<char> data;
+};
+
+// Calls handler with type, payload and its length of each attribute
+template <class Handler>
+void forEachAttribute(const void* data, size_t length, Handler&& handler)
+{
+    const auto* attr = static_cast<const nlattr*>(data);
+    while (length >= attributeHeaderLength &&
+           attr->nla_len >= attributeHeaderLength && attr->nla_len <= length)
+    {
+        handler(static_cast<uint16_t>(attr->nla_type & attributeTypeMask),
+                reinterpret_cast<const char*>(attr) + attributeHeaderLength,
+                attr->nla_len - attributeHeaderLength);
+        const size_t aligned = align(attr->nla_len);
+        if (aligned >= length)
+        {
+            break;
+        }
+        length -= aligned;
+        attr = reinterpret_cast<const nlattr*>(
+            reinterpret_cast<const char*>(attr) + aligned);
+    }
+}
+
+// Attributes of generic netlink message
+template <class Handler>
+void forEachAttribute(const nlmsghdr* nh, Handler&& handler)
+{
+    if (nh->nlmsg_len < attributesOffset)
+    {
+        return;
+    }
+    forEachAttribute(reinterpret_cast<const char*>(nh) + attributesOffset,
+                     nh->nlmsg_len - attributesOffset,
+                     std::forward<Handler>(handler));
+}
+
+// Calls handler with each complete message received, until it returns false
+template <class Handler>
+void forEachMessage(const char* data, size_t length, Handler&& handler)
+{
+    while (length >= messageHeaderLength)
+    {
+        const auto* nh = reinterpret_cast<const nlmsghdr*>(data);
+        if (nh->nlmsg_len < messageHeaderLength || nh->nlmsg_len > length ||
+            !handler(nh))
+        {
+            return;
+        }
+        const size_t aligned = align(nh->nlmsg_len);
+        if (aligned >= length)
+        {
+            return;
+        }
+        data += aligned;
+        length -= aligned;
+    }
+}
+
+template <class T>
+T readAttribute(const char* payload, size_t length)
+{
+    T value{};
+    std::memcpy(&value, payload, std::min(length, sizeof(value)));
+    return value;
+}
+
+// Waits for replies to a request to the driver, until the request is
+// acknowledged or an error is reported
+class Replies
+{
+  public:
+    Replies(uint32_t sequence, std::function<void(const nlmsghdr*)> onReply) :
+        sequence(sequence), onReply(std::move(onReply))
+    {
+    }
+
+    // Result of the request, once the received data completes it
+    std::optional<std::error_code> parse(const char* data, size_t length)
+    {
+        std::optional<std::error_code> result;
+        forEachMessage(data, length, [this, &result](const nlmsghdr* nh) {
+            if (nh->nlmsg_seq != sequence)
+            {
+                return true;
+            }
+            if (nh->nlmsg_type == NLMSG_ERROR)
+            {
+                nlmsgerr error{};
+                std::memcpy(&error,
+                            reinterpret_cast<const char*>(nh) +
+                                messageHeaderLength,
+                            std::min<size_t>(sizeof(error),
+                                             nh->nlmsg_len -
+                                                 messageHeaderLength));
+                result = error.error == 0
+                             ? std::error_code{}
+                             : std::error_code{-error.error,
+                                               std::system_category()};
+                return false;
+            }
+            if (nh->nlmsg_type == NLMSG_DONE)
+            {
+                result = std::error_code{};
+                return false;
+            }
+            onReply(nh);
+            return true;
+        });
+        return result;
+    }
+
+  private:
+    uint32_t sequence;
+    std::function<void(const nlmsghdr*)> onReply;
+};
+
+// Sends the request to the kernel, which handles it before the send returns
+std::error_code send(int fd, Message& message, uint32_t sequence)
+{
+    const auto* request = message.finish(sequence);
+    sockaddr_nl kernel{};
+    kernel.nl_family = AF_NETLINK;
+    if (::sendto(fd, request, request->nlmsg_len, 0,
+                 reinterpret_cast<sockaddr*>(&kernel), sizeof(kernel)) < 0)
+    {
+        return {errno, std::system_category()};
+    }
+    return {};
+}
+
+// Blocking request, used only to look up the family once; the controller
+// answers it right away
+template <class Handler>
+std::error_code transact(Message& message, Handler&& onReply)
+{
+    const int fd = ::socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC,
+                            NETLINK_GENERIC);
+    if (fd < 0)
+    {
+        return {errno, std::system_category()};
+    }
+    const timeval timeout{replyTimeoutSec, 0};
+    ::setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    Replies replies(1, std::forward<Handler>(onReply));
+    std::error_code ec = send(fd, message, 1);
+    std::array<char, 16384> buffer;
+    while (!ec)
+    {
+        const ssize_t received = ::recv(fd, buffer.data(), buffer.size(), 0);
+        if (received < 0)
+        {
+            if (errno != EINTR)
+            {
+                ec = {errno, std::system_category()};
+            }
+            continue;
+        }
+        if (auto result =
+                replies.parse(buffer.data(), static_cast<size_t>(received)))
+        {
+            ec = *result;
+            break;
+        }
+    }
+    ::close(fd);
+    return ec;
+}
+
+// Request on a non-blocking socket of its own, replies are awaited on the
+// io_context. Handler is called once, never from within start().
+class Transaction : public std::enable_shared_from_this<Transaction>
+{
+  public:
+    using OnReply = std::function<void(const nlmsghdr*)>;
+    using Handler = std::function<void(std::error_code)>;
+
+    Transaction(boost::asio::io_context& ioc, OnReply&& onReply,
+                Handler&& handler) :
+        socket(ioc), timer(ioc), replies(1, std::move(onReply)),
+        handler(std::move(handler))
+    {
+    }
+
+    static void start(boost::asio::io_context& ioc, Message& message,
+                      OnReply&& onReply, Handler&& handler)
+    {
+        auto transaction = std::make_shared<Transaction>(
+            ioc, std::move(onReply), std::move(handler));
+        const int fd = ::socket(AF_NETLINK,
+                                SOCK_RAW | SOCK_CLOEXEC | SOCK_NONBLOCK,
+                                NETLINK_GENERIC);
+        std::error_code ec;
+        if (fd < 0)
+        {
+            ec = {errno, std::system_category()};
+        }
+        else
+        {
+            transaction->socket.assign(fd);
+            ec = send(fd, message, 1);
+        }
+        if (ec)
+        {
+            boost::asio::post(ioc, [transaction, ec]() {
+                transaction->finish(ec);
+            });
+            return;
+        }
+
+        transaction->timer.expires_after(std::chrono::seconds(replyTimeoutSec));
+        transaction->timer.async_wait(
+            [transaction](const boost::system::error_code& ec) {
+                if (!ec)
+                {
+                    transaction->finish(
+                        std::make_error_code(std::errc::timed_out));
+                }
+            });
+        transaction->receive();
+    }
+
+  private:
+    void receive()
+    {
+        socket.async_wait(
+            boost::asio::posix::stream_descriptor::wait_read,
+            [self = shared_from_this()](const boost::system::error_code& ec) {
+                if (ec)
+                {
+                    return;
+                }
+                self->received();
+            });
+    }
+
+    void received()
+    {
+        std::array<char, 16384> buffer;
+        while (handler)
+        {
+            const ssize_t received = ::recv(socket.native_handle(),
+                                            buffer.data(), buffer.size(),
+                                            MSG_DONTWAIT);
+            if (received < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                if (errno == EAGAIN)
+                {
+                    receive();
+                    return;
+                }
+                finish({errno, std::system_category()});
+                return;
+            }
+            if (auto result = replies.parse(buffer.data(),
+                                            static_cast<size_t>(received)))
+            {
+                finish(*result);
+                return;
+            }
+        }
+    }
+
+    void finish(std::error_code ec)
+    {
+        if (!handler)
+        {
+            return;
+        }
+        boost::system::error_code ignored;
+        socket.close(ignored);
+        timer.cancel();
+        std::exchange(handler, nullptr)(ec);
+    }
+
+    boost::asio::posix::stream_descriptor socket;
+    boost::asio::steady_timer timer;
+    Replies replies;
+    Handler handler;
+};
+
+struct Family
+{
+    uint16_t id = 0;
+    uint32_t group = 0;
+};
+
+// Resolved once, the driver does not go away while it is in use
+std::optional<Family> family()
+{
+    static std::optional<Family> resolved;
+    if (resolved)
+    {
+        return resolved;
+    }
+
+    Message message(GENL_ID_CTRL, CTRL_CMD_GETFAMILY);
+    message.put(CTRL_ATTR_FAMILY_NAME, std::string(NBD_GENL_FAMILY_NAME));
+    Family found;
+    const auto ec = transact(message, [&found](const nlmsghdr* nh) {
+        forEachAttribute(nh, [&found](uint16_t type, const char* payload,
+                                      size_t length) {
+            if (type == CTRL_ATTR_FAMILY_ID)
+            {
+                found.id = readAttribute<uint16_t>(payload, length);
+            }
+            else if (type == CTRL_ATTR_MCAST_GROUPS)
+            {
+                forEachAttribute(payload, length, [&found](uint16_t,
+                                                           const char* group,
+                                                           size_t length) {
+                    std::string name;
+                    uint32_t id = 0;
+                    forEachAttribute(
+                        group, length,
+                        [&name, &id](uint16_t type, const char* payload,
+                                     size_t length) {
+                            if (type == CTRL_ATTR_MCAST_GRP_NAME)
+                            {
+                                name.assign(payload, strnlen(payload, length));
+                            }
+                            else if (type == CTRL_ATTR_MCAST_GRP_ID)
+                            {
+                                id = readAttribute<uint32_t>(payload, length);
+                            }
+                        });
+                    if (name == NBD_GENL_MCAST_GROUP_NAME)
+                    {
+                        found.group = id;
+                    }
+                });
+            }
+        });
+    });
+    if (ec || found.id == 0)
+    {
+        LogMsg(Logger::Debug, "[Netlink]: NBD family not available: ", ec);
+        return std::nullopt;
+    }
+    resolved = found;
+    return resolved;
+}
+
+} // namespace
+
+bool available()
+{
+    return family().has_value();
+}
+
+void disconnect(boost::asio::io_context& ioc, uint32_t index,
+                Handler&& handler)
+{
+    const auto nbd = family();
+    if (!nbd)
+    {
+        boost::asio::post(ioc, [handler = std::move(handler)]() {
+            handler(std::make_error_code(std::errc::function_not_supported));
+        });
+        return;
+    }
+    Message message(nbd->id, NBD_CMD_DISCONNECT);
+    message.put<uint32_t>(NBD_ATTR_INDEX, index);
+    Transaction::start(ioc, message, [](const nlmsghdr*) {},
+                       std::move(handler));
+}
+
+void isConnected(boost::asio::io_context& ioc, uint32_t index,
+                 StatusHandler&& handler)
+{
+    const auto nbd = family();
+    if (!nbd)
+    {
+        boost::asio::post(ioc, [handler = std::move(handler)]() {
+            handler(std::nullopt);
+        });
+        return;
+    }
+    Message message(nbd->id, NBD_CMD_STATUS);
+    message.put<uint32_t>(NBD_ATTR_INDEX, index);
+    auto connected = std::make_shared<std::optional<bool>>();
+    Transaction::start(
+        ioc, message,
+        [connected](const nlmsghdr* nh) {
+            forEachAttribute(nh, [&connected](uint16_t type,
+                                              const char* payload,
+                                              size_t length) {
+                if (type != NBD_ATTR_DEVICE_LIST)
+                {
+                    return;
+                }
+                forEachAttribute(payload, length, [&connected](
+                                                      uint16_t,
+                                                      const char* item,
+                                                      size_t length) {
+                    forEachAttribute(item, length,
+                                     [&connected](uint16_t type,
+                                                  const char* payload,
+                                                  size_t length) {
+                                         if (type == NBD_DEVICE_CONNECTED)
+                                         {
+                                             *connected =
+                                                 readAttribute<uint8_t>(
+                                                     payload, length) != 0;
+                                         }
+                                     });
+                });
+            });
+        },
+        [connected, handler = std::move(handler)](std::error_code ec) {
+            handler(ec ? std::nullopt : *connected);
+        });
+}
+
+Device::Device(boost::asio::io_context& ioc, std::string_view name,
+               uint32_t index, Handler&& onDisconnected) :
+    ioc(ioc),
+    name(name), index(index), monitor(ioc), timer(ioc),
+    onDisconnected(std::move(onDisconnected))
+{
+}
+
+Device::~Device()
+{
+    boost::system::error_code ignored;
+    monitor.close(ignored);
+}
+
+void Device::connect(const std::vector<int>& sockets, const Export& exp,
+                     std::optional<uint32_t> blockSize,
+                     std::chrono::seconds timeout, Handler&& onConnected)
+{
+    if (state != State::idle)
+    {
+        boost::asio::post(ioc, [onConnected = std::move(onConnected)]() {
+            onConnected(std::make_error_code(std::errc::operation_canceled));
+        });
+        return;
+    }
+    const auto nbd = family();
+    if (!nbd)
+    {
+        const auto ec = std::make_error_code(std::errc::function_not_supported);
+        closed(ec);
+        boost::asio::post(ioc, [onConnected = std::move(onConnected), ec]() {
+            onConnected(ec);
+        });
+        return;
+    }
+
+    // Subscribed before connecting, so no notification is missed
+    if (nbd->group != 0)
+    {
+        const int events = ::socket(AF_NETLINK,
+                                    SOCK_RAW | SOCK_CLOEXEC | SOCK_NONBLOCK,
+                                    NETLINK_GENERIC);
+        const int group = static_cast<int>(nbd->group);
+        if (events >= 0 &&
+            ::setsockopt(events, SOL_NETLINK, NETLINK_ADD_MEMBERSHIP, &group,
+                         sizeof(group)) == 0)
+        {
+            monitor.assign(events);
+        }
+        else if (events >= 0)
+        {
+            ::close(events);
+        }
+    }
+
+    Message message(nbd->id, NBD_CMD_CONNECT);
+    message.put<uint32_t>(NBD_ATTR_INDEX, index);
+    message.put<uint64_t>(NBD_ATTR_SIZE_BYTES, exp.size);
+    if (blockSize)
+    {
+        message.put<uint64_t>(NBD_ATTR_BLOCK_SIZE_BYTES, *blockSize);
+    }
+    message.put<uint64_t>(NBD_ATTR_TIMEOUT,
+                          static_cast<uint64_t>(timeout.count()));
+    message.put<uint64_t>(NBD_ATTR_SERVER_FLAGS, exp.flags);
+    const size_t list = message.begin(NBD_ATTR_SOCKETS);
+    for (const int fd : sockets)
+    {
+        const size_t item = message.begin(NBD_SOCK_ITEM);
+        message.put<uint32_t>(NBD_SOCK_FD, static_cast<uint32_t>(fd));
+        message.end(item);
+    }
+    message.end(list);
+
+    state = State::connecting;
+    Transaction::start(
+        ioc, message, [](const nlmsghdr*) {},
+        [this, self = shared_from_this(), count = sockets.size(),
+         onConnected = std::move(onConnected)](std::error_code ec) {
+            if (ec)
+            {
+                LogMsg(Logger::Error, "[Netlink]: (", name,
+                       ") Connect failed: ", ec);
+                closed(ec);
+                onConnected(ec);
+                return;
+            }
+            LogMsg(Logger::Info, "[Netlink]: (", name, ") Device nbd", index,
+                   " connected over ", count, " sockets");
+            if (state == State::disconnecting)
+            {
+                requestDisconnect();
+            }
+            else
+            {
+                state = State::connected;
+            }
+            watchLink();
+            onConnected({});
+        });
+}
+
+void Device::disconnect()
+{
+    if (state == State::idle)
+    {
+        closed(std::make_error_code(std::errc::operation_canceled));
+        return;
+    }
+    // Device being connected is disconnected once connected
+    if (state == State::connecting)
+    {
+        state = State::disconnecting;
+        return;
+    }
+    if (state != State::connected)
+    {
+        return;
+    }
+
+    state = State::disconnecting;
+    requestDisconnect();
+}
+
+void Device::requestDisconnect()
+{
+    netlink::disconnect(
+        ioc, index, [this, self = shared_from_this()](std::error_code ec) {
+            if (ec)
+            {
+                LogMsg(Logger::Error, "[Netlink]: (", name,
+                       ") Disconnect failed: ", ec);
+            }
+            pollStatus(std::chrono::steady_clock::now() + disconnectTimeout);
+        });
+}
+
+void Device::watchLink()
+{
+    if (!monitor.is_open())
+    {
+        return;
+    }
+    monitor.async_wait(
+        boost::asio::posix::stream_descriptor::wait_read,
+        [this, self = shared_from_this()](const boost::system::error_code& ec) {
+            if (ec || state == State::closed)
+            {
+                return;
+            }
+
+            std::array<char, 4096> buffer;
+            const ssize_t received = ::recv(monitor.native_handle(),
+                                            buffer.data(), buffer.size(),
+                                            MSG_DONTWAIT);
+            bool dead = false;
+            forEachMessage(
+                buffer.data(),
+                static_cast<size_t>(std::max<ssize_t>(received, 0)),
+                [this, &dead](const nlmsghdr* nh) {
+                    genlmsghdr gh;
+                    if (nh->nlmsg_len < attributesOffset)
+                    {
+                        return true;
+                    }
+                    std::memcpy(&gh,
+                                reinterpret_cast<const char*>(nh) +
+                                    messageHeaderLength,
+                                sizeof(gh));
+                    if (gh.cmd != NBD_CMD_LINK_DEAD)
+                    {
+                        return true;
+                    }
+                    forEachAttribute(nh, [this, &dead](uint16_t type,
+                                                       const char* payload,
+                                                       size_t length) {
+                        if (type == NBD_ATTR_INDEX &&
+                            readAttribute<uint32_t>(payload, length) == index)
+                        {
+                            dead = true;
+                        }
+                    });
+                    return true;
+                });
+            if (dead && state == State::connected)
+            {
+                LogMsg(Logger::Error, "[Netlink]: (", name,
+                       ") Link of the device is dead");
+                closed(std::make_error_code(std::errc::connection_aborted));
+                return;
+            }
+            // Link going down while disconnecting is likely the release of
+            // the device, which need not wait for the next poll
+            if (dead && state == State::disconnecting)
+            {
+                checkReleased();
+            }
+            watchLink();
+        });
+}
+
+void Device::pollStatus(std::chrono::steady_clock::time_point deadline)
+{
+    isConnected(ioc, index,
+                [this, self = shared_from_this(),
+                 deadline](std::optional<bool> connected) {
+                    if (state != State::disconnecting)
+                    {
+                        return;
+                    }
+                    if (!connected.value_or(true))
+                    {
+                        closed({});
+                        return;
+                    }
+                    if (std::chrono::steady_clock::now() >= deadline)
+                    {
+                        LogMsg(Logger::Error, "[Netlink]: (", name,
+                               ") Device not released after disconnect");
+                        closed(std::make_error_code(std::errc::timed_out));
+                        return;
+                    }
+
+                    timer.expires_after(statusPollInterval);
+                    timer.async_wait(
+                        [this, self,
+                         deadline](const boost::system::error_code& ec) {
+                            if (!ec)
+                            {
+                                pollStatus(deadline);
+                            }
+                        });
+                });
+}
+
+void Device::checkReleased()
+{
+    isConnected(ioc, index,
+                [this, self = shared_from_this()](
+                    std::optional<bool> connected) {
+                    if (state == State::disconnecting &&
+                        !connected.value_or(true))
+                    {
+                        closed({});
+                    }
+                });
+}
+
+void Device::closed(std::error_code ec)
+{
+    if (state == State::connected || state == State::disconnecting)
+    {
+        LogMsg(Logger::Info, "[Netlink]: (", name, ") Device nbd", index,
+               " disconnected");
+    }
+    state = State::closed;
+    boost::system::error_code ignored;
+    monitor.close(ignored);
+    timer.cancel();
+    if (onDisconnected)
+    {
+        std::exchange(onDisconnected, nullptr)(ec);
+    }
+}
+
+} // namespace nbd::netlink
@@ -0,0 +1,95 @@
+#pragma once
+
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/posix/stream_descriptor.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <string>
+#include <system_error>
+#include <vector>
+
+// Configuration of NBD devices through the generic netlink interface of the
+// kernel driver, replacing nbd-client and its ioctls. Requests to the driver
+// are completed on the io_context, which never waits for replies; handlers
+// are not called from within the call issuing the request.
+namespace nbd::netlink
+{
+
+using Handler = std::function<void(std::error_code)>;
+// Whether device is connected, nullopt when status is not known
+using StatusHandler = std::function<void(std::optional<bool>)>;
+
+// Whether the loaded NBD driver provides the netlink interface, looked up
+// once
+bool available();
+
+// Disconnects device regardless of how it was configured
+void disconnect(boost::asio::io_context& ioc, uint32_t index,
+                Handler&& handler);
+
+void isConnected(boost::asio::io_context& ioc, uint32_t index,
+                 StatusHandler&& handler);
+
+struct Export
+{
+    uint64_t size = 0;
+    uint16_t flags = 0;
+};
+
+// NBD device attached to sockets already in transmission phase. Its end is
+// reported to the handler once: after disconnect(), when the kernel finds the
+// link dead or when connecting fails. Release of the device after disconnect
+// is polled, and checked at once when the kernel reports the link down.
+class Device : public std::enable_shared_from_this<Device>
+{
+  public:
+    // Time given to the kernel to release the device after disconnect
+    static constexpr std::chrono::seconds disconnectTimeout{2};
+    static constexpr std::chrono::milliseconds statusPollInterval{50};
+
+    Device(boost::asio::io_context& ioc, std::string_view name, uint32_t index,
+           Handler&& onDisconnected);
+    ~Device();
+
+    Device(const Device&) = delete;
+    Device(Device&&) = delete;
+    Device& operator=(const Device&) = delete;
+    Device& operator=(Device&&) = delete;
+
+    // Kernel takes its own references to the sockets before connect()
+    // returns, caller closes them. Device keeps the block size of the driver
+    // unless blockSize is set.
+    void connect(const std::vector<int>& sockets, const Export& exp,
+                 std::optional<uint32_t> blockSize,
+                 std::chrono::seconds timeout, Handler&& onConnected);
+    void disconnect();
+
+  private:
+    enum class State
+    {
+        idle,
+        connecting,
+        connected,
+        disconnecting,
+        closed
+    };
+
+    void requestDisconnect();
+    void watchLink();
+    void pollStatus(std::chrono::steady_clock::time_point deadline);
+    void checkReleased();
+    void closed(std::error_code ec);
+
+    boost::asio::io_context& ioc;
+    std::string name;
+    uint32_t index;
+    State state = State::idle;
+    boost::asio::posix::stream_descriptor monitor;
+    boost::asio::steady_timer timer;
+    Handler onDisconnected;
+};
+
+} // namespace nbd::netlink
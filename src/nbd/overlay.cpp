@@ -0,0 +1,313 @@
+#include "nbd/overlay.hpp"
+
+#include "logger.hpp"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+
+namespace nbd
+{
+
+namespace fs = std::filesystem;
+
+struct Overlay::Pending
+{
+    explicit Pending(Handler&& handler) : handler(std::move(handler))
+    {
+    }
+
+    void complete(const std::error_code& result = {})
+    {
+        if (result)
+        {
+            ec = result;
+        }
+        if (--remaining == 0)
+        {
+            handler(ec);
+        }
+    }
+
+    Handler handler;
+    unsigned remaining = 1;
+    std::error_code ec;
+};
+
+Overlay::Overlay(boost::asio::io_context& ioc, std::string_view name,
+                 std::shared_ptr<Backend> lower, fs::path directory,
+                 uint64_t capacity) :
+    ioc(ioc),
+    name(name), lower(std::move(lower)), directory(std::move(directory)),
+    capacity(capacity)
+{
+}
+
+Overlay::~Overlay()
+{
+    if (fd < 0)
+    {
+        return;
+    }
+    LogMsg(Logger::Info, "[Overlay]: (", name, ") Discarding ", used,
+           " bytes written");
+    ::close(fd);
+}
+
+void Overlay::open(Handler&& handler)
+{
+    lower->open([self = shared_from_this(),
+                 handler = std::move(handler)](std::error_code ec) {
+        if (!ec)
+        {
+            ec = self->create();
+        }
+        handler(ec);
+    });
+}
+
+std::error_code Overlay::create()
+{
+    std::error_code ec;
+    fs::create_directories(directory, ec);
+    if (ec)
+    {
+        LogMsg(Logger::Error, "[Overlay]: (", name, ") Unable to create ",
+               directory, ": ", ec.message());
+        return ec;
+    }
+    const auto space = fs::space(directory, ec);
+    if (ec || space.available < capacity)
+    {
+        LogMsg(Logger::Error, "[Overlay]: (", name, ") Overlay of ", capacity,
+               " bytes does not fit into ", directory);
+        return std::make_error_code(std::errc::no_space_on_device);
+    }
+
+    const fs::path path = directory / (name + ".overlay");
+    fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0)
+    {
+        ec = std::error_code(errno, std::generic_category());
+        LogMsg(Logger::Error, "[Overlay]: (", name, ") Unable to open ", path,
+               ": ", ec.message());
+        return ec;
+    }
+    // Nothing refers to the file once it is closed
+    ::unlink(path.c_str());
+    if (::ftruncate(fd, static_cast<off_t>(size())) != 0)
+    {
+        ec = std::error_code(errno, std::generic_category());
+        LogMsg(Logger::Error, "[Overlay]: (", name, ") Unable to resize ",
+               path, ": ", ec.message());
+        return ec;
+    }
+
+    blockIo = BlockIo::create(ioc);
+    if (!blockIo)
+    {
+        return std::make_error_code(std::errc::io_error);
+    }
+
+    const uint64_t blocks = (size() + blockSize - 1) / blockSize;
+    present.assign(static_cast<size_t>((blocks + 7) / 8), 0);
+    LogMsg(Logger::Info, "[Overlay]: (", name, ") Writes kept in ", directory,
+           ", up to ", capacity, " bytes");
+    return {};
+}
+
+uint32_t Overlay::blockLength(uint64_t index) const
+{
+    return static_cast<uint32_t>(
+        std::min<uint64_t>(blockSize, size() - index * blockSize));
+}
+
+bool Overlay::isPresent(uint64_t index) const
+{
+    return (present[static_cast<size_t>(index / 8)] & (1u << (index % 8))) !=
+           0;
+}
+
+void Overlay::read(uint64_t offset, boost::asio::mutable_buffer buffer,
+                   Handler&& handler)
+{
+    auto pending = std::make_shared<Pending>(std::move(handler));
+    auto* dst = static_cast<char*>(buffer.data());
+    const uint64_t end = offset + buffer.size();
+
+    // Consecutive blocks of the same origin are read at once
+    for (uint64_t from = offset; from < end;)
+    {
+        const bool local = isPresent(from / blockSize);
+        uint64_t to = std::min(end, (from / blockSize + 1) * blockSize);
+        while (to < end && isPresent(to / blockSize) == local)
+        {
+            to = std::min(end, to + blockSize);
+        }
+
+        const auto part = boost::asio::buffer(
+            dst + (from - offset), static_cast<size_t>(to - from));
+        pending->remaining++;
+        if (local)
+        {
+            blockIo->read(fd, from, part,
+                          [self = shared_from_this(),
+                           pending](std::error_code ec) {
+                              pending->complete(ec);
+                          });
+        }
+        else
+        {
+            lower->read(from, part, [pending](std::error_code ec) {
+                pending->complete(ec);
+            });
+        }
+        from = to;
+    }
+    pending->complete();
+}
+
+void Overlay::write(uint64_t offset, boost::asio::const_buffer buffer,
+                    Handler&& handler)
+{
+    auto pending = std::make_shared<Pending>(std::move(handler));
+    const auto* src = static_cast<const char*>(buffer.data());
+    const uint64_t end = offset + buffer.size();
+
+    for (uint64_t from = offset; from < end;)
+    {
+        const uint64_t index = from / blockSize;
+        const uint64_t to = std::min(end, (index + 1) * blockSize);
+        pending->remaining++;
+        writeBlock(index, from,
+                   boost::asio::buffer(src + (from - offset),
+                                       static_cast<size_t>(to - from)),
+                   pending);
+        from = to;
+    }
+    pending->complete();
+}
+
+void Overlay::writeBlock(uint64_t index, uint64_t offset,
+                         boost::asio::const_buffer data,
+                         const std::shared_ptr<Pending>& pending)
+{
+    if (isPresent(index))
+    {
+        blockIo->write(fd, offset, data,
+                       [self = shared_from_this(),
+                        pending](std::error_code ec) {
+                           pending->complete(ec);
+                       });
+        return;
+    }
+    if (auto it = copying.find(index); it != copying.end())
+    {
+        it->second.emplace_back(
+            [self = shared_from_this(), index, offset, data, pending]() {
+                self->writeBlock(index, offset, data, pending);
+            });
+        return;
+    }
+
+    const uint64_t start = index * blockSize;
+    const uint32_t length = blockLength(index);
+    if (used + length > capacity)
+    {
+        if (!full)
+        {
+            LogMsg(Logger::Error, "[Overlay]: (", name, ") Overlay is full, ",
+                   used, " bytes");
+            full = true;
+        }
+        pending->complete(std::make_error_code(std::errc::no_space_on_device));
+        return;
+    }
+    used += length;
+    copying[index];
+
+    if (offset == start && data.size() == length)
+    {
+        blockIo->write(fd, offset, data,
+                       [self = shared_from_this(), index,
+                        pending](std::error_code ec) {
+                           self->copied(index, ec);
+                           pending->complete(ec);
+                       });
+        return;
+    }
+
+    // Rest of the block comes from the image
+    std::shared_ptr<char[]> block(new char[length]);
+    lower->read(
+        start, boost::asio::buffer(block.get(), length),
+        [self = shared_from_this(), index, offset, data, pending, block, start,
+         length](std::error_code ec) {
+            if (ec)
+            {
+                self->copied(index, ec);
+                pending->complete(ec);
+                return;
+            }
+            std::memcpy(block.get() + (offset - start), data.data(),
+                        data.size());
+            self->blockIo->write(
+                self->fd, start, boost::asio::buffer(block.get(), length),
+                [self, index, pending, block](std::error_code ec) {
+                    self->copied(index, ec);
+                    pending->complete(ec);
+                });
+        });
+}
+
+void Overlay::copied(uint64_t index, const std::error_code& ec)
+{
+    auto node = copying.extract(index);
+    if (ec)
+    {
+        used -= blockLength(index);
+    }
+    else
+    {
+        present[static_cast<size_t>(index / 8)] |=
+            static_cast<uint8_t>(1u << (index % 8));
+    }
+    for (const auto& waiting : node.mapped())
+    {
+        waiting();
+    }
+}
+
+void Overlay::flush(Handler&& handler)
+{
+    blockIo->sync(fd, [self = shared_from_this(),
+                       handler = std::move(handler)](std::error_code ec) {
+        handler(ec);
+    });
+}
+
+void Overlay::extents(uint64_t offset, uint64_t length,
+                      ExtentsHandler&& handler)
+{
+    // Blocks of the overlay hold data, the rest is described by the image
+    const uint64_t end = std::min(offset + length, size());
+    uint64_t to = offset;
+    while (to < end && isPresent(to / blockSize))
+    {
+        to = std::min(end, (to / blockSize + 1) * blockSize);
+    }
+    if (to > offset)
+    {
+        handler({}, {Extent{to - offset, false}});
+        return;
+    }
+    while (to < end && !isPresent(to / blockSize))
+    {
+        to = std::min(end, (to / blockSize + 1) * blockSize);
+    }
+    lower->extents(offset, to - offset, std::move(handler));
+}
+
+} // namespace nbd
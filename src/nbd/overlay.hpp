@@ -0,0 +1,101 @@
+#pragma once
+
+#include "nbd/backend.hpp"
+#include "nbd/block_io.hpp"
+
+#include <boost/asio/io_context.hpp>
+#include <filesystem>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace nbd
+{
+
+// Makes a read-only image writable by keeping written blocks in a sparse,
+// local file, eg. on tmpfs. A bitmap tells which blocks live in the overlay,
+// reads merge them with the image below. Blocks written only partially are
+// first copied from the image; writes of a block being copied wait for the
+// copy to finish.
+//
+// The overlay never grows beyond its capacity, further writes of new blocks
+// fail with ENOSPC; open fails when the capacity does not fit into the
+// directory. It is discarded together with the backend, its file is unlinked
+// right after creation.
+class Overlay : public Backend, public std::enable_shared_from_this<Overlay>
+{
+  public:
+    static constexpr uint32_t blockSize = 64 * 1024;
+
+    Overlay(boost::asio::io_context& ioc, std::string_view name,
+            std::shared_ptr<Backend> lower, std::filesystem::path directory,
+            uint64_t capacity);
+    ~Overlay() override;
+
+    void open(Handler&& handler) override;
+
+    uint64_t size() const override
+    {
+        return lower->size();
+    }
+
+    // Content differs from the image once written
+    std::string contentId() const override
+    {
+        return {};
+    }
+
+    bool isWritable() const override
+    {
+        return true;
+    }
+
+    void read(uint64_t offset, boost::asio::mutable_buffer buffer,
+              Handler&& handler) override;
+    void write(uint64_t offset, boost::asio::const_buffer buffer,
+               Handler&& handler) override;
+    void flush(Handler&& handler) override;
+    void extents(uint64_t offset, uint64_t length,
+                 ExtentsHandler&& handler) override;
+
+    void prefetch(uint64_t offset, uint64_t length) override
+    {
+        lower->prefetch(offset, length);
+    }
+
+    void cancelPrefetch() override
+    {
+        lower->cancelPrefetch();
+    }
+
+  private:
+    struct Pending;
+
+    std::error_code create();
+
+    uint32_t blockLength(uint64_t index) const;
+    bool isPresent(uint64_t index) const;
+    void writeBlock(uint64_t index, uint64_t offset,
+                    boost::asio::const_buffer data,
+                    const std::shared_ptr<Pending>& pending);
+    void copied(uint64_t index, const std::error_code& ec);
+
+    boost::asio::io_context& ioc;
+    std::string name;
+    std::shared_ptr<Backend> lower;
+    std::filesystem::path directory;
+    uint64_t capacity;
+
+    int fd = -1;
+    std::shared_ptr<BlockIo> blockIo;
+    std::vector<uint8_t> present;
+    // Bytes of the blocks in the overlay, including ones being copied
+    uint64_t used = 0;
+    // Running out of capacity is logged once
+    bool full = false;
+    // Blocks being copied from the image and writes waiting for them
+    std::unordered_map<uint64_t, std::vector<std::function<void()>>> copying;
+};
+
+} // namespace nbd
@@ -0,0 +1,223 @@
+#include "nbd/pin.hpp"
+
+#include "logger.hpp"
+#include "nbd/file_backend.hpp"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+
+namespace nbd
+{
+
+namespace fs = std::filesystem;
+
+Pin::Pin(boost::asio::io_context& ioc, std::string_view name,
+         std::shared_ptr<Backend> lower, fs::path directory, uint64_t rate,
+         Statistics::Pin& stats) :
+    ioc(ioc),
+    name(name), lower(std::move(lower)), directory(std::move(directory)),
+    rate(rate), stats(stats), timer(ioc)
+{
+}
+
+Pin::~Pin()
+{
+    if (fd >= 0)
+    {
+        LogMsg(Logger::Info, "[Pin]: (", name, ") Download stopped at ",
+               position, " of ", size(), " bytes");
+    }
+    stop();
+}
+
+void Pin::open(Handler&& handler)
+{
+    lower->open([self = shared_from_this(),
+                 handler = std::move(handler)](std::error_code ec) {
+        if (!ec && self->create())
+        {
+            self->stats = Statistics::Pin{};
+            self->downloadStarted = std::chrono::steady_clock::now();
+            self->download();
+        }
+        handler(ec);
+    });
+}
+
+bool Pin::create()
+{
+    if (lower->isWritable())
+    {
+        return false;
+    }
+
+    std::error_code ec;
+    fs::create_directories(directory, ec);
+    const auto space = fs::space(directory, ec);
+    if (ec || space.available < size())
+    {
+        LogMsg(Logger::Error, "[Pin]: (", name, ") Image does not fit into ",
+               directory, ", served remotely");
+        return false;
+    }
+
+    path = directory / (name + ".pin");
+    fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0 || ::ftruncate(fd, static_cast<off_t>(size())) != 0)
+    {
+        LogMsg(Logger::Error, "[Pin]: (", name, ") Unable to create ", path,
+               ": ", std::strerror(errno));
+        stop();
+        return false;
+    }
+    blockIo = BlockIo::create(ioc);
+    if (!blockIo)
+    {
+        stop();
+        return false;
+    }
+
+    LogMsg(Logger::Info, "[Pin]: (", name, ") Downloading image to ", path,
+           rate > 0 ? ", bytes per second: " : "",
+           rate > 0 ? std::to_string(rate) : "");
+    return true;
+}
+
+void Pin::download()
+{
+    if (position >= size())
+    {
+        switchOver();
+        return;
+    }
+
+    const auto length = static_cast<uint32_t>(
+        std::min<uint64_t>(blockSize, size() - position));
+    std::shared_ptr<char[]> block(new char[length]);
+    blockStarted = std::chrono::steady_clock::now();
+    // Unmount stops the download, data of a read in flight is dropped
+    BackgroundScope scope;
+    lower->read(position, boost::asio::buffer(block.get(), length),
+                [weak = weak_from_this(), block,
+                 length](std::error_code ec) {
+                    auto self = weak.lock();
+                    if (!self || self->fd < 0)
+                    {
+                        return;
+                    }
+                    if (ec)
+                    {
+                        LogMsg(Logger::Error, "[Pin]: (", self->name,
+                               ") Download failed at ", self->position, ": ",
+                               ec.message());
+                        self->wait(retryDelay);
+                        return;
+                    }
+                    self->downloaded(block, length);
+                });
+}
+
+void Pin::downloaded(const std::shared_ptr<char[]>& block, uint32_t length)
+{
+    auto written = [self = shared_from_this(), length](std::error_code ec) {
+        if (ec)
+        {
+            LogMsg(Logger::Error, "[Pin]: (", self->name,
+                   ") Unable to write local copy: ", ec.message());
+            self->stop();
+            return;
+        }
+
+        self->position += length;
+        self->stats.downloaded = self->position;
+        self->stats.progress = self->position * 100 / self->size();
+        if (self->rate == 0 || self->position == self->size())
+        {
+            self->download();
+            return;
+        }
+        const auto due = self->blockStarted +
+                         std::chrono::duration_cast<
+                             std::chrono::steady_clock::duration>(
+                             std::chrono::duration<double>(
+                                 static_cast<double>(length) /
+                                 static_cast<double>(self->rate)));
+        self->wait(due - std::chrono::steady_clock::now());
+    };
+
+    if (isZero(block.get(), length))
+    {
+        written({});
+        return;
+    }
+    blockIo->write(fd, position, boost::asio::buffer(block.get(), length),
+                   [block, written](std::error_code ec) { written(ec); });
+}
+
+void Pin::wait(std::chrono::steady_clock::duration delay)
+{
+    if (delay <= std::chrono::steady_clock::duration::zero())
+    {
+        download();
+        return;
+    }
+    timer.expires_after(delay);
+    timer.async_wait(
+        [weak = weak_from_this()](const boost::system::error_code& ec) {
+            if (auto self = weak.lock(); self && !ec)
+            {
+                self->download();
+            }
+        });
+}
+
+void Pin::switchOver()
+{
+    try
+    {
+        auto file = std::make_shared<FileBackend>(ioc, path, false);
+        file->open([](std::error_code) {});
+        local = std::move(file);
+    }
+    catch (const std::system_error& e)
+    {
+        LogMsg(Logger::Error, "[Pin]: (", name, ") ", e.what());
+    }
+    // Local copy lives on while opened by its backend
+    stop();
+    if (!local)
+    {
+        return;
+    }
+
+    LogMsg(Logger::Info, "[Pin]: (", name, ") Downloaded in ",
+           std::chrono::duration_cast<std::chrono::seconds>(
+               std::chrono::steady_clock::now() - downloadStarted)
+               .count(),
+           " s, serving local copy");
+}
+
+void Pin::stop()
+{
+    if (fd >= 0)
+    {
+        ::close(fd);
+        fd = -1;
+    }
+    removeFile();
+}
+
+void Pin::removeFile()
+{
+    if (!path.empty())
+    {
+        std::error_code ec;
+        fs::remove(path, ec);
+        path.clear();
+    }
+}
+
+} // namespace nbd
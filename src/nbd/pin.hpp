@@ -0,0 +1,118 @@
+#pragma once
+
+#include "nbd/backend.hpp"
+#include "nbd/block_io.hpp"
+#include "nbd/statistics.hpp"
+
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <chrono>
+#include <filesystem>
+#include <memory>
+#include <string>
+
+namespace nbd
+{
+
+// Serves a read-only image from the backend below while downloading all of
+// it into a local file in the background, then serves the local copy, eg. so
+// a long install does not depend on a flaky WAN link once the image is local.
+// Switch happens between two requests of the host and is not visible to it;
+// the image below is not read afterwards.
+//
+// Download reads one block at a time, at most rate bytes per second when rate
+// is not 0, and retries failed reads after retryDelay. Blocks of zeroes are
+// left as holes of the file. Images which do not fit into the directory are
+// only passed through. Local copy is unlinked once complete and discarded
+// with the backend.
+class Pin : public Backend, public std::enable_shared_from_this<Pin>
+{
+  public:
+    static constexpr uint32_t blockSize = 1024 * 1024;
+    static constexpr std::chrono::seconds retryDelay{5};
+
+    Pin(boost::asio::io_context& ioc, std::string_view name,
+        std::shared_ptr<Backend> lower, std::filesystem::path directory,
+        uint64_t rate, Statistics::Pin& stats);
+    ~Pin() override;
+
+    void open(Handler&& handler) override;
+
+    uint64_t size() const override
+    {
+        return lower->size();
+    }
+
+    std::string contentId() const override
+    {
+        return lower->contentId();
+    }
+
+    void read(uint64_t offset, boost::asio::mutable_buffer buffer,
+              Handler&& handler) override
+    {
+        current().read(offset, buffer, std::move(handler));
+    }
+
+    bool supportsSplice() const override
+    {
+        return local && local->supportsSplice();
+    }
+
+    void splice(uint64_t offset, size_t length, int pipe,
+                Handler&& handler) override
+    {
+        current().splice(offset, length, pipe, std::move(handler));
+    }
+
+    void extents(uint64_t offset, uint64_t length,
+                 ExtentsHandler&& handler) override
+    {
+        current().extents(offset, length, std::move(handler));
+    }
+
+    void prefetch(uint64_t offset, uint64_t length) override
+    {
+        current().prefetch(offset, length);
+    }
+
+    void cancelPrefetch() override
+    {
+        current().cancelPrefetch();
+    }
+
+  private:
+    Backend& current() const
+    {
+        return local ? *local : *lower;
+    }
+
+    bool create();
+    void download();
+    void downloaded(const std::shared_ptr<char[]>& block, uint32_t length);
+    void wait(std::chrono::steady_clock::duration delay);
+    void switchOver();
+    // Ends the download, local copy is removed
+    void stop();
+    void removeFile();
+
+    boost::asio::io_context& ioc;
+    std::string name;
+    std::shared_ptr<Backend> lower;
+    std::filesystem::path directory;
+    uint64_t rate;
+    Statistics::Pin& stats;
+
+    std::filesystem::path path;
+    int fd = -1;
+    std::shared_ptr<BlockIo> blockIo;
+    boost::asio::steady_timer timer;
+    std::chrono::steady_clock::time_point downloadStarted;
+    std::chrono::steady_clock::time_point blockStarted;
+    // End of the downloaded part of the image
+    uint64_t position = 0;
+    // Serves the image once downloaded
+    std::shared_ptr<Backend> local;
+};
+
+} // namespace nbd
@@ -0,0 +1,223 @@
+#pragma once
+
+#include <boost/endian/buffers.hpp>
+#include <cstdint>
+
+// Wire format of the NBD protocol, as described in
+// https://github.com/NetworkBlockDevice/nbd/blob/master/doc/proto.md
+// All multi-byte fields are big endian.
+namespace nbd::proto
+{
+
+using boost::endian::big_uint16_buf_t;
+using boost::endian::big_uint32_buf_t;
+using boost::endian::big_uint64_buf_t;
+
+// Handshake
+constexpr uint64_t nbdMagic = 0x4e42444d41474943;   // "NBDMAGIC"
+constexpr uint64_t optionMagic = 0x49484156454F5054; // "IHAVEOPT"
+constexpr uint64_t optionReplyMagic = 0x3e889045565a9;
+
+constexpr uint16_t flagFixedNewstyle = 1 << 0;
+constexpr uint16_t flagNoZeroes = 1 << 1;
+
+constexpr uint32_t clientFlagFixedNewstyle = 1 << 0;
+constexpr uint32_t clientFlagNoZeroes = 1 << 1;
+
+enum Option : uint32_t
+{
+    optExportName = 1,
+    optAbort = 2,
+    optList = 3,
+    optStartTls = 5,
+    optInfo = 6,
+    optGo = 7,
+    optStructuredReply = 8,
+    optListMetaContext = 9,
+    optSetMetaContext = 10,
+};
+
+constexpr uint32_t replyErrorBit = 1U << 31;
+
+enum OptionReply : uint32_t
+{
+    repAck = 1,
+    repServer = 2,
+    repInfo = 3,
+    repMetaContext = 4,
+    repErrUnsup = replyErrorBit + 1,
+    repErrPolicy = replyErrorBit + 2,
+    repErrInvalid = replyErrorBit + 3,
+    repErrPlatform = replyErrorBit + 4,
+    repErrTlsReqd = replyErrorBit + 5,
+    repErrUnknown = replyErrorBit + 6,
+    repErrShutdown = replyErrorBit + 7,
+    repErrBlockSizeReqd = replyErrorBit + 8,
+    repErrTooBig = replyErrorBit + 9,
+};
+
+enum Info : uint16_t
+{
+    infoExport = 0,
+    infoName = 1,
+    infoDescription = 2,
+    infoBlockSize = 3,
+};
+
+// Transmission flags
+constexpr uint16_t flagHasFlags = 1 << 0;
+constexpr uint16_t flagReadOnly = 1 << 1;
+constexpr uint16_t flagSendFlush = 1 << 2;
+constexpr uint16_t flagSendFua = 1 << 3;
+constexpr uint16_t flagRotational = 1 << 4;
+constexpr uint16_t flagSendTrim = 1 << 5;
+constexpr uint16_t flagSendWriteZeroes = 1 << 6;
+constexpr uint16_t flagSendDf = 1 << 7;
+constexpr uint16_t flagCanMultiConn = 1 << 8;
+constexpr uint16_t flagSendCache = 1 << 10;
+
+// Transmission phase
+constexpr uint32_t requestMagic = 0x25609513;
+constexpr uint32_t simpleReplyMagic = 0x67446698;
+constexpr uint32_t structuredReplyMagic = 0x668e33ef;
+
+enum Command : uint16_t
+{
+    cmdRead = 0,
+    cmdWrite = 1,
+    cmdDisc = 2,
+    cmdFlush = 3,
+    cmdTrim = 4,
+    cmdCache = 5,
+    cmdWriteZeroes = 6,
+    cmdBlockStatus = 7,
+};
+
+// Structured reply chunks
+enum ReplyType : uint16_t
+{
+    replyNone = 0,
+    replyOffsetData = 1,
+    replyOffsetHole = 2,
+    replyBlockStatus = 5,
+    replyError = (1 << 15) + 1,
+    replyErrorOffset = (1 << 15) + 2,
+};
+
+constexpr uint16_t replyFlagDone = 1 << 0;
+
+// Flags of NBD_REPLY_TYPE_BLOCK_STATUS descriptors in base:allocation context
+constexpr uint32_t stateHole = 1 << 0;
+constexpr uint32_t stateZero = 1 << 1;
+
+constexpr uint16_t cmdFlagFua = 1 << 0;
+constexpr uint16_t cmdFlagNoHole = 1 << 1;
+constexpr uint16_t cmdFlagDf = 1 << 2;
+constexpr uint16_t cmdFlagReqOne = 1 << 3;
+
+// Errors are transmitted using the Linux errno values below, regardless of
+// the platform the peer is running on
+enum Error : uint32_t
+{
+    errNone = 0,
+    errPerm = 1,
+    errIo = 5,
+    errNoMem = 12,
+    errInval = 22,
+    errNoSpc = 28,
+    errOverflow = 75,
+    errNotSup = 95,
+    errShutdown = 108,
+};
+
+// Requests longer than this are refused, as recommended by the spec
+constexpr uint32_t maxRequestLength = 32 * 1024 * 1024;
+
+struct ServerGreeting
+{
+    big_uint64_buf_t magic;
+    big_uint64_buf_t optionMagic;
+    big_uint16_buf_t handshakeFlags;
+};
+static_assert(sizeof(ServerGreeting) == 18);
+
+struct OptionHeader
+{
+    big_uint64_buf_t magic;
+    big_uint32_buf_t option;
+    big_uint32_buf_t length;
+};
+static_assert(sizeof(OptionHeader) == 16);
+
+struct OptionReplyHeader
+{
+    big_uint64_buf_t magic;
+    big_uint32_buf_t option;
+    big_uint32_buf_t type;
+    big_uint32_buf_t length;
+};
+static_assert(sizeof(OptionReplyHeader) == 20);
+
+struct InfoExport
+{
+    big_uint16_buf_t type;
+    big_uint64_buf_t size;
+    big_uint16_buf_t flags;
+};
+static_assert(sizeof(InfoExport) == 12);
+
+struct InfoBlockSize
+{
+    big_uint16_buf_t type;
+    big_uint32_buf_t minimum;
+    big_uint32_buf_t preferred;
+    big_uint32_buf_t maximum;
+};
+static_assert(sizeof(InfoBlockSize) == 14);
+
+// Reply to NBD_OPT_EXPORT_NAME, followed by 124 zero bytes unless
+// NBD_FLAG_NO_ZEROES was negotiated
+struct ExportNameReply
+{
+    big_uint64_buf_t size;
+    big_uint16_buf_t flags;
+};
+static_assert(sizeof(ExportNameReply) == 10);
+
+struct Request
+{
+    big_uint32_buf_t magic;
+    big_uint16_buf_t flags;
+    big_uint16_buf_t type;
+    big_uint64_buf_t handle;
+    big_uint64_buf_t offset;
+    big_uint32_buf_t length;
+};
+static_assert(sizeof(Request) == 28);
+
+struct SimpleReply
+{
+    big_uint32_buf_t magic;
+    big_uint32_buf_t error;
+    big_uint64_buf_t handle;
+};
+static_assert(sizeof(SimpleReply) == 16);
+
+struct StructuredReply
+{
+    big_uint32_buf_t magic;
+    big_uint16_buf_t flags;
+    big_uint16_buf_t type;
+    big_uint64_buf_t handle;
+    big_uint32_buf_t length;
+};
+static_assert(sizeof(StructuredReply) == 20);
+
+struct BlockDescriptor
+{
+    big_uint32_buf_t length;
+    big_uint32_buf_t flags;
+};
+static_assert(sizeof(BlockDescriptor) == 8);
+
+} // namespace nbd::proto
@@ -0,0 +1,195 @@
+#pragma once
+
+#include "logger.hpp"
+#include "nbd/backend.hpp"
+#include "nbd/statistics.hpp"
+
+#include <algorithm>
+#include <array>
+#include <memory>
+
+namespace nbd
+{
+
+// Detects sequential streams in reads of the host and hints the lower backend
+// to prefetch data ahead of them. The window of a stream doubles each time
+// the host catches up with it, up to maxWindow, and is halved whenever a read
+// does not continue any stream. After a run of random reads all windows are
+// reset and queued prefetches are cancelled.
+class ReadAhead : public Backend
+{
+  public:
+    static constexpr uint64_t minWindow = 256 * 1024;
+    static constexpr size_t maxStreams = 4;
+    static constexpr unsigned randomReadsToReset = 4;
+
+    ReadAhead(std::shared_ptr<Backend> lower, uint64_t maxWindow,
+              Statistics::ReadAhead& stats) :
+        lower(std::move(lower)),
+        maxWindow(std::max(maxWindow, minWindow)), stats(stats)
+    {
+        LogMsg(Logger::Info, "[ReadAhead]: Window up to ", this->maxWindow,
+               " bytes");
+    }
+
+    ~ReadAhead() override
+    {
+        stats.window = 0;
+    }
+
+    void open(Handler&& handler) override
+    {
+        lower->open(std::move(handler));
+    }
+
+    uint64_t size() const override
+    {
+        return lower->size();
+    }
+
+    std::string contentId() const override
+    {
+        return lower->contentId();
+    }
+
+    bool isWritable() const override
+    {
+        return lower->isWritable();
+    }
+
+    void read(uint64_t offset, boost::asio::mutable_buffer buffer,
+              Handler&& handler) override
+    {
+        // Host read is issued first, prefetches queue up behind it
+        lower->read(offset, buffer, std::move(handler));
+        track(offset, buffer.size());
+    }
+
+    bool supportsSplice() const override
+    {
+        return lower->supportsSplice();
+    }
+
+    void splice(uint64_t offset, size_t length, int pipe,
+                Handler&& handler) override
+    {
+        lower->splice(offset, length, pipe, std::move(handler));
+        track(offset, length);
+    }
+
+    void extents(uint64_t offset, uint64_t length,
+                 ExtentsHandler&& handler) override
+    {
+        lower->extents(offset, length, std::move(handler));
+    }
+
+    void prefetch(uint64_t offset, uint64_t length) override
+    {
+        lower->prefetch(offset, length);
+    }
+
+    void write(uint64_t offset, boost::asio::const_buffer buffer,
+               Handler&& handler) override
+    {
+        lower->write(offset, buffer, std::move(handler));
+    }
+
+    void flush(Handler&& handler) override
+    {
+        lower->flush(std::move(handler));
+    }
+
+  private:
+    struct Stream
+    {
+        // End of the last read of the stream
+        uint64_t next = 0;
+        // End of data already requested ahead of the stream
+        uint64_t ahead = 0;
+        uint64_t window = 0;
+        uint64_t lastUse = 0;
+    };
+
+    void track(uint64_t offset, uint64_t length)
+    {
+        tick++;
+        auto it = std::find_if(
+            streams.begin(), streams.end(), [offset](const Stream& s) {
+                return s.lastUse != 0 && offset + minWindow >= s.next &&
+                       offset <= s.next + minWindow;
+            });
+
+        if (it == streams.end())
+        {
+            startStream(offset + length);
+            return;
+        }
+
+        randomReads = 0;
+        Stream& stream = *it;
+        stream.next = offset + length;
+        stream.lastUse = tick;
+
+        // Host consumed half of the window, extend it
+        if (stream.ahead < stream.next + stream.window / 2)
+        {
+            stream.window = stream.window == 0
+                                ? minWindow
+                                : std::min(stream.window * 2, maxWindow);
+            const uint64_t from = std::max(stream.ahead, stream.next);
+            const uint64_t to =
+                std::min(stream.next + stream.window, lower->size());
+            if (from < to)
+            {
+                lower->prefetch(from, to - from);
+            }
+            stream.ahead = std::max(to, stream.ahead);
+        }
+        updateWindow();
+    }
+
+    void startStream(uint64_t next)
+    {
+        for (auto& stream : streams)
+        {
+            stream.window = stream.window / 2 < minWindow ? 0
+                                                          : stream.window / 2;
+        }
+        if (++randomReads >= randomReadsToReset)
+        {
+            for (auto& stream : streams)
+            {
+                stream.window = 0;
+                stream.ahead = 0;
+            }
+            lower->cancelPrefetch();
+        }
+
+        auto lru = std::min_element(
+            streams.begin(), streams.end(),
+            [](const Stream& a, const Stream& b) {
+                return a.lastUse < b.lastUse;
+            });
+        *lru = Stream{next, next, 0, tick};
+        updateWindow();
+    }
+
+    void updateWindow()
+    {
+        stats.window = std::max_element(streams.begin(), streams.end(),
+                                        [](const Stream& a, const Stream& b) {
+                                            return a.window < b.window;
+                                        })
+                           ->window;
+    }
+
+    std::shared_ptr<Backend> lower;
+    uint64_t maxWindow;
+    Statistics::ReadAhead& stats;
+
+    std::array<Stream, maxStreams> streams{};
+    uint64_t tick = 0;
+    unsigned randomReads = 0;
+};
+
+} // namespace nbd
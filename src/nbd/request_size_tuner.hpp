@@ -0,0 +1,149 @@
+#pragma once
+
+#include "logger.hpp"
+#include "nbd/backend.hpp"
+
+#include <array>
+#include <chrono>
+#include <memory>
+
+namespace nbd
+{
+
+// Measures read throughput of a backend for several request sizes and picks
+// the best one. Each size reads its own, not yet read region of the image, so
+// it is not helped by data cached by previous measurements. Regions are read
+// with a few requests in flight, as the kernel NBD client would.
+class RequestSizeTuner :
+    public std::enable_shared_from_this<RequestSizeTuner>
+{
+  public:
+    using ResultHandler = std::function<void(uint32_t)>;
+
+    static constexpr std::array<uint32_t, 4> candidates = {
+        128 * 1024, 256 * 1024, 512 * 1024, 1024 * 1024};
+    // Read for each request size, so requests of the biggest size are also
+    // issued in parallel
+    static constexpr uint64_t regionSize = 4 * 1024 * 1024;
+    static constexpr unsigned depth = 4;
+    // Bigger requests are preferred only when they are noticeably faster
+    static constexpr double margin = 1.05;
+
+    RequestSizeTuner(std::string_view name, std::shared_ptr<Backend> backend) :
+        name(name), backend(std::move(backend)),
+        buffer(new char[regionSize])
+    {
+    }
+
+    // Handler receives the best request size, 0 when it was not measured
+    void run(ResultHandler&& handler)
+    {
+        resultHandler = std::move(handler);
+        // First region only warms up, eg. establishes connections
+        if (backend->size() < (candidates.size() + 1) * regionSize)
+        {
+            LogMsg(Logger::Info, "[RequestSizeTuner]: (", name,
+                   ") Image too small to measure request sizes");
+            resultHandler(0);
+            return;
+        }
+        startRegion(0);
+    }
+
+  private:
+    void startRegion(size_t region)
+    {
+        current = region;
+        // Warm-up uses the smallest size
+        requestSize = candidates[region == 0 ? 0 : region - 1];
+        next = region * regionSize;
+        end = next + regionSize;
+        started = std::chrono::steady_clock::now();
+        issue();
+    }
+
+    void issue()
+    {
+        while (!failed && inFlight < depth && next < end)
+        {
+            const uint64_t offset = next;
+            next += requestSize;
+            inFlight++;
+            backend->read(
+                offset,
+                boost::asio::buffer(buffer.get() + offset % regionSize,
+                                    requestSize),
+                [self = shared_from_this()](std::error_code ec) {
+                    self->inFlight--;
+                    if (ec)
+                    {
+                        LogMsg(Logger::Error, "[RequestSizeTuner]: (",
+                               self->name, ") Read failed: ", ec.message());
+                        self->failed = true;
+                    }
+                    self->completed();
+                });
+        }
+    }
+
+    // Requests are refilled as soon as one completes, as the kernel client
+    // keeps its queue full, rather than waiting for the slowest of them
+    void completed()
+    {
+        if (!failed && next < end)
+        {
+            issue();
+            return;
+        }
+        if (inFlight > 0)
+        {
+            return;
+        }
+        if (failed)
+        {
+            resultHandler(0);
+            return;
+        }
+
+        if (current > 0)
+        {
+            const std::chrono::duration<double> elapsed =
+                std::chrono::steady_clock::now() - started;
+            const double throughput =
+                static_cast<double>(regionSize) /
+                std::max(elapsed.count(), 1e-6);
+            LogMsg(Logger::Info, "[RequestSizeTuner]: (", name, ") ",
+                   requestSize, " bytes requests: ",
+                   static_cast<uint64_t>(throughput / 1024), " KiB/s");
+            if (throughput > bestThroughput * margin)
+            {
+                bestThroughput = throughput;
+                best = requestSize;
+            }
+        }
+        if (current < candidates.size())
+        {
+            startRegion(current + 1);
+            return;
+        }
+        resultHandler(best);
+    }
+
+    std::string name;
+    std::shared_ptr<Backend> backend;
+    std::unique_ptr<char[]> buffer;
+    ResultHandler resultHandler;
+
+    size_t current = 0;
+    uint32_t requestSize = 0;
+    uint64_t next = 0;
+    uint64_t end = 0;
+    unsigned inFlight = 0;
+    bool failed = false;
+    std::chrono::steady_clock::time_point started;
+
+    uint32_t best = 0;
+    double bestThroughput = 0;
+};
+
+} // namespace nbd
@@ -0,0 +1,200 @@
+#include "nbd/resolver.hpp"
+
+#include "logger.hpp"
+
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <boost/asio/steady_timer.hpp>
+
+namespace nbd
+{
+
+std::shared_ptr<Resolver> Resolver::create(boost::asio::io_context& ioc)
+{
+    auto resolver = std::make_shared<Resolver>(ioc);
+    if (!resolver->start())
+    {
+        return nullptr;
+    }
+    return resolver;
+}
+
+Resolver::~Resolver()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    jobAvailable.notify_all();
+    if (worker.joinable())
+    {
+        worker.join();
+    }
+}
+
+bool Resolver::start()
+{
+    int efd = ::eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (efd < 0)
+    {
+        LogMsg(Logger::Error, "[Resolver]: Unable to create eventfd: ",
+               std::error_code(errno, std::generic_category()));
+        return false;
+    }
+    eventSd.assign(efd);
+    worker = std::thread([this]() { work(); });
+    return true;
+}
+
+void Resolver::resolve(const std::string& host, const std::string& port,
+                       Handler&& handler)
+{
+    // Addresses need no name server, they are resolved right away
+    boost::system::error_code ec;
+    boost::asio::ip::tcp::resolver numeric(ioc);
+    const auto results = numeric.resolve(
+        host, port,
+        boost::asio::ip::resolver_base::numeric_host |
+            boost::asio::ip::resolver_base::numeric_service,
+        ec);
+    if (!ec)
+    {
+        handler({}, Endpoints(results.begin(), results.end()));
+        return;
+    }
+
+    auto job = std::make_unique<Job>();
+    job->host = host;
+    job->port = port;
+    job->handler = std::move(handler);
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        jobs.push_back(std::move(job));
+    }
+    jobAvailable.notify_one();
+    inflight++;
+    waitForCompletions();
+}
+
+std::error_code Resolver::resolve(const std::string& host,
+                                  const std::string& port,
+                                  std::chrono::seconds timeout,
+                                  Endpoints& endpoints,
+                                  boost::asio::yield_context yield)
+{
+    // Shared with the handler, which may come after the wait timed out
+    struct Result
+    {
+        bool done = false;
+        std::error_code ec;
+        Endpoints endpoints;
+        boost::asio::steady_timer* waiter = nullptr;
+    };
+    auto result = std::make_shared<Result>();
+
+    boost::asio::steady_timer timer(ioc, timeout);
+    result->waiter = &timer;
+    resolve(host, port,
+            [result](std::error_code ec, Endpoints resolved) {
+                result->done = true;
+                result->ec = ec;
+                result->endpoints = std::move(resolved);
+                if (result->waiter != nullptr)
+                {
+                    result->waiter->cancel();
+                }
+            });
+    if (!result->done)
+    {
+        boost::system::error_code ignored;
+        timer.async_wait(yield[ignored]);
+    }
+    result->waiter = nullptr;
+
+    if (!result->done)
+    {
+        return std::make_error_code(std::errc::timed_out);
+    }
+    endpoints = std::move(result->endpoints);
+    return result->ec;
+}
+
+void Resolver::work()
+{
+    // Thread resolves with an io_context of its own, nothing of asio is
+    // shared with the io_context thread
+    boost::asio::io_context context;
+    boost::asio::ip::tcp::resolver resolver(context);
+
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true)
+    {
+        jobAvailable.wait(lock, [this]() { return stopping || !jobs.empty(); });
+        if (stopping)
+        {
+            return;
+        }
+        auto job = std::move(jobs.front());
+        jobs.pop_front();
+        lock.unlock();
+
+        boost::system::error_code ec;
+        const auto results = resolver.resolve(job->host, job->port, ec);
+        job->ec = ec;
+        job->endpoints.assign(results.begin(), results.end());
+
+        lock.lock();
+        completions.push_back(std::move(job));
+        const uint64_t one = 1;
+        if (::write(eventSd.native_handle(), &one, sizeof(one)) < 0)
+        {
+            LogMsg(Logger::Error, "[Resolver]: Unable to signal eventfd");
+        }
+    }
+}
+
+// The pending wait keeps resolver alive until all names are resolved
+void Resolver::waitForCompletions()
+{
+    if (waiting)
+    {
+        return;
+    }
+    waiting = true;
+    eventSd.async_wait(
+        boost::asio::posix::stream_descriptor::wait_read,
+        [self = shared_from_this()](const boost::system::error_code& ec) {
+            self->waiting = false;
+            if (ec)
+            {
+                return;
+            }
+            self->reap();
+        });
+}
+
+void Resolver::reap()
+{
+    uint64_t counter = 0;
+    while (::read(eventSd.native_handle(), &counter, sizeof(counter)) > 0)
+    {
+    }
+
+    std::vector<std::unique_ptr<Job>> completed;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::swap(completed, completions);
+    }
+    inflight -= static_cast<unsigned>(completed.size());
+    if (inflight > 0)
+    {
+        waitForCompletions();
+    }
+    for (auto& job : completed)
+    {
+        job->handler(job->ec, std::move(job->endpoints));
+    }
+}
+
+} // namespace nbd
@@ -0,0 +1,86 @@
+#pragma once
+
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/posix/stream_descriptor.hpp>
+#include <boost/asio/spawn.hpp>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+namespace nbd
+{
+
+// Resolves host names on a thread of its own. Resolving blocks and
+// asynchronous resolving of asio requires asio threads, which are disabled,
+// so names resolved on the io_context thread would stall every mount point
+// for as long as the name server takes. Handlers are run on the io_context
+// thread, in the order names were resolved.
+//
+// Resolvers are owned by shared_ptr and stay alive until all of the queued
+// names are resolved.
+class Resolver : public std::enable_shared_from_this<Resolver>
+{
+  public:
+    using Endpoints = std::vector<boost::asio::ip::tcp::endpoint>;
+    using Handler = std::function<void(std::error_code, Endpoints)>;
+
+    // Returns nullptr when the resolver thread cannot be notified
+    static std::shared_ptr<Resolver> create(boost::asio::io_context& ioc);
+
+    explicit Resolver(boost::asio::io_context& ioc) : ioc(ioc), eventSd(ioc)
+    {
+    }
+    ~Resolver();
+
+    Resolver(const Resolver&) = delete;
+    Resolver& operator=(const Resolver&) = delete;
+
+    void resolve(const std::string& host, const std::string& port,
+                 Handler&& handler);
+
+    // Waits in the coroutine for the endpoints for at most timeout, fails
+    // with timed_out when the name server did not answer by then
+    std::error_code resolve(const std::string& host, const std::string& port,
+                            std::chrono::seconds timeout,
+                            Endpoints& endpoints,
+                            boost::asio::yield_context yield);
+
+  private:
+    struct Job
+    {
+        std::string host;
+        std::string port;
+        // Touched by the io_context thread only
+        Handler handler;
+        std::error_code ec;
+        Endpoints endpoints;
+    };
+
+    bool start();
+    void work();
+    void waitForCompletions();
+    void reap();
+
+    boost::asio::io_context& ioc;
+    boost::asio::posix::stream_descriptor eventSd;
+    std::thread worker;
+
+    std::mutex mutex;
+    std::condition_variable jobAvailable;
+    std::deque<std::unique_ptr<Job>> jobs;
+    std::vector<std::unique_ptr<Job>> completions;
+    bool stopping = false;
+
+    unsigned inflight = 0;
+    bool waiting = false;
+};
+
+} // namespace nbd
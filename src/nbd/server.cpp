@@ -0,0 +1,1392 @@
+#include "nbd/server.hpp"
+
+#include "logger.hpp"
+#include "nbd/protocol.hpp"
+#include "nbd/request_size_tuner.hpp"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <boost/asio/local/connect_pair.hpp>
+#include <boost/asio/posix/stream_descriptor.hpp>
+#include <boost/asio/read.hpp>
+#include <boost/asio/spawn.hpp>
+#include <boost/asio/write.hpp>
+#include <cstring>
+#include <deque>
+#include <vector>
+
+namespace nbd
+{
+
+namespace
+{
+
+// Upper bound for option payload, anything bigger is considered malicious
+constexpr uint32_t maxOptionLength = 64 * 1024;
+// Advertised to clients, requests of any alignment are served
+constexpr uint32_t preferredBlockSize = 4096;
+// Requested size of the pipes carrying spliced read data, the kernel may grant
+// less to unprivileged processes
+constexpr int splicePipeSize = 1024 * 1024;
+// Spliced reads in flight on a connection, each fills a pipe of its own
+constexpr unsigned maxSplicePipes = 16;
+// Only metadata context served, describing holes and zeroes of the image
+constexpr std::string_view allocationContext = "base:allocation";
+constexpr uint32_t allocationContextId = 1;
+
+// Source of zero payloads of simple replies to reads of empty regions
+std::array<char, 64 * 1024> zeroBlock{};
+
+uint32_t toNbdError(const std::error_code& ec)
+{
+    if (!ec)
+    {
+        return proto::errNone;
+    }
+    if (ec == std::errc::operation_not_permitted ||
+        ec == std::errc::permission_denied ||
+        ec == std::errc::read_only_file_system)
+    {
+        return proto::errPerm;
+    }
+    if (ec == std::errc::not_enough_memory)
+    {
+        return proto::errNoMem;
+    }
+    if (ec == std::errc::invalid_argument)
+    {
+        return proto::errInval;
+    }
+    if (ec == std::errc::no_space_on_device ||
+        ec == std::errc::file_too_large)
+    {
+        return proto::errNoSpc;
+    }
+    if (ec == std::errc::value_too_large)
+    {
+        return proto::errOverflow;
+    }
+    if (ec == std::errc::not_supported ||
+        ec == std::errc::operation_not_supported)
+    {
+        return proto::errNotSup;
+    }
+    return proto::errIo;
+}
+
+uint16_t transmissionFlags(const Backend& backend)
+{
+    // Connections share the backend, flush on any of them covers writes
+    // completed on all
+    uint16_t flags = proto::flagHasFlags | proto::flagCanMultiConn;
+    if (backend.isWritable())
+    {
+        flags |= proto::flagSendFlush | proto::flagSendFua;
+    }
+    else
+    {
+        flags |= proto::flagReadOnly;
+    }
+    return flags;
+}
+
+} // namespace
+
+class Connection : public std::enable_shared_from_this<Connection>
+{
+  public:
+    using Socket = boost::asio::local::stream_protocol::socket;
+
+    Connection(std::string_view name, Socket&& socket,
+               std::shared_ptr<Backend> backend, uint32_t maxRequestLength) :
+        name(name),
+        socket(std::move(socket)), backend(std::move(backend)),
+        maxRequestLength(maxRequestLength),
+        spliceEnabled(this->backend->supportsSplice())
+    {
+    }
+
+    // Negotiated connections start in transmission phase
+    void start(bool negotiated = false)
+    {
+        boost::asio::spawn(socket.get_executor(),
+                           [this, self = shared_from_this(), negotiated](
+                               boost::asio::yield_context yield) {
+                               if (negotiated || handshake(yield))
+                               {
+                                   LogMsg(Logger::Debug, "[NbdServer]: (",
+                                          name,
+                                          ") Entering transmission phase");
+                                   transmission(yield);
+                               }
+                               LogMsg(Logger::Debug, "[NbdServer]: (", name,
+                                      ") Connection closed");
+                               close();
+                           });
+    }
+
+    void close()
+    {
+        boost::system::error_code ignored;
+        socket.close(ignored);
+    }
+
+  private:
+    // Carries data of a spliced reply from backend to the socket
+    struct Pipe
+    {
+        explicit Pipe(const Socket::executor_type& executor) :
+            in(executor), out(executor)
+        {
+        }
+
+        // Write and read end
+        boost::asio::posix::stream_descriptor in;
+        boost::asio::posix::stream_descriptor out;
+        // Bytes the pipe is able to hold at once
+        uint32_t chunk = 0;
+    };
+
+    struct Reply
+    {
+        enum class Payload
+        {
+            none,
+            // Data of the image at offset, in data unless spliced
+            data,
+            // Zeroes, a hole chunk when structured replies are negotiated
+            zero,
+            // Block status descriptors in data
+            blockStatus
+        };
+
+        explicit Reply(uint64_t handle, Payload payload = Payload::none,
+                       uint32_t length = 0, uint64_t offset = 0) :
+            handle(handle),
+            payload(payload), length(length), offset(offset)
+        {
+        }
+
+        void setError(const std::error_code& ec)
+        {
+            error = toNbdError(ec);
+            if (ec)
+            {
+                // Errors carry no payload
+                payload = Payload::none;
+                length = 0;
+            }
+        }
+
+        uint64_t handle;
+        uint32_t error = proto::errNone;
+        Payload payload;
+        std::unique_ptr<char[]> data;
+        uint32_t length;
+        uint64_t offset;
+        // Data is moved from backend straight to the socket, through the pipe
+        // holding the first chunk once the reply is queued
+        bool spliced = false;
+        std::unique_ptr<Pipe> pipe;
+        uint32_t spliceLength = 0;
+        // Encoded right before the reply is sent
+        std::array<char, 32> header{};
+        size_t headerLength = 0;
+    };
+
+    uint16_t transmissionFlags() const
+    {
+        uint16_t flags = nbd::transmissionFlags(*backend);
+        if (structured)
+        {
+            // Reads are always answered by a single chunk
+            flags |= proto::flagSendDf;
+        }
+        return flags;
+    }
+
+    bool sendOptionReply(uint32_t option, uint32_t type,
+                         boost::asio::const_buffer data,
+                         boost::asio::yield_context yield)
+    {
+        proto::OptionReplyHeader header;
+        header.magic = proto::optionReplyMagic;
+        header.option = option;
+        header.type = type;
+        header.length = static_cast<uint32_t>(data.size());
+
+        boost::system::error_code ec;
+        const std::array<boost::asio::const_buffer, 2> buffers = {
+            boost::asio::buffer(&header, sizeof(header)), data};
+        boost::asio::async_write(socket, buffers, yield[ec]);
+        if (ec)
+        {
+            LogMsg(Logger::Error, "[NbdServer]: (", name,
+                   ") Unable to send option reply: ", ec);
+            return false;
+        }
+        return true;
+    }
+
+    bool sendOptionReply(uint32_t option, uint32_t type,
+                         boost::asio::yield_context yield)
+    {
+        return sendOptionReply(option, type, boost::asio::const_buffer(),
+                               yield);
+    }
+
+    // Handles NBD_OPT_INFO and NBD_OPT_GO, returns false when connection
+    // shall be dropped. Valid is set when the export was described, only
+    // then NBD_OPT_GO ends the handshake.
+    bool handleInfo(uint32_t option, const std::vector<char>& data,
+                    bool& valid, boost::asio::yield_context yield)
+    {
+        valid = false;
+        // Payload: 32 bit name length, name, 16 bit number of info requests
+        // followed by the requests themselves
+        if (data.size() < sizeof(uint32_t) + sizeof(uint16_t))
+        {
+            return sendOptionReply(option, proto::repErrInvalid, yield);
+        }
+        proto::big_uint32_buf_t nameLength;
+        std::memcpy(&nameLength, data.data(), sizeof(nameLength));
+        const size_t requestsOffset =
+            sizeof(uint32_t) + static_cast<size_t>(nameLength.value());
+        if (data.size() < requestsOffset + sizeof(uint16_t))
+        {
+            return sendOptionReply(option, proto::repErrInvalid, yield);
+        }
+        proto::big_uint16_buf_t requests;
+        std::memcpy(&requests, data.data() + requestsOffset, sizeof(requests));
+        if (data.size() != requestsOffset + sizeof(uint16_t) +
+                               requests.value() * sizeof(uint16_t))
+        {
+            return sendOptionReply(option, proto::repErrInvalid, yield);
+        }
+
+        bool blockSizeRequested = false;
+        for (uint16_t i = 0; i < requests.value(); i++)
+        {
+            proto::big_uint16_buf_t request;
+            std::memcpy(&request,
+                        data.data() + requestsOffset + sizeof(uint16_t) +
+                            i * sizeof(uint16_t),
+                        sizeof(request));
+            blockSizeRequested =
+                blockSizeRequested || request.value() == proto::infoBlockSize;
+        }
+        if (blockSizeRequested)
+        {
+            proto::InfoBlockSize blockSize;
+            blockSize.type = proto::infoBlockSize;
+            blockSize.minimum = 1;
+            blockSize.preferred = preferredBlockSize;
+            blockSize.maximum = maxRequestLength;
+            if (!sendOptionReply(
+                    option, proto::repInfo,
+                    boost::asio::buffer(&blockSize, sizeof(blockSize)), yield))
+            {
+                return false;
+            }
+        }
+
+        proto::InfoExport info;
+        info.type = proto::infoExport;
+        info.size = backend->size();
+        info.flags = transmissionFlags();
+        if (!sendOptionReply(option, proto::repInfo,
+                             boost::asio::buffer(&info, sizeof(info)), yield))
+        {
+            return false;
+        }
+        valid = true;
+        return sendOptionReply(option, proto::repAck, yield);
+    }
+
+    // Handles NBD_OPT_LIST_META_CONTEXT and NBD_OPT_SET_META_CONTEXT, returns
+    // false when connection shall be dropped
+    bool handleMetaContext(uint32_t option, const std::vector<char>& data,
+                           boost::asio::yield_context yield)
+    {
+        if (option == proto::optSetMetaContext && !structured)
+        {
+            return sendOptionReply(option, proto::repErrInvalid, yield);
+        }
+
+        // Payload: 32 bit name length, name, 32 bit number of queries, each
+        // being 32 bit length followed by the query string
+        size_t position = 0;
+        const auto take = [&data, &position](size_t length) -> const char* {
+            if (data.size() - position < length)
+            {
+                return nullptr;
+            }
+            position += length;
+            return data.data() + position - length;
+        };
+        const auto takeLength = [&take](uint32_t& value) {
+            proto::big_uint32_buf_t field;
+            const char* bytes = take(sizeof(field));
+            if (bytes == nullptr)
+            {
+                return false;
+            }
+            std::memcpy(&field, bytes, sizeof(field));
+            value = field.value();
+            return true;
+        };
+
+        uint32_t nameLength = 0;
+        uint32_t queries = 0;
+        if (!takeLength(nameLength) || take(nameLength) == nullptr ||
+            !takeLength(queries))
+        {
+            return sendOptionReply(option, proto::repErrInvalid, yield);
+        }
+        // Listing without queries asks for all contexts
+        bool selected = option == proto::optListMetaContext && queries == 0;
+        for (uint32_t i = 0; i < queries; i++)
+        {
+            uint32_t queryLength = 0;
+            const char* query = nullptr;
+            if (!takeLength(queryLength) ||
+                (query = take(queryLength)) == nullptr)
+            {
+                return sendOptionReply(option, proto::repErrInvalid, yield);
+            }
+            const std::string_view text(query, queryLength);
+            selected = selected || text == allocationContext ||
+                       (option == proto::optListMetaContext && text == "base:");
+        }
+        if (position != data.size())
+        {
+            return sendOptionReply(option, proto::repErrInvalid, yield);
+        }
+
+        if (option == proto::optSetMetaContext)
+        {
+            allocationSelected = selected;
+        }
+        if (selected)
+        {
+            std::vector<char> context(sizeof(uint32_t) +
+                                      allocationContext.size());
+            const proto::big_uint32_buf_t id{
+                option == proto::optSetMetaContext ? allocationContextId : 0};
+            std::memcpy(context.data(), &id, sizeof(id));
+            std::memcpy(context.data() + sizeof(id), allocationContext.data(),
+                        allocationContext.size());
+            if (!sendOptionReply(option, proto::repMetaContext,
+                                 boost::asio::buffer(context), yield))
+            {
+                return false;
+            }
+        }
+        return sendOptionReply(option, proto::repAck, yield);
+    }
+
+    bool handshake(boost::asio::yield_context yield)
+    {
+        boost::system::error_code ec;
+
+        proto::ServerGreeting greeting;
+        greeting.magic = proto::nbdMagic;
+        greeting.optionMagic = proto::optionMagic;
+        greeting.handshakeFlags =
+            proto::flagFixedNewstyle | proto::flagNoZeroes;
+        boost::asio::async_write(
+            socket, boost::asio::buffer(&greeting, sizeof(greeting)),
+            yield[ec]);
+        if (ec)
+        {
+            return false;
+        }
+
+        proto::big_uint32_buf_t clientFlags;
+        boost::asio::async_read(
+            socket, boost::asio::buffer(&clientFlags, sizeof(clientFlags)),
+            yield[ec]);
+        if (ec)
+        {
+            return false;
+        }
+        constexpr uint32_t knownFlags =
+            proto::clientFlagFixedNewstyle | proto::clientFlagNoZeroes;
+        if ((clientFlags.value() & ~knownFlags) != 0)
+        {
+            LogMsg(Logger::Error, "[NbdServer]: (", name,
+                   ") Unknown client flags: ", clientFlags.value());
+            return false;
+        }
+        const bool noZeroes =
+            (clientFlags.value() & proto::clientFlagNoZeroes) != 0;
+
+        while (true)
+        {
+            proto::OptionHeader header;
+            boost::asio::async_read(
+                socket, boost::asio::buffer(&header, sizeof(header)),
+                yield[ec]);
+            if (ec)
+            {
+                return false;
+            }
+            if (header.magic.value() != proto::optionMagic ||
+                header.length.value() > maxOptionLength)
+            {
+                LogMsg(Logger::Error, "[NbdServer]: (", name,
+                       ") Malformed option received");
+                return false;
+            }
+
+            std::vector<char> data(header.length.value());
+            boost::asio::async_read(socket, boost::asio::buffer(data),
+                                    yield[ec]);
+            if (ec)
+            {
+                return false;
+            }
+
+            const uint32_t option = header.option.value();
+            LogMsg(Logger::Debug, "[NbdServer]: (", name, ") Option ", option);
+            switch (option)
+            {
+                case proto::optExportName:
+                {
+                    proto::ExportNameReply reply;
+                    reply.size = backend->size();
+                    reply.flags = transmissionFlags();
+                    const std::array<char, 124> zeroes = {};
+                    std::vector<boost::asio::const_buffer> buffers = {
+                        boost::asio::buffer(&reply, sizeof(reply))};
+                    if (!noZeroes)
+                    {
+                        buffers.push_back(boost::asio::buffer(zeroes));
+                    }
+                    boost::asio::async_write(socket, buffers, yield[ec]);
+                    return !ec;
+                }
+                case proto::optGo:
+                case proto::optInfo:
+                {
+                    bool valid = false;
+                    if (!handleInfo(option, data, valid, yield))
+                    {
+                        return false;
+                    }
+                    if (valid && option == proto::optGo)
+                    {
+                        return true;
+                    }
+                    break;
+                }
+                case proto::optStructuredReply:
+                    if (!data.empty())
+                    {
+                        if (!sendOptionReply(option, proto::repErrInvalid,
+                                             yield))
+                        {
+                            return false;
+                        }
+                        break;
+                    }
+                    structured = true;
+                    if (!sendOptionReply(option, proto::repAck, yield))
+                    {
+                        return false;
+                    }
+                    break;
+                case proto::optListMetaContext:
+                case proto::optSetMetaContext:
+                    if (!handleMetaContext(option, data, yield))
+                    {
+                        return false;
+                    }
+                    break;
+                case proto::optAbort:
+                    sendOptionReply(option, proto::repAck, yield);
+                    return false;
+                case proto::optList:
+                {
+                    // Single, unnamed export
+                    const proto::big_uint32_buf_t nameLength{0};
+                    if (!sendOptionReply(
+                            option, proto::repServer,
+                            boost::asio::buffer(&nameLength,
+                                                sizeof(nameLength)),
+                            yield) ||
+                        !sendOptionReply(option, proto::repAck, yield))
+                    {
+                        return false;
+                    }
+                    break;
+                }
+                default:
+                    if (!sendOptionReply(option, proto::repErrUnsup, yield))
+                    {
+                        return false;
+                    }
+                    break;
+            }
+        }
+    }
+
+    bool inBounds(uint64_t offset, uint32_t length) const
+    {
+        const uint64_t size = backend->size();
+        return offset <= size && length <= size - offset;
+    }
+
+    void transmission(boost::asio::yield_context yield)
+    {
+        boost::system::error_code ec;
+        while (true)
+        {
+            proto::Request request;
+            boost::asio::async_read(
+                socket, boost::asio::buffer(&request, sizeof(request)),
+                yield[ec]);
+            if (ec)
+            {
+                if (ec != boost::asio::error::eof &&
+                    ec != boost::asio::error::operation_aborted)
+                {
+                    LogMsg(Logger::Error, "[NbdServer]: (", name,
+                           ") Read error: ", ec);
+                }
+                return;
+            }
+            if (request.magic.value() != proto::requestMagic)
+            {
+                LogMsg(Logger::Error, "[NbdServer]: (", name,
+                       ") Invalid request magic");
+                return;
+            }
+
+            const uint16_t flags = request.flags.value();
+            const uint64_t handle = request.handle.value();
+            const uint64_t offset = request.offset.value();
+            const uint32_t length = request.length.value();
+
+            switch (request.type.value())
+            {
+                case proto::cmdRead:
+                {
+                    if (!inBounds(offset, length))
+                    {
+                        auto reply = std::make_shared<Reply>(handle);
+                        reply->setError(
+                            std::make_error_code(std::errc::invalid_argument));
+                        send(std::move(reply));
+                        break;
+                    }
+                    // Longer than advertised in NBD_INFO_BLOCK_SIZE, overflow
+                    // is only known to clients of structured replies
+                    if (length > maxRequestLength)
+                    {
+                        auto reply = std::make_shared<Reply>(handle);
+                        reply->setError(std::make_error_code(
+                            structured ? std::errc::value_too_large
+                                       : std::errc::invalid_argument));
+                        send(std::move(reply));
+                        break;
+                    }
+                    if (length == 0)
+                    {
+                        send(std::make_shared<Reply>(handle));
+                        break;
+                    }
+                    // Regions known to read as zeroes are not read at all
+                    backend->extents(
+                        offset, length,
+                        [self = shared_from_this(), handle, offset,
+                         length](const std::error_code& ec,
+                                 const std::vector<Extent>& extents) {
+                            if (!ec && !extents.empty() &&
+                                extents.front().zero &&
+                                extents.front().length >= length)
+                            {
+                                self->send(std::make_shared<Reply>(
+                                    handle, Reply::Payload::zero, length,
+                                    offset));
+                                return;
+                            }
+                            self->read(handle, offset, length);
+                        });
+                    break;
+                }
+                case proto::cmdWrite:
+                {
+                    if (length > proto::maxRequestLength)
+                    {
+                        LogMsg(Logger::Error, "[NbdServer]: (", name,
+                               ") Write request too big: ", length);
+                        return;
+                    }
+                    auto payload = std::shared_ptr<char[]>(new char[length]);
+                    boost::asio::async_read(
+                        socket, boost::asio::buffer(payload.get(), length),
+                        yield[ec]);
+                    if (ec)
+                    {
+                        return;
+                    }
+
+                    auto reply = std::make_shared<Reply>(handle);
+                    // Payloads longer than advertised but within protocol
+                    // limit are refused without dropping the connection
+                    if (length > maxRequestLength)
+                    {
+                        reply->setError(
+                            std::make_error_code(std::errc::invalid_argument));
+                        send(std::move(reply));
+                        break;
+                    }
+                    if (!backend->isWritable())
+                    {
+                        reply->setError(std::make_error_code(
+                            std::errc::operation_not_permitted));
+                        send(std::move(reply));
+                        break;
+                    }
+                    if (!inBounds(offset, length))
+                    {
+                        reply->setError(std::make_error_code(
+                            std::errc::no_space_on_device));
+                        send(std::move(reply));
+                        break;
+                    }
+                    const bool fua = (flags & proto::cmdFlagFua) != 0;
+                    backend->write(
+                        offset, boost::asio::buffer(payload.get(), length),
+                        [self = shared_from_this(), reply, payload,
+                         fua](const std::error_code& ec) {
+                            if (ec || !fua)
+                            {
+                                reply->setError(ec);
+                                self->send(reply);
+                                return;
+                            }
+                            self->backend->flush(
+                                [self, reply](const std::error_code& ec) {
+                                    reply->setError(ec);
+                                    self->send(reply);
+                                });
+                        });
+                    break;
+                }
+                case proto::cmdFlush:
+                {
+                    auto reply = std::make_shared<Reply>(handle);
+                    backend->flush([self = shared_from_this(),
+                                    reply](const std::error_code& ec) {
+                        reply->setError(ec);
+                        self->send(reply);
+                    });
+                    break;
+                }
+                case proto::cmdBlockStatus:
+                {
+                    if (!allocationSelected || length == 0 ||
+                        !inBounds(offset, length))
+                    {
+                        auto reply = std::make_shared<Reply>(handle);
+                        reply->setError(
+                            std::make_error_code(std::errc::invalid_argument));
+                        send(std::move(reply));
+                        break;
+                    }
+                    const bool one = (flags & proto::cmdFlagReqOne) != 0;
+                    backend->extents(
+                        offset, length,
+                        [self = shared_from_this(), handle, length,
+                         one](const std::error_code& ec,
+                              const std::vector<Extent>& extents) {
+                            self->send(self->blockStatus(handle, length, ec,
+                                                         extents, one));
+                        });
+                    break;
+                }
+                case proto::cmdDisc:
+                    LogMsg(Logger::Info, "[NbdServer]: (", name,
+                           ") Client disconnected");
+                    return;
+                default:
+                {
+                    auto reply = std::make_shared<Reply>(handle);
+                    reply->setError(
+                        std::make_error_code(std::errc::invalid_argument));
+                    send(std::move(reply));
+                    break;
+                }
+            }
+        }
+    }
+
+    void read(uint64_t handle, uint64_t offset, uint32_t length)
+    {
+        auto reply = std::make_shared<Reply>(handle, Reply::Payload::data,
+                                             length, offset);
+        if (spliceEnabled)
+        {
+            reply->spliced = true;
+            awaitingPipe.push_back(std::move(reply));
+            startSplices();
+            return;
+        }
+        readBuffered(reply);
+    }
+
+    std::shared_ptr<Reply> blockStatus(uint64_t handle, uint32_t length,
+                                       const std::error_code& ec,
+                                       const std::vector<Extent>& extents,
+                                       bool one)
+    {
+        auto reply = std::make_shared<Reply>(handle);
+        if (ec || extents.empty())
+        {
+            reply->setError(ec ? ec
+                               : std::make_error_code(std::errc::io_error));
+            return reply;
+        }
+
+        // Descriptors end at the end of the request at most
+        std::vector<proto::BlockDescriptor> descriptors;
+        uint64_t covered = 0;
+        for (const Extent& extent : extents)
+        {
+            if (covered >= length || (one && !descriptors.empty()))
+            {
+                break;
+            }
+            proto::BlockDescriptor descriptor;
+            const auto described = static_cast<uint32_t>(
+                std::min<uint64_t>(extent.length, length - covered));
+            descriptor.length = described;
+            descriptor.flags =
+                extent.zero ? proto::stateHole | proto::stateZero : 0;
+            descriptors.push_back(descriptor);
+            covered += described;
+        }
+
+        reply->payload = Reply::Payload::blockStatus;
+        reply->length = static_cast<uint32_t>(descriptors.size() *
+                                              sizeof(proto::BlockDescriptor));
+        reply->data.reset(new char[reply->length]);
+        std::memcpy(reply->data.get(), descriptors.data(), reply->length);
+        return reply;
+    }
+
+    // Header of the reply, structured replies describe their payload in it
+    void encode(Reply& reply) const
+    {
+        reply.headerLength = 0;
+        const auto put = [&reply](const auto& field) {
+            std::memcpy(reply.header.data() + reply.headerLength, &field,
+                        sizeof(field));
+            reply.headerLength += sizeof(field);
+        };
+
+        if (!structured)
+        {
+            proto::SimpleReply simple;
+            simple.magic = proto::simpleReplyMagic;
+            simple.error = reply.error;
+            simple.handle = reply.handle;
+            put(simple);
+            return;
+        }
+
+        proto::StructuredReply chunk;
+        chunk.magic = proto::structuredReplyMagic;
+        chunk.flags = proto::replyFlagDone;
+        chunk.handle = reply.handle;
+        if (reply.error != proto::errNone)
+        {
+            // Error without message
+            chunk.type = proto::replyError;
+            chunk.length = sizeof(uint32_t) + sizeof(uint16_t);
+            put(chunk);
+            put(proto::big_uint32_buf_t{reply.error});
+            put(proto::big_uint16_buf_t{0});
+            return;
+        }
+        switch (reply.payload)
+        {
+            case Reply::Payload::none:
+                chunk.type = proto::replyNone;
+                chunk.length = 0;
+                put(chunk);
+                break;
+            case Reply::Payload::data:
+                chunk.type = proto::replyOffsetData;
+                chunk.length = sizeof(uint64_t) + reply.length;
+                put(chunk);
+                put(proto::big_uint64_buf_t{reply.offset});
+                break;
+            case Reply::Payload::zero:
+                chunk.type = proto::replyOffsetHole;
+                chunk.length = sizeof(uint64_t) + sizeof(uint32_t);
+                put(chunk);
+                put(proto::big_uint64_buf_t{reply.offset});
+                put(proto::big_uint32_buf_t{reply.length});
+                break;
+            case Reply::Payload::blockStatus:
+                chunk.type = proto::replyBlockStatus;
+                chunk.length = sizeof(uint32_t) + reply.length;
+                put(chunk);
+                put(proto::big_uint32_buf_t{allocationContextId});
+                break;
+        }
+    }
+
+    // Replies may complete out of order, they are queued to never interleave
+    // on the socket
+    void send(std::shared_ptr<Reply> reply)
+    {
+        replies.push_back(std::move(reply));
+        if (replies.size() == 1)
+        {
+            writeNext();
+        }
+    }
+
+    void writeNext()
+    {
+        const std::shared_ptr<Reply> reply = replies.front();
+        encode(*reply);
+        if (reply->spliced)
+        {
+            // First chunk is in the pipe already
+            boost::asio::async_write(
+                socket,
+                boost::asio::buffer(reply->header.data(), reply->headerLength),
+                [self = shared_from_this(),
+                 reply](const boost::system::error_code& ec, size_t) {
+                    if (ec)
+                    {
+                        self->written(ec);
+                        return;
+                    }
+                    self->drainPipe(reply, 0, reply->spliceLength);
+                });
+            return;
+        }
+
+        std::vector<boost::asio::const_buffer> buffers = {
+            boost::asio::buffer(reply->header.data(), reply->headerLength)};
+        if (reply->payload == Reply::Payload::data ||
+            reply->payload == Reply::Payload::blockStatus)
+        {
+            buffers.push_back(
+                boost::asio::buffer(reply->data.get(), reply->length));
+        }
+        else if (reply->payload == Reply::Payload::zero && !structured)
+        {
+            for (uint32_t left = reply->length; left > 0;)
+            {
+                const auto part = std::min<uint32_t>(left, zeroBlock.size());
+                buffers.push_back(boost::asio::buffer(zeroBlock.data(), part));
+                left -= part;
+            }
+        }
+        boost::asio::async_write(
+            socket, buffers,
+            [self = shared_from_this()](const boost::system::error_code& ec,
+                                        size_t) { self->written(ec); });
+    }
+
+    void written(const boost::system::error_code& ec)
+    {
+        if (ec)
+        {
+            LogMsg(Logger::Error, "[NbdServer]: (", name,
+                   ") Write error: ", ec);
+            replies.clear();
+            awaitingPipe.clear();
+            close();
+            return;
+        }
+        replies.pop_front();
+        if (!replies.empty())
+        {
+            writeNext();
+        }
+    }
+
+    // Turns spliced reply into an ordinary one, when splicing is unavailable
+    void readBuffered(const std::shared_ptr<Reply>& reply)
+    {
+        reply->spliced = false;
+        reply->data.reset(new char[reply->length]);
+        backend->read(reply->offset,
+                      boost::asio::buffer(reply->data.get(), reply->length),
+                      [self = shared_from_this(),
+                       reply](const std::error_code& ec) {
+                          reply->setError(ec);
+                          self->send(reply);
+                      });
+    }
+
+    // Backend fills pipes of spliced replies concurrently, a reply is queued
+    // for the socket once its first chunk is in its pipe. Replies wait for a
+    // pipe when all of them are in use.
+    void startSplices()
+    {
+        while (!awaitingPipe.empty())
+        {
+            std::unique_ptr<Pipe> pipe = takePipe();
+            if (!pipe && spliceEnabled)
+            {
+                return;
+            }
+            std::shared_ptr<Reply> reply = std::move(awaitingPipe.front());
+            awaitingPipe.pop_front();
+            if (!pipe)
+            {
+                readBuffered(reply);
+                continue;
+            }
+            reply->pipe = std::move(pipe);
+            reply->spliceLength = std::min(reply->length, reply->pipe->chunk);
+            backend->splice(reply->offset, reply->spliceLength,
+                            reply->pipe->in.native_handle(),
+                            [self = shared_from_this(),
+                             reply](const std::error_code& ec) {
+                                if (ec)
+                                {
+                                    self->spliceFailed(reply, 0, ec);
+                                    return;
+                                }
+                                self->send(reply);
+                            });
+        }
+    }
+
+    std::unique_ptr<Pipe> takePipe()
+    {
+        if (!idlePipes.empty())
+        {
+            std::unique_ptr<Pipe> pipe = std::move(idlePipes.back());
+            idlePipes.pop_back();
+            return pipe;
+        }
+        if (!spliceEnabled || openPipes >= maxSplicePipes)
+        {
+            return nullptr;
+        }
+
+        std::array<int, 2> fds{};
+        if (::pipe2(fds.data(), O_CLOEXEC) != 0)
+        {
+            LogMsg(Logger::Error, "[NbdServer]: (", name,
+                   ") Unable to create pipe: ", std::strerror(errno));
+            // Replies already spliced keep their pipes
+            spliceEnabled = openPipes > 0;
+            return nullptr;
+        }
+        auto pipe = std::make_unique<Pipe>(socket.get_executor());
+        pipe->out.assign(fds[0]);
+        pipe->in.assign(fds[1]);
+        // Splicing into the socket shall not block the event loop
+        boost::system::error_code ignored;
+        socket.non_blocking(true, ignored);
+
+        int size = ::fcntl(fds[1], F_SETPIPE_SZ, splicePipeSize);
+        if (size < 0)
+        {
+            size = ::fcntl(fds[1], F_GETPIPE_SZ);
+        }
+        // Data at unaligned offset takes one more page of the pipe
+        const long pageSize = ::sysconf(_SC_PAGESIZE);
+        pipe->chunk = static_cast<uint32_t>(
+            std::max(static_cast<long>(size) - pageSize, pageSize));
+        if (openPipes == 0)
+        {
+            LogMsg(Logger::Debug, "[NbdServer]: (", name,
+                   ") Splicing reads in chunks of ", pipe->chunk, " bytes");
+        }
+        openPipes++;
+        return pipe;
+    }
+
+    // Pipe is reused unless it may hold data of a failed splice
+    void releasePipe(const std::shared_ptr<Reply>& reply, bool reuse)
+    {
+        if (!reply->pipe)
+        {
+            return;
+        }
+        if (reuse)
+        {
+            idlePipes.push_back(std::move(reply->pipe));
+        }
+        else
+        {
+            reply->pipe = nullptr;
+            openPipes--;
+        }
+        startSplices();
+    }
+
+    // Chunks following the first one are spliced in the turn of the reply,
+    // after the previous chunk was sent
+    void spliceChunk(const std::shared_ptr<Reply>& reply, uint32_t sent)
+    {
+        const uint32_t chunk =
+            std::min(reply->length - sent, reply->pipe->chunk);
+        backend->splice(reply->offset + sent, chunk,
+                        reply->pipe->in.native_handle(),
+                        [self = shared_from_this(), reply, sent,
+                         chunk](const std::error_code& ec) {
+                            if (ec)
+                            {
+                                self->spliceFailed(reply, sent, ec);
+                                return;
+                            }
+                            self->drainPipe(reply, sent, chunk);
+                        });
+    }
+
+    void spliceFailed(const std::shared_ptr<Reply>& reply, uint32_t sent,
+                      const std::error_code& ec)
+    {
+        if (sent > 0)
+        {
+            LogMsg(Logger::Error, "[NbdServer]: (", name,
+                   ") Splice failed after header was sent: ", ec.message());
+            awaitingPipe.clear();
+            replies.clear();
+            close();
+            return;
+        }
+        if (ec == std::errc::operation_not_supported ||
+            ec == std::errc::invalid_argument)
+        {
+            if (spliceEnabled)
+            {
+                LogMsg(Logger::Info, "[NbdServer]: (", name,
+                       ") Splice unavailable, reads are copied: ",
+                       ec.message());
+                spliceEnabled = false;
+                openPipes -= static_cast<unsigned>(idlePipes.size());
+                idlePipes.clear();
+            }
+            // Replies waiting for the pipe are read buffered
+            releasePipe(reply, false);
+            readBuffered(reply);
+            return;
+        }
+        // Pipe may hold part of the chunk
+        releasePipe(reply, false);
+        reply->spliced = false;
+        reply->setError(ec);
+        send(reply);
+    }
+
+    void drainPipe(const std::shared_ptr<Reply>& reply, uint32_t sent,
+                   uint32_t pending)
+    {
+        while (pending > 0)
+        {
+            const ssize_t moved =
+                ::splice(reply->pipe->out.native_handle(), nullptr,
+                         socket.native_handle(), nullptr, pending,
+                         SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (moved < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                if (errno == EAGAIN)
+                {
+                    socket.async_wait(
+                        Socket::wait_write,
+                        [self = shared_from_this(), reply, sent,
+                         pending](const boost::system::error_code& ec) {
+                            if (ec)
+                            {
+                                self->written(ec);
+                                return;
+                            }
+                            self->drainPipe(reply, sent, pending);
+                        });
+                    return;
+                }
+                const boost::system::error_code ec(
+                    errno, boost::system::system_category());
+                releasePipe(reply, false);
+                written(ec);
+                return;
+            }
+            sent += static_cast<uint32_t>(moved);
+            pending -= static_cast<uint32_t>(moved);
+        }
+
+        if (sent < reply->length)
+        {
+            spliceChunk(reply, sent);
+            return;
+        }
+        releasePipe(reply, true);
+        written({});
+    }
+
+    std::string name;
+    Socket socket;
+    std::shared_ptr<Backend> backend;
+    uint32_t maxRequestLength;
+    std::deque<std::shared_ptr<Reply>> replies;
+    bool spliceEnabled;
+    bool structured = false;
+    // Client selected base:allocation context for block status queries
+    bool allocationSelected = false;
+    // Spliced replies waiting for a pipe, pipes not used by any reply and
+    // count of pipes open
+    std::deque<std::shared_ptr<Reply>> awaitingPipe;
+    std::vector<std::unique_ptr<Pipe>> idlePipes;
+    unsigned openPipes = 0;
+};
+
+Server::Server(boost::asio::io_context& ioc, std::string_view name,
+               std::shared_ptr<Backend> backend) :
+    ioc(ioc),
+    name(name), backend(std::move(backend)), acceptor(ioc),
+    maxRequestLength(proto::maxRequestLength)
+{
+}
+
+void Server::setMaxRequestLength(uint32_t length)
+{
+    maxRequestLength = std::clamp(length, preferredBlockSize,
+                                  proto::maxRequestLength);
+}
+
+void Server::autotune(std::shared_ptr<Backend> probe)
+{
+    tuneProbe = std::move(probe);
+}
+
+Server::~Server()
+{
+    stop();
+}
+
+bool Server::listen(Acceptor& acceptor, std::string_view name,
+                    const std::filesystem::path& path)
+{
+    std::error_code ec;
+    // Cleanup of previous socket
+    std::filesystem::remove(path, ec);
+    if (ec)
+    {
+        LogMsg(Logger::Error, "[NbdServer]: (", name,
+               ") Unable to remove pre-existing socket ", path, ": ", ec);
+        return false;
+    }
+
+    boost::system::error_code bec;
+    const boost::asio::local::stream_protocol::endpoint endpoint(path.string());
+    acceptor.open(endpoint.protocol(), bec);
+    if (!bec)
+    {
+        acceptor.bind(endpoint, bec);
+    }
+    if (!bec)
+    {
+        acceptor.listen(boost::asio::socket_base::max_listen_connections, bec);
+    }
+    if (bec)
+    {
+        LogMsg(Logger::Error, "[NbdServer]: (", name,
+               ") Unable to listen on ", path, ": ", bec);
+        acceptor.close(bec);
+        return false;
+    }
+    return true;
+}
+
+bool Server::start(const std::filesystem::path& path)
+{
+    if (!listen(acceptor, name, path))
+    {
+        return false;
+    }
+
+    socketPath = path;
+    LogMsg(Logger::Info, "[NbdServer]: (", name, ") Listening on ", path);
+    serve();
+    return true;
+}
+
+bool Server::start(Acceptor&& listening, const std::filesystem::path& path)
+{
+    if (!listening.is_open())
+    {
+        return false;
+    }
+
+    acceptor = std::move(listening);
+    socketPath = path;
+    LogMsg(Logger::Info, "[NbdServer]: (", name, ") Serving on ", path);
+    serve();
+    return true;
+}
+
+void Server::attach(unsigned count, AttachHandler&& handler)
+{
+    attachCount = std::max(count, 1U);
+    attachHandler = std::move(handler);
+    LogMsg(Logger::Info, "[NbdServer]: (", name, ") Serving ", attachCount,
+           " attached connections");
+    serve();
+}
+
+void Server::serve()
+{
+    // Clients wait in the listen backlog until the backend is ready, when it
+    // fails their connections are dropped together with the socket
+    backend->open([this, self = shared_from_this()](std::error_code ec) {
+        if (stopped)
+        {
+            return;
+        }
+        if (ec)
+        {
+            LogMsg(Logger::Error, "[NbdServer]: (", name,
+                   ") Unable to open image: ", ec.message());
+            stop();
+            if (attachHandler)
+            {
+                std::exchange(attachHandler, nullptr)(ec, {}, {});
+            }
+            return;
+        }
+        if (!tuneProbe)
+        {
+            ready();
+            return;
+        }
+
+        auto tuner =
+            std::make_shared<RequestSizeTuner>(name, std::move(tuneProbe));
+        tuner->run([this, self = shared_from_this()](uint32_t best) {
+            if (stopped)
+            {
+                return;
+            }
+            if (best > 0)
+            {
+                setMaxRequestLength(best);
+                tunedRequestLength = maxRequestLength;
+                LogMsg(Logger::Info, "[NbdServer]: (", name,
+                       ") Maximum request length tuned to ", best);
+            }
+            ready();
+        });
+    });
+}
+
+void Server::ready()
+{
+    if (!attachHandler)
+    {
+        accept();
+        return;
+    }
+
+    std::vector<int> sockets;
+    boost::system::error_code ec;
+    for (unsigned i = 0; i < attachCount && !ec; i++)
+    {
+        Connection::Socket local(ioc);
+        Connection::Socket remote(ioc);
+        boost::asio::local::connect_pair(local, remote, ec);
+        if (ec)
+        {
+            LogMsg(Logger::Error, "[NbdServer]: (", name,
+                   ") Unable to create socket pair: ", ec);
+            break;
+        }
+        auto connection = std::make_shared<Connection>(
+            name, std::move(local), backend, maxRequestLength);
+        connections.push_back(connection);
+        connection->start(true);
+        sockets.push_back(remote.release());
+    }
+
+    netlink::Export exp;
+    exp.size = backend->size();
+    exp.flags = transmissionFlags(*backend);
+    std::exchange(attachHandler, nullptr)(
+        ec ? std::make_error_code(std::errc::too_many_files_open)
+           : std::error_code{},
+        sockets, exp);
+    for (const int fd : sockets)
+    {
+        ::close(fd);
+    }
+}
+
+void Server::stop()
+{
+    stopped = true;
+    boost::system::error_code ignored;
+    acceptor.close(ignored);
+
+    for (auto& weak : connections)
+    {
+        if (auto connection = weak.lock())
+        {
+            connection->close();
+        }
+    }
+    connections.clear();
+
+    if (!socketPath.empty())
+    {
+        std::error_code ec;
+        std::filesystem::remove(socketPath, ec);
+        socketPath.clear();
+    }
+}
+
+void Server::accept()
+{
+    boost::asio::spawn(ioc, [this, self = shared_from_this()](
+                                boost::asio::yield_context yield) {
+        while (acceptor.is_open())
+        {
+            boost::system::error_code ec;
+            Connection::Socket socket(ioc);
+            acceptor.async_accept(socket, yield[ec]);
+            if (ec)
+            {
+                if (ec == boost::asio::error::operation_aborted)
+                {
+                    break;
+                }
+                LogMsg(Logger::Error, "[NbdServer]: (", name,
+                       ") Accept error: ", ec);
+                continue;
+            }
+
+            LogMsg(Logger::Info, "[NbdServer]: (", name,
+                   ") Client connected");
+            connections.erase(
+                std::remove_if(connections.begin(), connections.end(),
+                               [](const auto& weak) { return weak.expired(); }),
+                connections.end());
+            auto connection = std::make_shared<Connection>(
+                name, std::move(socket), backend, maxRequestLength);
+            connections.push_back(connection);
+            connection->start();
+        }
+    });
+}
+
+} // namespace nbd
@@ -0,0 +1,99 @@
+#pragma once
+
+#include "nbd/backend.hpp"
+#include "nbd/netlink.hpp"
+
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/local/stream_protocol.hpp>
+#include <filesystem>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace nbd
+{
+
+class Connection;
+
+// In-process NBD server (fixed newstyle handshake) listening on a unix
+// socket and serving a single export backed by nbd::Backend. Runs entirely on
+// the provided io_context.
+class Server : public std::enable_shared_from_this<Server>
+{
+  public:
+    using Acceptor = boost::asio::local::stream_protocol::acceptor;
+    // Receives sockets to attach to NBD device, closed after it returns
+    using AttachHandler = std::function<void(
+        std::error_code, const std::vector<int>& sockets, netlink::Export)>;
+
+    Server(boost::asio::io_context& ioc, std::string_view name,
+           std::shared_ptr<Backend> backend);
+
+    Server(const Server&) = delete;
+    Server(Server&&) = delete;
+    Server& operator=(const Server&) = delete;
+    Server& operator=(Server&&) = delete;
+
+    ~Server();
+
+    bool start(const std::filesystem::path& socketPath);
+    // Serves on a socket which is already listening, clients connected to it
+    // beforehand are waiting in its backlog
+    bool start(Acceptor&& listening, const std::filesystem::path& socketPath);
+    // Serves count connections over socket pairs instead of listening. Once
+    // the backend is open, handler receives the other ends of the pairs,
+    // already in transmission phase, to attach them to NBD device by netlink.
+    void attach(unsigned count, AttachHandler&& handler);
+    void stop();
+
+    // Replaces socket at socketPath with a new one listening on acceptor
+    static bool listen(Acceptor& acceptor, std::string_view name,
+                       const std::filesystem::path& socketPath);
+
+    // Largest request clients are asked to send, advertised in
+    // NBD_INFO_BLOCK_SIZE. Takes effect for clients connected afterwards.
+    void setMaxRequestLength(uint32_t length);
+
+    uint32_t getMaxRequestLength() const
+    {
+        return maxRequestLength;
+    }
+
+    // Before clients are accepted, throughput of reads of various sizes is
+    // measured on `probe` and the best size becomes the maximum request
+    // length. Probe shall be the part of the served backend below any
+    // caches, so the measurement does not fill them.
+    void autotune(std::shared_ptr<Backend> probe);
+
+    // Maximum request length chosen by autotune, 0 when not measured
+    uint32_t getTunedRequestLength() const
+    {
+        return tunedRequestLength;
+    }
+
+    Backend& getBackend()
+    {
+        return *backend;
+    }
+
+  private:
+    void serve();
+    void ready();
+    void accept();
+
+    boost::asio::io_context& ioc;
+    std::string name;
+    std::shared_ptr<Backend> backend;
+    Acceptor acceptor;
+    std::filesystem::path socketPath;
+    std::vector<std::weak_ptr<Connection>> connections;
+    uint32_t maxRequestLength;
+    std::shared_ptr<Backend> tuneProbe;
+    uint32_t tunedRequestLength = 0;
+    unsigned attachCount = 0;
+    AttachHandler attachHandler;
+    bool stopped = false;
+};
+
+} // namespace nbd
@@ -0,0 +1,105 @@
+#pragma once
+
+#include <cstdint>
+
+namespace nbd
+{
+
+// Counters of the serving path kept per mount point and published on D-Bus.
+// Counters accumulate over the lifetime of the service, gauges describe the
+// current mount.
+struct Statistics
+{
+    struct Cache
+    {
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+        uint64_t evictions = 0;
+        // Bytes currently held by the cache
+        uint64_t size = 0;
+    };
+
+    struct ReadAhead
+    {
+        // Bytes fetched ahead of the host, of them later read by the host
+        // and evicted before being read; known only when memory cache holds
+        // prefetched data
+        uint64_t fetched = 0;
+        uint64_t used = 0;
+        uint64_t wasted = 0;
+        // Largest window of the currently detected sequential streams
+        uint64_t window = 0;
+    };
+
+    struct Coalescing
+    {
+        // Reads merged into a read of adjacent data and reads which waited
+        // for a read of the same data already in flight
+        uint64_t merged = 0;
+        uint64_t joined = 0;
+    };
+
+    struct Https
+    {
+        // Connections to HTTPS servers set up with a full TLS handshake, with
+        // a resumed TLS session and taken over from earlier mounts
+        uint64_t handshakes = 0;
+        uint64_t resumed = 0;
+        uint64_t reused = 0;
+        // Time from the start of the last mount to the first byte of the
+        // image in ms
+        uint64_t firstByte = 0;
+    };
+
+    struct WarmUp
+    {
+        // Percent of the planned warm-up read so far and how long the last
+        // warm-up took in ms, 0 while it runs
+        uint64_t progress = 0;
+        uint64_t duration = 0;
+    };
+
+    struct Pin
+    {
+        // Bytes of the image downloaded to local storage and percent of the
+        // image, 100 once the local copy is served
+        uint64_t downloaded = 0;
+        uint64_t progress = 0;
+    };
+
+    // Counts what counters of layers shared with other mount points grew by
+    // since earlier and takes over their gauges. Read-ahead window and
+    // warm-up are not shared.
+    void addShared(const Statistics& now, const Statistics& earlier)
+    {
+        const auto add = [](Cache& to, const Cache& now, const Cache& earlier) {
+            to.hits += now.hits - earlier.hits;
+            to.misses += now.misses - earlier.misses;
+            to.evictions += now.evictions - earlier.evictions;
+            to.size = now.size;
+        };
+        add(cache, now.cache, earlier.cache);
+        add(imageCache, now.imageCache, earlier.imageCache);
+        readAhead.fetched += now.readAhead.fetched - earlier.readAhead.fetched;
+        readAhead.used += now.readAhead.used - earlier.readAhead.used;
+        readAhead.wasted += now.readAhead.wasted - earlier.readAhead.wasted;
+        coalescing.merged += now.coalescing.merged - earlier.coalescing.merged;
+        coalescing.joined += now.coalescing.joined - earlier.coalescing.joined;
+        https.handshakes += now.https.handshakes - earlier.https.handshakes;
+        https.resumed += now.https.resumed - earlier.https.resumed;
+        https.reused += now.https.reused - earlier.https.reused;
+        https.firstByte = now.https.firstByte;
+        pin = now.pin;
+    }
+
+    Cache cache;
+    // Persistent cache, evictions count whole images removed from disk
+    Cache imageCache;
+    ReadAhead readAhead;
+    Coalescing coalescing;
+    Https https;
+    WarmUp warmUp;
+    Pin pin;
+};
+
+} // namespace nbd
@@ -0,0 +1,156 @@
+#include "nbd/throttle.hpp"
+
+#include <algorithm>
+
+namespace nbd
+{
+
+Throttle::Throttle(boost::asio::io_context& ioc,
+                   std::shared_ptr<Backend> lower, TokenBucket& bucket,
+                   TokenBucket& shared) :
+    lower(std::move(lower)),
+    bucket(bucket), shared(shared), timer(ioc)
+{
+}
+
+Throttle::~Throttle()
+{
+    shared.leave(this);
+}
+
+void Throttle::read(uint64_t offset, boost::asio::mutable_buffer buffer,
+                    Handler&& handler)
+{
+    enqueue(Request{offset, buffer.size(),
+                    [this, offset, buffer, handler = std::move(handler)]() {
+                        lower->read(offset, buffer, Handler(handler));
+                    },
+                    false},
+            BackgroundScope::isActive());
+}
+
+void Throttle::write(uint64_t offset, boost::asio::const_buffer buffer,
+                     Handler&& handler)
+{
+    enqueue(Request{offset, buffer.size(),
+                    [this, offset, buffer, handler = std::move(handler)]() {
+                        lower->write(offset, buffer, Handler(handler));
+                    },
+                    false},
+            BackgroundScope::isActive());
+}
+
+void Throttle::splice(uint64_t offset, size_t length, int pipe,
+                      Handler&& handler)
+{
+    enqueue(Request{offset, length,
+                    [this, offset, length, pipe,
+                     handler = std::move(handler)]() {
+                        lower->splice(offset, length, pipe, Handler(handler));
+                    },
+                    false},
+            BackgroundScope::isActive());
+}
+
+void Throttle::prefetch(uint64_t offset, uint64_t length)
+{
+    enqueue(Request{offset, length,
+                    [this, offset, length]() {
+                        lower->prefetch(offset, length);
+                    },
+                    true},
+            true);
+}
+
+void Throttle::cancelPrefetch()
+{
+    background.erase(std::remove_if(background.begin(), background.end(),
+                                    [](const Request& request) {
+                                        return request.hint;
+                                    }),
+                     background.end());
+    schedule();
+    lower->cancelPrefetch();
+}
+
+void Throttle::enqueue(Request&& request, bool isBackground)
+{
+    if (!request.hint)
+    {
+        const uint64_t end = request.offset + request.length;
+        background.erase(
+            std::remove_if(background.begin(), background.end(),
+                           [&request, end](const Request& queued) {
+                               return queued.hint &&
+                                      queued.offset >= request.offset &&
+                                      queued.offset + queued.length <= end;
+                           }),
+            background.end());
+    }
+    (isBackground ? background : foreground).push_back(std::move(request));
+    schedule();
+}
+
+void Throttle::schedule()
+{
+    // Requests completing right away issue new ones from within start(),
+    // the loop below picks them up
+    if (scheduling)
+    {
+        return;
+    }
+    scheduling = true;
+
+    while (!foreground.empty() || !background.empty())
+    {
+        const bool isBackground = foreground.empty();
+        auto& queue = isBackground ? background : foreground;
+        auto delay = bucket.delay(isBackground);
+        if (delay > TokenBucket::Clock::duration::zero())
+        {
+            // Turn is taken only once the bandwidth of the mount point allows
+            shared.leave(this);
+        }
+        else
+        {
+            shared.join(this, isBackground);
+            delay = shared.delay(isBackground);
+            if (!shared.isTurn(this, isBackground))
+            {
+                delay = std::max<TokenBucket::Clock::duration>(delay,
+                                                               turnWait);
+            }
+        }
+        if (delay > TokenBucket::Clock::duration::zero())
+        {
+            timer.expires_after(
+                std::min<TokenBucket::Clock::duration>(delay, maxWait));
+            timer.async_wait([weak = weak_from_this()](
+                                 const boost::system::error_code& ec) {
+                if (auto self = weak.lock(); self && !ec)
+                {
+                    self->schedule();
+                }
+            });
+            break;
+        }
+
+        Request request = std::move(queue.front());
+        queue.pop_front();
+        if (!request.hint)
+        {
+            bucket.take(request.length);
+            shared.take(request.length);
+        }
+        shared.leave(this);
+        request.start();
+    }
+    if (foreground.empty() && background.empty())
+    {
+        shared.leave(this);
+    }
+
+    scheduling = false;
+}
+
+} // namespace nbd
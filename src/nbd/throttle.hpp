@@ -0,0 +1,112 @@
+#pragma once
+
+#include "nbd/backend.hpp"
+#include "nbd/token_bucket.hpp"
+
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <string>
+
+namespace nbd
+{
+
+// Shapes traffic of a mount point to the image below, eg. a remote server,
+// by the bandwidth of the mount point and the bandwidth shared by all mount
+// points, so a bulk transfer of one slot does not starve the others or the
+// rest of the BMC. Requests wait in order until both buckets let them
+// through; requests of the host go before background ones, ie. prefetches
+// and requests issued in a BackgroundScope.
+//
+// Buckets are owned by the configuration, so their rates may change at any
+// time; waiting requests notice the change within maxWait. Throttles of all
+// mount points take turns on the shared bucket, one request each.
+//
+// Prefetch hints wait like background requests but are not charged, the
+// data they bring in is charged once read. Hints covered by a request
+// queued after them are dropped, as that request fetches the data anyway.
+class Throttle : public Backend, public std::enable_shared_from_this<Throttle>
+{
+  public:
+    static constexpr std::chrono::milliseconds maxWait{100};
+    // Wait of a request whose turn on the shared bucket has not come yet
+    static constexpr std::chrono::milliseconds turnWait{1};
+
+    Throttle(boost::asio::io_context& ioc, std::shared_ptr<Backend> lower,
+             TokenBucket& bucket, TokenBucket& shared);
+    ~Throttle() override;
+
+    void open(Handler&& handler) override
+    {
+        lower->open(std::move(handler));
+    }
+
+    uint64_t size() const override
+    {
+        return lower->size();
+    }
+
+    std::string contentId() const override
+    {
+        return lower->contentId();
+    }
+
+    bool isWritable() const override
+    {
+        return lower->isWritable();
+    }
+
+    void read(uint64_t offset, boost::asio::mutable_buffer buffer,
+              Handler&& handler) override;
+    void write(uint64_t offset, boost::asio::const_buffer buffer,
+               Handler&& handler) override;
+
+    void flush(Handler&& handler) override
+    {
+        lower->flush(std::move(handler));
+    }
+
+    bool supportsSplice() const override
+    {
+        return lower->supportsSplice();
+    }
+
+    void splice(uint64_t offset, size_t length, int pipe,
+                Handler&& handler) override;
+
+    void extents(uint64_t offset, uint64_t length,
+                 ExtentsHandler&& handler) override
+    {
+        lower->extents(offset, length, std::move(handler));
+    }
+
+    void prefetch(uint64_t offset, uint64_t length) override;
+    void cancelPrefetch() override;
+
+  private:
+    struct Request
+    {
+        uint64_t offset;
+        uint64_t length;
+        std::function<void()> start;
+        // Prefetch hint, not charged and dropped by cancelPrefetch()
+        bool hint;
+    };
+
+    void enqueue(Request&& request, bool background);
+    void schedule();
+
+    std::shared_ptr<Backend> lower;
+    TokenBucket& bucket;
+    TokenBucket& shared;
+
+    std::deque<Request> foreground;
+    std::deque<Request> background;
+    boost::asio::steady_timer timer;
+    bool scheduling = false;
+};
+
+} // namespace nbd
@@ -0,0 +1,128 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+
+namespace nbd
+{
+
+// Limits transfers to rate bytes per second on average, letting up to a
+// second worth of them through at once. Transfers are charged after the fact,
+// so tokens go negative on transfers larger than the bucket and following
+// ones wait for the debt to be paid. Rate of 0 does not limit transfers.
+//
+// Background transfers wait until the bucket is half full, so under load
+// transfers of the host are served first and background ones take what is
+// left of the bandwidth. Users sharing a bucket take turns, so a busy one does
+// not starve the others.
+class TokenBucket
+{
+  public:
+    using Clock = std::chrono::steady_clock;
+
+    explicit TokenBucket(uint64_t rate = 0) : rate(rate), tokens(capacity())
+    {
+    }
+
+    // Bucket of a limit which does not apply, its rate is never changed
+    static TokenBucket& unlimited()
+    {
+        static TokenBucket bucket;
+        return bucket;
+    }
+
+    uint64_t getRate() const
+    {
+        return rate;
+    }
+
+    void setRate(uint64_t newRate)
+    {
+        refill();
+        rate = newRate;
+        tokens = std::min(tokens, capacity());
+    }
+
+    // Time until a transfer may start, zero when it may start now
+    Clock::duration delay(bool background)
+    {
+        if (rate == 0)
+        {
+            return Clock::duration::zero();
+        }
+        refill();
+        const double threshold = background ? capacity() / 2 : 0;
+        if (tokens >= threshold)
+        {
+            return Clock::duration::zero();
+        }
+        return std::max<Clock::duration>(
+            std::chrono::duration_cast<Clock::duration>(
+                std::chrono::duration<double>((threshold - tokens) /
+                                              static_cast<double>(rate))),
+            Clock::duration(1));
+    }
+
+    void take(uint64_t bytes)
+    {
+        if (rate == 0)
+        {
+            return;
+        }
+        refill();
+        tokens -= static_cast<double>(bytes);
+    }
+
+    // Queues user for its turn unless queued already, a user waits for one
+    // kind of transfers at a time
+    void join(const void* user, bool background)
+    {
+        auto& other = turns[background ? 0 : 1];
+        other.erase(std::remove(other.begin(), other.end(), user), other.end());
+        auto& queue = turns[background ? 1 : 0];
+        if (std::find(queue.begin(), queue.end(), user) == queue.end())
+        {
+            queue.push_back(user);
+        }
+    }
+
+    bool isTurn(const void* user, bool background) const
+    {
+        const auto& queue = turns[background ? 1 : 0];
+        return rate == 0 || queue.empty() || queue.front() == user;
+    }
+
+    void leave(const void* user)
+    {
+        for (auto& queue : turns)
+        {
+            queue.erase(std::remove(queue.begin(), queue.end(), user),
+                        queue.end());
+        }
+    }
+
+  private:
+    double capacity() const
+    {
+        return static_cast<double>(rate);
+    }
+
+    void refill()
+    {
+        const auto now = Clock::now();
+        const std::chrono::duration<double> elapsed = now - last;
+        last = now;
+        tokens = std::min(capacity(),
+                          tokens + elapsed.count() * static_cast<double>(rate));
+    }
+
+    uint64_t rate;
+    double tokens;
+    Clock::time_point last = Clock::now();
+    // Users waiting for transfers of the host and for background ones
+    std::deque<const void*> turns[2];
+};
+
+} // namespace nbd
@@ -0,0 +1,306 @@
+#include "nbd/write_back.hpp"
+
+#include "logger.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <iterator>
+
+namespace nbd
+{
+
+// Completes once all writes of a batch completed
+struct WriteBack::Pending
+{
+    explicit Pending(Handler&& handler) : handler(std::move(handler))
+    {
+    }
+
+    void complete(const std::error_code& result = {})
+    {
+        if (result && !ec)
+        {
+            ec = result;
+        }
+        if (--remaining == 0)
+        {
+            handler(ec);
+        }
+    }
+
+    Handler handler;
+    unsigned remaining = 1;
+    std::error_code ec;
+};
+
+WriteBack::WriteBack(boost::asio::io_context& ioc, std::string_view name,
+                     std::shared_ptr<Backend> lower, uint64_t capacity) :
+    name(name), lower(std::move(lower)), capacity(capacity), timer(ioc)
+{
+    LogMsg(Logger::Info, "[WriteBack]: (", name, ") Buffering up to ",
+           capacity, " bytes of writes");
+}
+
+WriteBack::~WriteBack()
+{
+    if (dirtyBytes + flushingBytes > 0)
+    {
+        LogMsg(Logger::Error, "[WriteBack]: (", name, ") ",
+               dirtyBytes + flushingBytes, " bytes not written back");
+    }
+}
+
+bool WriteBack::overlaps(const Runs& runs, uint64_t offset, uint64_t length)
+{
+    // Runs are disjoint, the last one starting before the end reaches
+    // furthest
+    auto it = runs.lower_bound(offset + length);
+    if (it == runs.begin())
+    {
+        return false;
+    }
+    it--;
+    return it->first + it->second.size() > offset;
+}
+
+void WriteBack::read(uint64_t offset, boost::asio::mutable_buffer buffer,
+                     Handler&& handler)
+{
+    // Reads also wait behind writes not buffered yet, so they see them
+    if (!blockedWrites.empty() || overlaps(dirty, offset, buffer.size()) ||
+        overlaps(flushing, offset, buffer.size()))
+    {
+        blockedReads.emplace_back(
+            [self = shared_from_this(), offset, buffer,
+             handler = std::move(handler)]() mutable {
+                self->read(offset, buffer, std::move(handler));
+            });
+        startBatch();
+        return;
+    }
+    lower->read(offset, buffer, std::move(handler));
+}
+
+void WriteBack::extents(uint64_t offset, uint64_t length,
+                        ExtentsHandler&& handler)
+{
+    // Buffered data replaces whatever the image holds
+    if (overlaps(dirty, offset, length) || overlaps(flushing, offset, length))
+    {
+        handler({}, {Extent{length, false}});
+        return;
+    }
+    lower->extents(offset, length, std::move(handler));
+}
+
+void WriteBack::write(uint64_t offset, boost::asio::const_buffer buffer,
+                      Handler&& handler)
+{
+    // Writes not fitting wait in order, any write is admitted into an empty
+    // buffer
+    const uint64_t buffered = dirtyBytes + flushingBytes;
+    if (!blockedWrites.empty() ||
+        (buffered > 0 && buffered + buffer.size() > capacity))
+    {
+        blockedWrites.emplace_back(
+            [self = shared_from_this(), offset, buffer,
+             handler = std::move(handler)]() mutable {
+                self->write(offset, buffer, std::move(handler));
+            });
+        startBatch();
+        return;
+    }
+
+    insert(offset, buffer);
+    handler({});
+    schedule();
+}
+
+void WriteBack::insert(uint64_t offset, boost::asio::const_buffer buffer)
+{
+    const auto* data = static_cast<const char*>(buffer.data());
+    const uint64_t end = offset + buffer.size();
+
+    // Sequential writes are appended to the run they continue
+    auto next = dirty.lower_bound(offset);
+    if (next != dirty.begin() && (next == dirty.end() || next->first >= end))
+    {
+        auto& run = std::prev(next)->second;
+        if (std::prev(next)->first + run.size() == offset &&
+            run.size() + buffer.size() <= maxRunLength)
+        {
+            run.insert(run.end(), data, data + buffer.size());
+            dirtyBytes += buffer.size();
+            return;
+        }
+    }
+
+    // Runs overlapping the write are merged with it
+    auto first = next;
+    if (first != dirty.begin() &&
+        std::prev(first)->first + std::prev(first)->second.size() > offset)
+    {
+        first--;
+    }
+    auto last = first;
+    while (last != dirty.end() && last->first < end)
+    {
+        last++;
+    }
+
+    const uint64_t start = first == last ? offset
+                                         : std::min(offset, first->first);
+    const uint64_t runEnd =
+        first == last
+            ? end
+            : std::max(end, std::prev(last)->first +
+                                std::prev(last)->second.size());
+    std::vector<char> run(static_cast<size_t>(runEnd - start));
+    for (auto it = first; it != last; it++)
+    {
+        std::memcpy(run.data() + (it->first - start), it->second.data(),
+                    it->second.size());
+        dirtyBytes -= it->second.size();
+    }
+    std::memcpy(run.data() + (offset - start), data, buffer.size());
+    dirty.erase(first, last);
+    dirtyBytes += run.size();
+    dirty.emplace(start, std::move(run));
+}
+
+void WriteBack::schedule()
+{
+    if (dirtyBytes >= capacity / 2)
+    {
+        startBatch();
+        return;
+    }
+    // Completed batch schedules the next one
+    if (scheduled || inFlight || dirty.empty())
+    {
+        return;
+    }
+
+    scheduled = true;
+    timer.expires_after(delay);
+    timer.async_wait(
+        [weak = weak_from_this()](const boost::system::error_code& ec) {
+            auto self = weak.lock();
+            if (!self || ec)
+            {
+                return;
+            }
+            self->scheduled = false;
+            self->startBatch();
+        });
+}
+
+void WriteBack::startBatch()
+{
+    if (inFlight || dirty.empty())
+    {
+        return;
+    }
+    if (scheduled)
+    {
+        timer.cancel();
+        scheduled = false;
+    }
+
+    inFlight = true;
+    started++;
+    flushing.swap(dirty);
+    flushingBytes = std::exchange(dirtyBytes, 0);
+
+    // Runs do not overlap, so they are written back in parallel
+    auto pending = std::make_shared<Pending>(
+        [self = shared_from_this()](std::error_code ec) {
+            self->batchDone(ec);
+        });
+    for (const auto& [offset, run] : flushing)
+    {
+        pending->remaining++;
+        lower->write(offset, boost::asio::buffer(run),
+                     [pending](std::error_code ec) { pending->complete(ec); });
+    }
+    pending->complete();
+}
+
+void WriteBack::batchDone(const std::error_code& ec)
+{
+    if (ec)
+    {
+        LogMsg(Logger::Error, "[WriteBack]: (", name, ") Write back of ",
+               flushingBytes, " bytes failed: ", ec.message());
+        if (!error)
+        {
+            error = ec;
+        }
+    }
+    flushing.clear();
+    flushingBytes = 0;
+    inFlight = false;
+    completed++;
+
+    finishFlushes();
+    for (auto& write : std::exchange(blockedWrites, {}))
+    {
+        write();
+    }
+    for (auto& read : std::exchange(blockedReads, {}))
+    {
+        read();
+    }
+    // Flushes still waiting need data buffered while the batch was in flight
+    if (!flushWaiters.empty())
+    {
+        startBatch();
+        return;
+    }
+    schedule();
+}
+
+void WriteBack::flush(Handler&& handler)
+{
+    // Data buffered so far is written back by the next batch at latest
+    uint64_t batch = completed;
+    if (!dirty.empty())
+    {
+        batch = started + 1;
+    }
+    else if (inFlight)
+    {
+        batch = started;
+    }
+    flushWaiters.push_back(FlushWaiter{batch, std::move(handler)});
+    startBatch();
+    finishFlushes();
+}
+
+void WriteBack::finishFlushes()
+{
+    auto handlers = std::make_shared<std::vector<Handler>>();
+    auto waiting = std::partition(flushWaiters.begin(), flushWaiters.end(),
+                                  [this](const FlushWaiter& waiter) {
+                                      return waiter.batch > completed;
+                                  });
+    for (auto it = waiting; it != flushWaiters.end(); it++)
+    {
+        handlers->push_back(std::move(it->handler));
+    }
+    flushWaiters.erase(waiting, flushWaiters.end());
+    if (handlers->empty())
+    {
+        return;
+    }
+
+    lower->flush([handlers, failed = std::exchange(error, {})](
+                     std::error_code ec) {
+        for (const auto& handler : *handlers)
+        {
+            handler(failed ? failed : ec);
+        }
+    });
+}
+
+} // namespace nbd
@@ -0,0 +1,122 @@
+#pragma once
+
+#include "nbd/backend.hpp"
+
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace nbd
+{
+
+// Buffers writes of the host in memory and writes them back to the image
+// below in batches, so many small writes become a few large ones, eg. SMB
+// writes to a CIFS share. Adjacent and overlapping writes are merged.
+//
+// A batch takes all of the buffered data and is written back once half of
+// the capacity is used, after a short delay, or when data is needed sooner:
+// on flush, by a read of buffered data or a write not fitting the buffer.
+// Batches are written back one after another, so later data never lands
+// before earlier data. Reads of buffered ranges wait for their write back;
+// flush completes once data buffered before it is written back and synced,
+// failures to write back are reported by the next flush.
+class WriteBack : public Backend, public std::enable_shared_from_this<WriteBack>
+{
+  public:
+    // Buffered data is written back after at most this time
+    static constexpr std::chrono::seconds delay{1};
+    // Merged writes do not grow beyond this size
+    static constexpr size_t maxRunLength = 4 * 1024 * 1024;
+
+    WriteBack(boost::asio::io_context& ioc, std::string_view name,
+              std::shared_ptr<Backend> lower, uint64_t capacity);
+    ~WriteBack() override;
+
+    void open(Handler&& handler) override
+    {
+        lower->open(std::move(handler));
+    }
+
+    uint64_t size() const override
+    {
+        return lower->size();
+    }
+
+    std::string contentId() const override
+    {
+        return lower->contentId();
+    }
+
+    bool isWritable() const override
+    {
+        return lower->isWritable();
+    }
+
+    void read(uint64_t offset, boost::asio::mutable_buffer buffer,
+              Handler&& handler) override;
+    void write(uint64_t offset, boost::asio::const_buffer buffer,
+               Handler&& handler) override;
+    void flush(Handler&& handler) override;
+    void extents(uint64_t offset, uint64_t length,
+                 ExtentsHandler&& handler) override;
+
+    void prefetch(uint64_t offset, uint64_t length) override
+    {
+        lower->prefetch(offset, length);
+    }
+
+    void cancelPrefetch() override
+    {
+        lower->cancelPrefetch();
+    }
+
+  private:
+    struct Pending;
+
+    // Buffered data by offset, ranges do not overlap
+    using Runs = std::map<uint64_t, std::vector<char>>;
+
+    struct FlushWaiter
+    {
+        // Completes once this many batches are written back
+        uint64_t batch;
+        Handler handler;
+    };
+
+    static bool overlaps(const Runs& runs, uint64_t offset, uint64_t length);
+    void insert(uint64_t offset, boost::asio::const_buffer buffer);
+    void schedule();
+    void startBatch();
+    void batchDone(const std::error_code& ec);
+    void finishFlushes();
+
+    std::string name;
+    std::shared_ptr<Backend> lower;
+    uint64_t capacity;
+    boost::asio::steady_timer timer;
+    bool scheduled = false;
+
+    Runs dirty;
+    uint64_t dirtyBytes = 0;
+    // Batch being written back
+    Runs flushing;
+    uint64_t flushingBytes = 0;
+    bool inFlight = false;
+    uint64_t started = 0;
+    uint64_t completed = 0;
+    // First failure since the last flush
+    std::error_code error;
+
+    std::vector<FlushWaiter> flushWaiters;
+    // Requests waiting for a batch to complete
+    std::deque<std::function<void()>> blockedWrites;
+    std::deque<std::function<void()>> blockedReads;
+};
+
+} // namespace nbd
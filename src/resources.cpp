@@ -1,10 +1,38 @@
 #include "resources.hpp"
 
 #include "interfaces/mount_point_state_machine.hpp"
+#include "nbd/client.hpp"
 
 namespace resource
 {
 
+namespace
+{
+
+void attach(interfaces::MountPointStateMachine& machine,
+            nbd::netlink::Device& device, const std::vector<int>& sockets,
+            const nbd::netlink::Export& exp)
+{
+    auto& config = machine.getConfig();
+    std::optional<uint32_t> blockSize;
+    if (config.blocksize)
+    {
+        blockSize = static_cast<uint32_t>(*config.blocksize);
+    }
+    device.connect(sockets, exp, blockSize,
+                   std::chrono::seconds(config.timeout.value_or(
+                       Configuration::MountPoint::defaultTimeout)),
+                   [&config, count = sockets.size()](std::error_code ec) {
+                       if (!ec)
+                       {
+                           config.activeConnections =
+                               static_cast<uint32_t>(count);
+                       }
+                   });
+}
+
+} // namespace
+
 Process::~Process()
 {
     if (spawned)
@@ -17,6 +45,69 @@ Process::~Process()
     }
 }
 
+Attachment::Attachment(interfaces::MountPointStateMachine& machine) :
+    machine(&machine),
+    device(std::make_shared<nbd::netlink::Device>(
+        machine.getIoc(), machine.getName(),
+        machine.getConfig().nbdDevice.index(),
+        [&machine](std::error_code ec) {
+            boost::asio::post(machine.getIoc(), [&machine, ec]() {
+                LogMsg(Logger::Info, machine.getName(), " device released.");
+                machine.getExitCode() = ec.value();
+                machine.emitSubprocessStoppedEvent();
+            });
+        }))
+{
+}
+
+Attachment::~Attachment()
+{
+    device->disconnect();
+}
+
+nbd::Server::AttachHandler Attachment::attachServer()
+{
+    return [&machine = *machine, weak = std::weak_ptr(device)](
+               std::error_code ec, const std::vector<int>& sockets,
+               nbd::netlink::Export exp) {
+        auto device = weak.lock();
+        if (!device)
+        {
+            return;
+        }
+        if (ec)
+        {
+            device->disconnect();
+            return;
+        }
+        attach(machine, *device, sockets, exp);
+    };
+}
+
+void Attachment::attachProxy()
+{
+    nbd::negotiate(
+        machine->getIoc(), machine->getName(), machine->getConfig().unixSocket,
+        [&machine = *machine, weak = std::weak_ptr(device)](
+            std::error_code ec, int socket, nbd::netlink::Export exp) {
+            if (auto device = weak.lock())
+            {
+                if (ec)
+                {
+                    device->disconnect();
+                }
+                else
+                {
+                    attach(machine, *device, {socket}, exp);
+                }
+            }
+            if (socket >= 0)
+            {
+                ::close(socket);
+            }
+        });
+}
+
 Gadget::Gadget(interfaces::MountPointStateMachine& machine,
                StateChange devState) :
     machine(&machine)
@@ -26,6 +117,19 @@ Gadget::Gadget(interfaces::MountPointStateMachine& machine,
         machine.getTarget() ? machine.getTarget()->rw : false);
 }
 
+Gadget::Gadget(interfaces::MountPointStateMachine& machine,
+               const std::filesystem::path& file) :
+    machine(&machine)
+{
+    status = UsbGadget::configure(
+        std::string(machine.getName()), file, StateChange::inserted,
+        machine.getTarget() ? machine.getTarget()->rw : false);
+    if (status != 0)
+    {
+        throw Error(std::errc::io_error, "Failed to configure USB gadget");
+    }
+}
+
 Gadget::~Gadget()
 {
     int32_t ret = UsbGadget::configure(std::string(machine->getName()),
@@ -45,4 +149,141 @@ Gadget::~Gadget()
     }
 }
 
+WarmClient::WarmClient(interfaces::MountPointStateMachine& machine) :
+    machine(&machine), acceptor(machine.getIoc()),
+    retryTimer(machine.getIoc())
+{
+}
+
+WarmClient::~WarmClient()
+{
+    if (slot)
+    {
+        slot->pool = nullptr;
+    }
+    retryTimer.cancel();
+    // Idle client fails the handshake and exits on its own
+    boost::system::error_code ignored;
+    acceptor.close(ignored);
+}
+
+void WarmClient::refill()
+{
+    const auto& config = machine->getConfig();
+    // Not needed when devices are attached by netlink
+    if (!config.warmNbdClient || config.mode != Configuration::Mode::legacy ||
+        nbd::netlink::available())
+    {
+        return;
+    }
+    wanted = true;
+    if (!process)
+    {
+        boost::asio::post(machine->getIoc(), [this]() { spawn(); });
+    }
+}
+
+std::optional<WarmClient::Claimed> WarmClient::claim()
+{
+    wanted = false;
+    retryTimer.cancel();
+    if (!process)
+    {
+        return std::nullopt;
+    }
+
+    LogMsg(Logger::Info, machine->getName(), " Claiming warm nbd-client");
+    slot->claimed = true;
+    slot.reset();
+    return Claimed{std::move(acceptor),
+                   std::make_unique<Process>(*machine, std::move(process),
+                                             true)};
+}
+
+void WarmClient::spawn()
+{
+    if (!wanted || process)
+    {
+        return;
+    }
+
+    const auto& config = machine->getConfig();
+    const std::filesystem::path socketPath(config.unixSocket);
+    std::error_code ec;
+    std::filesystem::create_directories(socketPath.parent_path(), ec);
+    if (!ec)
+    {
+        std::filesystem::permissions(socketPath.parent_path(),
+                                     std::filesystem::perms::owner_all, ec);
+    }
+    if (ec)
+    {
+        LogMsg(Logger::Error, machine->getName(),
+               " Unable to prepare directory for socket: ", ec);
+        return;
+    }
+
+    nbd::Server::Acceptor listening(machine->getIoc());
+    if (!nbd::Server::listen(listening, machine->getName(), socketPath))
+    {
+        return;
+    }
+
+    auto client = std::make_shared<::Process>(
+        machine->getIoc(), machine->getName(), "/usr/sbin/nbd-client",
+        config.nbdDevice);
+    auto spawned = std::make_shared<Slot>(Slot{this});
+    if (!client->spawn(
+            Configuration::MountPoint::toArgs(config),
+            [&machine = *machine, spawned](int exitCode) {
+                if (spawned->claimed)
+                {
+                    LogMsg(Logger::Info, machine.getName(),
+                           " process ended.");
+                    machine.getExitCode() = exitCode;
+                    machine.emitSubprocessStoppedEvent();
+                }
+                else if (spawned->pool)
+                {
+                    spawned->pool->idleExited(spawned, exitCode);
+                }
+            }))
+    {
+        LogMsg(Logger::Error, machine->getName(),
+               " Failed to spawn warm nbd-client");
+        boost::system::error_code ignored;
+        listening.close(ignored);
+        std::filesystem::remove(socketPath, ec);
+        return;
+    }
+
+    LogMsg(Logger::Info, machine->getName(), " Warm nbd-client started");
+    acceptor = std::move(listening);
+    process = std::move(client);
+    slot = std::move(spawned);
+}
+
+void WarmClient::idleExited(const std::shared_ptr<Slot>& exited, int exitCode)
+{
+    if (exited != slot)
+    {
+        return;
+    }
+
+    LogMsg(Logger::Error, machine->getName(),
+           " Warm nbd-client ended, exit code: ", exitCode);
+    boost::system::error_code ignored;
+    acceptor.close(ignored);
+    process.reset();
+    slot.reset();
+
+    retryTimer.expires_after(retryInterval);
+    retryTimer.async_wait([this](const boost::system::error_code& ec) {
+        if (!ec)
+        {
+            spawn();
+        }
+    });
+}
+
 } // namespace resource
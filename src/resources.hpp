@@ -1,5 +1,6 @@
 #pragma once
 
+#include "nbd/server.hpp"
 #include "smb.hpp"
 #include "system.hpp"
 
@@ -104,7 +105,14 @@ class Mount
     std::unique_ptr<Directory> directory;
 };
 
-class Process
+// Client of the NBD device, its end is reported as SubprocessStoppedEvent
+class Client
+{
+  public:
+    virtual ~Client() = default;
+};
+
+class Process : public Client
 {
   public:
     Process() = delete;
@@ -112,10 +120,11 @@ class Process
     Process(Process&& other) = delete;
     Process& operator=(const Process&) = delete;
     Process& operator=(Process&& other) = delete;
+    // Spawned is set when taking over a process which is already running
     Process(interfaces::MountPointStateMachine& machine,
-            std::shared_ptr<::Process> process) :
+            std::shared_ptr<::Process> process, bool spawned = false) :
         machine(&machine),
-        process(std::move(process))
+        process(std::move(process)), spawned(spawned)
     {
         if (!this->process)
         {
@@ -123,7 +132,7 @@ class Process
         }
     }
 
-    ~Process();
+    ~Process() override;
 
     template <class... Args>
     auto spawn(Args&&... args)
@@ -142,6 +151,69 @@ class Process
     bool spawned = false;
 };
 
+// NBD device attached by netlink to sockets of the service, in place of
+// nbd-client. Device is disconnected when the attachment is destroyed.
+class Attachment : public Client
+{
+  public:
+    Attachment() = delete;
+    Attachment(const Attachment&) = delete;
+    Attachment(Attachment&& other) = delete;
+    Attachment& operator=(const Attachment&) = delete;
+    Attachment& operator=(Attachment&& other) = delete;
+
+    explicit Attachment(interfaces::MountPointStateMachine& machine);
+    ~Attachment() override;
+
+    // Attaches connections of the built-in server once it is ready
+    nbd::Server::AttachHandler attachServer();
+    // Attaches connection negotiated with the server listening on unix
+    // socket of the mount point
+    void attachProxy();
+
+  private:
+    interfaces::MountPointStateMachine* machine;
+    std::shared_ptr<nbd::netlink::Device> device;
+};
+
+class Server
+{
+  public:
+    Server() = delete;
+    Server(const Server&) = delete;
+    Server(Server&& other) = delete;
+    Server& operator=(const Server&) = delete;
+    Server& operator=(Server&& other) = delete;
+
+    explicit Server(std::shared_ptr<nbd::Server> server) :
+        server(std::move(server))
+    {
+        if (!this->server)
+        {
+            throw Error(std::errc::io_error, "Failed to create NBD server");
+        }
+    }
+
+    ~Server()
+    {
+        server->stop();
+    }
+
+    uint32_t getTunedRequestLength() const
+    {
+        return server->getTunedRequestLength();
+    }
+
+    // Writes data buffered by the image back, eg. once the device is gone
+    void flush(nbd::Backend::Handler&& handler)
+    {
+        server->getBackend().flush(std::move(handler));
+    }
+
+  private:
+    std::shared_ptr<nbd::Server> server;
+};
+
 class Gadget
 {
   public:
@@ -152,6 +224,9 @@ class Gadget
     Gadget(Gadget&& other) = delete;
 
     Gadget(interfaces::MountPointStateMachine& machine, StateChange devState);
+    // Exports the file directly, throws when gadget cannot be configured
+    Gadget(interfaces::MountPointStateMachine& machine,
+           const std::filesystem::path& file);
     ~Gadget();
 
   private:
@@ -159,4 +234,53 @@ class Gadget
     int32_t status;
 };
 
+// Keeps nbd-client of a slot started ahead of mounts. The client connects to
+// the socket of the slot, which is already listening, and waits in its backlog
+// for the NBD handshake. A mount claims both and only starts serving on the
+// socket. The client is started again once the slot is ready for next mount.
+class WarmClient
+{
+  public:
+    WarmClient() = delete;
+    WarmClient(const WarmClient&) = delete;
+    WarmClient(WarmClient&& other) = delete;
+    WarmClient& operator=(const WarmClient&) = delete;
+    WarmClient& operator=(WarmClient&& other) = delete;
+
+    explicit WarmClient(interfaces::MountPointStateMachine& machine);
+    ~WarmClient();
+
+    struct Claimed
+    {
+        nbd::Server::Acceptor acceptor;
+        std::unique_ptr<Process> process;
+    };
+
+    // Starts the client in background, when enabled and not running already
+    void refill();
+    // Takes the running client, nullopt when there is none
+    std::optional<Claimed> claim();
+
+  private:
+    // Shared with exit handler of the client, which may outlive the pool
+    struct Slot
+    {
+        WarmClient* pool;
+        bool claimed = false;
+    };
+
+    // Delay before the client is started again after it ended while idle
+    static constexpr std::chrono::seconds retryInterval{5};
+
+    void spawn();
+    void idleExited(const std::shared_ptr<Slot>& exited, int exitCode);
+
+    interfaces::MountPointStateMachine* machine;
+    nbd::Server::Acceptor acceptor;
+    std::shared_ptr<::Process> process;
+    std::shared_ptr<Slot> slot;
+    boost::asio::steady_timer retryTimer;
+    bool wanted = false;
+};
+
 } // namespace resource
@@ -1,6 +1,19 @@
 #include "activating_state.hpp"
 
 #include "active_state.hpp"
+#include "nbd/boot_trace.hpp"
+#include "nbd/chunk_cache.hpp"
+#include "nbd/coalescer.hpp"
+#include "nbd/disk_cache.hpp"
+#include "nbd/file_backend.hpp"
+#include "nbd/https_backend.hpp"
+#include "nbd/iso_warm_up.hpp"
+#include "nbd/overlay.hpp"
+#include "nbd/pin.hpp"
+#include "nbd/read_ahead.hpp"
+#include "nbd/server.hpp"
+#include "nbd/throttle.hpp"
+#include "nbd/write_back.hpp"
 
 #include <sys/mount.h>
 
@@ -28,6 +41,7 @@ std::unique_ptr<BasicState> ActivatingState::onEnter()
 {
     // Reset previous exit code
     machine.getExitCode() = -1;
+    machine.getConfig().activeConnections = 0;
 
     if (machine.getConfig().mode == Configuration::Mode::proxy)
     {
@@ -41,6 +55,7 @@ std::unique_ptr<BasicState>
 {
     if (event.devState == StateChange::inserted)
     {
+        applyTransportLimits();
         gadget = std::make_unique<resource::Gadget>(machine, event.devState);
         return std::make_unique<ActiveState>(machine, std::move(process),
                                              std::move(gadget));
@@ -50,6 +65,28 @@ std::unique_ptr<BasicState>
                                                std::move(gadget), event);
 }
 
+void ActivatingState::applyTransportLimits()
+{
+    auto& config = machine.getConfig();
+    const auto& target = machine.getTarget();
+    std::optional<uint32_t> requestSize = config.maxRequestSize;
+    if (config.autotuneRequestSize && target && target->server &&
+        target->server->getTunedRequestLength() > 0)
+    {
+        requestSize = target->server->getTunedRequestLength();
+    }
+    // Device limit set before the first request of the host
+    if (requestSize)
+    {
+        config.nbdDevice.setMaxRequestSize(*requestSize);
+    }
+    config.activeBlockSize = config.nbdDevice.getBlockSize();
+    config.activeMaxRequestSize = config.nbdDevice.getMaxRequestSize();
+    LogMsg(Logger::Info, machine.getName(), " Block size ",
+           config.activeBlockSize, ", maximum request size ",
+           config.activeMaxRequestSize);
+}
+
 std::unique_ptr<BasicState> ActivatingState::handleEvent([
     [maybe_unused]] SubprocessStoppedEvent event)
 {
@@ -58,24 +95,34 @@ std::unique_ptr<BasicState> ActivatingState::handleEvent([
                                         "Process ended prematurely");
 }
 
+std::unique_ptr<BasicState>
+    ActivatingState::handleEvent(ImageUnavailableEvent event)
+{
+    // Errors of TLS and HTTP have no errno value of their own
+    const auto code = event.ec == static_cast<std::errc>(event.ec.value())
+                          ? static_cast<std::errc>(event.ec.value())
+                          : std::errc::io_error;
+    return std::make_unique<ReadyState>(
+        machine, code, "Image not available: " + event.ec.message());
+}
+
 std::unique_ptr<BasicState> ActivatingState::activateProxyMode()
 {
-    process = std::make_unique<resource::Process>(
-        machine, std::make_shared<::Process>(
-                     machine.getIoc(), machine.getName(),
-                     "/usr/sbin/nbd-client", machine.getConfig().nbdDevice));
+    if (nbd::netlink::available())
+    {
+        auto attachment = std::make_unique<resource::Attachment>(machine);
+        attachment->attachProxy();
+        process = std::move(attachment);
+        return nullptr;
+    }
 
-    if (!process->spawn(Configuration::MountPoint::toArgs(machine.getConfig()),
-                        [&machine = machine](int exitCode) {
-                            LogMsg(Logger::Info, machine.getName(),
-                                   " process ended.");
-                            machine.getExitCode() = exitCode;
-                            machine.emitSubprocessStoppedEvent();
-                        }))
+    process = spawnNbdClient(machine);
+    if (!process)
     {
         return std::make_unique<ReadyState>(
             machine, std::errc::operation_canceled, "Failed to spawn process");
     }
+    machine.getConfig().activeConnections = 1;
 
     return nullptr;
 }
@@ -124,6 +171,10 @@ std::unique_ptr<BasicState> ActivatingState::activateLegacyMode()
     {
         return mountHttpsShare();
     }
+    if (isFileUrl(machine.getTarget()->imgUrl))
+    {
+        return mountLocalImage();
+    }
 
     return std::make_unique<ReadyState>(machine, std::errc::invalid_argument,
                                         "URL not recognized");
@@ -149,153 +200,386 @@ std::unique_ptr<BasicState> ActivatingState::mountSmbShare()
             std::move(mountDir), smb, remoteParent, machine.getTarget()->rw,
             machine.getTarget()->credentials);
 
-        process = spawnNbdKit(machine, localFile);
-        if (!process)
+        auto& config = machine.getConfig();
+        if (config.cifsDirect)
         {
-            return std::make_unique<ReadyState>(machine,
-                                                std::errc::operation_canceled,
-                                                "Unable to setup NbdKit");
+            // Mount is complete once the share is mounted, no NBD device is
+            // involved
+            LogMsg(Logger::Info, machine.getName(),
+                   " Exporting file directly");
+            config.activeBlockSize = 0;
+            config.activeMaxRequestSize = 0;
+            config.activeConnections = 0;
+            gadget = std::make_unique<resource::Gadget>(machine, localFile);
+            return std::make_unique<ActiveState>(machine, nullptr,
+                                                 std::move(gadget));
         }
 
-        return nullptr;
+        std::shared_ptr<nbd::Backend> file =
+            std::make_shared<nbd::FileBackend>(machine.getIoc(), localFile,
+                                               machine.getTarget()->rw);
+        // Reads of the share are coalesced and shaped, with the download of
+        // pin and the measurement of request sizes as well
+        auto throttle = std::make_shared<nbd::Throttle>(
+            machine.getIoc(), file, config.bandwidth, Configuration::bandwidth);
+        std::shared_ptr<nbd::Backend> backend =
+            std::make_shared<nbd::Coalescer>(machine.getIoc(), throttle,
+                                             config.statistics.coalescing);
+        if (!machine.getTarget()->rw && config.streamThenPin &&
+            !Configuration::pinDirectory.empty())
+        {
+            backend = std::make_shared<nbd::Pin>(
+                machine.getIoc(), machine.getName(), std::move(backend),
+                Configuration::pinDirectory, config.pinRate,
+                config.statistics.pin);
+        }
+        if (machine.getTarget()->rw && config.writeBackSize > 0)
+        {
+            backend = std::make_shared<nbd::WriteBack>(
+                machine.getIoc(), machine.getName(), std::move(backend),
+                config.writeBackSize);
+        }
+        if (config.warmUpSize > 0)
+        {
+            backend = std::make_shared<nbd::IsoWarmUp>(
+                machine.getIoc(), machine.getName(), std::move(backend),
+                config.warmUpSize, config.statistics.warmUp);
+        }
+        // Traces are replayed into the page cache
+        if (config.bootTraceSeconds > 0 &&
+            !Configuration::bootTraceDirectory.empty())
+        {
+            backend = std::make_shared<nbd::BootTrace>(
+                machine.getName(), std::move(backend),
+                Configuration::bootTraceDirectory,
+                std::chrono::seconds(config.bootTraceSeconds),
+                nbd::BootTrace::maxWindow);
+        }
+        if (config.readAheadSize > 0)
+        {
+            backend = std::make_shared<nbd::ReadAhead>(
+                std::move(backend), config.readAheadSize,
+                config.statistics.readAhead);
+        }
+
+        return serveImage(std::move(backend), std::move(throttle));
     }
     catch (const resource::Error& e)
     {
         return std::make_unique<ReadyState>(machine, e.errorCode, e.what());
     }
+    catch (const std::system_error& e)
+    {
+        return std::make_unique<ReadyState>(
+            machine, static_cast<std::errc>(e.code().value()), e.what());
+    }
 }
 
 std::unique_ptr<BasicState> ActivatingState::mountHttpsShare()
 {
-    process = spawnNbdKit(machine, machine.getTarget()->imgUrl);
-    if (!process)
+    auto& target = *machine.getTarget();
+    auto& config = machine.getConfig();
+    const bool overlay = target.rw && config.overlaySize > 0 &&
+                         !Configuration::overlayDirectory.empty();
+    if (target.rw && !overlay)
     {
-        return std::make_unique<ReadyState>(machine,
-                                            std::errc::invalid_argument,
-                                            "Failed to mount HTTPS share");
+        LogMsg(Logger::Info, machine.getName(),
+               " HTTPS images are served read-only without overlay");
+        target.rw = false;
     }
 
-    return nullptr;
+    // Local copy takes place of the disk cache, overlay keeps writes above
+    // it
+    const bool pin =
+        config.streamThenPin && !Configuration::pinDirectory.empty();
+    const bool diskCache = !pin &&
+                           !Configuration::imageCacheDirectory.empty() &&
+                           Configuration::imageCacheSize > 0;
+
+    try
+    {
+        // Layers below the overlay only read the image, so they are shared
+        // by mount points of the same image
+        auto image = machine.getImageRegistry().acquire(
+            machine.getName(), getHttpsImageKey(pin), config.statistics,
+            [this, pin, diskCache](nbd::Statistics& statistics) {
+                return buildHttpsImage(pin, diskCache, statistics);
+            });
+        preflight(*image);
+        // Reads of the shared image are charged to the mount point reading
+        // them
+        std::shared_ptr<nbd::Backend> backend = std::make_shared<nbd::Throttle>(
+            machine.getIoc(), image, config.bandwidth,
+            nbd::TokenBucket::unlimited());
+        // Writes land in the overlay, caches below keep the image only
+        if (overlay)
+        {
+            backend = std::make_shared<nbd::Overlay>(
+                machine.getIoc(), machine.getName(), std::move(backend),
+                Configuration::overlayDirectory, config.overlaySize);
+        }
+        // Data warmed up in memory only must not evict itself
+        const uint64_t warmUpSize =
+            diskCache ? config.warmUpSize
+                      : std::min(config.warmUpSize, config.cacheSize / 2);
+        if (warmUpSize > 0)
+        {
+            backend = std::make_shared<nbd::IsoWarmUp>(
+                machine.getIoc(), machine.getName(), std::move(backend),
+                warmUpSize, config.statistics.warmUp);
+        }
+        // Prefetched data is kept in the memory cache only, so the windows
+        // must not be able to evict data before the host reads it
+        if (config.cacheSize > 0 && config.bootTraceSeconds > 0 &&
+            !Configuration::bootTraceDirectory.empty())
+        {
+            backend = std::make_shared<nbd::BootTrace>(
+                machine.getName(), std::move(backend),
+                Configuration::bootTraceDirectory,
+                std::chrono::seconds(config.bootTraceSeconds),
+                config.cacheSize / 4);
+        }
+        if (config.cacheSize > 0 && config.readAheadSize > 0)
+        {
+            backend = std::make_shared<nbd::ReadAhead>(
+                std::move(backend),
+                std::min(config.readAheadSize, config.cacheSize / 4),
+                config.statistics.readAhead);
+        }
+
+        // Server opening the image joins the preflight, which already learns
+        // size and validator of the image. Request sizes are measured on the
+        // server, within the bandwidth of the mount point.
+        auto probe = std::make_shared<nbd::Throttle>(
+            machine.getIoc(), image->origin(), config.bandwidth,
+            Configuration::bandwidth);
+        return serveImage(std::move(backend), std::move(probe));
+    }
+    catch (const std::system_error& e)
+    {
+        return std::make_unique<ReadyState>(
+            machine, static_cast<std::errc>(e.code().value()), e.what());
+    }
 }
 
-std::unique_ptr<resource::Process>
-    ActivatingState::spawnNbdKit(interfaces::MountPointStateMachine& machine,
-                                 std::unique_ptr<utils::VolatileFile>&& secret,
-                                 const std::vector<std::string>& params)
+void ActivatingState::preflight(nbd::Backend& image)
 {
-    // Investigate
-    auto process = std::make_unique<resource::Process>(
-        machine, std::make_shared<::Process>(
-                     machine.getIoc(), std::string(machine.getName()),
-                     "/usr/sbin/nbdkit", machine.getConfig().nbdDevice));
+    const auto started = std::chrono::steady_clock::now();
+    preflightTimer = std::make_shared<boost::asio::steady_timer>(
+        machine.getIoc(),
+        std::chrono::seconds(machine.getConfig().timeout.value_or(
+            Configuration::MountPoint::defaultTimeout)));
+    std::weak_ptr<boost::asio::steady_timer> weak = preflightTimer;
+    preflightTimer->async_wait(
+        [&machine = machine, weak](const boost::system::error_code& ec) {
+            if (ec || weak.expired())
+            {
+                return;
+            }
+            machine.emitImageUnavailableEvent(
+                std::make_error_code(std::errc::timed_out));
+        });
+
+    // Handler may be called right away, events are not emitted from within
+    // another one
+    image.open([this, &machine = machine, weak, started](std::error_code ec) {
+        boost::asio::post(machine.getIoc(), [this, &machine, weak, started,
+                                             ec]() {
+            if (weak.expired())
+            {
+                return;
+            }
+            preflightTimer = nullptr;
+            if (ec)
+            {
+                machine.emitImageUnavailableEvent(ec);
+                return;
+            }
+            LogMsg(Logger::Info, machine.getName(), " Image available in ",
+                   std::chrono::duration_cast<std::chrono::milliseconds>(
+                       std::chrono::steady_clock::now() - started)
+                       .count(),
+                   " ms");
+        });
+    });
+}
 
-    // Cleanup of previous socket
-    if (fs::exists(machine.getConfig().unixSocket))
+std::string ActivatingState::getHttpsImageKey(bool pin)
+{
+    auto& target = *machine.getTarget();
+    auto& config = machine.getConfig();
+    // Only mounts with the same credentials share an image, which are kept
+    // hashed
+    std::string id = target.imgUrl;
+    if (target.credentials)
     {
-        LogMsg(Logger::Debug, machine.getName(),
-               " Removing previously mounted socket: ",
-               machine.getConfig().unixSocket);
-        if (!fs::remove(machine.getConfig().unixSocket))
-        {
-            LogMsg(Logger::Error, machine.getName(),
-                   " Unable to remove pre-existing socket :",
-                   machine.getConfig().unixSocket);
-            return {};
-        }
+        id += '\0' + target.credentials->user() + '\0' +
+              target.credentials->password();
     }
+    id += '\0' + std::to_string(config.cacheSize) + '\0' +
+          std::to_string(config.httpConnections) + '\0' +
+          std::to_string(config.timeout.value_or(
+              Configuration::MountPoint::defaultTimeout));
+    if (pin)
+    {
+        id += '\0' + std::to_string(config.pinRate);
+    }
+    std::string key = nbd::hashOf(id);
+    utils::secureCleanup(id);
+    return key;
+}
 
-    std::string nbdClient =
-        "/usr/sbin/nbd-client " +
-        boost::algorithm::join(
-            Configuration::MountPoint::toArgs(machine.getConfig()), " ");
+nbd::ImageRegistry::Layers
+    ActivatingState::buildHttpsImage(bool pin, bool diskCache,
+                                     nbd::Statistics& statistics)
+{
+    auto& target = *machine.getTarget();
+    auto& config = machine.getConfig();
+    auto https = std::make_shared<nbd::HttpsBackend>(
+        machine.getIoc(), machine.getHttpsPool(), machine.getName(),
+        target.imgUrl,
+        std::chrono::seconds(
+            config.timeout.value_or(Configuration::MountPoint::defaultTimeout)),
+        statistics.https, config.httpConnections);
+    if (target.credentials)
+    {
+        https->setCredentials(target.credentials->user(),
+                              target.credentials->password());
+    }
 
-    std::vector<std::string> args = {
-        // Listen for client on this unix socket...
-        "--unix",
-        machine.getConfig().unixSocket,
+    std::shared_ptr<nbd::Backend> backend = std::make_shared<nbd::Throttle>(
+        machine.getIoc(), https, nbd::TokenBucket::unlimited(),
+        Configuration::bandwidth);
+    backend = std::make_shared<nbd::Coalescer>(
+        machine.getIoc(), std::move(backend), statistics.coalescing);
+    if (pin)
+    {
+        backend = std::make_shared<nbd::Pin>(
+            machine.getIoc(), machine.getName(), std::move(backend),
+            Configuration::pinDirectory, config.pinRate, statistics.pin);
+    }
+    if (diskCache)
+    {
+        backend = std::make_shared<nbd::DiskCache>(
+            machine.getIoc(), std::move(backend),
+            Configuration::imageCacheDirectory, Configuration::imageCacheSize,
+            statistics.imageCache);
+    }
+    if (config.cacheSize > 0)
+    {
+        backend = std::make_shared<nbd::ChunkCache>(
+            std::move(backend), config.cacheSize, statistics.cache,
+            statistics.readAhead);
+    }
+    return {std::move(backend), std::move(https)};
+}
 
-        // ... then connect nbd-client to served image
-        "--run",
-        nbdClient,
+std::unique_ptr<BasicState> ActivatingState::mountLocalImage()
+{
+    auto& target = *machine.getTarget();
+    const auto image = getLocalImagePath(target.imgUrl);
+    if (!image)
+    {
+        return std::make_unique<ReadyState>(
+            machine, std::errc::no_such_file_or_directory,
+            "Image not found in local image directory");
+    }
+    // Images are shared by all mount points and kept across mounts
+    if (target.rw)
+    {
+        LogMsg(Logger::Info, machine.getName(),
+               " Local images are served read-only");
+        target.rw = false;
+    }
 
-#if VM_VERBOSE_NBDKIT_LOGS
-        "--verbose", // swarm of debug logs - only for brave souls
-#endif
-    };
+    try
+    {
+        // Local storage is fastest read by the gadget directly
+        LogMsg(Logger::Info, machine.getName(), " Exporting local image ",
+               *image);
+        auto& config = machine.getConfig();
+        config.activeBlockSize = 0;
+        config.activeMaxRequestSize = 0;
+        config.activeConnections = 0;
+        gadget = std::make_unique<resource::Gadget>(machine, *image);
+        return std::make_unique<ActiveState>(machine, nullptr,
+                                             std::move(gadget));
+    }
+    catch (const resource::Error& e)
+    {
+        return std::make_unique<ReadyState>(machine, e.errorCode, e.what());
+    }
+}
 
-    if (!machine.getTarget()->rw)
+std::unique_ptr<BasicState>
+    ActivatingState::serveImage(std::shared_ptr<nbd::Backend> backend,
+                                std::shared_ptr<nbd::Backend> probe)
+{
+    const auto& config = machine.getConfig();
+    auto server = std::make_shared<nbd::Server>(
+        machine.getIoc(), machine.getName(), std::move(backend));
+    if (config.maxRequestSize)
+    {
+        server->setMaxRequestLength(*config.maxRequestSize);
+    }
+    if (config.autotuneRequestSize)
     {
-        args.emplace_back("--readonly");
+        server->autotune(std::move(probe));
+    }
+    if (nbd::netlink::available())
+    {
+        auto attachment = std::make_unique<resource::Attachment>(machine);
+        server->attach(config.connections, attachment->attachServer());
+        machine.getTarget()->server =
+            std::make_unique<resource::Server>(std::move(server));
+        process = std::move(attachment);
+        return nullptr;
     }
 
-    // Insert extra params
-    args.insert(args.end(), params.begin(), params.end());
+    auto warm = machine.getWarmClient().claim();
+    if (!(warm ? server->start(std::move(warm->acceptor), config.unixSocket)
+               : server->start(config.unixSocket)))
+    {
+        return std::make_unique<ReadyState>(machine,
+                                            std::errc::operation_canceled,
+                                            "Unable to start NBD server");
+    }
+    machine.getTarget()->server =
+        std::make_unique<resource::Server>(std::move(server));
 
-    if (!process->spawn(args, [&machine = machine,
-                               secret = std::move(secret)](int exitCode) {
-            LogMsg(Logger::Info, machine.getName(), " process ended.");
-            machine.getExitCode() = exitCode;
-            machine.emitSubprocessStoppedEvent();
-        }))
+    process = warm ? std::move(warm->process) : spawnNbdClient(machine);
+    if (!process)
     {
-        LogMsg(Logger::Error, machine.getName(),
-               " Failed to spawn Process for: ", machine.getName());
-        return {};
+        return std::make_unique<ReadyState>(
+            machine, std::errc::operation_canceled, "Failed to spawn process");
     }
+    machine.getConfig().activeConnections = config.connections;
 
-    return process;
+    return nullptr;
 }
 
 std::unique_ptr<resource::Process>
-    ActivatingState::spawnNbdKit(interfaces::MountPointStateMachine& machine,
-                                 const fs::path& file)
+    ActivatingState::spawnNbdClient(interfaces::MountPointStateMachine& machine)
 {
-    return spawnNbdKit(machine, {},
-                       {// Use file plugin ...
-                        "file",
-                        // ... to mount file at this location
-                        "file=" + file.string()});
-}
+    auto process = std::make_unique<resource::Process>(
+        machine, std::make_shared<::Process>(
+                     machine.getIoc(), machine.getName(),
+                     "/usr/sbin/nbd-client", machine.getConfig().nbdDevice));
 
-std::unique_ptr<resource::Process>
-    ActivatingState::spawnNbdKit(interfaces::MountPointStateMachine& machine,
-                                 const std::string& url)
-{
-    std::unique_ptr<utils::VolatileFile> secret;
-    std::vector<std::string> params = {
-        // Use curl plugin ...
-        "curl",
-        // ... to mount http resource at url
-        "url=" + url,
-        // custom OpenBMC path for CA
-        "cainfo=", "capath=/etc/ssl/certs/authority", "ssl-version=tlsv1.2",
-        "followlocation=false",
-        "ssl-cipher-list="
-        "ECDHE-RSA-AES256-GCM-SHA384:"
-        "ECDHE-ECDSA-AES256-GCM-SHA384",
-        "tls13-ciphers="
-        "TLS_AES_256_GCM_SHA384"};
-
-    // Authenticate if needed
-    if (machine.getTarget()->credentials)
-    {
-        // Pack password into buffer
-        utils::CredentialsProvider::SecureBuffer buff =
-            machine.getTarget()->credentials->pack(
-                []([[maybe_unused]] const std::string& user,
-                   const std::string& pass, std::vector<char>& buff) {
-                    std::copy(pass.begin(), pass.end(),
-                              std::back_inserter(buff));
-                });
-
-        // Prepare file to provide the password with
-        secret = std::make_unique<utils::VolatileFile>(std::move(buff));
-
-        params.push_back("user=" + machine.getTarget()->credentials->user());
-        params.push_back("password=+" + secret->path());
-    }
-
-    return spawnNbdKit(machine, std::move(secret), params);
+    if (!process->spawn(Configuration::MountPoint::toArgs(machine.getConfig()),
+                        [&machine = machine](int exitCode) {
+                            LogMsg(Logger::Info, machine.getName(),
+                                   " process ended.");
+                            machine.getExitCode() = exitCode;
+                            machine.emitSubprocessStoppedEvent();
+                        }))
+    {
+        LogMsg(Logger::Error, machine.getName(),
+               " Failed to spawn Process for: ", machine.getName());
+        return {};
+    }
+
+    return process;
 }
 
 bool ActivatingState::checkUrl(const std::string& urlScheme,
@@ -346,6 +630,50 @@ bool ActivatingState::getImagePathFromCifsUrl(const std::string& imageUrl,
     return getImagePathFromUrl("smb://", imageUrl, imagePath);
 }
 
+bool ActivatingState::isFileUrl(const std::string& imageUrl)
+{
+    return checkUrl("file://", imageUrl);
+}
+
+std::optional<fs::path>
+    ActivatingState::getLocalImagePath(const std::string& imageUrl)
+{
+    if (Configuration::localImageDirectory.empty())
+    {
+        LogMsg(Logger::Error, "Local image directory not configured");
+        return std::nullopt;
+    }
+
+    std::error_code ec;
+    const fs::path directory =
+        fs::canonical(Configuration::localImageDirectory, ec);
+    if (ec)
+    {
+        LogMsg(Logger::Error, "Local image directory not available: ", ec);
+        return std::nullopt;
+    }
+
+    // Relative paths are relative to the directory, absolute ones have to
+    // point inside of it, also after symbolic links are resolved
+    const fs::path image = fs::canonical(
+        directory / imageUrl.substr(std::string_view("file://").size()), ec);
+    if (ec)
+    {
+        LogMsg(Logger::Error, "Local image not available: ", ec);
+        return std::nullopt;
+    }
+    if (std::mismatch(directory.begin(), directory.end(), image.begin(),
+                      image.end())
+                .first != directory.end() ||
+        !fs::is_regular_file(image))
+    {
+        LogMsg(Logger::Error, "Local image ", image,
+               " is not a file inside of the local image directory");
+        return std::nullopt;
+    }
+    return image;
+}
+
 fs::path ActivatingState::getImagePath(const std::string& imageUrl)
 {
     std::string imagePath;
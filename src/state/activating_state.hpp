@@ -2,6 +2,9 @@
 
 #include "basic_state.hpp"
 
+#include <boost/asio/steady_timer.hpp>
+#include <memory>
+
 struct ActivatingState : public BasicStateT<ActivatingState>
 {
     static std::string_view stateName()
@@ -15,6 +18,7 @@ struct ActivatingState : public BasicStateT<ActivatingState>
 
     std::unique_ptr<BasicState> handleEvent(UdevStateChangeEvent event);
     std::unique_ptr<BasicState> handleEvent(SubprocessStoppedEvent event);
+    std::unique_ptr<BasicState> handleEvent(ImageUnavailableEvent event);
 
     template <class AnyEvent>
     [[noreturn]] std::unique_ptr<BasicState> handleEvent(AnyEvent event) {
@@ -26,17 +30,26 @@ struct ActivatingState : public BasicStateT<ActivatingState>
     std::unique_ptr<BasicState> activateLegacyMode();
     std::unique_ptr<BasicState> mountSmbShare();
     std::unique_ptr<BasicState> mountHttpsShare();
+    std::unique_ptr<BasicState> mountLocalImage();
+    // Mount points share an image only when the shared layers would be
+    // configured the same for both
+    std::string getHttpsImageKey(bool pin);
+    // Layers of an HTTPS image shared by mount points, shaped only by the
+    // bandwidth of all mount points
+    nbd::ImageRegistry::Layers buildHttpsImage(bool pin, bool diskCache,
+                                               nbd::Statistics& statistics);
+    // Opens the image while the device is set up, so an image which is not
+    // available fails the mount at once rather than once the client gives up
+    void preflight(nbd::Backend& image);
+    // Probe is the backend below caches, used to autotune request size;
+    // it is shaped by the bandwidth of the mount point
+    std::unique_ptr<BasicState>
+        serveImage(std::shared_ptr<nbd::Backend> backend,
+                   std::shared_ptr<nbd::Backend> probe);
+    void applyTransportLimits();
 
     static std::unique_ptr<resource::Process>
-        spawnNbdKit(interfaces::MountPointStateMachine& machine,
-                    std::unique_ptr<utils::VolatileFile>&& secret,
-                    const std::vector<std::string>& params);
-    static std::unique_ptr<resource::Process>
-        spawnNbdKit(interfaces::MountPointStateMachine& machine,
-                    const fs::path& file);
-    static std::unique_ptr<resource::Process>
-        spawnNbdKit(interfaces::MountPointStateMachine& machine,
-                    const std::string& url);
+        spawnNbdClient(interfaces::MountPointStateMachine& machine);
 
     static bool checkUrl(const std::string& urlScheme,
                          const std::string& imageUrl);
@@ -52,6 +65,15 @@ struct ActivatingState : public BasicStateT<ActivatingState>
                                         std::string* imagePath);
     static fs::path getImagePath(const std::string& imageUrl);
 
-    std::unique_ptr<resource::Process> process;
+    static bool isFileUrl(const std::string& imageUrl);
+    // Resolves file:// URL to an image inside the local image directory
+    static std::optional<fs::path>
+        getLocalImagePath(const std::string& imageUrl);
+
+    std::unique_ptr<resource::Client> process;
     std::unique_ptr<resource::Gadget> gadget;
+    // Bounds the preflight by the timeout of the mount point; owned by the
+    // state only, so preflights completing after the state was left are
+    // ignored
+    std::shared_ptr<boost::asio::steady_timer> preflightTimer;
 };
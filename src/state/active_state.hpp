@@ -11,7 +11,7 @@ struct ActiveState : public BasicStateT<ActiveState>
     }
 
     ActiveState(interfaces::MountPointStateMachine& machine,
-                std::unique_ptr<resource::Process> process,
+                std::unique_ptr<resource::Client> process,
                 std::unique_ptr<resource::Gadget> gadget) :
         BasicStateT(machine),
         process(std::move(process)), gadget(std::move(gadget))
@@ -102,7 +102,7 @@ struct ActiveState : public BasicStateT<ActiveState>
 
   private:
     boost::asio::steady_timer timer{machine.getIoc()};
-    std::unique_ptr<resource::Process> process;
+    std::unique_ptr<resource::Client> process;
     std::unique_ptr<resource::Gadget> gadget;
     std::function<void(const boost::system::error_code&)> handler;
     std::chrono::time_point<std::chrono::steady_clock> lastAccess;
@@ -3,6 +3,9 @@
 #include "basic_state.hpp"
 #include "ready_state.hpp"
 
+#include <boost/asio/steady_timer.hpp>
+#include <memory>
+
 struct DeactivatingState : public BasicStateT<DeactivatingState>
 {
     static std::string_view stateName()
@@ -12,7 +15,7 @@ struct DeactivatingState : public BasicStateT<DeactivatingState>
 
     template <class EventT>
     DeactivatingState(interfaces::MountPointStateMachine& machine,
-                      std::unique_ptr<resource::Process> process,
+                      std::unique_ptr<resource::Client> process,
                       std::unique_ptr<resource::Gadget> gadget, EventT event) :
         BasicStateT(machine),
         process(std::move(process)), gadget(std::move(gadget))
@@ -21,7 +24,7 @@ struct DeactivatingState : public BasicStateT<DeactivatingState>
     }
 
     DeactivatingState(interfaces::MountPointStateMachine& machine,
-                      std::unique_ptr<resource::Process> process,
+                      std::unique_ptr<resource::Client> process,
                       std::unique_ptr<resource::Gadget> gadget) :
         BasicStateT(machine),
         process(std::move(process)), gadget(std::move(gadget))
@@ -30,9 +33,17 @@ struct DeactivatingState : public BasicStateT<DeactivatingState>
 
     std::unique_ptr<BasicState> onEnter() override
     {
+        // File exported directly by the gadget, no NBD device and process to
+        // wait for
+        const bool direct = !process;
+
         gadget = nullptr;
         process = nullptr;
 
+        if (direct)
+        {
+            return ready();
+        }
         return nullptr;
     }
 
@@ -48,6 +59,12 @@ struct DeactivatingState : public BasicStateT<DeactivatingState>
         return evaluate();
     }
 
+    std::unique_ptr<BasicState> handleEvent(ImageFlushedEvent event)
+    {
+        imageFlushedEvent = std::move(event);
+        return evaluate();
+    }
+
     template <class AnyEvent>
     [[noreturn]] std::unique_ptr<BasicState> handleEvent(AnyEvent event)
     {
@@ -64,7 +81,13 @@ struct DeactivatingState : public BasicStateT<DeactivatingState>
             {
                 LogMsg(Logger::Info, machine.getName(),
                        " udev StateChange::removed");
-                return std::make_unique<ReadyState>(machine);
+                // Host is gone, write back what the image still buffers
+                // before it is closed
+                if (!flushed())
+                {
+                    return nullptr;
+                }
+                return ready();
             }
             else
             {
@@ -79,8 +102,79 @@ struct DeactivatingState : public BasicStateT<DeactivatingState>
         return nullptr;
     }
 
-    std::unique_ptr<resource::Process> process;
+    bool flushed()
+    {
+        auto& target = machine.getTarget();
+        if (imageFlushedEvent || !target || !target->rw || !target->server)
+        {
+            return true;
+        }
+        if (!flushTimer)
+        {
+            // Image that can not be written back in time does not keep the
+            // mount point busy
+            flushTimer = std::make_shared<boost::asio::steady_timer>(
+                machine.getIoc(),
+                std::chrono::seconds(machine.getConfig().timeout.value_or(
+                    Configuration::MountPoint::defaultTimeout)));
+            std::weak_ptr<boost::asio::steady_timer> weak = flushTimer;
+            flushTimer->async_wait([&machine = machine,
+                                    weak](const boost::system::error_code& ec) {
+                if (ec || weak.expired())
+                {
+                    return;
+                }
+                machine.emitImageFlushedEvent(
+                    std::make_error_code(std::errc::timed_out));
+            });
+            target->server->flush(
+                [&machine = machine, weak](std::error_code ec) {
+                    boost::asio::post(machine.getIoc(), [&machine, weak, ec]() {
+                        // State was left when the write back timed out
+                        if (weak.expired())
+                        {
+                            return;
+                        }
+                        machine.emitImageFlushedEvent(ec);
+                    });
+                });
+        }
+        return false;
+    }
+
+    std::unique_ptr<BasicState> ready()
+    {
+        if (imageFlushedEvent && imageFlushedEvent->ec)
+        {
+            LogMsg(Logger::Error, machine.getName(),
+                   " Unable to write back image: ",
+                   imageFlushedEvent->ec.message());
+            if (imageFlushedEvent->ec == std::errc::timed_out)
+            {
+                return std::make_unique<ReadyState>(
+                    machine, std::errc::timed_out,
+                    "Write back of image timed out");
+            }
+            return std::make_unique<ReadyState>(
+                machine, std::errc::io_error, "Unable to write back image");
+        }
+
+        LogMsg(Logger::Info, machine.getName(), " Deactivated in ",
+               std::chrono::duration_cast<std::chrono::milliseconds>(
+                   std::chrono::steady_clock::now() - started)
+                   .count(),
+               " ms");
+        return std::make_unique<ReadyState>(machine);
+    }
+
+    const std::chrono::steady_clock::time_point started =
+        std::chrono::steady_clock::now();
+    std::unique_ptr<resource::Client> process;
     std::unique_ptr<resource::Gadget> gadget;
     std::optional<UdevStateChangeEvent> udevStateChangeEvent;
     std::optional<SubprocessStoppedEvent> subprocessStoppedEvent;
+    std::optional<ImageFlushedEvent> imageFlushedEvent;
+    // Bounds the write back by the timeout of the mount point; owned by the
+    // state only, so flushes completing after the state was left are ignored
+    std::shared_ptr<boost::asio::steady_timer> flushTimer;
 };
@@ -36,6 +36,7 @@ struct InitialState : public BasicStateT<InitialState>
         if (isLegacy)
         {
             cleanUpMountPoint();
+            addStatisticsInterface(event);
         }
         addMountPointInterface(event);
         addProcessInterface(event);
@@ -95,6 +96,168 @@ struct InitialState : public BasicStateT<InitialState>
         processIface->initialize();
     }
 
+    void addStatisticsInterface(const RegisterDbusEvent& event)
+    {
+        std::string objPath = getObjectPath(machine);
+
+        auto iface = event.objServer->add_interface(
+            objPath + std::string(machine.getName()),
+            "xyz.openbmc_project.VirtualMedia.Statistics");
+
+        registerStatistic(*iface, "CacheHits",
+                          [](const nbd::Statistics& stats) {
+                              return stats.cache.hits;
+                          });
+        registerStatistic(*iface, "CacheMisses",
+                          [](const nbd::Statistics& stats) {
+                              return stats.cache.misses;
+                          });
+        registerStatistic(*iface, "CacheEvictions",
+                          [](const nbd::Statistics& stats) {
+                              return stats.cache.evictions;
+                          });
+        registerStatistic(*iface, "CacheSize",
+                          [](const nbd::Statistics& stats) {
+                              return stats.cache.size;
+                          });
+        registerStatistic(*iface, "ImageCacheHits",
+                          [](const nbd::Statistics& stats) {
+                              return stats.imageCache.hits;
+                          });
+        registerStatistic(*iface, "ImageCacheMisses",
+                          [](const nbd::Statistics& stats) {
+                              return stats.imageCache.misses;
+                          });
+        registerStatistic(*iface, "ImageCacheEvictions",
+                          [](const nbd::Statistics& stats) {
+                              return stats.imageCache.evictions;
+                          });
+        registerStatistic(*iface, "ImageCacheSize",
+                          [](const nbd::Statistics& stats) {
+                              return stats.imageCache.size;
+                          });
+        registerStatistic(*iface, "ReadAheadFetched",
+                          [](const nbd::Statistics& stats) {
+                              return stats.readAhead.fetched;
+                          });
+        registerStatistic(*iface, "ReadAheadUsed",
+                          [](const nbd::Statistics& stats) {
+                              return stats.readAhead.used;
+                          });
+        registerStatistic(*iface, "ReadAheadWasted",
+                          [](const nbd::Statistics& stats) {
+                              return stats.readAhead.wasted;
+                          });
+        registerStatistic(*iface, "ReadAheadWindow",
+                          [](const nbd::Statistics& stats) {
+                              return stats.readAhead.window;
+                          });
+        registerStatistic(*iface, "ReadsMerged",
+                          [](const nbd::Statistics& stats) {
+                              return stats.coalescing.merged;
+                          });
+        registerStatistic(*iface, "ReadsJoined",
+                          [](const nbd::Statistics& stats) {
+                              return stats.coalescing.joined;
+                          });
+        registerStatistic(*iface, "TlsHandshakes",
+                          [](const nbd::Statistics& stats) {
+                              return stats.https.handshakes;
+                          });
+        registerStatistic(*iface, "TlsResumptions",
+                          [](const nbd::Statistics& stats) {
+                              return stats.https.resumed;
+                          });
+        registerStatistic(*iface, "ConnectionsReused",
+                          [](const nbd::Statistics& stats) {
+                              return stats.https.reused;
+                          });
+        registerStatistic(*iface, "TimeToFirstByte",
+                          [](const nbd::Statistics& stats) {
+                              return stats.https.firstByte;
+                          });
+        registerStatistic(*iface, "WarmUpProgress",
+                          [](const nbd::Statistics& stats) {
+                              return stats.warmUp.progress;
+                          });
+        registerStatistic(*iface, "WarmUpDuration",
+                          [](const nbd::Statistics& stats) {
+                              return stats.warmUp.duration;
+                          });
+        registerStatistic(*iface, "PinDownloaded",
+                          [](const nbd::Statistics& stats) {
+                              return stats.pin.downloaded;
+                          });
+        registerStatistic(*iface, "PinProgress",
+                          [](const nbd::Statistics& stats) {
+                              return stats.pin.progress;
+                          });
+        iface->initialize();
+    }
+
+    // Read-only property reflecting current value of a statistic
+    template <typename Getter>
+    void registerStatistic(sdbusplus::asio::dbus_interface& iface,
+                           const std::string& name, Getter&& getter)
+    {
+        iface.register_property(
+            name, uint64_t(0),
+            []([[maybe_unused]] const uint64_t& req,
+               [[maybe_unused]] uint64_t& property) {
+                throw sdbusplus::exception::SdBusError(
+                    EPERM, "Setting statistics is not allowed");
+                return -1;
+            },
+            [&stats = machine.getConfig().statistics,
+             getter = std::forward<Getter>(getter)](
+                [[maybe_unused]] const uint64_t& property) {
+                return getter(stats);
+            });
+    }
+
+    // Read-only property with value the mounted NBD device runs with, 0 when
+    // nothing is mounted
+    void registerTransportLimit(sdbusplus::asio::dbus_interface& iface,
+                                const std::string& name,
+                                uint32_t Configuration::MountPoint::*member)
+    {
+        iface.register_property(
+            name, uint32_t(0),
+            []([[maybe_unused]] const uint32_t& req,
+               [[maybe_unused]] uint32_t& property) {
+                throw sdbusplus::exception::SdBusError(
+                    EPERM, "Setting transport limits is not allowed");
+                return -1;
+            },
+            [&machine = machine,
+             member]([[maybe_unused]] const uint32_t& property) -> uint32_t {
+                if (!machine.getState().get_if<ActiveState>())
+                {
+                    return 0;
+                }
+                return machine.getConfig().*member;
+            });
+    }
+
+    // Writable property with bandwidth of the mount point in bytes per
+    // second, applies to the current mount as well
+    void registerBandwidth(sdbusplus::asio::dbus_interface& iface)
+    {
+        iface.register_property(
+            "Bandwidth", machine.getConfig().bandwidth.getRate(),
+            [&machine = machine](const uint64_t& req, uint64_t& property) {
+                LogMsg(Logger::Info, machine.getName(), " Bandwidth set to ",
+                       req, " bytes per second");
+                machine.getConfig().bandwidth.setRate(req);
+                property = req;
+                return 1;
+            },
+            [&bucket = machine.getConfig().bandwidth](
+                [[maybe_unused]] const uint64_t& property) {
+                return bucket.getRate();
+            });
+    }
+
     void cleanUpMountPoint()
     {
         if (UsbGadget::isConfigured(std::string(machine.getName())))
@@ -178,6 +341,17 @@ struct InitialState : public BasicStateT<InitialState>
         iface->register_property(
             "Timeout", machine.getConfig().timeout.value_or(
                            Configuration::MountPoint::defaultTimeout));
+        registerTransportLimit(*iface, "BlockSize",
+                               &Configuration::MountPoint::activeBlockSize);
+        registerTransportLimit(
+            *iface, "MaxRequestSize",
+            &Configuration::MountPoint::activeMaxRequestSize);
+        registerTransportLimit(*iface, "Connections",
+                               &Configuration::MountPoint::activeConnections);
+        if (machine.getConfig().mode == Configuration::Mode::legacy)
+        {
+            registerBandwidth(*iface);
+        }
         iface->register_property(
             "RemainingInactivityTimeout", 0,
             []([[maybe_unused]] const int& req,
@@ -233,7 +407,7 @@ struct InitialState : public BasicStateT<InitialState>
                            getObjectPath(machine), machine.getName());
 
                     interfaces::MountPointStateMachine::Target target = {
-                        imgUrl, rw, nullptr, nullptr};
+                        imgUrl, rw, nullptr, nullptr, nullptr};
 
                     if (std::holds_alternative<unix_fd>(fd))
                     {
@@ -46,6 +46,7 @@ struct ReadyState : public BasicStateT<ReadyState>
         machine.getTarget() = std::nullopt;
         machine.getConfig().remainingInactivityTimeout =
             std::chrono::seconds(0);
+        machine.getWarmClient().refill();
         return nullptr;
     }
 
@@ -12,10 +12,13 @@
 struct MountPointStateMachine : public interfaces::MountPointStateMachine
 {
     MountPointStateMachine(boost::asio::io_context& ioc,
-                           DeviceMonitor& devMonitor, const std::string& name,
+                           DeviceMonitor& devMonitor,
+                           nbd::ImageRegistry& imageRegistry,
+                           nbd::HttpsPool& httpsPool, const std::string& name,
                            const Configuration::MountPoint& config) :
         ioc{ioc},
-        name{name}, config{config}
+        imageRegistry{imageRegistry}, httpsPool{httpsPool}, name{name},
+        config{config}
     {
         devMonitor.addDevice(config.nbdDevice);
     }
@@ -52,6 +55,21 @@ struct MountPointStateMachine : public interfaces::MountPointStateMachine
         return ioc;
     }
 
+    resource::WarmClient& getWarmClient() override
+    {
+        return warmClient;
+    }
+
+    nbd::ImageRegistry& getImageRegistry() override
+    {
+        return imageRegistry;
+    }
+
+    nbd::HttpsPool& getHttpsPool() override
+    {
+        return httpsPool;
+    }
+
     void changeState(std::unique_ptr<BasicState> newState)
     {
         state = std::move(newState);
@@ -109,6 +127,16 @@ struct MountPointStateMachine : public interfaces::MountPointStateMachine
         }
     }
 
+    void emitImageFlushedEvent(const std::error_code& ec) override
+    {
+        emitEvent(ImageFlushedEvent(ec));
+    }
+
+    void emitImageUnavailableEvent(const std::error_code& ec) override
+    {
+        emitEvent(ImageUnavailableEvent(ec));
+    }
+
     virtual void
         notificationInitialize(std::shared_ptr<sdbusplus::asio::connection> con,
                                const std::string& svc, const std::string& iface,
@@ -152,11 +180,14 @@ struct MountPointStateMachine : public interfaces::MountPointStateMachine
     }
 
     boost::asio::io_context& ioc;
+    nbd::ImageRegistry& imageRegistry;
+    nbd::HttpsPool& httpsPool;
     std::string name;
     Configuration::MountPoint config;
     std::unique_ptr<utils::NotificationWrapper> completionNotification;
 
     std::optional<Target> target;
+    resource::WarmClient warmClient{*this};
     std::unique_ptr<BasicState> state = std::make_unique<InitialState>(*this);
     int exitCode = -1;
 };
@@ -1,6 +1,10 @@
 #pragma once
 
 #include "logger.hpp"
+#include "nbd/netlink.hpp"
+
+#include <sys/syscall.h>
+#include <unistd.h>
 
 #include <algorithm>
 #include <boost/asio.hpp>
@@ -121,29 +125,50 @@ class NBDDevice
         return true;
     }
 
-    void disconnect() const
+    uint32_t index() const
+    {
+        return value;
+    }
+
+    void disconnect(boost::asio::io_context& ioc) const
     {
         if (value == unknown)
         {
             return;
         }
+        // Ioctls are used only with drivers without netlink interface
+        nbd::netlink::disconnect(ioc, index(),
+                                 [device = *this](std::error_code ec) {
+                                     if (ec)
+                                     {
+                                         device.disconnectByIoctl();
+                                     }
+                                 });
+    }
 
-        int fd = open(to_path().c_str(), O_RDWR);
-
-        if (fd < 0)
-        {
-            LogMsg(Logger::Error, "Couldn't open device ", to_path().c_str());
-            return;
-        }
-        if (ioctl(fd, NBD_DISCONNECT) < 0)
-        {
-            LogMsg(Logger::Info, "Ioctl failed: \n");
-        }
-        if (ioctl(fd, NBD_CLEAR_SOCK) < 0)
+    // Limits size of requests the kernel sends to the NBD server
+    bool setMaxRequestSize(uint32_t bytes) const
+    {
+        std::ofstream file(queuePath() / "max_sectors_kb");
+        file << bytes / 1024 << std::endl;
+        if (!file)
         {
-            LogMsg(Logger::Info, "Ioctl failed: \n");
+            LogMsg(Logger::Error, "Unable to set max request size of ",
+                   to_string());
+            return false;
         }
-        close(fd);
+        return true;
+    }
+
+    // Size of the largest request the kernel sends, 0 when unknown
+    uint32_t getMaxRequestSize() const
+    {
+        return readQueueAttribute("max_sectors_kb") * 1024;
+    }
+
+    uint32_t getBlockSize() const
+    {
+        return readQueueAttribute("logical_block_size");
     }
 
     std::string to_string() const
@@ -166,6 +191,39 @@ class NBDDevice
     }
 
   private:
+    void disconnectByIoctl() const
+    {
+        int fd = open(to_path().c_str(), O_RDWR);
+
+        if (fd < 0)
+        {
+            LogMsg(Logger::Error, "Couldn't open device ", to_path().c_str());
+            return;
+        }
+        if (ioctl(fd, NBD_DISCONNECT) < 0)
+        {
+            LogMsg(Logger::Info, "Ioctl failed: \n");
+        }
+        if (ioctl(fd, NBD_CLEAR_SOCK) < 0)
+        {
+            LogMsg(Logger::Info, "Ioctl failed: \n");
+        }
+        close(fd);
+    }
+
+    fs::path queuePath() const
+    {
+        return fs::path("/sys/block") / to_string() / "queue";
+    }
+
+    uint32_t readQueueAttribute(const char* attribute) const
+    {
+        std::ifstream file(queuePath() / attribute);
+        uint32_t result = 0;
+        file >> result;
+        return file ? result : 0;
+    }
+
     Value value = unknown;
 
     static const inline std::vector<std::string> nameMatching = {
@@ -372,6 +430,7 @@ class Process : public std::enable_shared_from_this<Process>
                    "[Process]: Error while creating child process: ", ec);
             return false;
         }
+        watchExit();
 
         boost::asio::spawn(ioc, [this, self = shared_from_this(),
                                  onExit = std::move(onExit)](
@@ -410,16 +469,7 @@ class Process : public std::enable_shared_from_this<Process>
             // The process shall be dead, or almost here, give it a chance
             LogMsg(Logger::Debug,
                    "[Process]: Waiting process to finish normally");
-            boost::asio::steady_timer timer(ioc);
-            int32_t waitCnt = 20;
-            while (child.running() && waitCnt > 0)
-            {
-                boost::system::error_code ignored_ec;
-                timer.expires_from_now(std::chrono::milliseconds(100));
-                timer.async_wait(yield[ignored_ec]);
-                waitCnt--;
-            }
-            if (child.running())
+            if (!waitForExit(yield))
             {
                 child.terminate();
             }
@@ -441,19 +491,10 @@ class Process : public std::enable_shared_from_this<Process>
                                  onTerminate = std::move(onTerminate)](
                                     boost::asio::yield_context yield) {
             // The Good
-            dev.disconnect();
+            dev.disconnect(ioc);
 
             // The Ugly (but required)
-            boost::asio::steady_timer timer(ioc);
-            int32_t waitCnt = 20;
-            while (child.running() && waitCnt > 0)
-            {
-                boost::system::error_code ignored_ec;
-                timer.expires_from_now(std::chrono::milliseconds(100));
-                timer.async_wait(yield[ignored_ec]);
-                waitCnt--;
-            }
-            if (child.running())
+            if (!waitForExit(yield))
             {
                 LogMsg(Logger::Info, "[Process] Terminate if process doesnt "
                                      "want to exit nicely");
@@ -469,9 +510,86 @@ class Process : public std::enable_shared_from_this<Process>
     }
 
   private:
+    // Time given to the process to exit on its own before it is terminated
+    static constexpr std::chrono::seconds exitTimeout{2};
+    // Exit is polled when pidfd is not supported by the kernel
+    static constexpr std::chrono::milliseconds exitPollInterval{100};
+
+    // Exit of the child is noticed as soon as its pidfd becomes readable,
+    // waiters are woken up then
+    void watchExit()
+    {
+#ifdef SYS_pidfd_open
+        const int pidfd =
+            static_cast<int>(::syscall(SYS_pidfd_open, child.id(), 0));
+        if (pidfd >= 0)
+        {
+            exitDescriptor.assign(pidfd);
+            exitDescriptor.async_wait(
+                boost::asio::posix::stream_descriptor::wait_read,
+                [this, self = shared_from_this()](
+                    const boost::system::error_code& ec) {
+                    if (!ec)
+                    {
+                        notifyExit();
+                    }
+                });
+            return;
+        }
+#endif
+        LogMsg(Logger::Debug, "[Process]: pidfd not available, polling");
+        pollExit();
+    }
+
+    void pollExit()
+    {
+        exitPollTimer.expires_after(exitPollInterval);
+        exitPollTimer.async_wait([this, self = shared_from_this()](
+                                     const boost::system::error_code& ec) {
+            if (ec)
+            {
+                return;
+            }
+            if (!child.running())
+            {
+                notifyExit();
+                return;
+            }
+            pollExit();
+        });
+    }
+
+    void notifyExit()
+    {
+        exited = true;
+        for (auto* waiter : exitWaiters)
+        {
+            waiter->cancel();
+        }
+    }
+
+    // Returns false when the process did not exit within exitTimeout
+    bool waitForExit(boost::asio::yield_context yield)
+    {
+        if (!exited)
+        {
+            boost::asio::steady_timer timer(ioc, exitTimeout);
+            exitWaiters.push_back(&timer);
+            boost::system::error_code ignored;
+            timer.async_wait(yield[ignored]);
+            exitWaiters.erase(std::find(exitWaiters.begin(),
+                                        exitWaiters.end(), &timer));
+        }
+        return !child.running();
+    }
+
     boost::asio::io_context& ioc;
     boost::process::child child;
     boost::process::async_pipe pipe;
+    boost::asio::posix::stream_descriptor exitDescriptor{ioc};
+    boost::asio::steady_timer exitPollTimer{ioc};
+    std::vector<boost::asio::steady_timer*> exitWaiters;
+    bool exited = false;
     std::string name;
     std::string app;
     const NBDDevice& dev;
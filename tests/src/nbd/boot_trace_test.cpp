@@ -0,0 +1,255 @@
+#include "nbd/boot_trace.hpp"
+#include "nbd/disk_cache.hpp"
+#include "nbd/memory_backend.hpp"
+
+#include <unistd.h>
+
+#include <filesystem>
+#include <fstream>
+
+#include <gtest/gtest.h>
+
+namespace nbd
+{
+namespace
+{
+
+namespace fs = std::filesystem;
+
+constexpr uint64_t imageSize = 8 * 1024 * 1024;
+constexpr uint64_t mebibyte = 1024 * 1024;
+
+// Trace files hold records of native 64 bit offset and length
+struct Record
+{
+    uint64_t offset;
+    uint64_t length;
+};
+
+class BootTraceTest : public ::testing::Test
+{
+  protected:
+    BootTraceTest() :
+        directory(fs::temp_directory_path() /
+                  ("boot-trace-test-" + std::to_string(::getpid()))),
+        lower(std::make_shared<MemoryBackend>(ioc, imageSize)),
+        path(directory / hashOf("image-v1"))
+    {
+        lower->id = "image-v1";
+        fs::create_directories(directory);
+    }
+
+    ~BootTraceTest() override
+    {
+        trace.reset();
+        std::error_code ec;
+        fs::remove_all(directory, ec);
+    }
+
+    void open(std::chrono::seconds duration = std::chrono::seconds(60),
+              uint64_t window = 64 * mebibyte)
+    {
+        trace = std::make_shared<BootTrace>("test", lower, directory,
+                                            duration, window);
+        bool opened = false;
+        trace->open([&opened](std::error_code ec) {
+            EXPECT_FALSE(ec);
+            opened = true;
+        });
+        ASSERT_TRUE(opened);
+    }
+
+    void read(uint64_t offset, size_t length)
+    {
+        buffer.resize(length);
+        trace->read(offset, boost::asio::buffer(buffer),
+                    [](std::error_code) {});
+    }
+
+    // Ends the mount, saving what was recorded
+    std::vector<Record> close()
+    {
+        trace.reset();
+        return load(path);
+    }
+
+    static std::vector<Record> load(const fs::path& file)
+    {
+        std::ifstream stream(file, std::ios::binary | std::ios::ate);
+        if (!stream)
+        {
+            return {};
+        }
+        std::vector<Record> records(static_cast<size_t>(stream.tellg()) /
+                                    sizeof(Record));
+        stream.seekg(0);
+        stream.read(reinterpret_cast<char*>(records.data()),
+                    static_cast<std::streamsize>(records.size() *
+                                                 sizeof(Record)));
+        return records;
+    }
+
+    void store(const std::vector<Record>& records)
+    {
+        std::ofstream stream(path, std::ios::binary);
+        stream.write(reinterpret_cast<const char*>(records.data()),
+                     static_cast<std::streamsize>(records.size() *
+                                                  sizeof(Record)));
+    }
+
+    static void expectRanges(const std::vector<MemoryBackend::Range>& ranges,
+                             const std::vector<Record>& expected)
+    {
+        ASSERT_EQ(ranges.size(), expected.size());
+        for (size_t i = 0; i < expected.size(); i++)
+        {
+            EXPECT_EQ(ranges[i].offset, expected[i].offset);
+            EXPECT_EQ(ranges[i].length, expected[i].length);
+        }
+    }
+
+    static void expectRecords(const std::vector<Record>& records,
+                              const std::vector<Record>& expected)
+    {
+        ASSERT_EQ(records.size(), expected.size());
+        for (size_t i = 0; i < expected.size(); i++)
+        {
+            EXPECT_EQ(records[i].offset, expected[i].offset);
+            EXPECT_EQ(records[i].length, expected[i].length);
+        }
+    }
+
+    boost::asio::io_context ioc;
+    fs::path directory;
+    std::shared_ptr<MemoryBackend> lower;
+    fs::path path;
+    std::shared_ptr<BootTrace> trace;
+    std::vector<char> buffer;
+};
+
+TEST_F(BootTraceTest, SequentialReadsAreMerged)
+{
+    open();
+    read(0, 4096);
+    read(4096, 4096);
+    read(65536, 512);
+    read(4096, 4096);
+    expectRecords(close(), {{0, 8192}, {65536, 512}, {4096, 4096}});
+}
+
+TEST_F(BootTraceTest, RecordsDoNotGrowBeyondMaximum)
+{
+    open();
+    for (uint64_t offset = 0; offset < 3 * mebibyte / 2;
+         offset += mebibyte / 2)
+    {
+        read(offset, mebibyte / 2);
+    }
+    expectRecords(close(), {{0, BootTrace::maxRecordLength},
+                            {mebibyte, mebibyte / 2}});
+}
+
+TEST_F(BootTraceTest, RecordingEndsAfterDuration)
+{
+    open(std::chrono::seconds(0));
+    read(0, 4096);
+    // Saved by the first read past the duration, which is not recorded
+    read(4096, 4096);
+    expectRecords(load(path), {{0, 4096}});
+    read(mebibyte, 4096);
+    expectRecords(close(), {{0, 4096}});
+}
+
+TEST_F(BootTraceTest, ImagesWithoutContentIdAreNotTraced)
+{
+    lower->id.clear();
+    open();
+    read(0, 4096);
+    trace.reset();
+    EXPECT_TRUE(fs::is_empty(directory));
+}
+
+TEST_F(BootTraceTest, ReplayKeepsWindowAheadOfHost)
+{
+    store({{0, mebibyte},
+           {4 * mebibyte, mebibyte},
+           {mebibyte, mebibyte},
+           {6 * mebibyte, mebibyte}});
+    open(std::chrono::seconds(60), 2 * mebibyte);
+    expectRanges(lower->prefetches, {{0, mebibyte}, {4 * mebibyte, mebibyte}});
+
+    read(0, mebibyte / 2);
+    expectRanges(lower->prefetches, {{0, mebibyte},
+                                     {4 * mebibyte, mebibyte},
+                                     {mebibyte, mebibyte}});
+
+    // Trace is not recorded again
+    expectRecords(close(), {{0, mebibyte},
+                            {4 * mebibyte, mebibyte},
+                            {mebibyte, mebibyte},
+                            {6 * mebibyte, mebibyte}});
+}
+
+TEST_F(BootTraceTest, CancelledHintsAreGivenAgain)
+{
+    store({{0, mebibyte}, {mebibyte, mebibyte}, {2 * mebibyte, mebibyte}});
+    open(std::chrono::seconds(60), 2 * mebibyte);
+    read(0, mebibyte);
+    expectRanges(lower->prefetches, {{0, mebibyte},
+                                     {mebibyte, mebibyte},
+                                     {2 * mebibyte, mebibyte}});
+
+    // Host caught up with the first record only
+    trace->cancelPrefetch();
+    expectRanges(lower->prefetches,
+                 {{mebibyte, mebibyte}, {2 * mebibyte, mebibyte}});
+}
+
+TEST_F(BootTraceTest, InvalidTracesAreDiscarded)
+{
+    const std::vector<std::vector<Record>> invalid = {
+        {{0, 0}},
+        {{0, BootTrace::maxRecordLength + 1}},
+        {{imageSize - 4096, 8192}},
+        {{UINT64_MAX, 1}},
+    };
+    for (const auto& records : invalid)
+    {
+        store(records);
+        open();
+        EXPECT_TRUE(lower->prefetches.empty());
+        EXPECT_FALSE(fs::exists(path));
+        trace.reset();
+    }
+
+    std::ofstream(path, std::ios::binary) << "short";
+    open();
+    EXPECT_TRUE(lower->prefetches.empty());
+    EXPECT_FALSE(fs::exists(path));
+}
+
+TEST_F(BootTraceTest, OldestTracesAreRemoved)
+{
+    const auto old = fs::file_time_type::clock::now() - std::chrono::hours(1);
+    for (size_t i = 0; i < BootTrace::maxTraces; i++)
+    {
+        const fs::path other = directory / ("other-" + std::to_string(i));
+        std::ofstream(other, std::ios::binary) << "trace";
+        fs::last_write_time(other, old + std::chrono::seconds(i));
+    }
+    open();
+    read(0, 4096);
+    expectRecords(close(), {{0, 4096}});
+
+    size_t count = 0;
+    for ([[maybe_unused]] const auto& entry : fs::directory_iterator(directory))
+    {
+        count++;
+    }
+    EXPECT_EQ(count, BootTrace::maxTraces);
+    EXPECT_FALSE(fs::exists(directory / "other-0"));
+    EXPECT_TRUE(fs::exists(directory / "other-1"));
+}
+
+} // namespace
+} // namespace nbd
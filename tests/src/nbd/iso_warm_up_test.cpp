@@ -0,0 +1,213 @@
+#include "nbd/iso_warm_up.hpp"
+#include "nbd/memory_backend.hpp"
+
+#include <boost/endian/conversion.hpp>
+
+#include <chrono>
+#include <cstring>
+#include <optional>
+
+#include <gtest/gtest.h>
+
+namespace nbd
+{
+namespace
+{
+
+constexpr uint64_t sector = IsoWarmUp::sectorSize;
+constexpr uint64_t imageSize = 8 * 1024 * 1024;
+constexpr uint64_t mebibyte = 1024 * 1024;
+
+constexpr uint32_t pathTableSector = 20;
+constexpr uint32_t pathTableLength = 100;
+constexpr uint32_t rootSector = 21;
+constexpr uint32_t catalogSector = 22;
+constexpr uint32_t biosImageSector = 30;
+constexpr uint32_t efiImageSector = 100;
+// FAT sectors of EFI system partition image, it spans several reads
+constexpr uint32_t efiImageSectors = 6144;
+
+// Remembers the ranges read, in order
+class RecordingBackend : public MemoryBackend
+{
+  public:
+    using MemoryBackend::MemoryBackend;
+
+    void read(uint64_t offset, boost::asio::mutable_buffer buffer,
+              Handler&& handler) override
+    {
+        ranges.push_back({offset, buffer.size()});
+        MemoryBackend::read(offset, buffer, std::move(handler));
+    }
+
+    std::vector<Range> ranges;
+};
+
+class IsoWarmUpTest : public ::testing::Test
+{
+  protected:
+    IsoWarmUpTest() : lower(std::make_shared<RecordingBackend>(ioc, imageSize))
+    {
+        std::fill(lower->image.begin(), lower->image.end(), 0);
+
+        uint8_t* primary = at(16 * sector);
+        primary[0] = 1;
+        std::memcpy(primary + 1, "CD001", 5);
+        boost::endian::store_little_u32(primary + 132, pathTableLength);
+        boost::endian::store_little_u32(primary + 140, pathTableSector);
+        boost::endian::store_little_u32(primary + 158, rootSector);
+        boost::endian::store_little_u32(primary + 166,
+                                        static_cast<uint32_t>(sector));
+
+        uint8_t* bootRecord = at(17 * sector);
+        bootRecord[0] = 0;
+        std::memcpy(bootRecord + 1, "CD001", 5);
+        std::memcpy(bootRecord + 7, "EL TORITO SPECIFICATION", 23);
+        boost::endian::store_little_u32(bootRecord + 71, catalogSector);
+
+        uint8_t* terminator = at(18 * sector);
+        terminator[0] = 255;
+        std::memcpy(terminator + 1, "CD001", 5);
+
+        // Validation entry, default entry for BIOS, then a section with
+        // an extension entry and an entry for EFI
+        uint8_t* catalog = at(catalogSector * sector);
+        catalog[0] = 1;
+        catalog[30] = 0x55;
+        catalog[31] = 0xaa;
+        catalog[32] = 0x88;
+        boost::endian::store_little_u16(catalog + 32 + 6, 4);
+        boost::endian::store_little_u32(catalog + 32 + 8, biosImageSector);
+        catalog[64] = 0x91;
+        boost::endian::store_little_u16(catalog + 64 + 2, 1);
+        catalog[96] = 0x44;
+        catalog[128] = 0x88;
+        boost::endian::store_little_u16(catalog + 128 + 6, 1);
+        boost::endian::store_little_u32(catalog + 128 + 8, efiImageSector);
+
+        // FAT boot sector giving the size of the EFI image
+        uint8_t* fat = at(efiImageSector * sector);
+        boost::endian::store_little_u16(fat + 11, 512);
+        boost::endian::store_little_u32(fat + 32, efiImageSectors);
+        fat[510] = 0x55;
+        fat[511] = 0xaa;
+    }
+
+    uint8_t* at(uint64_t offset)
+    {
+        return reinterpret_cast<uint8_t*>(lower->image.data() + offset);
+    }
+
+    // Opens warm-up and runs it to the end
+    void open(uint64_t limit = imageSize)
+    {
+        warmUp =
+            std::make_shared<IsoWarmUp>(ioc, "test", lower, limit, stats);
+        std::optional<std::error_code> result;
+        warmUp->open([&result](std::error_code ec) { result = ec; });
+        while (!result && ioc.run_one_for(std::chrono::seconds(5)) > 0)
+        {
+        }
+        ASSERT_TRUE(result);
+        EXPECT_FALSE(*result);
+    }
+
+    void expectRanges(const std::vector<MemoryBackend::Range>& expected)
+    {
+        ASSERT_EQ(lower->ranges.size(), expected.size());
+        for (size_t i = 0; i < expected.size(); i++)
+        {
+            EXPECT_EQ(lower->ranges[i].offset, expected[i].offset) << i;
+            EXPECT_EQ(lower->ranges[i].length, expected[i].length) << i;
+        }
+    }
+
+    boost::asio::io_context ioc;
+    std::shared_ptr<RecordingBackend> lower;
+    Statistics::WarmUp stats;
+    std::shared_ptr<IsoWarmUp> warmUp;
+};
+
+TEST_F(IsoWarmUpTest, ReadsTablesAndBootImages)
+{
+    open();
+    const uint64_t efi = efiImageSector * sector;
+    expectRanges({
+        // Volume descriptors with the system area before them
+        {0, 32 * sector},
+        {catalogSector * sector, sector},
+        // Boot sectors of images the catalog describes as short
+        {biosImageSector * sector, 512},
+        {efi, 512},
+        {pathTableSector * sector, pathTableLength},
+        {rootSector * sector, sector},
+        // BIOS image has no FAT boot sector, minimum length is read
+        {biosImageSector * sector, 64 * 1024},
+        {efi, mebibyte},
+        {efi + mebibyte, mebibyte},
+        {efi + 2 * mebibyte, mebibyte},
+    });
+    EXPECT_EQ(stats.progress, 100U);
+}
+
+TEST_F(IsoWarmUpTest, LimitCapsPlannedReads)
+{
+    open(pathTableLength + sector + 1000);
+    ASSERT_EQ(lower->ranges.size(), 7U);
+    EXPECT_EQ(lower->ranges[6].offset, biosImageSector * sector);
+    EXPECT_EQ(lower->ranges[6].length, 1000U);
+    EXPECT_EQ(stats.progress, 100U);
+}
+
+TEST_F(IsoWarmUpTest, LongCatalogEntriesAreReadAsGiven)
+{
+    uint8_t* catalog = at(catalogSector * sector);
+    boost::endian::store_little_u16(catalog + 32 + 6, 256);
+    boost::endian::store_little_u16(catalog + 128 + 6, 512);
+    open();
+    expectRanges({
+        {0, 32 * sector},
+        {catalogSector * sector, sector},
+        {pathTableSector * sector, pathTableLength},
+        {rootSector * sector, sector},
+        {biosImageSector * sector, 128 * 1024},
+        {efiImageSector * sector, 256 * 1024},
+    });
+}
+
+TEST_F(IsoWarmUpTest, InvalidCatalogIsSkipped)
+{
+    at(catalogSector * sector)[31] = 0;
+    open();
+    expectRanges({
+        {0, 32 * sector},
+        {catalogSector * sector, sector},
+        {pathTableSector * sector, pathTableLength},
+        {rootSector * sector, sector},
+    });
+}
+
+TEST_F(IsoWarmUpTest, OtherImagesAreNotWarmedUp)
+{
+    at(16 * sector)[1] = 'X';
+    open();
+    expectRanges({{0, 32 * sector}});
+    EXPECT_EQ(stats.progress, 100U);
+}
+
+TEST_F(IsoWarmUpTest, SmallImagesAreNotRead)
+{
+    lower->image.resize(16 * sector);
+    open();
+    EXPECT_TRUE(lower->ranges.empty());
+}
+
+TEST_F(IsoWarmUpTest, ReadFailureEndsWarmUp)
+{
+    lower->error = std::make_error_code(std::errc::io_error);
+    open();
+    expectRanges({{0, 32 * sector}});
+}
+
+} // namespace
+} // namespace nbd
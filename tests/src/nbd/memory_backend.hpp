@@ -0,0 +1,112 @@
+#pragma once
+
+#include "nbd/backend.hpp"
+
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/post.hpp>
+#include <cstring>
+#include <string>
+#include <vector>
+
+namespace nbd
+{
+
+// Image kept in memory, filled with a pattern no two neighbouring blocks
+// share. Requests complete from the io_context, like those of real backends.
+class MemoryBackend : public Backend
+{
+  public:
+    MemoryBackend(boost::asio::io_context& ioc, uint64_t size,
+                  bool writable = false) :
+        ioc(ioc),
+        writable(writable), image(static_cast<size_t>(size))
+    {
+        for (size_t i = 0; i < image.size(); i++)
+        {
+            image[i] = static_cast<char>(i * 7 + i / 4096);
+        }
+    }
+
+    uint64_t size() const override
+    {
+        return image.size();
+    }
+
+    std::string contentId() const override
+    {
+        return id;
+    }
+
+    bool isWritable() const override
+    {
+        return writable;
+    }
+
+    void read(uint64_t offset, boost::asio::mutable_buffer buffer,
+              Handler&& handler) override
+    {
+        reads++;
+        bytesRead += buffer.size();
+        std::memcpy(buffer.data(), image.data() + offset, buffer.size());
+        complete(std::move(handler));
+    }
+
+    void write(uint64_t offset, boost::asio::const_buffer buffer,
+               Handler&& handler) override
+    {
+        if (!writable)
+        {
+            Backend::write(offset, buffer, std::move(handler));
+            return;
+        }
+        writes.push_back({offset, buffer.size()});
+        std::memcpy(image.data() + offset, buffer.data(), buffer.size());
+        complete(std::move(handler));
+    }
+
+    void flush(Handler&& handler) override
+    {
+        flushes++;
+        complete(std::move(handler));
+    }
+
+    void prefetch(uint64_t offset, uint64_t length) override
+    {
+        prefetches.push_back({offset, length});
+    }
+
+    void cancelPrefetch() override
+    {
+        prefetches.clear();
+    }
+
+    struct Range
+    {
+        uint64_t offset;
+        uint64_t length;
+    };
+
+    boost::asio::io_context& ioc;
+    bool writable;
+    std::vector<char> image;
+    std::string id;
+    // Failure reported by the requests, when set
+    std::error_code error;
+
+    unsigned reads = 0;
+    uint64_t bytesRead = 0;
+    std::vector<Range> writes;
+    unsigned flushes = 0;
+    // Hints not cancelled yet
+    std::vector<Range> prefetches;
+
+  private:
+    void complete(Handler&& handler)
+    {
+        boost::asio::post(ioc, [handler = std::move(handler), ec = error]() {
+            handler(ec);
+        });
+    }
+};
+
+} // namespace nbd
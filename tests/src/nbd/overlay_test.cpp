@@ -0,0 +1,245 @@
+#include "nbd/memory_backend.hpp"
+#include "nbd/overlay.hpp"
+
+#include <unistd.h>
+
+#include <chrono>
+#include <filesystem>
+#include <optional>
+
+#include <gtest/gtest.h>
+
+namespace nbd
+{
+namespace
+{
+
+constexpr uint64_t block = Overlay::blockSize;
+// Last block is a short one
+constexpr uint64_t imageSize = 4 * block + 1000;
+
+class OverlayTest : public ::testing::Test
+{
+  protected:
+    OverlayTest() :
+        directory(std::filesystem::temp_directory_path() /
+                  ("overlay-test-" + std::to_string(::getpid()))),
+        lower(std::make_shared<MemoryBackend>(ioc, imageSize)),
+        image(lower->image)
+    {
+    }
+
+    ~OverlayTest() override
+    {
+        overlay.reset();
+        std::error_code ec;
+        std::filesystem::remove_all(directory, ec);
+    }
+
+    void open(uint64_t capacity = imageSize)
+    {
+        overlay = std::make_shared<Overlay>(ioc, "test", lower, directory,
+                                            capacity);
+        ASSERT_FALSE(wait([this](Backend::Handler&& handler) {
+            overlay->open(std::move(handler));
+        }));
+    }
+
+    // Runs the io_context until the request started completes
+    std::error_code wait(const std::function<void(Backend::Handler&&)>& start)
+    {
+        std::optional<std::error_code> result;
+        start([&result](std::error_code ec) { result = ec; });
+        ioc.restart();
+        while (!result && ioc.run_one_for(std::chrono::seconds(5)) > 0)
+        {
+        }
+        return result.value_or(std::make_error_code(std::errc::timed_out));
+    }
+
+    std::error_code read(uint64_t offset, std::vector<char>& data)
+    {
+        return wait([&](Backend::Handler&& h) {
+            overlay->read(offset, boost::asio::buffer(data), std::move(h));
+        });
+    }
+
+    std::error_code write(uint64_t offset, const std::vector<char>& data)
+    {
+        // Expected content of the overlay follows the writes
+        std::copy(data.begin(), data.end(),
+                  image.begin() + static_cast<ptrdiff_t>(offset));
+        return wait([&](Backend::Handler&& h) {
+            overlay->write(offset, boost::asio::buffer(data), std::move(h));
+        });
+    }
+
+    void expectContent()
+    {
+        std::vector<char> data(imageSize);
+        ASSERT_FALSE(read(0, data));
+        EXPECT_TRUE(data == image);
+    }
+
+    boost::asio::io_context ioc;
+    std::filesystem::path directory;
+    std::shared_ptr<MemoryBackend> lower;
+    std::shared_ptr<Overlay> overlay;
+    // Content the overlay shall read as
+    std::vector<char> image;
+};
+
+TEST_F(OverlayTest, ReadsImageUntilWritten)
+{
+    open();
+    EXPECT_TRUE(overlay->isWritable());
+    EXPECT_EQ(overlay->size(), imageSize);
+    EXPECT_TRUE(overlay->contentId().empty());
+    expectContent();
+}
+
+TEST_F(OverlayTest, PartialWriteCopiesRestOfBlock)
+{
+    open();
+    const auto original = lower->image;
+    ASSERT_FALSE(write(block + 100, std::vector<char>(300, 'a')));
+    EXPECT_EQ(lower->reads, 1U);
+    EXPECT_EQ(lower->bytesRead, block);
+    expectContent();
+    EXPECT_TRUE(lower->image == original);
+}
+
+TEST_F(OverlayTest, WholeBlockWriteIsNotCopied)
+{
+    open();
+    ASSERT_FALSE(write(2 * block, std::vector<char>(block, 'b')));
+    EXPECT_EQ(lower->reads, 0U);
+
+    // Block is read from the overlay from now on
+    std::vector<char> data(block);
+    ASSERT_FALSE(read(2 * block, data));
+    EXPECT_EQ(lower->reads, 0U);
+    EXPECT_EQ(data, std::vector<char>(block, 'b'));
+}
+
+TEST_F(OverlayTest, ReadMergesRunsOfBlocks)
+{
+    open();
+    ASSERT_FALSE(write(block, std::vector<char>(2 * block, 'c')));
+    lower->reads = 0;
+
+    // Block 0 comes from the image, 1 and 2 at once from the overlay, then
+    // 3 and the short block from the image
+    std::vector<char> data(imageSize - 10);
+    ASSERT_FALSE(read(10, data));
+    EXPECT_EQ(lower->reads, 2U);
+    EXPECT_TRUE(std::equal(data.begin(), data.end(), image.begin() + 10));
+}
+
+TEST_F(OverlayTest, WritesSpanningBlocksAndShortLastBlock)
+{
+    open();
+    ASSERT_FALSE(write(block - 5, std::vector<char>(10, 'd')));
+    ASSERT_FALSE(write(imageSize - 20, std::vector<char>(20, 'e')));
+    ASSERT_FALSE(write(imageSize - 1000, std::vector<char>(5, 'f')));
+    expectContent();
+}
+
+TEST_F(OverlayTest, WritesOfBlockBeingCopiedWait)
+{
+    open();
+    std::vector<char> first(100, 'g');
+    std::vector<char> second(100, 'h');
+    std::copy(first.begin(), first.end(), image.begin() + 1000);
+    std::copy(second.begin(), second.end(), image.begin() + 1050);
+
+    unsigned done = 0;
+    overlay->write(1000, boost::asio::buffer(first),
+                   [&done](std::error_code ec) {
+                       EXPECT_FALSE(ec);
+                       done++;
+                   });
+    overlay->write(1050, boost::asio::buffer(second),
+                   [&done](std::error_code ec) {
+                       EXPECT_FALSE(ec);
+                       done++;
+                   });
+    ioc.restart();
+    while (done < 2 && ioc.run_one_for(std::chrono::seconds(5)) > 0)
+    {
+    }
+    ASSERT_EQ(done, 2U);
+    // Block was copied from the image only once
+    EXPECT_EQ(lower->reads, 1U);
+    expectContent();
+}
+
+TEST_F(OverlayTest, FullOverlayRefusesNewBlocks)
+{
+    open(block);
+    ASSERT_FALSE(write(0, std::vector<char>(10, 'i')));
+    EXPECT_EQ(write(3 * block, std::vector<char>(10, 'j')),
+              std::errc::no_space_on_device);
+    std::copy_n(lower->image.begin() + 3 * block, 10,
+                image.begin() + 3 * block);
+
+    // Blocks in the overlay are still writable
+    ASSERT_FALSE(write(block - 10, std::vector<char>(10, 'k')));
+    expectContent();
+}
+
+TEST_F(OverlayTest, FailedCopyReleasesBlock)
+{
+    open(block);
+    lower->error = std::make_error_code(std::errc::io_error);
+    EXPECT_EQ(write(10, std::vector<char>(10, 'l')), std::errc::io_error);
+    std::copy_n(lower->image.begin() + 10, 10, image.begin() + 10);
+    lower->error = {};
+    expectContent();
+
+    // Capacity taken by the failed copy was returned
+    ASSERT_FALSE(write(3 * block, std::vector<char>(10, 'm')));
+    expectContent();
+}
+
+TEST_F(OverlayTest, OverlayNotFittingIsRefused)
+{
+    overlay = std::make_shared<Overlay>(ioc, "test", lower, directory,
+                                        UINT64_MAX);
+    EXPECT_EQ(wait([this](Backend::Handler&& handler) {
+                  overlay->open(std::move(handler));
+              }),
+              std::errc::no_space_on_device);
+}
+
+TEST_F(OverlayTest, WrittenBlocksAreData)
+{
+    open();
+    ASSERT_FALSE(write(block, std::vector<char>(2 * block, 'n')));
+
+    std::vector<Extent> extents;
+    auto extentsOf = [&](uint64_t offset, uint64_t length) {
+        return wait([&](Backend::Handler&& h) {
+            overlay->extents(offset, length,
+                             [&extents, h = std::move(h)](
+                                 std::error_code ec, std::vector<Extent> e) {
+                                 extents = std::move(e);
+                                 h(ec);
+                             });
+        });
+    };
+
+    // Run of written blocks is reported at once
+    ASSERT_FALSE(extentsOf(block + 10, imageSize - block - 10));
+    ASSERT_EQ(extents.size(), 1U);
+    EXPECT_EQ(extents[0].length, 2 * block - 10);
+    EXPECT_FALSE(extents[0].zero);
+
+    // Image describes blocks up to the written ones
+    ASSERT_FALSE(extentsOf(0, imageSize));
+    ASSERT_EQ(extents.size(), 1U);
+    EXPECT_EQ(extents[0].length, block);
+}
+
+} // namespace
+} // namespace nbd
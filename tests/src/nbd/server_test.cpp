@@ -0,0 +1,521 @@
+#include "nbd/memory_backend.hpp"
+#include "nbd/protocol.hpp"
+#include "nbd/server.hpp"
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstring>
+#include <filesystem>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+namespace nbd
+{
+namespace
+{
+
+constexpr uint64_t imageSize = 1024 * 1024;
+
+class NbdServerTest : public ::testing::Test
+{
+  protected:
+    ~NbdServerTest() override
+    {
+        if (fd >= 0)
+        {
+            ::close(fd);
+        }
+        if (server)
+        {
+            server->stop();
+            ioc.restart();
+            ioc.poll();
+        }
+        std::error_code ec;
+        std::filesystem::remove_all(directory, ec);
+    }
+
+    void createServer(bool writable = false, uint32_t maxRequestLength = 0)
+    {
+        backend = std::make_shared<MemoryBackend>(ioc, imageSize, writable);
+        server = std::make_shared<Server>(ioc, "test", backend);
+        if (maxRequestLength > 0)
+        {
+            server->setMaxRequestLength(maxRequestLength);
+        }
+    }
+
+    // Connects to the server listening on a socket, handshake comes next
+    void connect(bool writable = false)
+    {
+        createServer(writable);
+        directory = std::filesystem::temp_directory_path() /
+                    ("nbd-server-test-" + std::to_string(::getpid()));
+        std::filesystem::create_directories(directory);
+        const auto path = directory / "socket";
+        ASSERT_TRUE(server->start(path));
+
+        fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+        ASSERT_GE(fd, 0);
+        sockaddr_un address = {};
+        address.sun_family = AF_UNIX;
+        std::strncpy(address.sun_path, path.c_str(),
+                     sizeof(address.sun_path) - 1);
+        ASSERT_EQ(::connect(fd, reinterpret_cast<sockaddr*>(&address),
+                            sizeof(address)),
+                  0);
+    }
+
+    // Connects to the server over a socket pair, skipping the handshake
+    void attach(bool writable = false, uint32_t maxRequestLength = 0)
+    {
+        createServer(writable, maxRequestLength);
+        server->attach(
+            1, [this](std::error_code ec, const std::vector<int>& sockets,
+                      netlink::Export) {
+                ASSERT_FALSE(ec);
+                ASSERT_EQ(sockets.size(), 1U);
+                fd = ::dup(sockets.front());
+            });
+        run();
+        ASSERT_GE(fd, 0);
+    }
+
+    void run()
+    {
+        ioc.restart();
+        ioc.run_for(std::chrono::milliseconds(1));
+    }
+
+    void send(const void* data, size_t size)
+    {
+        ASSERT_EQ(::send(fd, data, size, MSG_NOSIGNAL),
+                  static_cast<ssize_t>(size));
+    }
+
+    // Runs the server until size bytes are received from it, false when it
+    // closed the connection or nothing came for a while
+    bool receive(void* data, size_t size)
+    {
+        auto* bytes = static_cast<char*>(data);
+        const auto deadline =
+            std::chrono::steady_clock::now() + std::chrono::seconds(5);
+        while (size > 0 && std::chrono::steady_clock::now() < deadline)
+        {
+            const ssize_t rc = ::recv(fd, bytes, size, MSG_DONTWAIT);
+            if (rc == 0)
+            {
+                return false;
+            }
+            if (rc < 0)
+            {
+                run();
+                continue;
+            }
+            bytes += rc;
+            size -= static_cast<size_t>(rc);
+        }
+        return size == 0;
+    }
+
+    bool closed()
+    {
+        char byte = 0;
+        return !receive(&byte, sizeof(byte));
+    }
+
+    void handshake(uint32_t flags = proto::clientFlagFixedNewstyle |
+                                    proto::clientFlagNoZeroes)
+    {
+        proto::ServerGreeting greeting;
+        ASSERT_TRUE(receive(&greeting, sizeof(greeting)));
+        const proto::big_uint32_buf_t clientFlags{flags};
+        send(&clientFlags, sizeof(clientFlags));
+    }
+
+    void sendOption(uint32_t option, const std::vector<char>& data = {})
+    {
+        proto::OptionHeader header;
+        header.magic = proto::optionMagic;
+        header.option = option;
+        header.length = static_cast<uint32_t>(data.size());
+        send(&header, sizeof(header));
+        if (!data.empty())
+        {
+            send(data.data(), data.size());
+        }
+    }
+
+    // Receives reply to option, returns its type and stores its payload
+    uint32_t receiveOptionReply(uint32_t option, std::vector<char>& data)
+    {
+        proto::OptionReplyHeader header;
+        EXPECT_TRUE(receive(&header, sizeof(header)));
+        EXPECT_EQ(header.magic.value(), proto::optionReplyMagic);
+        EXPECT_EQ(header.option.value(), option);
+        data.resize(header.length.value());
+        EXPECT_TRUE(receive(data.data(), data.size()));
+        return header.type.value();
+    }
+
+    uint32_t receiveOptionReply(uint32_t option)
+    {
+        std::vector<char> data;
+        return receiveOptionReply(option, data);
+    }
+
+    // Payload of NBD_OPT_INFO and NBD_OPT_GO with an empty name
+    static std::vector<char> infoPayload(const std::vector<uint16_t>& infos)
+    {
+        std::vector<char> data(sizeof(uint32_t) + sizeof(uint16_t));
+        const proto::big_uint16_buf_t count{
+            static_cast<uint16_t>(infos.size())};
+        std::memcpy(data.data() + sizeof(uint32_t), &count, sizeof(count));
+        for (const uint16_t info : infos)
+        {
+            const proto::big_uint16_buf_t request{info};
+            const auto* bytes = reinterpret_cast<const char*>(&request);
+            data.insert(data.end(), bytes, bytes + sizeof(request));
+        }
+        return data;
+    }
+
+    void sendRequest(uint16_t type, uint64_t handle, uint64_t offset,
+                     uint32_t length)
+    {
+        proto::Request request;
+        request.magic = proto::requestMagic;
+        request.flags = 0;
+        request.type = type;
+        request.handle = handle;
+        request.offset = offset;
+        request.length = length;
+        send(&request, sizeof(request));
+    }
+
+    // Receives simple reply to the request with handle, returns its error
+    uint32_t receiveReply(uint64_t handle)
+    {
+        proto::SimpleReply reply;
+        EXPECT_TRUE(receive(&reply, sizeof(reply)));
+        EXPECT_EQ(reply.magic.value(), proto::simpleReplyMagic);
+        EXPECT_EQ(reply.handle.value(), handle);
+        return reply.error.value();
+    }
+
+    boost::asio::io_context ioc;
+    std::shared_ptr<MemoryBackend> backend;
+    std::shared_ptr<Server> server;
+    std::filesystem::path directory;
+    int fd = -1;
+};
+
+TEST_F(NbdServerTest, GreetingOffersFixedNewstyleWithoutZeroes)
+{
+    connect();
+    proto::ServerGreeting greeting;
+    ASSERT_TRUE(receive(&greeting, sizeof(greeting)));
+    EXPECT_EQ(greeting.magic.value(), proto::nbdMagic);
+    EXPECT_EQ(greeting.optionMagic.value(), proto::optionMagic);
+    EXPECT_EQ(greeting.handshakeFlags.value(),
+              proto::flagFixedNewstyle | proto::flagNoZeroes);
+}
+
+TEST_F(NbdServerTest, UnknownClientFlagsDropConnection)
+{
+    connect();
+    handshake(proto::clientFlagFixedNewstyle | 1U << 5);
+    EXPECT_TRUE(closed());
+}
+
+TEST_F(NbdServerTest, OptionWithBadMagicDropsConnection)
+{
+    connect();
+    handshake();
+    proto::OptionHeader header;
+    header.magic = proto::nbdMagic;
+    header.option = proto::optList;
+    header.length = 0;
+    send(&header, sizeof(header));
+    EXPECT_TRUE(closed());
+}
+
+TEST_F(NbdServerTest, OversizedOptionDropsConnection)
+{
+    connect();
+    handshake();
+    proto::OptionHeader header;
+    header.magic = proto::optionMagic;
+    header.option = proto::optInfo;
+    header.length = 64 * 1024 + 1;
+    send(&header, sizeof(header));
+    EXPECT_TRUE(closed());
+}
+
+TEST_F(NbdServerTest, UnknownOptionIsUnsupported)
+{
+    connect();
+    handshake();
+    sendOption(proto::optStartTls);
+    EXPECT_EQ(receiveOptionReply(proto::optStartTls), proto::repErrUnsup);
+    sendOption(100);
+    EXPECT_EQ(receiveOptionReply(100), proto::repErrUnsup);
+}
+
+TEST_F(NbdServerTest, ListAnnouncesSingleUnnamedExport)
+{
+    connect();
+    handshake();
+    sendOption(proto::optList);
+    std::vector<char> data;
+    ASSERT_EQ(receiveOptionReply(proto::optList, data), proto::repServer);
+    EXPECT_EQ(data, std::vector<char>(sizeof(uint32_t), 0));
+    EXPECT_EQ(receiveOptionReply(proto::optList), proto::repAck);
+}
+
+TEST_F(NbdServerTest, InfoReportsExportAndKeepsNegotiating)
+{
+    connect();
+    handshake();
+    sendOption(proto::optInfo, infoPayload({}));
+    std::vector<char> data;
+    ASSERT_EQ(receiveOptionReply(proto::optInfo, data), proto::repInfo);
+    proto::InfoExport info;
+    ASSERT_EQ(data.size(), sizeof(info));
+    std::memcpy(&info, data.data(), sizeof(info));
+    EXPECT_EQ(info.type.value(), proto::infoExport);
+    EXPECT_EQ(info.size.value(), imageSize);
+    EXPECT_EQ(info.flags.value(), proto::flagHasFlags | proto::flagReadOnly |
+                                      proto::flagCanMultiConn);
+    EXPECT_EQ(receiveOptionReply(proto::optInfo), proto::repAck);
+
+    sendOption(proto::optList);
+    EXPECT_EQ(receiveOptionReply(proto::optList), proto::repServer);
+}
+
+TEST_F(NbdServerTest, GoReportsBlockSizeWhenRequested)
+{
+    connect(true);
+    handshake();
+    sendOption(proto::optGo,
+               infoPayload({proto::infoName, proto::infoBlockSize}));
+    std::vector<char> data;
+    ASSERT_EQ(receiveOptionReply(proto::optGo, data), proto::repInfo);
+    proto::InfoBlockSize blockSize;
+    ASSERT_EQ(data.size(), sizeof(blockSize));
+    std::memcpy(&blockSize, data.data(), sizeof(blockSize));
+    EXPECT_EQ(blockSize.type.value(), proto::infoBlockSize);
+    EXPECT_EQ(blockSize.minimum.value(), 1U);
+    EXPECT_EQ(blockSize.maximum.value(), server->getMaxRequestLength());
+
+    ASSERT_EQ(receiveOptionReply(proto::optGo, data), proto::repInfo);
+    proto::InfoExport info;
+    ASSERT_EQ(data.size(), sizeof(info));
+    std::memcpy(&info, data.data(), sizeof(info));
+    EXPECT_EQ(info.flags.value(), proto::flagHasFlags | proto::flagSendFlush |
+                                      proto::flagSendFua |
+                                      proto::flagCanMultiConn);
+    EXPECT_EQ(receiveOptionReply(proto::optGo), proto::repAck);
+
+    // Transmission follows right away
+    sendRequest(proto::cmdFlush, 1, 0, 0);
+    EXPECT_EQ(receiveReply(1), proto::errNone);
+}
+
+TEST_F(NbdServerTest, MalformedInfoIsInvalid)
+{
+    connect();
+    handshake();
+    // Too short for name length and number of requests
+    sendOption(proto::optGo, std::vector<char>(3));
+    EXPECT_EQ(receiveOptionReply(proto::optGo), proto::repErrInvalid);
+
+    // Name longer than payload
+    auto data = infoPayload({});
+    data[3] = 1;
+    sendOption(proto::optGo, data);
+    EXPECT_EQ(receiveOptionReply(proto::optGo), proto::repErrInvalid);
+
+    // Fewer requests than announced
+    data = infoPayload({proto::infoBlockSize});
+    data.pop_back();
+    sendOption(proto::optGo, data);
+    EXPECT_EQ(receiveOptionReply(proto::optGo), proto::repErrInvalid);
+
+    // Connection is still negotiating
+    sendOption(proto::optList);
+    EXPECT_EQ(receiveOptionReply(proto::optList), proto::repServer);
+}
+
+TEST_F(NbdServerTest, StructuredReplyRejectsPayload)
+{
+    connect();
+    handshake();
+    sendOption(proto::optStructuredReply, {0});
+    EXPECT_EQ(receiveOptionReply(proto::optStructuredReply),
+              proto::repErrInvalid);
+    sendOption(proto::optStructuredReply);
+    EXPECT_EQ(receiveOptionReply(proto::optStructuredReply), proto::repAck);
+}
+
+TEST_F(NbdServerTest, MetaContextRequiresStructuredReplies)
+{
+    connect();
+    handshake();
+    sendOption(proto::optSetMetaContext, infoPayload({}));
+    EXPECT_EQ(receiveOptionReply(proto::optSetMetaContext),
+              proto::repErrInvalid);
+}
+
+TEST_F(NbdServerTest, AbortIsAcknowledged)
+{
+    connect();
+    handshake();
+    sendOption(proto::optAbort);
+    EXPECT_EQ(receiveOptionReply(proto::optAbort), proto::repAck);
+    EXPECT_TRUE(closed());
+}
+
+TEST_F(NbdServerTest, ExportNameOmitsZeroesWhenNegotiated)
+{
+    connect();
+    handshake();
+    sendOption(proto::optExportName);
+    proto::ExportNameReply reply;
+    ASSERT_TRUE(receive(&reply, sizeof(reply)));
+    EXPECT_EQ(reply.size.value(), imageSize);
+
+    sendRequest(proto::cmdRead, 7, 0, 16);
+    EXPECT_EQ(receiveReply(7), proto::errNone);
+}
+
+TEST_F(NbdServerTest, ExportNamePadsWithZeroes)
+{
+    connect();
+    handshake(proto::clientFlagFixedNewstyle);
+    sendOption(proto::optExportName);
+    proto::ExportNameReply reply;
+    ASSERT_TRUE(receive(&reply, sizeof(reply)));
+    std::vector<char> zeroes(124, 1);
+    ASSERT_TRUE(receive(zeroes.data(), zeroes.size()));
+    EXPECT_EQ(zeroes, std::vector<char>(124, 0));
+}
+
+TEST_F(NbdServerTest, ReadReturnsData)
+{
+    attach();
+    sendRequest(proto::cmdRead, 1, 4000, 300);
+    ASSERT_EQ(receiveReply(1), proto::errNone);
+    std::vector<char> data(300);
+    ASSERT_TRUE(receive(data.data(), data.size()));
+    EXPECT_TRUE(std::equal(data.begin(), data.end(),
+                           backend->image.begin() + 4000));
+}
+
+TEST_F(NbdServerTest, ReadOfNothingHasNoPayload)
+{
+    attach();
+    sendRequest(proto::cmdRead, 1, 0, 0);
+    EXPECT_EQ(receiveReply(1), proto::errNone);
+    sendRequest(proto::cmdFlush, 2, 0, 0);
+    EXPECT_EQ(receiveReply(2), proto::errNone);
+}
+
+TEST_F(NbdServerTest, ReadOutOfBoundsIsInvalid)
+{
+    attach();
+    sendRequest(proto::cmdRead, 1, imageSize - 1, 2);
+    EXPECT_EQ(receiveReply(1), proto::errInval);
+    sendRequest(proto::cmdRead, 2, UINT64_MAX, 1);
+    EXPECT_EQ(receiveReply(2), proto::errInval);
+    sendRequest(proto::cmdRead, 3, 0, proto::maxRequestLength + 1);
+    EXPECT_EQ(receiveReply(3), proto::errInval);
+}
+
+TEST_F(NbdServerTest, RequestsLongerThanAdvertisedAreInvalid)
+{
+    constexpr uint32_t limit = 64 * 1024;
+    attach(true, limit);
+    sendRequest(proto::cmdRead, 1, 0, limit + 1);
+    EXPECT_EQ(receiveReply(1), proto::errInval);
+    sendRequest(proto::cmdRead, 2, 0, limit);
+    ASSERT_EQ(receiveReply(2), proto::errNone);
+    std::vector<char> data(limit);
+    ASSERT_TRUE(receive(data.data(), data.size()));
+
+    // Payload is consumed, the connection is kept
+    data.assign(limit + 1, 'x');
+    sendRequest(proto::cmdWrite, 3, 0, limit + 1);
+    send(data.data(), data.size());
+    EXPECT_EQ(receiveReply(3), proto::errInval);
+    EXPECT_NE(backend->image[0], 'x');
+    sendRequest(proto::cmdFlush, 4, 0, 0);
+    EXPECT_EQ(receiveReply(4), proto::errNone);
+}
+
+TEST_F(NbdServerTest, WriteToReadOnlyExportIsNotPermitted)
+{
+    attach();
+    const std::vector<char> data(512, 'x');
+    sendRequest(proto::cmdWrite, 1, 0, static_cast<uint32_t>(data.size()));
+    send(data.data(), data.size());
+    EXPECT_EQ(receiveReply(1), proto::errPerm);
+    EXPECT_NE(backend->image[0], 'x');
+
+    // Payload was consumed, next request is parsed after it
+    sendRequest(proto::cmdFlush, 2, 0, 0);
+    EXPECT_EQ(receiveReply(2), proto::errNone);
+}
+
+TEST_F(NbdServerTest, WriteStoresData)
+{
+    attach(true);
+    const std::vector<char> data(512, 'x');
+    sendRequest(proto::cmdWrite, 1, 1024, static_cast<uint32_t>(data.size()));
+    send(data.data(), data.size());
+    EXPECT_EQ(receiveReply(1), proto::errNone);
+    EXPECT_EQ(backend->image[1024], 'x');
+    EXPECT_EQ(backend->image[1535], 'x');
+
+    sendRequest(proto::cmdWrite, 2, imageSize - 1,
+                static_cast<uint32_t>(data.size()));
+    send(data.data(), data.size());
+    EXPECT_EQ(receiveReply(2), proto::errNoSpc);
+}
+
+TEST_F(NbdServerTest, BlockStatusWithoutContextIsInvalid)
+{
+    attach();
+    sendRequest(proto::cmdBlockStatus, 1, 0, 4096);
+    EXPECT_EQ(receiveReply(1), proto::errInval);
+}
+
+TEST_F(NbdServerTest, UnknownCommandIsInvalid)
+{
+    attach();
+    sendRequest(100, 1, 0, 0);
+    EXPECT_EQ(receiveReply(1), proto::errInval);
+}
+
+TEST_F(NbdServerTest, BadRequestMagicDropsConnection)
+{
+    attach();
+    proto::Request request = {};
+    request.magic = proto::simpleReplyMagic;
+    send(&request, sizeof(request));
+    EXPECT_TRUE(closed());
+}
+
+TEST_F(NbdServerTest, DisconnectClosesConnection)
+{
+    attach();
+    sendRequest(proto::cmdDisc, 1, 0, 0);
+    EXPECT_TRUE(closed());
+}
+
+} // namespace
+} // namespace nbd
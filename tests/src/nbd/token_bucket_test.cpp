@@ -0,0 +1,129 @@
+#include "nbd/token_bucket.hpp"
+
+#include <chrono>
+#include <thread>
+
+#include <gtest/gtest.h>
+
+namespace nbd
+{
+namespace
+{
+
+using std::chrono::milliseconds;
+
+constexpr uint64_t rate = 1000 * 1000;
+
+// Delays are computed from the clock, tests allow for the time they take
+milliseconds delayOf(TokenBucket& bucket, bool background = false)
+{
+    return std::chrono::duration_cast<milliseconds>(bucket.delay(background));
+}
+
+TEST(TokenBucketTest, ZeroRateDoesNotLimit)
+{
+    TokenBucket bucket;
+    bucket.take(10 * rate);
+    EXPECT_EQ(bucket.delay(false), TokenBucket::Clock::duration::zero());
+    EXPECT_EQ(bucket.delay(true), TokenBucket::Clock::duration::zero());
+
+    int a = 0;
+    int b = 0;
+    bucket.join(&a, false);
+    bucket.join(&b, false);
+    EXPECT_TRUE(bucket.isTurn(&b, false));
+}
+
+TEST(TokenBucketTest, UnlimitedIsShared)
+{
+    EXPECT_EQ(&TokenBucket::unlimited(), &TokenBucket::unlimited());
+    EXPECT_EQ(TokenBucket::unlimited().getRate(), 0U);
+}
+
+TEST(TokenBucketTest, SecondOfTransfersPassesAtOnce)
+{
+    TokenBucket bucket(rate);
+    EXPECT_EQ(bucket.delay(false), TokenBucket::Clock::duration::zero());
+    bucket.take(rate / 2);
+    EXPECT_EQ(bucket.delay(false), TokenBucket::Clock::duration::zero());
+    bucket.take(rate / 2);
+    bucket.take(rate / 2);
+
+    // Debt of half a second
+    const auto delay = delayOf(bucket);
+    EXPECT_GT(delay, milliseconds(400));
+    EXPECT_LE(delay, milliseconds(500));
+}
+
+TEST(TokenBucketTest, DebtIsPaidOverTime)
+{
+    TokenBucket bucket(rate);
+    bucket.take(rate + rate / 5);
+    const auto before = delayOf(bucket);
+    std::this_thread::sleep_for(milliseconds(100));
+    const auto after = delayOf(bucket);
+    EXPECT_GT(before, milliseconds(150));
+    EXPECT_LE(after, before - milliseconds(90));
+
+    std::this_thread::sleep_for(after + milliseconds(10));
+    EXPECT_EQ(bucket.delay(false), TokenBucket::Clock::duration::zero());
+}
+
+TEST(TokenBucketTest, BackgroundWaitsForHalfOfBucket)
+{
+    TokenBucket bucket(rate);
+    bucket.take(rate * 6 / 10);
+    EXPECT_EQ(bucket.delay(false), TokenBucket::Clock::duration::zero());
+    const auto delay = delayOf(bucket, true);
+    EXPECT_GT(delay, milliseconds(50));
+    EXPECT_LE(delay, milliseconds(100));
+}
+
+TEST(TokenBucketTest, LowerRateCapsTokens)
+{
+    TokenBucket bucket(rate);
+    bucket.setRate(rate / 10);
+    EXPECT_EQ(bucket.getRate(), rate / 10);
+    // Bucket holds a second of the new rate, not of the old one
+    bucket.take(rate / 5);
+    const auto delay = delayOf(bucket);
+    EXPECT_GT(delay, milliseconds(900));
+    EXPECT_LE(delay, milliseconds(1000));
+
+    bucket.setRate(0);
+    EXPECT_EQ(bucket.delay(false), TokenBucket::Clock::duration::zero());
+}
+
+TEST(TokenBucketTest, UsersTakeTurns)
+{
+    TokenBucket bucket(rate);
+    int a = 0;
+    int b = 0;
+    int c = 0;
+    // Nobody waits
+    EXPECT_TRUE(bucket.isTurn(&a, false));
+
+    bucket.join(&a, false);
+    bucket.join(&b, false);
+    bucket.join(&a, false);
+    EXPECT_TRUE(bucket.isTurn(&a, false));
+    EXPECT_FALSE(bucket.isTurn(&b, false));
+
+    // Background transfers queue separately
+    bucket.join(&c, true);
+    EXPECT_TRUE(bucket.isTurn(&c, true));
+    EXPECT_FALSE(bucket.isTurn(&b, true));
+
+    bucket.leave(&a);
+    EXPECT_TRUE(bucket.isTurn(&b, false));
+
+    // Waiting for background transfers instead moves user to their queue
+    bucket.join(&b, true);
+    EXPECT_TRUE(bucket.isTurn(&a, false));
+    EXPECT_FALSE(bucket.isTurn(&b, true));
+    bucket.leave(&c);
+    EXPECT_TRUE(bucket.isTurn(&b, true));
+}
+
+} // namespace
+} // namespace nbd
@@ -0,0 +1,242 @@
+#include "nbd/memory_backend.hpp"
+#include "nbd/write_back.hpp"
+
+#include <chrono>
+#include <optional>
+
+#include <gtest/gtest.h>
+
+namespace nbd
+{
+namespace
+{
+
+constexpr uint64_t imageSize = 16 * 1024 * 1024;
+
+class WriteBackTest : public ::testing::Test
+{
+  protected:
+    WriteBackTest() :
+        lower(std::make_shared<MemoryBackend>(ioc, imageSize, true)),
+        image(lower->image)
+    {
+    }
+
+    void create(uint64_t capacity = 64 * 1024 * 1024)
+    {
+        writeBack = std::make_shared<WriteBack>(ioc, "test", lower, capacity);
+    }
+
+    // Runs the io_context until the request started completes
+    std::error_code wait(const std::function<void(Backend::Handler&&)>& start)
+    {
+        std::optional<std::error_code> result;
+        start([&result](std::error_code ec) { result = ec; });
+        ioc.restart();
+        while (!result && ioc.run_one_for(std::chrono::seconds(5)) > 0)
+        {
+        }
+        return result.value_or(std::make_error_code(std::errc::timed_out));
+    }
+
+    std::error_code write(uint64_t offset, size_t length, char fill)
+    {
+        auto data = std::make_shared<std::vector<char>>(length, fill);
+        std::fill_n(image.begin() + static_cast<ptrdiff_t>(offset), length,
+                    fill);
+        // Write completes once buffered, the buffer stays with the test
+        buffers.push_back(data);
+        return wait([&](Backend::Handler&& handler) {
+            writeBack->write(offset, boost::asio::buffer(*data),
+                             std::move(handler));
+        });
+    }
+
+    std::error_code flush()
+    {
+        return wait([this](Backend::Handler&& handler) {
+            writeBack->flush(std::move(handler));
+        });
+    }
+
+    void expectWrites(const std::vector<MemoryBackend::Range>& expected)
+    {
+        ASSERT_EQ(lower->writes.size(), expected.size());
+        for (size_t i = 0; i < expected.size(); i++)
+        {
+            EXPECT_EQ(lower->writes[i].offset, expected[i].offset);
+            EXPECT_EQ(lower->writes[i].length, expected[i].length);
+        }
+    }
+
+    boost::asio::io_context ioc;
+    std::shared_ptr<MemoryBackend> lower;
+    std::shared_ptr<WriteBack> writeBack;
+    // Content the image shall have once written back
+    std::vector<char> image;
+    std::vector<std::shared_ptr<std::vector<char>>> buffers;
+};
+
+TEST_F(WriteBackTest, WritesAreBufferedUntilFlush)
+{
+    create();
+    ASSERT_FALSE(write(0, 4096, 'a'));
+    EXPECT_TRUE(lower->writes.empty());
+    ASSERT_FALSE(flush());
+    expectWrites({{0, 4096}});
+    EXPECT_EQ(lower->flushes, 1U);
+    EXPECT_TRUE(lower->image == image);
+}
+
+TEST_F(WriteBackTest, SequentialWritesAreAppended)
+{
+    create();
+    ASSERT_FALSE(write(8192, 4096, 'a'));
+    ASSERT_FALSE(write(12288, 4096, 'b'));
+    ASSERT_FALSE(write(16384, 100, 'c'));
+    ASSERT_FALSE(flush());
+    expectWrites({{8192, 8292}});
+    EXPECT_TRUE(lower->image == image);
+}
+
+TEST_F(WriteBackTest, OverlappingWritesAreMerged)
+{
+    create();
+    ASSERT_FALSE(write(100, 100, 'a'));
+    ASSERT_FALSE(write(300, 100, 'b'));
+    ASSERT_FALSE(write(500, 100, 'c'));
+    // Joins the first two runs, later data wins
+    ASSERT_FALSE(write(150, 200, 'd'));
+    // Within a run
+    ASSERT_FALSE(write(120, 10, 'e'));
+    // Ends where the last run begins, so it is not merged
+    ASSERT_FALSE(write(450, 50, 'f'));
+    ASSERT_FALSE(flush());
+    expectWrites({{100, 300}, {450, 50}, {500, 100}});
+    EXPECT_TRUE(lower->image == image);
+}
+
+TEST_F(WriteBackTest, WriteBeforeRunIsMerged)
+{
+    create();
+    ASSERT_FALSE(write(1000, 100, 'a'));
+    ASSERT_FALSE(write(900, 150, 'b'));
+    ASSERT_FALSE(flush());
+    expectWrites({{900, 200}});
+    EXPECT_TRUE(lower->image == image);
+}
+
+TEST_F(WriteBackTest, RunsDoNotGrowBeyondMaximum)
+{
+    create();
+    constexpr size_t part = 1024 * 1024;
+    for (size_t i = 0; i < 5; i++)
+    {
+        ASSERT_FALSE(write(i * part, part, static_cast<char>('a' + i)));
+    }
+    ASSERT_FALSE(flush());
+    expectWrites({{0, WriteBack::maxRunLength},
+                  {WriteBack::maxRunLength, part}});
+    EXPECT_TRUE(lower->image == image);
+}
+
+TEST_F(WriteBackTest, HalfFullBufferIsWrittenBack)
+{
+    create(8192);
+    ASSERT_FALSE(write(0, 2048, 'a'));
+    EXPECT_TRUE(lower->writes.empty());
+    ASSERT_FALSE(write(65536, 2048, 'b'));
+    ioc.restart();
+    ioc.poll();
+    expectWrites({{0, 2048}, {65536, 2048}});
+    EXPECT_EQ(lower->flushes, 0U);
+}
+
+TEST_F(WriteBackTest, WriteNotFittingWaitsForWriteBack)
+{
+    create(8192);
+    ASSERT_FALSE(write(0, 1024, 'a'));
+
+    std::vector<char> data(8192, 'b');
+    std::fill_n(image.begin() + 65536, data.size(), 'b');
+    bool written = false;
+    writeBack->write(65536, boost::asio::buffer(data),
+                     [&written](std::error_code ec) {
+                         EXPECT_FALSE(ec);
+                         written = true;
+                     });
+    EXPECT_FALSE(written);
+    // Buffered data is written back right away to make room
+    expectWrites({{0, 1024}});
+
+    // Write is admitted into the empty buffer and fills it
+    ioc.restart();
+    ioc.poll();
+    EXPECT_TRUE(written);
+    expectWrites({{0, 1024}, {65536, 8192}});
+    ASSERT_FALSE(flush());
+    EXPECT_TRUE(lower->image == image);
+}
+
+TEST_F(WriteBackTest, DataIsWrittenBackAfterDelay)
+{
+    create();
+    ASSERT_FALSE(write(0, 512, 'a'));
+    const auto half = std::chrono::milliseconds(WriteBack::delay) / 2;
+    ioc.restart();
+    ioc.run_for(half);
+    EXPECT_TRUE(lower->writes.empty());
+    ioc.restart();
+    ioc.run_for(3 * half);
+    expectWrites({{0, 512}});
+    EXPECT_EQ(lower->flushes, 0U);
+}
+
+TEST_F(WriteBackTest, ReadOfBufferedDataSeesIt)
+{
+    create();
+    ASSERT_FALSE(write(4096, 100, 'a'));
+    std::vector<char> data(200);
+    ASSERT_FALSE(wait([&](Backend::Handler&& handler) {
+        writeBack->read(4000, boost::asio::buffer(data), std::move(handler));
+    }));
+    EXPECT_TRUE(std::equal(data.begin(), data.end(), image.begin() + 4000));
+    expectWrites({{4096, 100}});
+
+    // Reads elsewhere do not wait
+    ASSERT_FALSE(write(8192, 100, 'b'));
+    ASSERT_FALSE(wait([&](Backend::Handler&& handler) {
+        writeBack->read(0, boost::asio::buffer(data), std::move(handler));
+    }));
+    expectWrites({{4096, 100}});
+}
+
+TEST_F(WriteBackTest, BufferedDataIsReportedAsData)
+{
+    create();
+    ASSERT_FALSE(write(4096, 100, 0));
+    std::vector<Extent> extents;
+    writeBack->extents(0, 8192,
+                       [&extents](std::error_code ec, std::vector<Extent> e) {
+                           EXPECT_FALSE(ec);
+                           extents = std::move(e);
+                       });
+    ASSERT_EQ(extents.size(), 1U);
+    EXPECT_EQ(extents[0].length, 8192U);
+    EXPECT_FALSE(extents[0].zero);
+}
+
+TEST_F(WriteBackTest, FailedWriteBackIsReportedByNextFlush)
+{
+    create(8192);
+    lower->error = std::make_error_code(std::errc::io_error);
+    ASSERT_FALSE(write(0, 4096, 'a'));
+    ioc.restart();
+    ioc.poll();
+    lower->error = {};
+    EXPECT_EQ(flush(), std::errc::io_error);
+    EXPECT_FALSE(flush());
+}
+
+} // namespace
+} // namespace nbd